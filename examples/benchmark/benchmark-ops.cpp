@@ -0,0 +1,386 @@
+// Benchmark single ggml ops at the shapes of LLaMA 7B
+
+#include "ggml.h"
+#include "build-info.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+// LLaMA 7B
+static const int n_embd  = 4096;
+static const int n_head  = 32;
+static const int n_rot   = n_embd/n_head;
+static const int n_ff    = 11008;
+static const int n_vocab = 32000;
+
+struct benchmark_ops_params {
+    std::vector<std::string> include_ops;
+    std::vector<std::string> include_types;
+    std::vector<int> n_tokens;
+    std::vector<int> n_threads;
+    int n_kv = 512;
+    int n_iterations = 10;
+    int n_warmup = 2;
+};
+
+// the inputs of an op are filled with random values, the weights are stored in the benchmarked type
+struct op_inputs {
+    std::vector<struct ggml_tensor *> tensors;
+
+    struct ggml_tensor * add(struct ggml_tensor * t) {
+        tensors.push_back(t);
+        return t;
+    }
+};
+
+struct op_case {
+    const char * name;
+    bool typed; // the weights of the op are stored in each benchmarked type
+    std::function<struct ggml_tensor * (struct ggml_context *, op_inputs &, ggml_type, int n_tokens, int n_kv)> build;
+    std::function<std::string(int n_tokens, int n_kv)> shape;
+};
+
+static std::string shape_str(std::initializer_list<int64_t> ne) {
+    std::ostringstream str;
+    for (auto it = ne.begin(); it != ne.end(); ++it) {
+        str << (it == ne.begin() ? "" : " x ") << *it;
+    }
+    return str.str();
+}
+
+static const std::vector<op_case> & op_cases() {
+    static const std::vector<op_case> cases = {
+        { "get_rows", true,
+            [](ggml_context * ctx, op_inputs & in, ggml_type type, int N, int) {
+                struct ggml_tensor * tok_embeddings = in.add(ggml_new_tensor_2d(ctx, type, n_embd, n_vocab));
+                struct ggml_tensor * rows = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, N);
+                for (int i = 0; i < N; i++) {
+                    ((int32_t *) rows->data)[i] = (i*7919) % n_vocab;
+                }
+                return ggml_get_rows(ctx, tok_embeddings, rows);
+            },
+            [](int N, int) { return shape_str({ n_embd, N }); } },
+        { "rms_norm", false,
+            [](ggml_context * ctx, op_inputs & in, ggml_type, int N, int) {
+                return ggml_rms_norm(ctx, in.add(ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, N)));
+            },
+            [](int N, int) { return shape_str({ n_embd, N }); } },
+        { "mul", false,
+            [](ggml_context * ctx, op_inputs & in, ggml_type, int N, int) {
+                return ggml_mul(ctx,
+                        in.add(ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, N)),
+                        in.add(ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd)));
+            },
+            [](int N, int) { return shape_str({ n_embd, N }); } },
+        { "add", false,
+            [](ggml_context * ctx, op_inputs & in, ggml_type, int N, int) {
+                return ggml_add(ctx,
+                        in.add(ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, N)),
+                        in.add(ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, N)));
+            },
+            [](int N, int) { return shape_str({ n_embd, N }); } },
+        { "mul_mat", true,
+            [](ggml_context * ctx, op_inputs & in, ggml_type type, int N, int) {
+                return ggml_mul_mat(ctx,
+                        in.add(ggml_new_tensor_2d(ctx, type, n_embd, n_embd)),
+                        in.add(ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, N)));
+            },
+            [](int N, int) { return shape_str({ n_embd, n_embd }) + " * " + shape_str({ n_embd, N }); } },
+        { "mul_mat", true,
+            [](ggml_context * ctx, op_inputs & in, ggml_type type, int N, int) {
+                return ggml_mul_mat(ctx,
+                        in.add(ggml_new_tensor_2d(ctx, type, n_embd, n_ff)),
+                        in.add(ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, N)));
+            },
+            [](int N, int) { return shape_str({ n_embd, n_ff }) + " * " + shape_str({ n_embd, N }); } },
+        { "rope", false,
+            [](ggml_context * ctx, op_inputs & in, ggml_type, int N, int n_kv) {
+                return ggml_rope(ctx, in.add(ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_rot, n_head, N)), n_kv - N, n_rot, 0);
+            },
+            [](int N, int) { return shape_str({ n_rot, n_head, N }); } },
+        { "cpy", true,
+            [](ggml_context * ctx, op_inputs & in, ggml_type type, int N, int) {
+                return ggml_cpy(ctx,
+                        in.add(ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd*N)),
+                        ggml_new_tensor_1d(ctx, type, n_embd*N));
+            },
+            [](int N, int) { return shape_str({ n_embd*N }); } },
+        { "mul_mat", false, // K * Q
+            [](ggml_context * ctx, op_inputs & in, ggml_type, int N, int n_kv) {
+                return ggml_mul_mat(ctx,
+                        in.add(ggml_new_tensor_3d(ctx, GGML_TYPE_F16, n_rot, n_kv, n_head)),
+                        in.add(ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_rot, N, n_head)));
+            },
+            [](int N, int n_kv) { return shape_str({ n_rot, n_kv, n_head }) + " * " + shape_str({ n_rot, N, n_head }); } },
+        { "scale", false,
+            [](ggml_context * ctx, op_inputs & in, ggml_type, int N, int n_kv) {
+                return ggml_scale(ctx,
+                        in.add(ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_kv, N, n_head)),
+                        ggml_new_f32(ctx, 1.0f/sqrtf(float(n_rot))));
+            },
+            [](int N, int n_kv) { return shape_str({ n_kv, N, n_head }); } },
+        { "diag_mask_inf", false,
+            [](ggml_context * ctx, op_inputs & in, ggml_type, int N, int n_kv) {
+                return ggml_diag_mask_inf(ctx, in.add(ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_kv, N, n_head)), n_kv - N);
+            },
+            [](int N, int n_kv) { return shape_str({ n_kv, N, n_head }); } },
+        { "soft_max", false,
+            [](ggml_context * ctx, op_inputs & in, ggml_type, int N, int n_kv) {
+                return ggml_soft_max(ctx, in.add(ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_kv, N, n_head)));
+            },
+            [](int N, int n_kv) { return shape_str({ n_kv, N, n_head }); } },
+        { "mul_mat", false, // V * softmax(KQ)
+            [](ggml_context * ctx, op_inputs & in, ggml_type, int N, int n_kv) {
+                return ggml_mul_mat(ctx,
+                        in.add(ggml_new_tensor_3d(ctx, GGML_TYPE_F16, n_kv, n_rot, n_head)),
+                        in.add(ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_kv, N, n_head)));
+            },
+            [](int N, int n_kv) { return shape_str({ n_kv, n_rot, n_head }) + " * " + shape_str({ n_kv, N, n_head }); } },
+        { "cont", false, // of the permuted attention output
+            [](ggml_context * ctx, op_inputs & in, ggml_type, int N, int) {
+                return ggml_cont(ctx, ggml_permute(ctx, in.add(ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_rot, N, n_head)), 0, 2, 1, 3));
+            },
+            [](int N, int) { return shape_str({ n_rot, N, n_head }); } },
+        { "silu", false,
+            [](ggml_context * ctx, op_inputs & in, ggml_type, int N, int) {
+                return ggml_silu(ctx, in.add(ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_ff, N)));
+            },
+            [](int N, int) { return shape_str({ n_ff, N }); } },
+    };
+    return cases;
+}
+
+// the weight types: F32, F16 and the quantized types that models are stored in
+static std::vector<ggml_type> weight_types() {
+    std::vector<ggml_type> types = { GGML_TYPE_F32, GGML_TYPE_F16 };
+    for (int i = 0; i < GGML_TYPE_COUNT; i++) {
+        const ggml_type type = (ggml_type) i;
+        if (ggml_internal_get_quantize_fn(i).quantize_row_q && type != GGML_TYPE_Q8_1 && type != GGML_TYPE_Q8_K) {
+            types.push_back(type);
+        }
+    }
+    return types;
+}
+
+static void fill_tensor(struct ggml_tensor * tensor, std::mt19937 & rng) {
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> data(ggml_nelements(tensor));
+    for (auto & x : data) {
+        x = dist(rng);
+    }
+    int64_t hist[16];
+    ggml_quantize_chunk(tensor->type, data.data(), tensor->data, 0, data.size(), hist);
+}
+
+static std::vector<int> split_int(const std::string & str) {
+    std::vector<int> values;
+    std::istringstream str_stream(str);
+    std::string token;
+    while (std::getline(str_stream, token, ',')) {
+        values.push_back(std::stoi(token));
+    }
+    return values;
+}
+
+static void print_usage(int /*argc*/, char ** argv, const benchmark_ops_params & params) {
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  --op NAME             benchmark only this op, can be repeated (default: all)\n");
+    fprintf(stderr, "  --type NAME           benchmark the weights of typed ops only in this type, can be repeated (default: all)\n");
+    fprintf(stderr, "  -n N, --tokens N      comma-separated numbers of tokens in the batch (default: 1,512)\n");
+    fprintf(stderr, "  -c N, --n-kv N        length of the KV cache seen by the attention ops (default: %d)\n", params.n_kv);
+    fprintf(stderr, "  -t N, --threads N     comma-separated numbers of threads (default: 1)\n");
+    fprintf(stderr, "  -i N, --iter N        number of timed iterations (default: %d)\n", params.n_iterations);
+    fprintf(stderr, "  -w N, --warmup N      number of untimed iterations (default: %d)\n", params.n_warmup);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "ops:");
+    for (const auto & c : op_cases()) {
+        fprintf(stderr, " %s", c.name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char ** argv) {
+    benchmark_ops_params params;
+
+    bool invalid_param = false;
+    std::string arg;
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        if (arg == "--op") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.include_ops.push_back(argv[i]);
+        } else if (arg == "--type") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.include_types.push_back(argv[i]);
+        } else if (arg == "-n" || arg == "--tokens") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            auto n = split_int(argv[i]);
+            params.n_tokens.insert(params.n_tokens.end(), n.begin(), n.end());
+        } else if (arg == "-c" || arg == "--n-kv") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_kv = std::stoi(argv[i]);
+        } else if (arg == "-t" || arg == "--threads") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            auto n = split_int(argv[i]);
+            params.n_threads.insert(params.n_threads.end(), n.begin(), n.end());
+        } else if (arg == "-i" || arg == "--iter") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_iterations = std::stoi(argv[i]);
+        } else if (arg == "-w" || arg == "--warmup") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_warmup = std::stoi(argv[i]);
+        } else if (arg == "-h" || arg == "--help") {
+            print_usage(argc, argv, params);
+            return 0;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            print_usage(argc, argv, params);
+            return 1;
+        }
+    }
+    if (invalid_param || params.n_iterations < 1 || params.n_warmup < 0) {
+        fprintf(stderr, "error: invalid parameter for argument: %s\n", arg.c_str());
+        print_usage(argc, argv, params);
+        return 1;
+    }
+
+    if (params.n_tokens.empty()) {
+        params.n_tokens = { 1, 512 };
+    }
+    if (params.n_threads.empty()) {
+        params.n_threads = { 1 };
+    }
+
+    printf("%s: build = %d (%s)\n", argv[0], BUILD_NUMBER, BUILD_COMMIT);
+    printf("%s: %d timed iterations after %d warmup iterations, the node time excludes the thread creation\n",
+            argv[0], params.n_iterations, params.n_warmup);
+    printf("\n");
+    printf("%-14s %-6s %-32s %7s %12s %12s %10s %10s\n", "op", "type", "shape", "threads", "avg us", "min us", "GFLOP/s", "GB/s");
+
+    std::mt19937 rng(1234);
+
+    for (const auto & c : op_cases()) {
+        if (!params.include_ops.empty() &&
+            std::find(params.include_ops.begin(), params.include_ops.end(), c.name) == params.include_ops.end()) {
+            continue;
+        }
+
+        std::vector<ggml_type> types = { GGML_TYPE_F32 };
+        if (c.typed) {
+            types.clear();
+            for (ggml_type type : weight_types()) {
+                if (params.include_types.empty() ||
+                    std::find(params.include_types.begin(), params.include_types.end(), ggml_type_name(type)) != params.include_types.end()) {
+                    types.push_back(type);
+                }
+            }
+        }
+
+        for (ggml_type type : types) {
+            for (int n_tokens : params.n_tokens) {
+                const int n_kv = std::max(params.n_kv, n_tokens);
+
+                // the largest case, the F32 token embeddings, needs about 600 MB
+                // the pages of the buffer that are not used are never touched
+                struct ggml_init_params ip = {
+                    /*.mem_size   =*/ (size_t) 1024*1024*1024,
+                    /*.mem_buffer =*/ NULL,
+                    /*.no_alloc   =*/ false,
+                };
+                struct ggml_context * ctx = ggml_init(ip);
+
+                op_inputs in;
+                struct ggml_tensor * out = c.build(ctx, in, type, n_tokens, n_kv);
+                for (struct ggml_tensor * t : in.tensors) {
+                    fill_tensor(t, rng);
+                }
+
+                struct ggml_cgraph gf = ggml_build_forward(out);
+
+                for (int n_threads : params.n_threads) {
+                    gf.n_threads = n_threads;
+                    // the work buffer is sized for the number of threads, let ggml_graph_compute allocate a new one
+                    gf.work      = NULL;
+                    gf.work_size = 0;
+
+                    struct ggml_profile profile = {};
+                    gf.profile = &profile;
+
+                    for (int i = 0; i < params.n_warmup; i++) {
+                        ggml_graph_compute(ctx, &gf);
+                    }
+
+                    // the time of all nodes in the graph, the views among them take no time
+                    int64_t t_total_us = 0;
+                    int64_t t_min_us   = INT64_MAX;
+                    int64_t flops = 0;
+                    int64_t bytes = 0;
+                    for (int i = 0; i < params.n_iterations; i++) {
+                        ggml_profile_reset(&profile);
+                        ggml_graph_compute(ctx, &gf);
+
+                        int64_t t_us = 0;
+                        for (int op = 0; op < GGML_OP_COUNT; op++) {
+                            t_us += profile.op_time_us[op][0] + profile.op_time_us[op][1] + profile.op_time_us[op][2];
+                        }
+                        t_total_us += t_us;
+                        t_min_us = std::min(t_min_us, t_us);
+
+                        flops = bytes = 0;
+                        for (int op = 0; op < GGML_OP_COUNT; op++) {
+                            flops += profile.op_flops[op];
+                            bytes += profile.op_bytes[op];
+                        }
+                    }
+
+                    const double t_avg_us = (double) t_total_us / params.n_iterations;
+                    printf("%-14s %-6s %-32s %7d %12.1f %12" PRId64 " %10.2f %10.2f\n",
+                            c.name, c.typed ? ggml_type_name(type) : "", c.shape(n_tokens, n_kv).c_str(), n_threads,
+                            t_avg_us, t_min_us, flops / t_avg_us / 1e3, bytes / t_avg_us / 1e3);
+                    fflush(stdout);
+                }
+
+                ggml_free(ctx);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -255,6 +255,18 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
                 break;
             }
             params.model = argv[i];
+        } else if (arg == "-md" || arg == "--model-draft") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.model_draft = argv[i];
+        } else if (arg == "--draft") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_draft = std::stoi(argv[i]);
         } else if (arg == "-a" || arg == "--alias") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -278,6 +290,24 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             params.interactive = true;
         } else if (arg == "--embedding") {
             params.embedding = true;
+        } else if (arg == "--pooling") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            std::string value(argv[i]);
+            if (value == "last") {
+                params.pooling_type = LLAMA_POOLING_LAST;
+            } else if (value == "mean") {
+                params.pooling_type = LLAMA_POOLING_MEAN;
+            } else if (value == "cls") {
+                params.pooling_type = LLAMA_POOLING_CLS;
+            } else {
+                invalid_param = true;
+                break;
+            }
+        } else if (arg == "--embd-normalize") {
+            params.embd_norm = true;
         } else if (arg == "--interactive-first") {
             params.interactive_first = true;
         } else if (arg == "-ins" || arg == "--instruct") {
@@ -355,6 +385,18 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             params.antiprompt.push_back(argv[i]);
         } else if (arg == "--perplexity") {
             params.perplexity = true;
+        } else if (arg == "--imatrix-out") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.path_imatrix_out = argv[i];
+        } else if (arg == "--trace") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.path_trace = argv[i];
         } else if (arg == "--ignore-eos") {
             params.logit_bias[llama_token_eos()] = -INFINITY;
         } else if (arg == "--no-penalize-nl") {
@@ -481,6 +523,8 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     fprintf(stderr, "  --temp N              temperature (default: %.1f)\n", (double)params.temp);
     fprintf(stderr, "  -b N, --batch-size N  batch size for prompt processing (default: %d)\n", params.n_batch);
     fprintf(stderr, "  --perplexity          compute perplexity over the prompt\n");
+    fprintf(stderr, "  --imatrix-out FNAME   collect activation statistics for quantize --imatrix and save them to FNAME\n");
+    fprintf(stderr, "  --trace FNAME         save the timeline of the evals on all threads to FNAME, for chrome://tracing or Perfetto\n");
     fprintf(stderr, "  --keep                number of tokens to keep from the initial prompt (default: %d, -1 = all)\n", params.n_keep);
     if (llama_mlock_supported()) {
         fprintf(stderr, "  --mlock               force system to keep model in RAM rather than swapping or compressing\n");
@@ -496,13 +540,19 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     fprintf(stderr, "  -mg i, --main-gpu i   the GPU to use for scratch and small tensors\n" );
     fprintf(stderr, "  -lv, --low-vram       don't allocate VRAM scratch buffer\n" );
 #endif
+    fprintf(stderr, "  --pooling {last,mean,cls}\n");
+    fprintf(stderr, "                        how the tokens are pooled into the embedding (default: last)\n");
+    fprintf(stderr, "  --embd-normalize      L2-normalize the embedding\n");
     fprintf(stderr, "  --mtest               compute maximum memory usage\n");
     fprintf(stderr, "  --export              export the computation graph to 'llama.ggml'\n");
     fprintf(stderr, "  --verbose-prompt      print prompt before generation\n");
     fprintf(stderr, "  --lora FNAME          apply LoRA adapter (implies --no-mmap)\n");
     fprintf(stderr, "  --lora-base FNAME     optional model to use as a base for the layers modified by the LoRA adapter\n");
     fprintf(stderr, "  -m FNAME, --model FNAME\n");
-    fprintf(stderr, "                        model path (default: %s)\n", params.model.c_str());
+    fprintf(stderr, "                        model path, or - to stream the model from stdin (default: %s)\n", params.model.c_str());
+    fprintf(stderr, "  -md FNAME, --model-draft FNAME\n");
+    fprintf(stderr, "                        draft model for speculative decoding (default: none)\n");
+    fprintf(stderr, "  --draft N             number of tokens to draft for speculative decoding (default: %d)\n", params.n_draft);
     fprintf(stderr, "\n");
 }
 
@@ -536,7 +586,7 @@ std::vector<llama_token> llama_tokenize(struct llama_context * ctx, const std::s
     return res;
 }
 
-std::tuple<struct llama_model *, struct llama_context *> llama_init_from_gpt_params(const gpt_params & params) {
+struct llama_context_params llama_context_params_from_gpt_params(const gpt_params & params) {
     auto lparams = llama_context_default_params();
 
     lparams.n_ctx        = params.n_ctx;
@@ -551,8 +601,18 @@ std::tuple<struct llama_model *, struct llama_context *> llama_init_from_gpt_par
     lparams.use_mlock    = params.use_mlock;
     lparams.logits_all   = params.perplexity;
     lparams.embedding    = params.embedding;
+    lparams.pooling_type = params.pooling_type;
+    lparams.embd_norm    = params.embd_norm;
+
+    return lparams;
+}
 
-    llama_model * model  = llama_load_model_from_file(params.model.c_str(), lparams);
+std::tuple<struct llama_model *, struct llama_context *> llama_init_from_gpt_params(const gpt_params & params) {
+    auto lparams = llama_context_params_from_gpt_params(params);
+
+    // "-" streams the model from stdin, e.g. `curl -s $URL | ./main -m - ...`
+    llama_model * model  = params.model == "-" ? llama_load_model_from_fd(0, lparams)
+                                               : llama_load_model_from_file(params.model.c_str(), lparams);
     if (model == NULL) {
         fprintf(stderr, "%s: error: failed to load model '%s'\n", __func__, params.model.c_str());
         return std::make_tuple(nullptr, nullptr);
@@ -581,6 +641,25 @@ std::tuple<struct llama_model *, struct llama_context *> llama_init_from_gpt_par
     return std::make_tuple(model, lctx);
 }
 
+struct llama_sampler_params llama_sampler_params_from_gpt_params(const gpt_params & params) {
+    auto sparams = llama_sampler_default_params();
+
+    sparams.temp              = params.temp;
+    sparams.top_k             = params.top_k;
+    sparams.top_p             = params.top_p;
+    sparams.tfs_z             = params.tfs_z;
+    sparams.typical_p         = params.typical_p;
+    sparams.repeat_penalty    = params.repeat_penalty;
+    sparams.presence_penalty  = params.presence_penalty;
+    sparams.frequency_penalty = params.frequency_penalty;
+    sparams.mirostat          = params.mirostat;
+    sparams.mirostat_tau      = params.mirostat_tau;
+    sparams.mirostat_eta      = params.mirostat_eta;
+    sparams.penalize_nl       = params.penalize_nl;
+
+    return sparams;
+}
+
 void console_init(console_state & con_st) {
 #if defined(_WIN32)
     // Windows-specific console initialization
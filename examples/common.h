@@ -28,10 +28,12 @@ struct gpt_params {
     int32_t n_ctx                           = 512; // context size
     int32_t n_batch                         = 512; // batch size for prompt processing (must be >=32 to use BLAS)
     int32_t n_keep                          = 0;   // number of tokens to keep from initial prompt
+    int32_t n_draft                         = 16;  // number of tokens to draft during speculative decoding
     int32_t n_gpu_layers                    = 0;   // number of layers to store in VRAM
     int32_t main_gpu                        = 0;   // the GPU that is used for scratch and small tensors
     float   tensor_split[LLAMA_MAX_DEVICES] = {0}; // how split tensors should be distributed across GPUs
     bool    low_vram                        = 0;   // if true, reduce VRAM usage at the cost of performance
+    enum llama_pooling_type pooling_type    = LLAMA_POOLING_LAST; // how the tokens are pooled into the embedding
 
     // sampling parameters
     std::unordered_map<llama_token, float> logit_bias; // logit bias for specific tokens
@@ -49,9 +51,12 @@ struct gpt_params {
     float   mirostat_eta      = 0.10f; // learning rate
 
     std::string model             = "models/7B/ggml-model.bin"; // model path
+    std::string model_draft       = "";  // draft model for speculative decoding
     std::string model_alias       = "unknown"; // model alias
     std::string prompt            = "";
     std::string path_prompt_cache = "";  // path to file for saving/loading prompt eval state
+    std::string path_imatrix_out  = "";  // path to file for saving the importance matrix (perplexity)
+    std::string path_trace        = "";  // path to file for saving the timeline of the evals
     std::string input_prefix      = "";  // string to prefix user inputs with
     std::string input_suffix      = "";  // string to suffix user inputs with
     std::vector<std::string> antiprompt; // string upon seeing which more user input is prompted
@@ -67,6 +72,7 @@ struct gpt_params {
     bool prompt_cache_ro   = false; // open the prompt cache read-only and do not update it
 
     bool embedding         = false; // get only sentence embedding
+    bool embd_norm         = false; // L2-normalize the embedding
     bool interactive_first = false; // wait for user input immediately
     bool multiline_input   = false; // reverse the usage of `\`
 
@@ -96,8 +102,12 @@ std::vector<llama_token> llama_tokenize(struct llama_context * ctx, const std::s
 // Model utils
 //
 
+struct llama_context_params llama_context_params_from_gpt_params(const gpt_params & params);
+
 std::tuple<struct llama_model *, struct llama_context *> llama_init_from_gpt_params(const gpt_params & params);
 
+struct llama_sampler_params llama_sampler_params_from_gpt_params(const gpt_params & params);
+
 //
 // Console utils
 //
@@ -0,0 +1,578 @@
+#include "common.h"
+#include "llama.h"
+#include "build-info.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+enum output_format {
+    OUTPUT_MD,
+    OUTPUT_CSV,
+    OUTPUT_JSON,
+};
+
+// every combination of the listed values is benchmarked
+struct bench_params {
+    std::vector<std::string> model;
+    std::vector<int> n_prompt;
+    std::vector<int> n_gen;
+    std::vector<int> n_batch;
+    std::vector<int> n_threads;
+    std::vector<int> n_gpu_layers;
+    std::vector<bool> f32_kv;
+    int reps;
+    int warmup;
+    output_format output;
+};
+
+static const bench_params default_params = {
+    /*.model        =*/ { "models/7B/ggml-model-q4_0.bin" },
+    /*.n_prompt     =*/ { 512 },
+    /*.n_gen        =*/ { 128 },
+    /*.n_batch      =*/ { 512 },
+    /*.n_threads    =*/ { get_num_physical_cores() },
+    /*.n_gpu_layers =*/ { 0 },
+    /*.f32_kv       =*/ { false },
+    /*.reps         =*/ 5,
+    /*.warmup       =*/ 1,
+    /*.output       =*/ OUTPUT_MD,
+};
+
+template<typename T>
+static std::string join(const std::vector<T> & values, const std::string & delim) {
+    std::ostringstream str;
+    for (size_t i = 0; i < values.size(); i++) {
+        if (i > 0) {
+            str << delim;
+        }
+        str << values[i];
+    }
+    return str.str();
+}
+
+static std::vector<std::string> split(const std::string & str, char delim) {
+    std::vector<std::string> values;
+    std::istringstream str_stream(str);
+    std::string token;
+    while (std::getline(str_stream, token, delim)) {
+        values.push_back(token);
+    }
+    return values;
+}
+
+static std::vector<int> split_int(const std::string & str) {
+    std::vector<int> values;
+    for (const auto & token : split(str, ',')) {
+        values.push_back(std::stoi(token));
+    }
+    return values;
+}
+
+static void print_usage(int /* argc */, char ** argv) {
+    fprintf(stdout, "usage: %s [options]\n", argv[0]);
+    fprintf(stdout, "\n");
+    fprintf(stdout, "options:\n");
+    fprintf(stdout, "  -h, --help\n");
+    fprintf(stdout, "  -m, --model <filename>            (default: %s)\n", join(default_params.model, ",").c_str());
+    fprintf(stdout, "  -p, --n-prompt <n>                (default: %s)\n", join(default_params.n_prompt, ",").c_str());
+    fprintf(stdout, "  -n, --n-gen <n>                   (default: %s)\n", join(default_params.n_gen, ",").c_str());
+    fprintf(stdout, "  -b, --batch-size <n>              (default: %s)\n", join(default_params.n_batch, ",").c_str());
+    fprintf(stdout, "  -t, --threads <n>                 (default: %s)\n", join(default_params.n_threads, ",").c_str());
+    fprintf(stdout, "  -ngl, --n-gpu-layers <n>          (default: %s)\n", join(default_params.n_gpu_layers, ",").c_str());
+    fprintf(stdout, "  --memory-f32 <0|1>                (default: %s)\n", join(default_params.f32_kv, ",").c_str());
+    fprintf(stdout, "  -r, --repetitions <n>             (default: %d)\n", default_params.reps);
+    fprintf(stdout, "  -w, --warmup <n>                  (default: %d)\n", default_params.warmup);
+    fprintf(stdout, "  -o, --output <md|csv|json>        (default: md)\n");
+    fprintf(stdout, "\n");
+    fprintf(stdout, "Multiple values can be given for each parameter, separated by commas or by repeating the option.\n");
+    fprintf(stdout, "Every -p value is a prompt processing test and every -n value a text generation test, 0 skips them.\n");
+}
+
+static bench_params parse_params(int argc, char ** argv) {
+    bench_params params;
+    params.reps   = default_params.reps;
+    params.warmup = default_params.warmup;
+    params.output = default_params.output;
+
+    std::string arg;
+    bool invalid_param = false;
+
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argc, argv);
+            exit(0);
+        }
+
+        const bool has_value = i + 1 < argc;
+        if (arg == "-m" || arg == "--model") {
+            if (!has_value) {
+                invalid_param = true;
+                break;
+            }
+            auto p = split(argv[++i], ',');
+            params.model.insert(params.model.end(), p.begin(), p.end());
+        } else if (arg == "-p" || arg == "--n-prompt") {
+            if (!has_value) {
+                invalid_param = true;
+                break;
+            }
+            auto p = split_int(argv[++i]);
+            params.n_prompt.insert(params.n_prompt.end(), p.begin(), p.end());
+        } else if (arg == "-n" || arg == "--n-gen") {
+            if (!has_value) {
+                invalid_param = true;
+                break;
+            }
+            auto p = split_int(argv[++i]);
+            params.n_gen.insert(params.n_gen.end(), p.begin(), p.end());
+        } else if (arg == "-b" || arg == "--batch-size") {
+            if (!has_value) {
+                invalid_param = true;
+                break;
+            }
+            auto p = split_int(argv[++i]);
+            params.n_batch.insert(params.n_batch.end(), p.begin(), p.end());
+        } else if (arg == "-t" || arg == "--threads") {
+            if (!has_value) {
+                invalid_param = true;
+                break;
+            }
+            auto p = split_int(argv[++i]);
+            params.n_threads.insert(params.n_threads.end(), p.begin(), p.end());
+        } else if (arg == "-ngl" || arg == "--n-gpu-layers") {
+            if (!has_value) {
+                invalid_param = true;
+                break;
+            }
+            auto p = split_int(argv[++i]);
+            params.n_gpu_layers.insert(params.n_gpu_layers.end(), p.begin(), p.end());
+        } else if (arg == "--memory-f32") {
+            if (!has_value) {
+                invalid_param = true;
+                break;
+            }
+            for (int v : split_int(argv[++i])) {
+                params.f32_kv.push_back(v != 0);
+            }
+        } else if (arg == "-r" || arg == "--repetitions") {
+            if (!has_value) {
+                invalid_param = true;
+                break;
+            }
+            params.reps = std::stoi(argv[++i]);
+        } else if (arg == "-w" || arg == "--warmup") {
+            if (!has_value) {
+                invalid_param = true;
+                break;
+            }
+            params.warmup = std::stoi(argv[++i]);
+        } else if (arg == "-o" || arg == "--output") {
+            if (!has_value) {
+                invalid_param = true;
+                break;
+            }
+            std::string value(argv[++i]);
+            if (value == "md") {
+                params.output = OUTPUT_MD;
+            } else if (value == "csv") {
+                params.output = OUTPUT_CSV;
+            } else if (value == "json") {
+                params.output = OUTPUT_JSON;
+            } else {
+                invalid_param = true;
+                break;
+            }
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            print_usage(argc, argv);
+            exit(1);
+        }
+    }
+
+    if (invalid_param || params.reps < 1 || params.warmup < 0) {
+        fprintf(stderr, "error: invalid parameter for argument: %s\n", arg.c_str());
+        print_usage(argc, argv);
+        exit(1);
+    }
+
+    // the defaults are used for the parameters that were not given
+    if (params.model.empty())        { params.model        = default_params.model; }
+    if (params.n_prompt.empty())     { params.n_prompt     = default_params.n_prompt; }
+    if (params.n_gen.empty())        { params.n_gen        = default_params.n_gen; }
+    if (params.n_batch.empty())      { params.n_batch      = default_params.n_batch; }
+    if (params.n_threads.empty())    { params.n_threads    = default_params.n_threads; }
+    if (params.n_gpu_layers.empty()) { params.n_gpu_layers = default_params.n_gpu_layers; }
+    if (params.f32_kv.empty())       { params.f32_kv       = default_params.f32_kv; }
+
+    return params;
+}
+
+// one benchmark, either prompt processing (n_gen == 0) or text generation (n_prompt == 0)
+struct test {
+    std::string model_filename;
+    std::string model_type;
+    uint64_t model_size = 0;
+    uint64_t model_n_params = 0;
+    int n_batch = 0;
+    int n_threads = 0;
+    int n_gpu_layers = 0;
+    bool f32_kv = false;
+    int n_prompt = 0;
+    int n_gen = 0;
+    std::string test_time;
+    std::vector<uint64_t> samples_ns;
+
+    int n_tokens() const {
+        return n_prompt + n_gen;
+    }
+
+    std::vector<double> samples_ts() const {
+        std::vector<double> ts;
+        for (uint64_t t : samples_ns) {
+            ts.push_back(1e9 * n_tokens() / t);
+        }
+        return ts;
+    }
+};
+
+template<typename T>
+static double mean(const std::vector<T> & v) {
+    return v.empty() ? 0.0 : std::accumulate(v.begin(), v.end(), 0.0) / v.size();
+}
+
+// sample standard deviation
+template<typename T>
+static double stddev(const std::vector<T> & v) {
+    if (v.size() <= 1) {
+        return 0.0;
+    }
+    const double m = mean(v);
+    double sq_sum = 0.0;
+    for (const T & x : v) {
+        sq_sum += (x - m) * (x - m);
+    }
+    return std::sqrt(sq_sum / (v.size() - 1));
+}
+
+static std::string get_cpu_features() {
+    std::string features = llama_print_system_info();
+    // "AVX = 1 | AVX2 = 0 | ..." without the disabled ones
+    std::vector<std::string> enabled;
+    for (auto & item : split(features, '|')) {
+        const size_t eq = item.find('=');
+        if (eq == std::string::npos || std::stoi(item.substr(eq + 1)) == 0) {
+            continue;
+        }
+        std::string name = item.substr(0, eq);
+        name.erase(0, name.find_first_not_of(' '));
+        name.erase(name.find_last_not_of(' ') + 1);
+        enabled.push_back(name);
+    }
+    return join(enabled, " ");
+}
+
+static std::string get_cpu_model() {
+#if defined(__linux__)
+    FILE * f = fopen("/proc/cpuinfo", "r");
+    if (f) {
+        char line[1024];
+        while (fgets(line, sizeof(line), f)) {
+            if (strncmp(line, "model name", 10) == 0) {
+                std::string name = strchr(line, ':') ? strchr(line, ':') + 1 : "";
+                name.erase(0, name.find_first_not_of(' '));
+                name.erase(name.find_last_not_of(" \n") + 1);
+                fclose(f);
+                return name;
+            }
+        }
+        fclose(f);
+    }
+#endif
+    return "unknown";
+}
+
+static std::string get_time_str() {
+    time_t t = time(NULL);
+    char buf[64];
+    strftime(buf, sizeof(buf), "%FT%TZ", gmtime(&t));
+    return buf;
+}
+
+static std::string escape_json(const std::string & str) {
+    std::string escaped;
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if ((unsigned char) c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            escaped += buf;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+static std::string escape_csv(const std::string & str) {
+    std::string escaped = "\"";
+    for (char c : str) {
+        if (c == '"') {
+            escaped += '"';
+        }
+        escaped += c;
+    }
+    return escaped + "\"";
+}
+
+static const std::vector<std::string> & fields() {
+    static const std::vector<std::string> fields = {
+        "build_commit", "build_number", "cpu_info", "cpu_features", "model_filename", "model_type",
+        "model_size", "model_n_params", "n_batch", "n_threads", "n_gpu_layers", "f32_kv",
+        "n_prompt", "n_gen", "test_time", "avg_ns", "stddev_ns", "avg_ts", "stddev_ts",
+    };
+    return fields;
+}
+
+static std::vector<std::string> values(const test & t) {
+    static const std::string cpu_info     = get_cpu_model();
+    static const std::string cpu_features = get_cpu_features();
+    const std::vector<double> ts = t.samples_ts();
+    return {
+        BUILD_COMMIT, std::to_string(BUILD_NUMBER), cpu_info, cpu_features, t.model_filename, t.model_type,
+        std::to_string(t.model_size), std::to_string(t.model_n_params), std::to_string(t.n_batch),
+        std::to_string(t.n_threads), std::to_string(t.n_gpu_layers), std::to_string(t.f32_kv),
+        std::to_string(t.n_prompt), std::to_string(t.n_gen), t.test_time,
+        std::to_string((uint64_t) mean(t.samples_ns)), std::to_string((uint64_t) stddev(t.samples_ns)),
+        std::to_string(mean(ts)), std::to_string(stddev(ts)),
+    };
+}
+
+// the string fields are quoted in the JSON output
+static bool is_string_field(const std::string & field) {
+    return field == "build_commit" || field == "cpu_info" || field == "cpu_features" || field == "model_filename" ||
+        field == "model_type" || field == "test_time";
+}
+
+// prints the results as they are measured, header() before the first and footer() after the last
+struct printer {
+    virtual ~printer() {}
+    virtual void header() {}
+    virtual void print(const test & t) = 0;
+    virtual void footer() {}
+};
+
+struct csv_printer : public printer {
+    void header() override {
+        printf("%s\n", join(fields(), ",").c_str());
+    }
+
+    void print(const test & t) override {
+        std::vector<std::string> row;
+        for (const auto & value : values(t)) {
+            row.push_back(escape_csv(value));
+        }
+        printf("%s\n", join(row, ",").c_str());
+    }
+};
+
+struct json_printer : public printer {
+    bool first = true;
+
+    void header() override {
+        printf("[\n");
+    }
+
+    void print(const test & t) override {
+        const std::vector<std::string> row = values(t);
+        printf("%s  {\n", first ? "" : ",\n");
+        for (size_t i = 0; i < row.size(); i++) {
+            const std::string & field = fields()[i];
+            if (is_string_field(field)) {
+                printf("    \"%s\": \"%s\",\n", field.c_str(), escape_json(row[i]).c_str());
+            } else {
+                printf("    \"%s\": %s,\n", field.c_str(), row[i].c_str());
+            }
+        }
+        printf("    \"samples_ns\": [ %s ],\n", join(t.samples_ns, ", ").c_str());
+        printf("    \"samples_ts\": [ %s ]\n", join(t.samples_ts(), ", ").c_str());
+        printf("  }");
+        fflush(stdout);
+        first = false;
+    }
+
+    void footer() override {
+        printf("\n]\n");
+    }
+};
+
+struct markdown_printer : public printer {
+    void header() override {
+        printf("| %-40s | %-24s | %10s | %10s | %7s | %7s | %3s | %3s | %10s | %20s |\n",
+                "model", "type", "size", "params", "n_batch", "threads", "ngl", "f32", "test", "t/s");
+        printf("| %s | %s | %s: | %s: | %s: | %s: | %s: | %s: | %s: | %s: |\n",
+                std::string(40, '-').c_str(), std::string(24, '-').c_str(),
+                std::string( 9, '-').c_str(), std::string( 9, '-').c_str(), std::string( 6, '-').c_str(),
+                std::string( 6, '-').c_str(), std::string( 2, '-').c_str(), std::string( 2, '-').c_str(),
+                std::string( 9, '-').c_str(), std::string(19, '-').c_str());
+    }
+
+    void print(const test & t) override {
+        const std::vector<double> ts = t.samples_ts();
+        const std::string test_name = t.n_gen == 0 ? "pp " + std::to_string(t.n_prompt) : "tg " + std::to_string(t.n_gen);
+        printf("| %-40s | %-24s | %6.2f GiB | %8.2f B | %7d | %7d | %3d | %3d | %10s | %9.2f ± %8.2f |\n",
+                t.model_filename.c_str(), t.model_type.c_str(), t.model_size / 1024.0 / 1024.0 / 1024.0,
+                t.model_n_params / 1e9, t.n_batch, t.n_threads, t.n_gpu_layers, t.f32_kv, test_name.c_str(),
+                mean(ts), stddev(ts));
+        fflush(stdout);
+    }
+
+    void footer() override {
+        printf("\nbuild: %s (%d)\n", BUILD_COMMIT, BUILD_NUMBER);
+    }
+};
+
+// evaluates n_prompt tokens in batches of n_batch, starting with an empty KV cache
+static bool test_prompt(llama_context * ctx, int n_prompt, int n_batch, int n_threads) {
+    std::vector<llama_token> tokens(n_batch, llama_token_bos());
+    for (int n_past = 0; n_past < n_prompt; n_past += n_batch) {
+        const int n_eval = std::min(n_prompt - n_past, n_batch);
+        if (llama_eval(ctx, tokens.data(), n_eval, n_past, n_threads)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// evaluates n_gen tokens one at a time, starting with an empty KV cache
+static bool test_gen(llama_context * ctx, int n_gen, int n_threads) {
+    const llama_token token = llama_token_bos();
+    for (int n_past = 0; n_past < n_gen; n_past++) {
+        if (llama_eval(ctx, &token, 1, n_past, n_threads)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    bench_params params = parse_params(argc, argv);
+
+    llama_init_backend();
+
+    std::unique_ptr<printer> p;
+    switch (params.output) {
+        case OUTPUT_CSV:  p.reset(new csv_printer());      break;
+        case OUTPUT_JSON: p.reset(new json_printer());     break;
+        case OUTPUT_MD:   p.reset(new markdown_printer()); break;
+    }
+    p->header();
+
+    // the model is loaded once for all tests that use it
+    for (const auto & model_filename : params.model) {
+        for (int n_gpu_layers : params.n_gpu_layers) {
+            llama_context_params lparams = llama_context_default_params();
+            lparams.n_gpu_layers = n_gpu_layers;
+
+            llama_model * model = llama_load_model_from_file(model_filename.c_str(), lparams);
+            if (model == NULL) {
+                fprintf(stderr, "%s: error: failed to load model '%s'\n", __func__, model_filename.c_str());
+                return 1;
+            }
+
+            char model_type[128];
+            llama_model_desc(model, model_type, sizeof(model_type));
+
+            test t_model;
+            t_model.model_filename = model_filename;
+            t_model.model_type     = model_type;
+            t_model.model_size     = llama_model_size(model);
+            t_model.model_n_params = llama_model_n_params(model);
+            t_model.n_gpu_layers   = n_gpu_layers;
+
+            std::vector<test> tests;
+            for (bool f32_kv : params.f32_kv) {
+                for (int n_batch : params.n_batch) {
+                    for (int n_threads : params.n_threads) {
+                        test t = t_model;
+                        t.f32_kv    = f32_kv;
+                        t.n_batch   = n_batch;
+                        t.n_threads = n_threads;
+                        for (int n_prompt : params.n_prompt) {
+                            if (n_prompt > 0) {
+                                t.n_prompt = n_prompt;
+                                t.n_gen    = 0;
+                                tests.push_back(t);
+                            }
+                        }
+                        for (int n_gen : params.n_gen) {
+                            if (n_gen > 0) {
+                                t.n_prompt = 0;
+                                t.n_gen    = n_gen;
+                                tests.push_back(t);
+                            }
+                        }
+                    }
+                }
+            }
+
+            for (auto & t : tests) {
+                lparams.n_ctx   = t.n_tokens();
+                lparams.n_batch = t.n_batch;
+                lparams.f16_kv  = !t.f32_kv;
+
+                llama_context * ctx = llama_new_context_with_model(model, lparams);
+                if (ctx == NULL) {
+                    fprintf(stderr, "%s: error: failed to create context with model '%s'\n", __func__, model_filename.c_str());
+                    llama_free_model(model);
+                    return 1;
+                }
+
+                t.test_time = get_time_str();
+
+                // the warmup runs are not counted
+                for (int i = 0; i < params.warmup + params.reps; i++) {
+                    const auto t_start = std::chrono::high_resolution_clock::now();
+                    const bool ok = t.n_prompt > 0 ? test_prompt(ctx, t.n_prompt, t.n_batch, t.n_threads)
+                                                   : test_gen(ctx, t.n_gen, t.n_threads);
+                    const auto t_end = std::chrono::high_resolution_clock::now();
+                    if (!ok) {
+                        fprintf(stderr, "%s: error: failed to eval\n", __func__);
+                        llama_free(ctx);
+                        llama_free_model(model);
+                        return 1;
+                    }
+                    if (i >= params.warmup) {
+                        t.samples_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(t_end - t_start).count());
+                    }
+                }
+
+                p->print(t);
+                llama_free(ctx);
+            }
+
+            llama_free_model(model);
+        }
+    }
+
+    p->footer();
+
+    return 0;
+}
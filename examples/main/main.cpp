@@ -39,6 +39,19 @@ static llama_context ** g_ctx;
 
 static bool is_interacting = false;
 
+static void print_memory_info(llama_context * ctx) {
+    const llama_memory_info info = llama_get_memory_info(ctx);
+    const double MB = 1024.0*1024.0;
+
+    fprintf(stderr, "%s:   model    = %8.2f MB (%8.2f MB resident)\n", __func__, info.model/MB, info.model_resident/MB);
+    fprintf(stderr, "%s:   kv cache = %8.2f MB (%8.2f MB used)\n", __func__, info.kv_size/MB, info.kv_used/MB);
+    fprintf(stderr, "%s:   compute  = %8.2f MB (%8.2f MB peak, %.2f MB of it work buffer)\n", __func__,
+            info.compute_size/MB, info.compute_peak/MB, info.work_peak/MB);
+    for (int i = 0; i < 2; i++) {
+        fprintf(stderr, "%s:   scratch%d = %8.2f MB (%8.2f MB peak)\n", __func__, i, info.scratch_size[i]/MB, info.scratch_peak[i]/MB);
+    }
+}
+
 #if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__)) || defined (_WIN32)
 void sigint_handler(int signo) {
     if (signo == SIGINT) {
@@ -125,6 +138,13 @@ int main(int argc, char ** argv) {
                 params.n_threads, std::thread::hardware_concurrency(), llama_print_system_info());
     }
 
+    // keeps the latest 1M events, 64 MB
+    ggml_trace * trace = NULL;
+    if (!params.path_trace.empty()) {
+        trace = ggml_trace_init(1 << 20);
+        llama_set_trace(ctx, trace);
+    }
+
     // determine the maximum memory usage needed to do inference for the given n_batch and n_predict parameters
     // uncomment the "used_mem" line in llama.cpp to see the results
     if (params.mem_test) {
@@ -139,6 +159,7 @@ int main(int argc, char ** argv) {
         }
 
         llama_print_timings(ctx);
+        print_memory_info(ctx);
         llama_free(ctx);
         llama_free_model(model);
 
@@ -303,6 +324,8 @@ int main(int argc, char ** argv) {
     fprintf(stderr, "generate: n_ctx = %d, n_batch = %d, n_predict = %d, n_keep = %d\n", n_ctx, params.n_batch, params.n_predict, params.n_keep);
     fprintf(stderr, "\n\n");
 
+    llama_sampler * sampler = llama_sampler_init(llama_sampler_params_from_gpt_params(params));
+
     // TODO: replace with ring-buffer
     std::vector<llama_token> last_n_tokens(n_ctx);
     std::fill(last_n_tokens.begin(), last_n_tokens.end(), 0);
@@ -434,19 +457,7 @@ int main(int argc, char ** argv) {
 
         if ((int) embd_inp.size() <= n_consumed && !is_interacting) {
             // out of user input, sample next token
-            const float   temp            = params.temp;
-            const int32_t top_k           = params.top_k <= 0 ? llama_n_vocab(ctx) : params.top_k;
-            const float   top_p           = params.top_p;
-            const float   tfs_z           = params.tfs_z;
-            const float   typical_p       = params.typical_p;
-            const int32_t repeat_last_n   = params.repeat_last_n < 0 ? n_ctx : params.repeat_last_n;
-            const float   repeat_penalty  = params.repeat_penalty;
-            const float   alpha_presence  = params.presence_penalty;
-            const float   alpha_frequency = params.frequency_penalty;
-            const int     mirostat        = params.mirostat;
-            const float   mirostat_tau    = params.mirostat_tau;
-            const float   mirostat_eta    = params.mirostat_eta;
-            const bool    penalize_nl     = params.penalize_nl;
+            const int32_t repeat_last_n = params.repeat_last_n < 0 ? n_ctx : params.repeat_last_n;
 
             // optionally save the session on first sample (for faster prompt loading next time)
             if (!path_session.empty() && need_to_save_session && !params.prompt_cache_ro) {
@@ -458,58 +469,15 @@ int main(int argc, char ** argv) {
 
             {
                 auto logits  = llama_get_logits(ctx);
-                auto n_vocab = llama_n_vocab(ctx);
 
                 // Apply params.logit_bias map
                 for (auto it = params.logit_bias.begin(); it != params.logit_bias.end(); it++) {
                     logits[it->first] += it->second;
                 }
 
-                std::vector<llama_token_data> candidates;
-                candidates.reserve(n_vocab);
-                for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-                    candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
-                }
-
-                llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
-
-                // Apply penalties
-                float nl_logit = logits[llama_token_nl()];
                 auto last_n_repeat = std::min(std::min((int)last_n_tokens.size(), repeat_last_n), n_ctx);
-                llama_sample_repetition_penalty(ctx, &candidates_p,
-                    last_n_tokens.data() + last_n_tokens.size() - last_n_repeat,
-                    last_n_repeat, repeat_penalty);
-                llama_sample_frequency_and_presence_penalties(ctx, &candidates_p,
-                    last_n_tokens.data() + last_n_tokens.size() - last_n_repeat,
-                    last_n_repeat, alpha_frequency, alpha_presence);
-                if (!penalize_nl) {
-                    logits[llama_token_nl()] = nl_logit;
-                }
-
-                if (temp <= 0) {
-                    // Greedy sampling
-                    id = llama_sample_token_greedy(ctx, &candidates_p);
-                } else {
-                    if (mirostat == 1) {
-                        static float mirostat_mu = 2.0f * mirostat_tau;
-                        const int mirostat_m = 100;
-                        llama_sample_temperature(ctx, &candidates_p, temp);
-                        id = llama_sample_token_mirostat(ctx, &candidates_p, mirostat_tau, mirostat_eta, mirostat_m, &mirostat_mu);
-                    } else if (mirostat == 2) {
-                        static float mirostat_mu = 2.0f * mirostat_tau;
-                        llama_sample_temperature(ctx, &candidates_p, temp);
-                        id = llama_sample_token_mirostat_v2(ctx, &candidates_p, mirostat_tau, mirostat_eta, &mirostat_mu);
-                    } else {
-                        // Temperature sampling
-                        llama_sample_top_k(ctx, &candidates_p, top_k, 1);
-                        llama_sample_tail_free(ctx, &candidates_p, tfs_z, 1);
-                        llama_sample_typical(ctx, &candidates_p, typical_p, 1);
-                        llama_sample_top_p(ctx, &candidates_p, top_p, 1);
-                        llama_sample_temperature(ctx, &candidates_p, temp);
-                        id = llama_sample_token(ctx, &candidates_p);
-                    }
-                }
-                // printf("`%d`", candidates_p.size);
+                id = llama_sampler_sample(sampler, ctx,
+                    last_n_tokens.data() + last_n_tokens.size() - last_n_repeat, last_n_repeat);
 
                 last_n_tokens.erase(last_n_tokens.begin());
                 last_n_tokens.push_back(id);
@@ -668,6 +636,13 @@ int main(int argc, char ** argv) {
     }
 
     llama_print_timings(ctx);
+    print_memory_info(ctx);
+    if (trace) {
+        fprintf(stderr, "%s: saving the trace to '%s'\n", __func__, params.path_trace.c_str());
+        ggml_trace_write(trace, params.path_trace.c_str());
+        ggml_trace_free(trace);
+    }
+    llama_sampler_free(sampler);
     llama_free(ctx);
     llama_free_model(model);
 
@@ -166,8 +166,19 @@ int main(int argc, char ** argv) {
                 params.n_threads, std::thread::hardware_concurrency(), llama_print_system_info());
     }
 
+    if (!params.path_imatrix_out.empty()) {
+        llama_set_imatrix_collection(ctx, true);
+    }
+
     perplexity(ctx, params);
 
+    if (!params.path_imatrix_out.empty()) {
+        if (!llama_save_imatrix(ctx, params.path_imatrix_out.c_str())) {
+            return 1;
+        }
+        fprintf(stderr, "%s: saved importance matrix to %s\n", __func__, params.path_imatrix_out.c_str());
+    }
+
     llama_print_timings(ctx);
     llama_free(ctx);
     llama_free_model(model);
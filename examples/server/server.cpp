@@ -2,8 +2,6 @@
 #include "llama.h"
 #include "build-info.h"
 
-// single thread
-#define CPPHTTPLIB_THREAD_POOL_COUNT 1
 #ifndef NDEBUG
 // crash the server in debug mode, otherwise send an http 500 error
 #define CPPHTTPLIB_NO_EXCEPTIONS 1
@@ -12,6 +10,26 @@
 #include "httplib.h"
 #include "json.hpp"
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <signal.h>
+#elif defined (_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <signal.h>
+#endif
+
 #ifndef SERVER_VERBOSE
 #define SERVER_VERBOSE 1
 #endif
@@ -24,6 +42,9 @@ struct server_params {
     int32_t port = 8080;
     int32_t read_timeout = 600;
     int32_t write_timeout = 600;
+    int32_t prompt_cache_mb = 0;
+    int32_t prompt_cache_disk_mb = 4096;
+    std::string prompt_cache_dir;
 };
 
 static size_t common_part(const std::vector<llama_token> & a, const std::vector<llama_token> & b) {
@@ -103,6 +124,59 @@ static bool server_verbose = false;
 #define LOG_WARNING(MSG, ...) server_log("WARNING", __func__, __LINE__, MSG, __VA_ARGS__)
 #define LOG_INFO(MSG, ...) server_log("INFO", __func__, __LINE__, MSG, __VA_ARGS__)
 
+// a completion or embedding request, the scheduler thread pushes results that the http thread sends
+struct server_task {
+    gpt_params params;
+    std::vector<llama_token> prompt_tokens;
+    bool stream = false;
+    // the texts of an embedding request, and their tokens
+    std::vector<std::string> contents;
+    std::vector<std::vector<llama_token>> inputs;
+    int64_t t_queued_us = 0;
+
+    // set by the http thread when the client went away
+    std::atomic<bool> cancelled{false};
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<json> results;
+    bool done = false;
+
+    void push(json data) {
+        std::lock_guard<std::mutex> lock(mutex);
+        results.push_back(std::move(data));
+        cv.notify_one();
+    }
+
+    void finish() {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        cv.notify_one();
+    }
+
+    // waits up to timeout_ms for a result or the end of the task
+    bool wait_for(int timeout_ms) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] { return !results.empty() || done; });
+    }
+
+    // waits for the next result, returns false when the task is finished and all results were taken
+    bool next(json & data) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return !results.empty() || done; });
+        if (results.empty()) {
+            return false;
+        }
+        data = std::move(results.front());
+        results.pop_front();
+        return true;
+    }
+};
+
+struct llama_server_context;
+
+static bool server_abort_eval(void * data);
+
 struct llama_server_context {
     bool stream = false;
     bool has_next_token = false;
@@ -117,6 +191,7 @@ struct llama_server_context {
 
     llama_model * model = nullptr;
     llama_context * ctx = nullptr;
+    llama_sampler * sampler = nullptr;
     gpt_params params;
 
     bool truncated = false;
@@ -126,7 +201,24 @@ struct llama_server_context {
     std::string stopping_word;
     int32_t multibyte_pending = 0;
 
+    // the request that is worked on, null when idle
+    std::shared_ptr<server_task> task;
+    size_t sent_count = 0;
+
+    // inputs of an embedding task that were evaluated, and their embeddings
+    size_t n_inputs_done = 0;
+    std::vector<float> embeddings;
+
+    // time spent on the prompt of the task, and on the eval and sampling of the last token or -1
+    int64_t t_prompt_us = 0;
+    int64_t t_decode_us = -1;
+    int64_t t_sample_us = -1;
+
     ~llama_server_context() {
+        if (sampler) {
+            llama_sampler_free(sampler);
+            sampler = nullptr;
+        }
         if (ctx) {
             llama_free(ctx);
             ctx = nullptr;
@@ -160,16 +252,14 @@ struct llama_server_context {
             LOG_ERROR("unable to load model", { { "model", params_.model } });
             return false;
         }
+        llama_set_abort_callback(ctx, server_abort_eval, this);
 
         last_n_tokens.resize(params.n_ctx);
         std::fill(last_n_tokens.begin(), last_n_tokens.end(), 0);
         return true;
     }
 
-    void loadPrompt() {
-        params.prompt.insert(0, 1, ' '); // always add a first space
-        std::vector<llama_token> prompt_tokens = ::llama_tokenize(ctx, params.prompt, true);
-
+    void loadPrompt(std::vector<llama_token> prompt_tokens) {
         if (params.n_keep < 0) {
             params.n_keep = (int)prompt_tokens.size();
         }
@@ -219,11 +309,16 @@ struct llama_server_context {
         // number of tokens to keep when resetting context
         n_remain = params.n_predict;
         llama_set_rng_seed(ctx, params.seed);
-    }
 
-    llama_token nextToken() {
-        llama_token result = -1;
+        // the sampling parameters may change with every request
+        if (sampler) {
+            llama_sampler_free(sampler);
+        }
+        sampler = llama_sampler_init(llama_sampler_params_from_gpt_params(params));
+    }
 
+    // evaluates at most one batch of the tokens that are not in the KV cache yet
+    void evalBatch() {
         if (embd.size() >= (size_t)params.n_ctx) {
             // Reset context
             const int n_left = (params.n_ctx - params.n_keep) / 2;
@@ -241,22 +336,43 @@ struct llama_server_context {
             });
         }
 
-        while (n_past < embd.size()) {
-            int n_eval = (int)embd.size() - n_past;
-            if (n_eval > params.n_batch) {
-                n_eval = params.n_batch;
-            }
-            if (llama_eval(ctx, &embd[n_past], n_eval, n_past, params.n_threads)) {
+        int n_eval = (int)embd.size() - n_past;
+        if (n_eval > params.n_batch) {
+            n_eval = params.n_batch;
+        }
+        if (llama_eval(ctx, &embd[n_past], n_eval, n_past, params.n_threads)) {
+            if (task && task->cancelled) {
+                LOG_VERBOSE("eval aborted", { { "n_eval", n_eval }, { "n_past", n_past } });
+            } else {
                 LOG_ERROR("failed to eval", {
                     { "n_eval", n_eval },
                     { "n_past", n_past },
                     { "n_threads", params.n_threads },
                     { "embd", tokens_to_str(ctx, embd.cbegin() + n_past, embd.cend()) },
                 });
-                has_next_token = false;
-                return result;
             }
-            n_past += n_eval;
+            // only the tokens before n_past are in the KV cache
+            embd.resize(n_past);
+            has_next_token = false;
+            return;
+        }
+        n_past += n_eval;
+    }
+
+    llama_token nextToken() {
+        llama_token result = -1;
+
+        t_decode_us = -1;
+        t_sample_us = -1;
+        if (n_past < embd.size()) {
+            const int64_t t_start_us = llama_time_us();
+            while (has_next_token && n_past < embd.size()) {
+                evalBatch();
+            }
+            t_decode_us = llama_time_us() - t_start_us;
+        }
+        if (!has_next_token) {
+            return result;
         }
 
         if (params.n_predict == 0) {
@@ -265,74 +381,23 @@ struct llama_server_context {
         }
 
         // out of user input, sample next token
-        const float temp = params.temp;
-        const int32_t top_k = params.top_k <= 0 ? llama_n_vocab(ctx) : params.top_k;
-        const float top_p = params.top_p;
-        const float tfs_z = params.tfs_z;
-        const float typical_p = params.typical_p;
         const int32_t repeat_last_n = params.repeat_last_n < 0 ? params.n_ctx : params.repeat_last_n;
-        const float repeat_penalty = params.repeat_penalty;
-        const float alpha_presence = params.presence_penalty;
-        const float alpha_frequency = params.frequency_penalty;
-        const int mirostat = params.mirostat;
-        const float mirostat_tau = params.mirostat_tau;
-        const float mirostat_eta = params.mirostat_eta;
-        const bool penalize_nl = params.penalize_nl;
         llama_token id = 0;
 
         {
             auto * logits = llama_get_logits(ctx);
-            auto n_vocab = llama_n_vocab(ctx);
 
             // Apply params.logit_bias map
             for (const auto & it : params.logit_bias) {
                 logits[it.first] += it.second;
             }
 
-            std::vector<llama_token_data> candidates;
-            candidates.reserve(n_vocab);
-            for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-                candidates.emplace_back(llama_token_data{ token_id, logits[token_id], 0.0f });
-            }
-
-            llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
-
-            // Apply penalties
-            float nl_logit = logits[llama_token_nl()];
             auto last_n_repeat = std::min(std::min((int)last_n_tokens.size(), repeat_last_n), params.n_ctx);
-            llama_sample_repetition_penalty(ctx, &candidates_p,
-                last_n_tokens.data() + last_n_tokens.size() - last_n_repeat,
-                last_n_repeat, repeat_penalty);
-            llama_sample_frequency_and_presence_penalties(ctx, &candidates_p,
-                last_n_tokens.data() + last_n_tokens.size() - last_n_repeat,
-                last_n_repeat, alpha_frequency, alpha_presence);
-            if (!penalize_nl) {
-                logits[llama_token_nl()] = nl_logit;
-            }
-
-            if (temp <= 0) {
-                // Greedy sampling
-                id = llama_sample_token_greedy(ctx, &candidates_p);
-            } else {
-                if (mirostat == 1) {
-                    static float mirostat_mu = 2.0f * mirostat_tau;
-                    const int mirostat_m = 100;
-                    llama_sample_temperature(ctx, &candidates_p, temp);
-                    id = llama_sample_token_mirostat(ctx, &candidates_p, mirostat_tau, mirostat_eta, mirostat_m, &mirostat_mu);
-                } else if (mirostat == 2) {
-                    static float mirostat_mu = 2.0f * mirostat_tau;
-                    llama_sample_temperature(ctx, &candidates_p, temp);
-                    id = llama_sample_token_mirostat_v2(ctx, &candidates_p, mirostat_tau, mirostat_eta, &mirostat_mu);
-                } else {
-                    // Temperature sampling
-                    llama_sample_top_k(ctx, &candidates_p, top_k, 1);
-                    llama_sample_tail_free(ctx, &candidates_p, tfs_z, 1);
-                    llama_sample_typical(ctx, &candidates_p, typical_p, 1);
-                    llama_sample_top_p(ctx, &candidates_p, top_p, 1);
-                    llama_sample_temperature(ctx, &candidates_p, temp);
-                    id = llama_sample_token(ctx, &candidates_p);
-                }
-            }
+            const int64_t t_start_us = llama_time_us();
+            id = llama_sampler_sample(sampler, ctx,
+                last_n_tokens.data() + last_n_tokens.size() - last_n_repeat, last_n_repeat);
+            t_sample_us = llama_time_us() - t_start_us;
+
             last_n_tokens.erase(last_n_tokens.begin());
             last_n_tokens.push_back(id);
             num_tokens_predicted++;
@@ -417,7 +482,7 @@ struct llama_server_context {
 
         LOG_VERBOSE("next token", {
             { "token", token },
-            { "token_text", llama_token_to_str(ctx, token) },
+            { "token_text", token_text },
             { "has_next_token", has_next_token },
             { "n_remain", n_remain },
             { "num_tokens_predicted", num_tokens_predicted },
@@ -430,20 +495,33 @@ struct llama_server_context {
         return token_text;
     }
 
-    std::vector<float> getEmbedding() {
-        static const int n_embd = llama_n_embd(ctx);
-        if (!params.embedding) {
-            LOG_WARNING("embedding disabled", {
-                { "params.embedding", params.embedding },
-            });
-            return std::vector<float>(n_embd, 0.0f);
+    void assignTask(const std::shared_ptr<server_task> & task_) {
+        rewind();
+        llama_reset_timings(ctx);
+
+        task = task_;
+        params = task->params;
+        stream = task->stream;
+        sent_count = 0;
+        t_prompt_us = 0;
+
+        if (!task->inputs.empty()) {
+            n_inputs_done = 0;
+            embeddings.assign(task->inputs.size()*llama_n_embd(ctx), 0.0f);
+            return;
         }
-        const float * data = llama_get_embeddings(ctx);
-        std::vector<float> embedding(data, data + n_embd);
-        return embedding;
+
+        loadPrompt(task->prompt_tokens);
+        beginCompletion();
     }
 };
 
+// stops the evaluation of a prompt when its client went away
+static bool server_abort_eval(void * data) {
+    const llama_server_context * llama = (const llama_server_context *) data;
+    return llama->task && llama->task->cancelled;
+}
+
 static void server_print_usage(const char * argv0, const gpt_params & params,
                                const server_params & sparams) {
     fprintf(stderr, "usage: %s [options]\n", argv0);
@@ -454,6 +532,11 @@ static void server_print_usage(const char * argv0, const gpt_params & params,
     fprintf(stderr, "  -t N, --threads N     number of threads to use during computation (default: %d)\n", params.n_threads);
     fprintf(stderr, "  -c N, --ctx-size N    size of the prompt context (default: %d)\n", params.n_ctx);
     fprintf(stderr, "  -b N, --batch-size N  batch size for prompt processing (default: %d)\n", params.n_batch);
+    fprintf(stderr, "  --prompt-cache-mb N   memory for KV state snapshots of prompts, reused by later requests (default: %d, disabled)\n", sparams.prompt_cache_mb);
+    fprintf(stderr, "  --prompt-cache-dir DIR\n");
+    fprintf(stderr, "                        keep snapshots evicted from memory in this directory\n");
+    fprintf(stderr, "  --prompt-cache-disk-mb N\n");
+    fprintf(stderr, "                        disk space for snapshots in the prompt cache directory (default: %d)\n", sparams.prompt_cache_disk_mb);
     fprintf(stderr, "  --memory-f32          use f32 instead of f16 for memory key+value (default: disabled)\n");
     fprintf(stderr, "                        not recommended: doubles context memory required and no measurable increase in quality\n");
     if (llama_mlock_supported()) {
@@ -481,6 +564,10 @@ static void server_print_usage(const char * argv0, const gpt_params & params,
     fprintf(stderr, "  --port PORT           port to listen (default  (default: %d)\n", sparams.port);
     fprintf(stderr, "  -to N, --timeout N    server read/write timeout in seconds (default: %d)\n", sparams.read_timeout);
     fprintf(stderr, "  --embedding           enable embedding vector output (default: %s)\n", params.embedding ? "enabled" : "disabled");
+    fprintf(stderr, "  --pooling {last,mean,cls}\n");
+    fprintf(stderr, "                        how the tokens are pooled into the embedding (default: last)\n");
+    fprintf(stderr, "  --embd-normalize      L2-normalize the embeddings\n");
+    fprintf(stderr, "  --trace FNAME         record the timeline of the latest evals, written to FNAME on POST /trace and at exit\n");
     fprintf(stderr, "\n");
 }
 
@@ -548,6 +635,24 @@ static void server_params_parse(int argc, char ** argv, server_params & sparams,
             }
             params.n_batch = std::stoi(argv[i]);
             params.n_batch = std::min(512, params.n_batch);
+        } else if (arg == "--prompt-cache-mb") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.prompt_cache_mb = std::max(0, std::stoi(argv[i]));
+        } else if (arg == "--prompt-cache-dir") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.prompt_cache_dir = argv[i];
+        } else if (arg == "--prompt-cache-disk-mb") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            sparams.prompt_cache_disk_mb = std::max(0, std::stoi(argv[i]));
         } else if (arg == "--gpu-layers" || arg == "-ngl" || arg == "--n-gpu-layers") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -629,6 +734,30 @@ static void server_params_parse(int argc, char ** argv, server_params & sparams,
             params.use_mmap = false;
         } else if (arg == "--embedding") {
             params.embedding = true;
+        } else if (arg == "--pooling") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            std::string value(argv[i]);
+            if (value == "last") {
+                params.pooling_type = LLAMA_POOLING_LAST;
+            } else if (value == "mean") {
+                params.pooling_type = LLAMA_POOLING_MEAN;
+            } else if (value == "cls") {
+                params.pooling_type = LLAMA_POOLING_CLS;
+            } else {
+                invalid_param = true;
+                break;
+            }
+        } else if (arg == "--embd-normalize") {
+            params.embd_norm = true;
+        } else if (arg == "--trace") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.path_trace = argv[i];
         } else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
             server_print_usage(argv[0], default_params, default_sparams);
@@ -643,38 +772,43 @@ static void server_params_parse(int argc, char ** argv, server_params & sparams,
     }
 }
 
-static json format_generation_settings(llama_server_context & llama) {
-    const auto eos_bias = llama.params.logit_bias.find(llama_token_eos());
-    const bool ignore_eos = eos_bias != llama.params.logit_bias.end() &&
+static json format_generation_settings(const gpt_params & params, bool stream) {
+    const auto eos_bias = params.logit_bias.find(llama_token_eos());
+    const bool ignore_eos = eos_bias != params.logit_bias.end() &&
         eos_bias->second < 0.0f && std::isinf(eos_bias->second);
 
     return json {
-        { "seed", llama.params.seed },
-        { "temp", llama.params.temp },
-        { "top_k", llama.params.top_k },
-        { "top_p", llama.params.top_p },
-        { "tfs_z", llama.params.tfs_z },
-        { "typical_p", llama.params.typical_p },
-        { "repeat_last_n", llama.params.repeat_last_n },
-        { "repeat_penalty", llama.params.repeat_penalty },
-        { "presence_penalty", llama.params.presence_penalty },
-        { "frequency_penalty", llama.params.frequency_penalty },
-        { "mirostat", llama.params.mirostat },
-        { "mirostat_tau", llama.params.mirostat_tau },
-        { "mirostat_eta", llama.params.mirostat_eta },
-        { "penalize_nl", llama.params.penalize_nl },
-        { "stop", llama.params.antiprompt },
-        { "n_predict", llama.params.n_predict },
-        { "n_keep", llama.params.n_keep },
+        { "seed", params.seed },
+        { "temp", params.temp },
+        { "top_k", params.top_k },
+        { "top_p", params.top_p },
+        { "tfs_z", params.tfs_z },
+        { "typical_p", params.typical_p },
+        { "repeat_last_n", params.repeat_last_n },
+        { "repeat_penalty", params.repeat_penalty },
+        { "presence_penalty", params.presence_penalty },
+        { "frequency_penalty", params.frequency_penalty },
+        { "mirostat", params.mirostat },
+        { "mirostat_tau", params.mirostat_tau },
+        { "mirostat_eta", params.mirostat_eta },
+        { "penalize_nl", params.penalize_nl },
+        { "stop", params.antiprompt },
+        { "n_predict", params.n_predict },
+        { "n_keep", params.n_keep },
         { "ignore_eos", ignore_eos },
-        { "stream", llama.stream },
-        { "logit_bias", llama.params.logit_bias },
+        { "stream", stream },
+        { "logit_bias", params.logit_bias },
     };
 }
 
 static json format_embedding_response(llama_server_context & llama) {
+    const size_t n_embd = llama_n_embd(llama.ctx);
+    json embeddings = json::array();
+    for (size_t i = 0; i < llama.task->inputs.size(); i++) {
+        embeddings.push_back(std::vector<float>(llama.embeddings.begin() + i*n_embd, llama.embeddings.begin() + (i + 1)*n_embd));
+    }
     return json {
-        { "embedding", llama.getEmbedding() },
+        { "embedding", embeddings },
     };
 }
 
@@ -684,7 +818,7 @@ static json format_final_response(llama_server_context & llama, const std::strin
         { "stop", true },
         { "model", llama.params.model_alias },
         { "tokens_predicted", llama.num_tokens_predicted },
-        { "generation_settings", format_generation_settings(llama) },
+        { "generation_settings", format_generation_settings(llama.params, llama.stream) },
         { "prompt", llama.params.prompt },
         { "truncated", llama.truncated },
         { "stopped_eos", llama.stopped_eos },
@@ -707,61 +841,96 @@ static json format_tokenizer_response(const std::vector<llama_token> & tokens) {
     };
 }
 
-static void parse_options_completion(const json & body, llama_server_context & llama) {
+static void parse_options_completion(const json & body, llama_context * ctx, server_task & task) {
     gpt_params default_params;
 
-    llama.stream = body.value("stream", false);
-    llama.params.n_predict = body.value("n_predict", default_params.n_predict);
-    llama.params.top_k = body.value("top_k", default_params.top_k);
-    llama.params.top_p = body.value("top_p", default_params.top_p);
-    llama.params.tfs_z = body.value("tfs_z", default_params.tfs_z);
-    llama.params.typical_p = body.value("typical_p", default_params.typical_p);
-    llama.params.repeat_last_n = body.value("repeat_last_n", default_params.repeat_last_n);
-    llama.params.temp = body.value("temperature", default_params.temp);
-    llama.params.repeat_penalty = body.value("repeat_penalty", default_params.repeat_penalty);
-    llama.params.presence_penalty = body.value("presence_penalty", default_params.presence_penalty);
-    llama.params.frequency_penalty = body.value("frequency_penalty", default_params.frequency_penalty);
-    llama.params.mirostat = body.value("mirostat", default_params.mirostat);
-    llama.params.mirostat_tau = body.value("mirostat_tau", default_params.mirostat_tau);
-    llama.params.mirostat_eta = body.value("mirostat_eta", default_params.mirostat_eta);
-    llama.params.penalize_nl = body.value("penalize_nl", default_params.penalize_nl);
-    llama.params.n_keep = body.value("n_keep", default_params.n_keep);
-    llama.params.seed = body.value("seed", default_params.seed);
-    llama.params.prompt = body.value("prompt", default_params.prompt);
-
-    llama.params.logit_bias.clear();
+    task.stream = body.value("stream", false);
+    task.params.n_predict = body.value("n_predict", default_params.n_predict);
+    task.params.top_k = body.value("top_k", default_params.top_k);
+    task.params.top_p = body.value("top_p", default_params.top_p);
+    task.params.tfs_z = body.value("tfs_z", default_params.tfs_z);
+    task.params.typical_p = body.value("typical_p", default_params.typical_p);
+    task.params.repeat_last_n = body.value("repeat_last_n", default_params.repeat_last_n);
+    task.params.temp = body.value("temperature", default_params.temp);
+    task.params.repeat_penalty = body.value("repeat_penalty", default_params.repeat_penalty);
+    task.params.presence_penalty = body.value("presence_penalty", default_params.presence_penalty);
+    task.params.frequency_penalty = body.value("frequency_penalty", default_params.frequency_penalty);
+    task.params.mirostat = body.value("mirostat", default_params.mirostat);
+    task.params.mirostat_tau = body.value("mirostat_tau", default_params.mirostat_tau);
+    task.params.mirostat_eta = body.value("mirostat_eta", default_params.mirostat_eta);
+    task.params.penalize_nl = body.value("penalize_nl", default_params.penalize_nl);
+    task.params.n_keep = body.value("n_keep", default_params.n_keep);
+    task.params.seed = body.value("seed", default_params.seed);
+    task.params.prompt = body.value("prompt", default_params.prompt);
+
+    task.params.logit_bias.clear();
     if (body.value("ignore_eos", false)) {
-        llama.params.logit_bias[llama_token_eos()] = -INFINITY;
+        task.params.logit_bias[llama_token_eos()] = -INFINITY;
     }
 
     const auto & logit_bias = body.find("logit_bias");
     if (logit_bias != body.end() && logit_bias->is_array()) {
-        const int n_vocab = llama_n_vocab(llama.ctx);
+        const int n_vocab = llama_n_vocab(ctx);
         for (const auto & el : *logit_bias) {
             if (el.is_array() && el.size() == 2 && el[0].is_number_integer()) {
                 llama_token tok = el[0].get<llama_token>();
                 if (tok >= 0 && tok < n_vocab) {
                     if (el[1].is_number()) {
-                        llama.params.logit_bias[tok] = el[1].get<float>();
+                        task.params.logit_bias[tok] = el[1].get<float>();
                     } else if (el[1].is_boolean() && !el[1].get<bool>()) {
-                        llama.params.logit_bias[tok] = -INFINITY;
+                        task.params.logit_bias[tok] = -INFINITY;
                     }
                 }
             }
         }
     }
 
-    llama.params.antiprompt.clear();
+    task.params.antiprompt.clear();
     const auto & stop = body.find("stop");
     if (stop != body.end() && stop->is_array()) {
         for (const auto & word : *stop) {
             if (!word.empty()) {
-                llama.params.antiprompt.push_back(word);
+                task.params.antiprompt.push_back(word);
             }
         }
     }
 
-    LOG_VERBOSE("completion parameters parsed", format_generation_settings(llama));
+    LOG_VERBOSE("completion parameters parsed", format_generation_settings(task.params, task.stream));
+}
+
+// sends the results of a task with a chunked content provider, a stream sends all of them and the others the first one
+// while there is no result the provider returns without writing, and httplib checks that the client is still connected
+// before it calls the provider again, so the task is cancelled soon after the client goes away
+static void set_task_content_provider(Response & res, const std::shared_ptr<server_task> & task, bool stream,
+                                      const char * content_type, std::function<std::string(json &)> format_result) {
+    const auto content_provider = [task, stream, format_result](size_t, DataSink & sink) {
+        if (!task->wait_for(100)) {
+            return true;
+        }
+        json data;
+        if (!task->next(data)) {
+            sink.done();
+            return true;
+        }
+        const std::string str = format_result(data);
+        LOG_VERBOSE("data stream", {
+            { "to_send", str }
+        });
+        if (!sink.write(str.data(), str.size())) {
+            return false;
+        }
+        if (!stream) {
+            sink.done();
+        }
+        return true;
+    };
+    const auto on_complete = [task](bool success) {
+        if (!success) {
+            LOG_VERBOSE("connection closed", {});
+            task->cancelled = true;
+        }
+    };
+    res.set_chunked_content_provider(content_type, content_provider, on_complete);
 }
 
 static void log_server_request(const Request & req, const Response & res) {
@@ -775,13 +944,802 @@ static void log_server_request(const Request & req, const Response & res) {
     });
 }
 
+static const double histogram_bounds[] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+    0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 25.0, 50.0, 100.0,
+};
+
+static const int histogram_n_bounds = sizeof(histogram_bounds)/sizeof(histogram_bounds[0]);
+
+// latency histogram in seconds, can be observed from any thread
+struct server_histogram {
+    std::atomic<uint64_t> buckets[histogram_n_bounds + 1];
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum_us{0};
+
+    server_histogram() {
+        for (auto & bucket : buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void observe(int64_t t_us) {
+        const double t = t_us * 1e-6;
+        int i = 0;
+        while (i < histogram_n_bounds && t > histogram_bounds[i]) {
+            i++;
+        }
+        buckets[i].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum_us.fetch_add(t_us, std::memory_order_relaxed);
+    }
+};
+
+struct server_metrics {
+    server_histogram queue_wait;
+    server_histogram tokenize;
+    server_histogram prompt_eval;
+    server_histogram decode;
+    server_histogram sample;
+
+    std::atomic<uint64_t> n_requests{0};
+    std::atomic<uint64_t> n_prompt_tokens{0};
+    std::atomic<uint64_t> n_prompt_tokens_cached{0};
+    std::atomic<uint64_t> n_tokens_predicted{0};
+
+    std::atomic<int64_t> n_processing{0};
+    std::atomic<int64_t> n_queued{0};
+    std::atomic<int64_t> n_kv_tokens{0};
+    std::atomic<int64_t> n_kv_size{0};
+    std::atomic<int64_t> prompt_cache_mem_bytes{0};
+    std::atomic<int64_t> prompt_cache_disk_bytes{0};
+    std::atomic<int64_t> model_bytes{0};
+    std::atomic<int64_t> model_resident_bytes{0};
+    std::atomic<int64_t> kv_used_bytes{0};
+    std::atomic<int64_t> kv_size_bytes{0};
+    std::atomic<int64_t> compute_peak_bytes{0};
+    std::atomic<int64_t> compute_size_bytes{0};
+};
+
+static void format_metric_header(std::string & out, const char * name, const char * type, const char * help) {
+    out += std::string("# HELP ") + name + " " + help + "\n";
+    out += std::string("# TYPE ") + name + " " + type + "\n";
+}
+
+static void format_counter(std::string & out, const char * name, const char * help, uint64_t value) {
+    format_metric_header(out, name, "counter", help);
+    out += std::string(name) + " " + std::to_string(value) + "\n";
+}
+
+static void format_gauge(std::string & out, const char * name, const char * help, int64_t value) {
+    format_metric_header(out, name, "gauge", help);
+    out += std::string(name) + " " + std::to_string(value) + "\n";
+}
+
+static void format_histogram(std::string & out, const char * name, const char * help, const server_histogram & h) {
+    format_metric_header(out, name, "histogram", help);
+    char buf[256];
+    uint64_t cumulative = 0;
+    for (int i = 0; i <= histogram_n_bounds; i++) {
+        cumulative += h.buckets[i].load(std::memory_order_relaxed);
+        if (i < histogram_n_bounds) {
+            snprintf(buf, sizeof(buf), "%s_bucket{le=\"%g\"} %llu\n", name, histogram_bounds[i], (unsigned long long) cumulative);
+        } else {
+            snprintf(buf, sizeof(buf), "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) cumulative);
+        }
+        out += buf;
+    }
+    snprintf(buf, sizeof(buf), "%s_sum %.6f\n", name, h.sum_us.load(std::memory_order_relaxed) * 1e-6);
+    out += buf;
+    snprintf(buf, sizeof(buf), "%s_count %llu\n", name, (unsigned long long) h.count.load(std::memory_order_relaxed));
+    out += buf;
+}
+
+// Prometheus text format
+static std::string format_metrics(const server_metrics & m) {
+    std::string out;
+    format_histogram(out, "llamacpp_queue_wait_seconds", "Time requests waited in the queue.", m.queue_wait);
+    format_histogram(out, "llamacpp_tokenize_seconds", "Time spent tokenizing prompts.", m.tokenize);
+    format_histogram(out, "llamacpp_prompt_eval_seconds", "Time spent evaluating the uncached part of a prompt.", m.prompt_eval);
+    format_histogram(out, "llamacpp_decode_seconds", "Time spent evaluating one generated token.", m.decode);
+    format_histogram(out, "llamacpp_sample_seconds", "Time spent sampling one token.", m.sample);
+    format_counter(out, "llamacpp_requests_total", "Completion and embedding requests received.", m.n_requests);
+    format_counter(out, "llamacpp_prompt_tokens_total", "Prompt tokens evaluated.", m.n_prompt_tokens);
+    format_counter(out, "llamacpp_prompt_tokens_cached_total", "Prompt tokens reused from the KV cache.", m.n_prompt_tokens_cached);
+    format_counter(out, "llamacpp_tokens_predicted_total", "Tokens generated.", m.n_tokens_predicted);
+    format_gauge(out, "llamacpp_requests_processing", "Requests being processed.", m.n_processing);
+    format_gauge(out, "llamacpp_requests_queued", "Requests waiting in the queue.", m.n_queued);
+    format_gauge(out, "llamacpp_kv_cache_tokens", "Tokens in the KV cache.", m.n_kv_tokens);
+    format_gauge(out, "llamacpp_kv_cache_size_tokens", "Capacity of the KV cache.", m.n_kv_size);
+    format_gauge(out, "llamacpp_prompt_cache_memory_bytes", "Size of the prompt cache snapshots in memory.", m.prompt_cache_mem_bytes);
+    format_gauge(out, "llamacpp_prompt_cache_disk_bytes", "Size of the prompt cache snapshots on disk.", m.prompt_cache_disk_bytes);
+    format_gauge(out, "llamacpp_model_bytes", "Size of the model weights.", m.model_bytes);
+    format_gauge(out, "llamacpp_model_resident_bytes", "Part of the model weights in RAM.", m.model_resident_bytes);
+    format_gauge(out, "llamacpp_kv_cache_bytes", "Part of the KV cache that holds tokens.", m.kv_used_bytes);
+    format_gauge(out, "llamacpp_kv_cache_size_bytes", "Size of the KV cache.", m.kv_size_bytes);
+    format_gauge(out, "llamacpp_compute_peak_bytes", "Most of the compute and scratch buffers used by an eval.", m.compute_peak_bytes);
+    format_gauge(out, "llamacpp_compute_size_bytes", "Size of the compute and scratch buffers.", m.compute_size_bytes);
+    return out;
+}
+
+// KV state snapshots of evaluated prompts, so that a request can continue from the longest cached
+// prefix of its prompt instead of evaluating it again. The snapshots are indexed by a radix tree over
+// their tokens and evicted least recently used first, to a directory if one is given.
+struct server_prompt_cache {
+    struct entry {
+        std::vector<llama_token> tokens;
+        std::vector<uint8_t> state; // empty when the snapshot is on disk
+        size_t state_size = 0;
+        std::string path;           // empty when the snapshot is in memory
+        std::list<entry *>::iterator lru;
+    };
+
+    struct node {
+        std::vector<llama_token> edge; // tokens between the parent and this node
+        std::map<llama_token, std::unique_ptr<node>> children;
+        std::unique_ptr<entry> snapshot;
+    };
+
+    size_t mem_budget = 0;
+    size_t disk_budget = 0;
+    std::string dir;
+
+    node root;
+    std::list<entry *> lru; // most recently used first
+    size_t mem_size = 0;
+    size_t disk_size = 0;
+    int n_files = 0;
+    std::vector<uint8_t> buf;
+
+    ~server_prompt_cache() {
+        for (entry * e : lru) {
+            if (!e->path.empty()) {
+                std::remove(e->path.c_str());
+            }
+        }
+    }
+
+    bool enabled() const {
+        return mem_budget > 0;
+    }
+
+    // length of the longest prefix of tokens that is in the cache, found is set to a snapshot that has it
+    size_t lookup(const std::vector<llama_token> & tokens, entry ** found) {
+        node * n = &root;
+        size_t pos = 0;
+        while (pos < tokens.size()) {
+            const auto it = n->children.find(tokens[pos]);
+            if (it == n->children.end()) {
+                break;
+            }
+            node * child = it->second.get();
+            size_t i = 0;
+            while (i < child->edge.size() && pos + i < tokens.size() && child->edge[i] == tokens[pos + i]) {
+                i++;
+            }
+            pos += i;
+            n = child;
+            if (i < child->edge.size()) {
+                break;
+            }
+        }
+
+        // every leaf has a snapshot, so any snapshot below n shares the first pos tokens
+        while (!n->snapshot) {
+            if (n->children.empty()) {
+                *found = nullptr;
+                return 0;
+            }
+            n = n->children.begin()->second.get();
+        }
+        *found = n->snapshot.get();
+        return pos;
+    }
+
+    // copies the KV state of ctx, which has to hold exactly the given tokens
+    void save(llama_context * ctx, const std::vector<llama_token> & tokens) {
+        entry * found = nullptr;
+        if (lookup(tokens, &found) == tokens.size()) {
+            touch(found);
+            return;
+        }
+
+        buf.resize(llama_get_kv_state_size(ctx));
+        const size_t state_size = llama_copy_kv_state_data(ctx, buf.data());
+        if (state_size > mem_budget) {
+            return;
+        }
+
+        // snapshots of a prefix of tokens are covered by the new one
+        std::vector<entry *> covered;
+        node * n = insert(tokens, covered);
+
+        n->snapshot.reset(new entry());
+        entry * e = n->snapshot.get();
+        e->tokens = tokens;
+        e->state.assign(buf.begin(), buf.begin() + state_size);
+        e->state_size = state_size;
+        lru.push_front(e);
+        e->lru = lru.begin();
+        mem_size += state_size;
+
+        for (entry * c : covered) {
+            erase(c);
+        }
+        evict();
+
+        LOG_VERBOSE("prompt cached", {
+            { "n_tokens", tokens.size() },
+            { "state_size", state_size },
+            { "n_snapshots", lru.size() },
+            { "mem_size", mem_size },
+            { "disk_size", disk_size },
+        });
+    }
+
+    // sets the KV state of ctx to the snapshot, loading it from disk if needed
+    bool restore(llama_context * ctx, entry * e) {
+        touch(e);
+        if (e->state.empty()) {
+            FILE * f = fopen(e->path.c_str(), "rb");
+            e->state.resize(e->state_size);
+            const bool ok = f != nullptr && fread(e->state.data(), 1, e->state_size, f) == e->state_size;
+            if (f) {
+                fclose(f);
+            }
+            if (!ok) {
+                LOG_WARNING("failed to read prompt cache file", { { "path", e->path } });
+                erase(e);
+                return false;
+            }
+            std::remove(e->path.c_str());
+            e->path.clear();
+            disk_size -= e->state_size;
+            mem_size += e->state_size;
+            evict();
+        }
+        // only the KV cache, the rng keeps the seed of the request
+        llama_set_kv_state_data(ctx, e->state.data());
+        return true;
+    }
+
+    void touch(entry * e) {
+        lru.splice(lru.begin(), lru, e->lru);
+    }
+
+    node * insert(const std::vector<llama_token> & tokens, std::vector<entry *> & covered) {
+        node * n = &root;
+        size_t pos = 0;
+        while (pos < tokens.size()) {
+            if (n->snapshot) {
+                covered.push_back(n->snapshot.get());
+            }
+            const auto it = n->children.find(tokens[pos]);
+            if (it == n->children.end()) {
+                std::unique_ptr<node> child(new node());
+                child->edge.assign(tokens.begin() + pos, tokens.end());
+                n = (n->children[tokens[pos]] = std::move(child)).get();
+                break;
+            }
+            node * child = it->second.get();
+            size_t i = 0;
+            while (i < child->edge.size() && pos + i < tokens.size() && child->edge[i] == tokens[pos + i]) {
+                i++;
+            }
+            if (i < child->edge.size()) {
+                // split the edge where the tokens diverge
+                std::unique_ptr<node> mid(new node());
+                mid->edge.assign(child->edge.begin(), child->edge.begin() + i);
+                std::unique_ptr<node> rest = std::move(it->second);
+                rest->edge.erase(rest->edge.begin(), rest->edge.begin() + i);
+                const llama_token key = rest->edge[0];
+                mid->children[key] = std::move(rest);
+                it->second = std::move(mid);
+                child = it->second.get();
+            }
+            pos += i;
+            n = child;
+        }
+        return n;
+    }
+
+    // removes the snapshot for tokens[pos:] below n, returns true when n is left empty
+    bool erase_node(node * n, const std::vector<llama_token> & tokens, size_t pos) {
+        if (pos == tokens.size()) {
+            n->snapshot.reset();
+        } else {
+            const auto it = n->children.find(tokens[pos]);
+            node * child = it->second.get();
+            if (erase_node(child, tokens, pos + child->edge.size())) {
+                n->children.erase(it);
+            } else if (!child->snapshot && child->children.size() == 1) {
+                // merge the child with its only child
+                std::unique_ptr<node> grandchild = std::move(child->children.begin()->second);
+                grandchild->edge.insert(grandchild->edge.begin(), child->edge.begin(), child->edge.end());
+                it->second = std::move(grandchild);
+            }
+        }
+        return !n->snapshot && n->children.empty();
+    }
+
+    void erase(entry * e) {
+        lru.erase(e->lru);
+        if (e->path.empty()) {
+            mem_size -= e->state_size;
+        } else {
+            std::remove(e->path.c_str());
+            disk_size -= e->state_size;
+        }
+        const std::vector<llama_token> tokens = std::move(e->tokens);
+        erase_node(&root, tokens, 0);
+    }
+
+    bool spill(entry * e) {
+        const std::string path = dir + "/prompt-cache-" + std::to_string(n_files++) + ".bin";
+        FILE * f = fopen(path.c_str(), "wb");
+        const bool ok = f != nullptr && fwrite(e->state.data(), 1, e->state_size, f) == e->state_size;
+        if (f) {
+            fclose(f);
+        }
+        if (!ok) {
+            LOG_WARNING("failed to write prompt cache file", { { "path", path } });
+            std::remove(path.c_str());
+            return false;
+        }
+        e->path = path;
+        e->state.clear();
+        e->state.shrink_to_fit();
+        mem_size -= e->state_size;
+        disk_size += e->state_size;
+        return true;
+    }
+
+    void evict() {
+        while (mem_size > mem_budget) {
+            const auto it = std::find_if(lru.rbegin(), lru.rend(), [](const entry * e) { return e->path.empty(); });
+            if (dir.empty() || !spill(*it)) {
+                erase(*it);
+            }
+        }
+        while (disk_size > disk_budget) {
+            const auto it = std::find_if(lru.rbegin(), lru.rend(), [](const entry * e) { return !e->path.empty(); });
+            erase(*it);
+        }
+    }
+};
+
+// Runs the requests of all clients one after the other on a single context, in the order they came in.
+// Every iteration evaluates one prompt batch or one token, the queue and the trace requests are looked
+// at in between.
+struct server_scheduler {
+    llama_server_context llama;
+    server_prompt_cache prompt_cache;
+    server_metrics metrics;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<server_task>> queue;
+    bool running = false;
+    std::thread thread;
+
+    // timeline of the evals, written to path_trace on POST /trace and when the scheduler stops
+    ggml_trace * trace = nullptr;
+    ggml_trace * trace_snapshot = nullptr; // copy of trace taken between two steps, written by POST /trace
+    std::string path_trace;
+    int n_trace_requests = 0;     // snapshots asked for by POST /trace, taken by the scheduler between two steps
+    int n_trace_snapshots = 0;
+    std::condition_variable cv_trace;
+    std::mutex mutex_trace_write; // one POST /trace at a time owns trace_snapshot
+
+    ~server_scheduler() {
+        stop();
+        ggml_trace_free(trace);
+        ggml_trace_free(trace_snapshot);
+    }
+
+    bool init(const gpt_params & params) {
+        if (!llama.loadModel(params)) {
+            return false;
+        }
+        metrics.n_kv_size = params.n_ctx;
+        updateMemoryMetrics();
+
+        if (!params.path_trace.empty()) {
+            trace = ggml_trace_init(1 << 18);
+            trace_snapshot = ggml_trace_init(1 << 18);
+            path_trace = params.path_trace;
+            llama_set_trace(llama.ctx, trace);
+        }
+        return true;
+    }
+
+    // tokenization only reads the vocabulary, it can run while the context evaluates
+    llama_context * vocab_ctx() const {
+        return llama.ctx;
+    }
+
+    void start() {
+        running = true;
+        thread = std::thread([this] { run(); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        cv.notify_one();
+        if (thread.joinable()) {
+            thread.join();
+        }
+        if (trace) {
+            ggml_trace_write(trace, path_trace.c_str());
+        }
+    }
+
+    // asks the scheduler for a snapshot of the trace once no graph is computed and writes it,
+    // the evals only stall for the copy, not for the file I/O
+    bool writeTrace() {
+        std::lock_guard<std::mutex> write_lock(mutex_trace_write);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!trace || !running) {
+                return false;
+            }
+            const int n_snapshot = ++n_trace_requests;
+            cv.notify_one();
+            cv_trace.wait(lock, [this, n_snapshot] { return n_trace_snapshots >= n_snapshot || !running; });
+            if (n_trace_snapshots < n_snapshot) {
+                return false;
+            }
+        }
+        return ggml_trace_write(trace_snapshot, path_trace.c_str());
+    }
+
+    // tokenizes the texts of an embedding request on n_threads threads,
+    // each one is cut to n_ctx tokens
+    std::vector<std::vector<llama_token>> tokenize_inputs(std::vector<std::string> texts, int n_ctx, int n_threads) {
+        std::vector<const char *> c_texts;
+        size_t n_max_tokens = 0;
+        for (auto & text : texts) {
+            text.insert(0, 1, ' '); // always add a first space
+            c_texts.push_back(text.c_str());
+            n_max_tokens += text.size() + 1;
+        }
+
+        // a token covers at least one byte, plus the BOS of each text
+        std::vector<llama_token> tokens(n_max_tokens);
+        std::vector<int32_t> offsets(texts.size() + 1);
+        int n = llama_tokenize_batch(vocab_ctx(), c_texts.data(), c_texts.size(), tokens.data(), tokens.size(), offsets.data(), true, n_threads);
+        if (n < 0) {
+            tokens.resize(-n);
+            n = llama_tokenize_batch(vocab_ctx(), c_texts.data(), c_texts.size(), tokens.data(), tokens.size(), offsets.data(), true, n_threads);
+        }
+
+        std::vector<std::vector<llama_token>> inputs;
+        for (size_t i = 0; i < texts.size(); i++) {
+            const int32_t n_tokens = std::min<int32_t>(offsets[i + 1] - offsets[i], n_ctx);
+            inputs.emplace_back(tokens.begin() + offsets[i], tokens.begin() + offsets[i] + n_tokens);
+        }
+        return inputs;
+    }
+
+    // tokenizes the prompt in the calling thread and queues the task
+    void post(const std::shared_ptr<server_task> & task) {
+        const int64_t t_start_us = llama_time_us();
+        if (!task->contents.empty()) {
+            task->inputs = tokenize_inputs(task->contents, task->params.n_ctx, task->params.n_threads);
+        } else {
+            task->params.prompt.insert(0, 1, ' '); // always add a first space
+            task->prompt_tokens = ::llama_tokenize(vocab_ctx(), task->params.prompt, true);
+        }
+        task->t_queued_us = llama_time_us();
+        metrics.tokenize.observe(task->t_queued_us - t_start_us);
+        metrics.n_requests++;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(task);
+        metrics.n_queued = queue.size();
+        cv.notify_one();
+    }
+
+    void updateMemoryMetrics() {
+        const llama_memory_info info = llama_get_memory_info(llama.ctx);
+        metrics.model_bytes = info.model;
+        metrics.model_resident_bytes = info.model_resident;
+        metrics.kv_used_bytes = info.kv_used;
+        metrics.kv_size_bytes = info.kv_size;
+        metrics.compute_peak_bytes = info.compute_peak + info.scratch_peak[0] + info.scratch_peak[1];
+        metrics.compute_size_bytes = info.compute_size + info.scratch_size[0] + info.scratch_size[1];
+    }
+
+    // starts the oldest queued task once the previous one is done
+    void startNextTask() {
+        if (llama.task || queue.empty()) {
+            return;
+        }
+        const std::shared_ptr<server_task> task = queue.front();
+        queue.pop_front();
+        metrics.n_queued = queue.size();
+
+        LOG_VERBOSE("task started", {
+            { "n_cached", common_part(llama.embd, task->prompt_tokens) },
+            { "n_queued", queue.size() },
+        });
+
+        llama.assignTask(task);
+        metrics.queue_wait.observe(llama_time_us() - task->t_queued_us);
+
+        if (prompt_cache.enabled()) {
+            loadCachedPrefix();
+        }
+        metrics.n_prompt_tokens_cached += llama.n_past;
+    }
+
+    // continues from the longest cached prefix of the prompt if the context itself has less of it
+    void loadCachedPrefix() {
+        server_prompt_cache::entry * found = nullptr;
+        size_t n_cached = prompt_cache.lookup(llama.embd, &found);
+        if (n_cached == llama.embd.size()) {
+            // we have to evaluate at least 1 token to generate logits.
+            n_cached--;
+        }
+        if (n_cached <= llama.n_past || !prompt_cache.restore(llama.ctx, found)) {
+            return;
+        }
+
+        LOG_VERBOSE("prompt cache hit", {
+            { "n_past", llama.n_past },
+            { "n_cached", n_cached },
+            { "to_eval", tokens_to_str(llama.ctx, llama.embd.cbegin() + n_cached, llama.embd.cend()) },
+        });
+        llama.n_past = n_cached;
+    }
+
+    // evaluates the next inputs of an embedding task, as many as fit in one batch,
+    // returns false when all inputs are done
+    bool stepEmbeddings() {
+        server_task & task = *llama.task;
+        const gpt_params & params = llama.params;
+        const size_t n_embd = llama_n_embd(llama.ctx);
+
+        if (!params.embedding) {
+            LOG_WARNING("embedding disabled", {
+                { "params.embedding", params.embedding },
+            });
+            task.push(format_embedding_response(llama));
+            return false;
+        }
+
+        const size_t first = llama.n_inputs_done;
+        std::vector<llama_token> tokens;
+        std::vector<int32_t> seq_lens;
+        while (llama.n_inputs_done < task.inputs.size()) {
+            const std::vector<llama_token> & input = task.inputs[llama.n_inputs_done];
+            if (!seq_lens.empty() && tokens.size() + input.size() > (size_t)params.n_batch) {
+                break;
+            }
+            tokens.insert(tokens.end(), input.begin(), input.end());
+            seq_lens.push_back(input.size());
+            llama.n_inputs_done++;
+        }
+
+        const int64_t t_start_us = llama_time_us();
+        bool ok = true;
+        if (tokens.size() > (size_t)params.n_batch) {
+            // a single input longer than a batch, evaluated in several batches
+            for (size_t i = 0; ok && i < tokens.size(); i += params.n_batch) {
+                const int n_eval = std::min(tokens.size() - i, (size_t)params.n_batch);
+                ok = llama_eval(llama.ctx, &tokens[i], n_eval, i, params.n_threads) == 0;
+            }
+            if (ok) {
+                std::copy_n(llama_get_embeddings(llama.ctx), n_embd, &llama.embeddings[first*n_embd]);
+            }
+        } else {
+            ok = llama_eval_embeddings(llama.ctx, tokens.data(), seq_lens.data(), seq_lens.size(),
+                &llama.embeddings[first*n_embd], params.n_threads) == 0;
+        }
+        llama.t_prompt_us += llama_time_us() - t_start_us;
+        metrics.n_prompt_tokens += tokens.size();
+
+        // the KV cache does not hold the tokens of the last completion anymore
+        llama.embd.clear();
+        llama.n_past = 0;
+
+        if (!ok) {
+            if (task.cancelled) {
+                LOG_VERBOSE("request cancelled", {});
+            } else {
+                LOG_ERROR("failed to eval", {
+                    { "n_eval", tokens.size() },
+                    { "n_inputs", seq_lens.size() },
+                    { "n_threads", params.n_threads },
+                });
+            }
+            return false;
+        }
+
+        LOG_VERBOSE("embeddings evaluated", {
+            { "n_eval", tokens.size() },
+            { "n_inputs", seq_lens.size() },
+            { "n_inputs_done", llama.n_inputs_done },
+            { "n_inputs_total", task.inputs.size() },
+        });
+
+        if (llama.n_inputs_done < task.inputs.size()) {
+            return true;
+        }
+
+        metrics.prompt_eval.observe(llama.t_prompt_us);
+        task.push(format_embedding_response(llama));
+        llama_print_timings(llama.ctx);
+        return false;
+    }
+
+    // advances the task by one prompt batch or one token,
+    // returns false when the task is finished
+    bool step() {
+        server_task & task = *llama.task;
+
+        if (task.cancelled) {
+            LOG_VERBOSE("request cancelled", {});
+            llama_print_timings(llama.ctx);
+            return false;
+        }
+
+        if (!task.inputs.empty()) {
+            return stepEmbeddings();
+        }
+
+        // the prompt is evaluated one batch per step, so that a cancelled request stops early
+        if (llama.num_tokens_predicted == 0 && llama.n_past < llama.embd.size()) {
+            const size_t n_past = llama.n_past;
+            const int64_t t_start_us = llama_time_us();
+            llama.evalBatch();
+            llama.t_prompt_us += llama_time_us() - t_start_us;
+            metrics.n_prompt_tokens += llama.n_past - n_past;
+            if (task.cancelled) {
+                LOG_VERBOSE("request cancelled", {});
+                return false;
+            }
+
+            if (llama.has_next_token) {
+                if (llama.n_past < llama.embd.size()) {
+                    return true;
+                }
+                metrics.prompt_eval.observe(llama.t_prompt_us);
+                if (prompt_cache.enabled()) {
+                    prompt_cache.save(llama.ctx, llama.embd);
+                }
+            }
+        }
+
+        const std::string token_text = llama.doCompletion();
+
+        if (llama.t_decode_us >= 0) {
+            metrics.decode.observe(llama.t_decode_us);
+        }
+        if (llama.t_sample_us >= 0) {
+            metrics.sample.observe(llama.t_sample_us);
+            metrics.n_tokens_predicted++;
+        }
+
+        if (!llama.stream) {
+            size_t stop_pos = llama.findStoppingStrings(llama.generated_text,
+                token_text.size(), STOP_FULL);
+            if (llama.has_next_token) {
+                return true;
+            }
+
+            if (stop_pos == std::string::npos) {
+                stop_pos = llama.findStoppingStrings(llama.generated_text, 0, STOP_PARTIAL);
+            }
+            if (stop_pos != std::string::npos) {
+                llama.generated_text.erase(llama.generated_text.begin() + stop_pos,
+                    llama.generated_text.end());
+            }
+
+            task.push(format_final_response(llama, llama.generated_text));
+        } else {
+            if (llama.multibyte_pending > 0) {
+                return true;
+            }
+
+            size_t pos = std::min(llama.sent_count, llama.generated_text.size());
+
+            const std::string str_test = llama.generated_text.substr(pos);
+            size_t stop_pos =
+                llama.findStoppingStrings(str_test, token_text.size(), STOP_FULL);
+            if (stop_pos != std::string::npos) {
+                llama.generated_text.erase(
+                    llama.generated_text.begin() + pos + stop_pos,
+                    llama.generated_text.end());
+                pos = std::min(llama.sent_count, llama.generated_text.size());
+            } else {
+                stop_pos = llama.findStoppingStrings(str_test, token_text.size(),
+                    STOP_PARTIAL);
+            }
+
+            const std::string to_send = llama.generated_text.substr(pos, stop_pos);
+            llama.sent_count += to_send.size();
+
+            task.push(llama.has_next_token
+                          ? format_partial_response(to_send)
+                          // Generation is done, send extra information.
+                          : format_final_response(llama, to_send));
+
+            if (llama.has_next_token) {
+                return true;
+            }
+        }
+
+        llama_print_timings(llama.ctx);
+        return false;
+    }
+
+    void run() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return !running || !queue.empty() || llama.task || n_trace_snapshots < n_trace_requests; });
+                if (!running) {
+                    break;
+                }
+                if (n_trace_snapshots < n_trace_requests) {
+                    ggml_trace_copy(trace_snapshot, trace);
+                    n_trace_snapshots = n_trace_requests;
+                    cv_trace.notify_all();
+                }
+                startNextTask();
+            }
+
+            bool finished = false;
+            if (llama.task && !step()) {
+                llama.task->finish();
+                llama.task.reset();
+                finished = true;
+            }
+            metrics.n_processing = llama.task ? 1 : 0;
+            metrics.n_kv_tokens = llama_get_kv_cache_token_count(llama.ctx);
+            metrics.prompt_cache_mem_bytes = prompt_cache.mem_size;
+            metrics.prompt_cache_disk_bytes = prompt_cache.disk_size;
+
+            // mincore walks the pages of the model, so only when a request is done
+            if (finished) {
+                updateMemoryMetrics();
+            }
+        }
+
+        // release the clients that are still waiting
+        if (llama.task) {
+            llama.task->finish();
+            llama.task.reset();
+        }
+        for (auto & task : queue) {
+            task->finish();
+        }
+        queue.clear();
+        cv_trace.notify_all();
+    }
+};
+
+static Server * g_svr = nullptr;
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__)) || defined (_WIN32)
+static void sigint_handler(int signo) {
+    if ((signo == SIGINT || signo == SIGTERM) && g_svr) {
+        g_svr->stop();
+    }
+}
+#endif
+
 int main(int argc, char ** argv) {
     // own arguments required by this example
     gpt_params params;
     server_params sparams;
 
-    // struct that contains llama context and inference
-    llama_server_context llama;
+    // the llama context and the thread that runs it
+    server_scheduler scheduler;
 
     server_params_parse(argc, argv, sparams, params);
 
@@ -802,9 +1760,13 @@ int main(int argc, char ** argv) {
     });
 
     // load the model
-    if (!llama.loadModel(params)) {
+    if (!scheduler.init(params)) {
         return 1;
     }
+    scheduler.prompt_cache.mem_budget = (size_t)sparams.prompt_cache_mb*1024*1024;
+    scheduler.prompt_cache.disk_budget = (size_t)sparams.prompt_cache_disk_mb*1024*1024;
+    scheduler.prompt_cache.dir = sparams.prompt_cache_dir;
+    scheduler.start();
 
     Server svr;
 
@@ -817,121 +1779,74 @@ int main(int argc, char ** argv) {
         res.set_content("<h1>llama.cpp server works</h1>", "text/html");
     });
 
-    svr.Post("/completion", [&llama](const Request & req, Response & res) {
-        llama.rewind();
-        llama_reset_timings(llama.ctx);
+    svr.Post("/completion", [&scheduler, &params](const Request & req, Response & res) {
+        auto task = std::make_shared<server_task>();
+        task->params = params;
 
-        parse_options_completion(json::parse(req.body), llama);
+        parse_options_completion(json::parse(req.body), scheduler.vocab_ctx(), *task);
 
-        llama.loadPrompt();
-        llama.beginCompletion();
+        scheduler.post(task);
 
-        if (!llama.stream) {
-            size_t stop_pos = std::string::npos;
-
-            while (llama.has_next_token) {
-                const std::string token_text = llama.doCompletion();
-
-                stop_pos = llama.findStoppingStrings(llama.generated_text,
-                    token_text.size(), STOP_FULL);
-            }
-
-            if (stop_pos == std::string::npos) {
-                stop_pos = llama.findStoppingStrings(llama.generated_text, 0, STOP_PARTIAL);
-            }
-            if (stop_pos != std::string::npos) {
-                llama.generated_text.erase(llama.generated_text.begin() + stop_pos,
-                    llama.generated_text.end());
-            }
-
-            const json data = format_final_response(llama, llama.generated_text);
-
-            llama_print_timings(llama.ctx);
-
-            res.set_content(data.dump(-1, ' ', false, json::error_handler_t::replace),
-                            "application/json");
-        } else {
-            const auto chunked_content_provider = [&](size_t, DataSink & sink) {
-                size_t sent_count = 0;
-
-                while (llama.has_next_token) {
-                    const std::string token_text = llama.doCompletion();
-                    if (llama.multibyte_pending > 0) {
-                        continue;
-                    }
-
-                    size_t pos = std::min(sent_count, llama.generated_text.size());
-
-                    const std::string str_test = llama.generated_text.substr(pos);
-                    size_t stop_pos =
-                        llama.findStoppingStrings(str_test, token_text.size(), STOP_FULL);
-                    if (stop_pos != std::string::npos) {
-                        llama.generated_text.erase(
-                            llama.generated_text.begin() + pos + stop_pos,
-                            llama.generated_text.end());
-                        pos = std::min(sent_count, llama.generated_text.size());
-                    } else {
-                        stop_pos = llama.findStoppingStrings(str_test, token_text.size(),
-                            STOP_PARTIAL);
-                    }
-
-                    const std::string to_send = llama.generated_text.substr(pos, stop_pos);
-                    sent_count += to_send.size();
-
-                    const json data = llama.has_next_token
-                                          ? format_partial_response(to_send)
-                                          // Generation is done, send extra information.
-                                          : format_final_response(llama, to_send);
-
-                    const std::string str =
-                        "data: " +
-                        data.dump(-1, ' ', false, json::error_handler_t::replace) +
-                        "\n\n";
-
-                    LOG_VERBOSE("data stream", {
-                        { "to_send", str }
-                    });
-
-                    if (!sink.write(str.data(), str.size())) {
-                        LOG_VERBOSE("stream closed", {});
-                        llama_print_timings(llama.ctx);
-                        return false;
-                    }
-                }
-
-                llama_print_timings(llama.ctx);
-                sink.done();
-                return true;
-            };
-            res.set_chunked_content_provider("text/event-stream", chunked_content_provider);
-        }
+        set_task_content_provider(res, task, task->stream, task->stream ? "text/event-stream" : "application/json",
+            [task](json & data) {
+                const std::string str = data.dump(-1, ' ', false, json::error_handler_t::replace);
+                return task->stream ? "data: " + str + "\n\n" : str;
+            });
     });
 
     svr.Options(R"(/.*)", [](const Request &, Response & res) {
         return res.set_content("", "application/json");
     });
 
-    svr.Post("/tokenize", [&llama](const Request & req, Response & res) {
+    svr.Post("/tokenize", [&scheduler](const Request & req, Response & res) {
         const json body = json::parse(req.body);
         const std::string content = body.value("content", "");
-        const std::vector<llama_token> tokens = llama_tokenize(llama.ctx, content, false);
+        const std::vector<llama_token> tokens = llama_tokenize(scheduler.vocab_ctx(), content, false);
         const json data = format_tokenizer_response(tokens);
         return res.set_content(data.dump(), "application/json");
     });
 
-    svr.Post("/embedding", [&llama](const Request & req, Response & res) {
+    svr.Get("/metrics", [&scheduler](const Request &, Response & res) {
+        res.set_content(format_metrics(scheduler.metrics), "text/plain; version=0.0.4");
+    });
+
+    svr.Post("/trace", [&scheduler](const Request &, Response & res) {
+        if (scheduler.path_trace.empty()) {
+            res.status = 404;
+            return res.set_content(json { { "error", "tracing is disabled, start the server with --trace" } }.dump(), "application/json");
+        }
+        if (!scheduler.writeTrace()) {
+            res.status = 500;
+        }
+        return res.set_content(json { { "path", scheduler.path_trace } }.dump(), "application/json");
+    });
+
+    svr.Post("/embedding", [&scheduler, &params](const Request & req, Response & res) {
         const json body = json::parse(req.body);
 
-        llama.rewind();
-        llama_reset_timings(llama.ctx);
-        llama.params.prompt = body.value("content", "");
-        llama.params.n_predict = 0;
-        llama.loadPrompt();
-        llama.beginCompletion();
-        llama.doCompletion();
+        auto task = std::make_shared<server_task>();
+        task->params = params;
+        task->params.n_predict = 0;
+        // an array of texts is evaluated in packed batches and gives an array of embeddings
+        const json content = body.count("content") ? body["content"] : json("");
+        if (content.is_array()) {
+            if (content.empty()) {
+                return res.set_content(json { { "embedding", json::array() } }.dump(), "application/json");
+            }
+            task->contents = content.get<std::vector<std::string>>();
+        } else {
+            task->contents.push_back(content.get<std::string>());
+        }
+
+        scheduler.post(task);
 
-        const json data = format_embedding_response(llama);
-        return res.set_content(data.dump(), "application/json");
+        const bool single = !content.is_array();
+        set_task_content_provider(res, task, false, "application/json", [single](json & data) {
+            if (single) {
+                data["embedding"] = data["embedding"][0];
+            }
+            return data.dump();
+        });
     });
 
     svr.set_logger(log_server_request);
@@ -967,9 +1882,29 @@ int main(int argc, char ** argv) {
         { "port", sparams.port },
     });
 
-    if (!svr.listen_after_bind()) {
+    // stop listening on SIGINT/SIGTERM, so that the scheduler is stopped and the trace is written on the way out
+    g_svr = &svr;
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+    struct sigaction sigint_action;
+    sigint_action.sa_handler = sigint_handler;
+    sigemptyset (&sigint_action.sa_mask);
+    sigint_action.sa_flags = 0;
+    sigaction(SIGINT, &sigint_action, NULL);
+    sigaction(SIGTERM, &sigint_action, NULL);
+#elif defined (_WIN32)
+    auto console_ctrl_handler = +[](DWORD ctrl_type) -> BOOL {
+        return (ctrl_type == CTRL_C_EVENT || ctrl_type == CTRL_CLOSE_EVENT) ? (sigint_handler(SIGINT), true) : false;
+    };
+    SetConsoleCtrlHandler(static_cast<PHANDLER_ROUTINE>(console_ctrl_handler), true);
+#endif
+
+    const bool listened = svr.listen_after_bind();
+    g_svr = nullptr;
+    if (!listened) {
         return 1;
     }
 
+    LOG_INFO("HTTP server stopped", {});
+
     return 0;
 }
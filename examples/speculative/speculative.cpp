@@ -0,0 +1,303 @@
+#include "common.h"
+#include "llama.h"
+#include "build-info.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+// probabilities of all tokens after top-k, tail free, typical, top-p and temperature,
+// greedy sampling (temp <= 0) puts all the probability on the most likely token
+static void token_probs(llama_context * ctx, const float * logits, const gpt_params & params, std::vector<float> & probs) {
+    const int n_vocab = llama_n_vocab(ctx);
+
+    probs.assign(n_vocab, 0.0f);
+    if (params.temp <= 0) {
+        probs[std::max_element(logits, logits + n_vocab) - logits] = 1.0f;
+        return;
+    }
+
+    std::vector<llama_token_data> candidates;
+    candidates.reserve(n_vocab);
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    }
+    llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
+
+    const int top_k = params.top_k <= 0 ? n_vocab : params.top_k;
+    llama_sample_top_k(ctx, &candidates_p, top_k, 1);
+    llama_sample_tail_free(ctx, &candidates_p, params.tfs_z, 1);
+    llama_sample_typical(ctx, &candidates_p, params.typical_p, 1);
+    llama_sample_top_p(ctx, &candidates_p, params.top_p, 1);
+    llama_sample_temperature(ctx, &candidates_p, params.temp);
+    llama_sample_softmax(ctx, &candidates_p);
+
+    for (size_t i = 0; i < candidates_p.size; i++) {
+        probs[candidates_p.data[i].id] = candidates_p.data[i].p;
+    }
+}
+
+static llama_token sample_token(const std::vector<float> & probs, std::mt19937 & rng) {
+    std::discrete_distribution<llama_token> dist(probs.begin(), probs.end());
+    return dist(rng);
+}
+
+// evaluates tokens[n_past] .. tokens[n_end - 1] in batches of n_batch tokens
+static bool eval_tokens(llama_context * ctx, const std::vector<llama_token> & tokens, int n_past, int n_end, const gpt_params & params) {
+    for (int i = n_past; i < n_end; i += params.n_batch) {
+        const int n_eval = std::min(n_end - i, params.n_batch);
+        if (llama_eval(ctx, &tokens[i], n_eval, i, params.n_threads)) {
+            fprintf(stderr, "%s : failed to eval\n", __func__);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    gpt_params params;
+
+    if (gpt_params_parse(argc, argv, params) == false) {
+        return 1;
+    }
+
+    if (params.model_draft.empty()) {
+        fprintf(stderr, "%s: error: a draft model is required, use --model-draft\n", __func__);
+        return 1;
+    }
+
+    if (params.n_draft < 0) {
+        fprintf(stderr, "%s: error: invalid number of draft tokens %d\n", __func__, params.n_draft);
+        return 1;
+    }
+
+    fprintf(stderr, "%s: build = %d (%s)\n", __func__, BUILD_NUMBER, BUILD_COMMIT);
+
+    if (params.seed < 0) {
+        params.seed = time(NULL);
+    }
+
+    fprintf(stderr, "%s: seed  = %d\n", __func__, params.seed);
+
+    std::mt19937 rng(params.seed);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+    llama_init_backend();
+
+    // the target model checks all drafted tokens in one batch, it needs the logits of each of them
+    llama_context_params lparams = llama_context_params_from_gpt_params(params);
+    lparams.logits_all = true;
+
+    llama_model * model_tgt = llama_load_model_from_file(params.model.c_str(), lparams);
+    if (model_tgt == NULL) {
+        fprintf(stderr, "%s: error: unable to load model\n", __func__);
+        return 1;
+    }
+    llama_context * ctx_tgt = llama_new_context_with_model(model_tgt, lparams);
+
+    lparams.logits_all = false;
+
+    llama_model * model_dft = llama_load_model_from_file(params.model_draft.c_str(), lparams);
+    if (model_dft == NULL) {
+        fprintf(stderr, "%s: error: unable to load draft model\n", __func__);
+        return 1;
+    }
+    llama_context * ctx_dft = llama_new_context_with_model(model_dft, lparams);
+
+    const int n_vocab = llama_n_vocab(ctx_tgt);
+    if (llama_n_vocab(ctx_dft) != n_vocab) {
+        fprintf(stderr, "%s: error: the draft model has a different vocabulary (%d tokens, %d in the target model)\n",
+                __func__, llama_n_vocab(ctx_dft), n_vocab);
+        return 1;
+    }
+
+    // print system information
+    {
+        fprintf(stderr, "\n");
+        fprintf(stderr, "system_info: n_threads = %d / %d | %s\n",
+                params.n_threads, std::thread::hardware_concurrency(), llama_print_system_info());
+    }
+
+    // Add a space in front of the first character to match OG llama tokenizer behavior
+    params.prompt.insert(0, 1, ' ');
+
+    std::vector<llama_token> inp = ::llama_tokenize(ctx_tgt, params.prompt, true);
+
+    const int n_ctx = llama_n_ctx(ctx_tgt);
+    if ((int) inp.size() >= n_ctx) {
+        fprintf(stderr, "%s: error: prompt too long (%d tokens, max %d)\n", __func__, (int) inp.size(), n_ctx - 1);
+        return 1;
+    }
+
+    fprintf(stderr, "\n\n");
+
+    for (auto id : inp) {
+        printf("%s", llama_token_to_str(ctx_tgt, id));
+    }
+    fflush(stdout);
+
+    const int64_t t_enc_start_us = llama_time_us();
+
+    // the last token of the prompt is evaluated by the first step
+    if (!eval_tokens(ctx_tgt, inp, 0, inp.size() - 1, params) ||
+        !eval_tokens(ctx_dft, inp, 0, inp.size() - 1, params)) {
+        return 1;
+    }
+
+    const int64_t t_enc_end_us = llama_time_us();
+
+    // both KV caches hold inp[0] .. inp[n_past - 1]
+    int n_past_tgt = inp.size() - 1;
+    int n_past_dft = inp.size() - 1;
+
+    const int n_predict = params.n_predict < 0 ? n_ctx : params.n_predict;
+    const int n_input   = inp.size();
+
+    int n_predicted = 0;
+    int n_drafted   = 0;
+    int n_accepted  = 0;
+    int n_steps     = 0;
+
+    std::vector<llama_token> drafted;
+    std::vector<std::vector<float>> probs_dft(params.n_draft);
+    std::vector<float> probs_tgt;
+
+    bool has_eos = false;
+
+    while (!has_eos && n_predicted < n_predict) {
+        // the target model evaluates the last accepted token and the drafted tokens,
+        // and adds one token of its own
+        const int n_draft = std::min(std::min(params.n_draft, n_ctx - (int) inp.size()), n_predict - n_predicted - 1);
+        if (n_draft < 0) {
+            break;
+        }
+
+        // draft with the draft model, after catching up with the tokens accepted in the last step
+        drafted.clear();
+        if (!eval_tokens(ctx_dft, inp, n_past_dft, inp.size(), params)) {
+            return 1;
+        }
+        n_past_dft = inp.size();
+
+        for (int i = 0; i < n_draft; i++) {
+            if (i > 0) {
+                if (llama_eval(ctx_dft, &drafted.back(), 1, n_past_dft, params.n_threads)) {
+                    fprintf(stderr, "%s : failed to eval\n", __func__);
+                    return 1;
+                }
+                n_past_dft++;
+            }
+
+            token_probs(ctx_dft, llama_get_logits(ctx_dft), params, probs_dft[i]);
+            drafted.push_back(sample_token(probs_dft[i], rng));
+
+            if (drafted.back() == llama_token_eos()) {
+                break;
+            }
+        }
+
+        // verify all drafted tokens with one eval of the target model
+        std::vector<llama_token> batch(1, inp.back());
+        batch.insert(batch.end(), drafted.begin(), drafted.end());
+        if (llama_eval(ctx_tgt, batch.data(), batch.size(), n_past_tgt, params.n_threads)) {
+            fprintf(stderr, "%s : failed to eval\n", __func__);
+            return 1;
+        }
+        const float * logits = llama_get_logits(ctx_tgt);
+        n_steps++;
+
+        // a drafted token is accepted with probability min(1, p_target/p_draft), the first rejected one is replaced
+        // by a token from the remaining target distribution max(0, p_target - p_draft), and if all are accepted the
+        // target model adds the next token, so the output follows the distribution of the target model alone
+        int n_ok = 0;
+        llama_token id = 0;
+        while (true) {
+            token_probs(ctx_tgt, logits + n_ok*n_vocab, params, probs_tgt);
+
+            if (n_ok == (int) drafted.size()) {
+                id = sample_token(probs_tgt, rng);
+                break;
+            }
+
+            const llama_token token = drafted[n_ok];
+            const std::vector<float> & probs = probs_dft[n_ok];
+            if (uniform(rng)*probs[token] < probs_tgt[token]) {
+                n_ok++;
+                continue;
+            }
+
+            for (int i = 0; i < n_vocab; i++) {
+                probs_tgt[i] = std::max(0.0f, probs_tgt[i] - probs[i]);
+            }
+            id = sample_token(probs_tgt, rng);
+            break;
+        }
+
+        n_drafted  += drafted.size();
+        n_accepted += n_ok;
+
+        // the KV caches stay valid up to the last accepted token, the rest is overwritten by the next step
+        const int n_valid = inp.size() + n_ok;
+        n_past_tgt = n_valid;
+        n_past_dft = std::min(n_past_dft, n_valid);
+
+        for (int i = 0; i < n_ok; i++) {
+            inp.push_back(drafted[i]);
+        }
+        if (!inp.empty() && inp.back() == llama_token_eos()) {
+            has_eos = true;
+        } else {
+            inp.push_back(id);
+            has_eos = id == llama_token_eos();
+        }
+        n_predicted = inp.size() - n_input;
+
+        for (int i = n_valid - n_ok; i < (int) inp.size(); i++) {
+            if (inp[i] != llama_token_eos()) {
+                printf("%s", llama_token_to_str(ctx_tgt, inp[i]));
+            }
+        }
+        fflush(stdout);
+    }
+
+    const int64_t t_dec_end_us = llama_time_us();
+
+    if (has_eos) {
+        fprintf(stderr, " [end of text]");
+    }
+    fprintf(stderr, "\n\n");
+
+    fprintf(stderr, "encoded %4d tokens in %8.3f seconds, speed: %8.3f t/s\n",
+            n_input, (t_enc_end_us - t_enc_start_us) / 1e6f, n_input / ((t_enc_end_us - t_enc_start_us) / 1e6f));
+    fprintf(stderr, "decoded %4d tokens in %8.3f seconds, speed: %8.3f t/s\n",
+            n_predicted, (t_dec_end_us - t_enc_end_us) / 1e6f, n_predicted / ((t_dec_end_us - t_enc_end_us) / 1e6f));
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "n_draft    = %d\n", params.n_draft);
+    fprintf(stderr, "n_steps    = %d (%.3f tokens per target eval)\n", n_steps, n_steps > 0 ? (double) n_predicted / n_steps : 0.0);
+    fprintf(stderr, "n_drafted  = %d\n", n_drafted);
+    fprintf(stderr, "n_accepted = %d\n", n_accepted);
+    fprintf(stderr, "accept     = %.3f%%\n", n_drafted > 0 ? 100.0 * n_accepted / n_drafted : 0.0);
+
+    fprintf(stderr, "\ndraft:\n");
+    llama_print_timings(ctx_dft);
+
+    fprintf(stderr, "\ntarget:\n");
+    llama_print_timings(ctx_tgt);
+
+    llama_free(ctx_dft);
+    llama_free_model(model_dft);
+
+    llama_free(ctx_tgt);
+    llama_free_model(model_tgt);
+
+    return 0;
+}
@@ -19,6 +19,7 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdio.h>
@@ -30,6 +31,12 @@
 #include <unistd.h>
 #endif
 
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 // if C99 - static_assert is noop
 // ref: https://stackoverflow.com/a/53923785/4039976
 #ifndef static_assert
@@ -3569,6 +3576,66 @@ inline static void ggml_vec_norm_inv_f32(const int n, float * s, const float * x
     *s = 1.f/(*s);
 }
 
+#if defined(__AVX2__) && defined(__FMA__)
+// exp(x) for 8 values: x = n*ln(2) + r with |r| <= ln(2)/2, exp(r) from a degree 7 polynomial (Cephes expf)
+// the relative error is below 3e-7 (2 ulp) over the whole range, x < -87.3 (including -INFINITY) gives 0
+inline static __m256 ggml_v_expf(__m256 x) {
+    const __m256 lo = _mm256_set1_ps(-87.33654f);
+    const __m256 hi = _mm256_set1_ps( 88.37626f);
+
+    const __m256 tiny = _mm256_cmp_ps(x, lo, _CMP_LT_OQ);
+    x = _mm256_min_ps(_mm256_max_ps(x, lo), hi);
+
+    const __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    // ln(2) split in two parts, so that n*ln(2) is subtracted exactly
+    x = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    x = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), x);
+
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, x, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_fmadd_ps(p, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+
+    // 2^n, n + 127 is in [1, 254] thanks to the clamping above
+    const __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    p = _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+
+    return _mm256_andnot_ps(tiny, p);
+}
+#endif
+
+// y[i] = exp(x[i] - max), returns the sum of y
+inline static ggml_float ggml_vec_soft_max_f32(const int n, float * y, const float * x, float max) {
+    int i = 0;
+    ggml_float sum = 0.0;
+#if defined(__AVX2__) && defined(__FMA__)
+    const __m256 vmax = _mm256_set1_ps(max);
+    __m256d vsum = _mm256_setzero_pd();
+    for (; i + 7 < n; i += 8) {
+        const __m256 val = ggml_v_expf(_mm256_sub_ps(_mm256_loadu_ps(x + i), vmax));
+        _mm256_storeu_ps(y + i, val);
+        vsum = _mm256_add_pd(vsum, _mm256_cvtps_pd(_mm256_castps256_ps128(val)));
+        vsum = _mm256_add_pd(vsum, _mm256_cvtps_pd(_mm256_extractf128_ps(val, 1)));
+    }
+    double tmp[4];
+    _mm256_storeu_pd(tmp, vsum);
+    sum = tmp[0] + tmp[1] + tmp[2] + tmp[3];
+#endif
+    for (; i < n; ++i) {
+        const float val = expf(x[i] - max);
+        sum += (ggml_float)val;
+        y[i] = val;
+    }
+    return sum;
+}
+
+double ggml_soft_max_exp_row(const float * x, float * y, int n, float max) {
+    return ggml_vec_soft_max_f32(n, y, x, max);
+}
+
 //
 // data types
 //
@@ -3821,6 +3888,14 @@ static_assert(sizeof(struct ggml_tensor)%GGML_MEM_ALIGN == 0, "ggml_tensor size
 // ggml context
 //
 
+// open addressing hash table of the named tensors of a context, by ggml_get_tensor
+// it is built by the first lookup, ggml_set_name marks it as stale and the next lookup builds it again
+struct ggml_name_index {
+    size_t size; // power of 2, 0 until the first lookup
+    atomic_bool stale;
+    struct ggml_tensor ** entries;
+};
+
 struct ggml_context {
     size_t mem_size;
     void * mem_buffer;
@@ -3835,6 +3910,8 @@ struct ggml_context {
 
     struct ggml_scratch scratch;
     struct ggml_scratch scratch_save;
+
+    struct ggml_name_index name_index;
 };
 
 struct ggml_context_container {
@@ -4183,6 +4260,7 @@ struct ggml_context * ggml_init(struct ggml_init_params params) {
         /*.objects_end        =*/ NULL,
         /*.scratch            =*/ { 0, 0, NULL, },
         /*.scratch_save       =*/ { 0, 0, NULL, },
+        /*.name_index         =*/ { 0, 0, NULL, },
     };
 
     GGML_ASSERT(ctx->mem_buffer != NULL);
@@ -4213,6 +4291,10 @@ void ggml_free(struct ggml_context * ctx) {
                 GGML_ALIGNED_FREE(ctx->mem_buffer);
             }
 
+            free(ctx->name_index.entries);
+            ctx->name_index.size    = 0;
+            ctx->name_index.entries = NULL;
+
             found = true;
             break;
         }
@@ -4752,9 +4834,71 @@ const char * ggml_get_name(const struct ggml_tensor * tensor) {
     return tensor->name;
 }
 
+static uint32_t ggml_name_hash(const char * name) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash = (hash ^ (uint8_t) *name) * 16777619u;
+    }
+    return hash;
+}
+
+static void ggml_name_index_insert(struct ggml_name_index * index, struct ggml_tensor * tensor) {
+    size_t i = ggml_name_hash(tensor->name) & (index->size - 1);
+    while (index->entries[i] != NULL) {
+        i = (i + 1) & (index->size - 1);
+    }
+    index->entries[i] = tensor;
+}
+
+static void ggml_name_index_build(struct ggml_context * ctx) {
+    struct ggml_name_index * index = &ctx->name_index;
+    char * const mem_buffer = ctx->mem_buffer;
+
+    size_t n_named = 0;
+    for (struct ggml_object * obj = ctx->objects_begin; obj != NULL; obj = obj->next) {
+        n_named += ((struct ggml_tensor *)(mem_buffer + obj->offs))->name[0] != '\0';
+    }
+
+    // at most half full
+    size_t size = 64;
+    while (size < 2*n_named) {
+        size *= 2;
+    }
+
+    free(index->entries);
+    index->size    = size;
+    index->entries = calloc(size, sizeof(struct ggml_tensor *));
+    GGML_ASSERT(index->entries != NULL);
+
+    for (struct ggml_object * obj = ctx->objects_begin; obj != NULL; obj = obj->next) {
+        struct ggml_tensor * cur = (struct ggml_tensor *)(mem_buffer + obj->offs);
+        if (cur->name[0] != '\0') {
+            ggml_name_index_insert(index, cur);
+        }
+    }
+}
+
+// marks the index of the context that holds the tensor as stale, copies of tensors are in no context
+static void ggml_name_index_invalidate(const struct ggml_tensor * tensor) {
+    for (int i = 0; i < GGML_MAX_CONTEXTS; i++) {
+        struct ggml_context * ctx = &g_state.contexts[i].context;
+        if (!g_state.contexts[i].used || ctx->name_index.size == 0) {
+            continue;
+        }
+
+        const char * mem_buffer = ctx->mem_buffer;
+        if ((const char *) tensor >= mem_buffer && (const char *) tensor < mem_buffer + ctx->mem_size) {
+            atomic_store(&ctx->name_index.stale, true);
+            break;
+        }
+    }
+}
+
 struct ggml_tensor * ggml_set_name(struct ggml_tensor * tensor, const char * name) {
     strncpy(tensor->name, name, sizeof(tensor->name));
     tensor->name[sizeof(tensor->name) - 1] = '\0';
+    ggml_name_index_invalidate(tensor);
     return tensor;
 }
 
@@ -4763,6 +4907,7 @@ struct ggml_tensor * ggml_format_name(struct ggml_tensor * tensor, const char *
     va_start(args, fmt);
     vsnprintf(tensor->name, sizeof(tensor->name), fmt, args);
     va_end(args);
+    ggml_name_index_invalidate(tensor);
     return tensor;
 }
 
@@ -4781,6 +4926,31 @@ struct ggml_tensor * ggml_view_tensor(
 }
 
 struct ggml_tensor * ggml_get_tensor(struct ggml_context * ctx, const char * name) {
+    struct ggml_name_index * index = &ctx->name_index;
+    if (name[0] != '\0') {
+        // the first lookup after the tensors are named builds the index, the others wait for it
+        if (index->size == 0 || atomic_load(&index->stale)) {
+            ggml_critical_section_start();
+            if (index->size == 0 || atomic_load(&index->stale)) {
+                ggml_name_index_build(ctx);
+                atomic_store(&index->stale, false);
+            }
+            ggml_critical_section_end();
+        }
+
+        // the tensors are allocated in order, the first one has the lowest address
+        struct ggml_tensor * result = NULL;
+        size_t i = ggml_name_hash(name) & (index->size - 1);
+        for (; index->entries[i] != NULL; i = (i + 1) & (index->size - 1)) {
+            struct ggml_tensor * cur = index->entries[i];
+            if ((result == NULL || cur < result) && strcmp(cur->name, name) == 0) {
+                result = cur;
+            }
+        }
+        return result;
+    }
+
+    // the unnamed tensors are not indexed
     struct ggml_object * obj = ctx->objects_begin;
 
     char * const mem_buffer = ctx->mem_buffer;
@@ -11924,6 +12094,9 @@ static void ggml_compute_forward_soft_max_f32(
         float max = -INFINITY;
         ggml_vec_max_f32(nc, &max, sp);
 
+#if defined(__AVX2__) && defined(__FMA__)
+        ggml_float sum = ggml_vec_soft_max_f32(nc, dp, sp, max);
+#else
         ggml_float sum = 0.0;
 
         uint16_t scvt;
@@ -11939,6 +12112,7 @@ static void ggml_compute_forward_soft_max_f32(
                 dp[i] = val;
             }
         }
+#endif
 
         assert(sum > 0.0);
 
@@ -16390,12 +16564,19 @@ struct ggml_cgraph ggml_build_forward(struct ggml_tensor * tensor) {
         /*.n_threads    =*/ GGML_DEFAULT_N_THREADS,
         /*.work_size    =*/ 0,
         /*.work         =*/ NULL,
+        /*.planned      =*/ false,
         /*.nodes        =*/ { NULL },
         /*.grads        =*/ { NULL },
         /*.leafs        =*/ { NULL },
         /*.perf_runs    =*/ 0,
         /*.perf_cycles  =*/ 0,
         /*.perf_time_us =*/ 0,
+        /*.eval_callback       =*/ NULL,
+        /*.eval_callback_data  =*/ NULL,
+        /*.abort_callback      =*/ NULL,
+        /*.abort_callback_data =*/ NULL,
+        /*.profile             =*/ NULL,
+        /*.trace               =*/ NULL,
     };
 
     ggml_build_forward_impl(&result, tensor, false);
@@ -16504,6 +16685,247 @@ typedef pthread_t ggml_thread_t;
 
 #endif
 
+//
+// tracing
+//
+
+#define GGML_TRACE_WAIT  -1 // the thread waits for the other threads
+#define GGML_TRACE_GRAPH -2 // the whole graph computation, on the calling thread
+
+struct ggml_trace_event {
+    int64_t t_start_us;
+    int64_t t_end_us;
+    int32_t graph;
+    int32_t node;
+    int16_t ith;
+    int16_t phase; // enum ggml_task_type, GGML_TRACE_WAIT or GGML_TRACE_GRAPH
+    int32_t op;
+    char    name[GGML_MAX_NAME];
+};
+
+struct ggml_trace {
+    int64_t t_start_us;
+    int     max_events;
+    int     n_graphs;
+
+    // number of recorded events, the latest max_events of them are kept in a ring
+    atomic_int n_events;
+
+    struct ggml_trace_event * events;
+};
+
+struct ggml_trace * ggml_trace_init(int max_events) {
+    GGML_ASSERT(max_events > 0);
+
+    struct ggml_trace * trace = malloc(sizeof(struct ggml_trace));
+    GGML_ASSERT(trace);
+    trace->events = malloc(max_events*sizeof(struct ggml_trace_event));
+    GGML_ASSERT(trace->events);
+    trace->max_events = max_events;
+
+    ggml_trace_reset(trace);
+
+    return trace;
+}
+
+void ggml_trace_free(struct ggml_trace * trace) {
+    if (trace == NULL) {
+        return;
+    }
+    free(trace->events);
+    free(trace);
+}
+
+void ggml_trace_reset(struct ggml_trace * trace) {
+    trace->t_start_us = ggml_time_us();
+    trace->n_graphs   = 0;
+    atomic_store(&trace->n_events, 0);
+}
+
+void ggml_trace_copy(struct ggml_trace * dst, struct ggml_trace * src) {
+    GGML_ASSERT(dst->max_events == src->max_events);
+
+    const int n_events = atomic_load(&src->n_events);
+
+    dst->t_start_us = src->t_start_us;
+    dst->n_graphs   = src->n_graphs;
+    atomic_store(&dst->n_events, n_events);
+    memcpy(dst->events, src->events, MIN(n_events, src->max_events)*sizeof(struct ggml_trace_event));
+}
+
+static void ggml_trace_add(
+        struct ggml_trace * trace, int ith, const struct ggml_tensor * node, int i_node, int phase,
+        int64_t t_start_us, int64_t t_end_us) {
+    const int i = atomic_fetch_add(&trace->n_events, 1) % trace->max_events;
+
+    struct ggml_trace_event * e = &trace->events[i];
+    e->t_start_us = t_start_us - trace->t_start_us;
+    e->t_end_us   = t_end_us   - trace->t_start_us;
+    e->graph      = trace->n_graphs;
+    e->node       = i_node;
+    e->ith        = ith;
+    e->phase      = phase;
+    e->op         = node ? node->op : GGML_OP_NONE;
+    if (node) {
+        memcpy(e->name, node->name, GGML_MAX_NAME);
+    } else {
+        e->name[0] = '\0';
+    }
+}
+
+// adds the interval from *t_us until now as an event of the calling thread, if it is not empty, and moves *t_us to now
+static void ggml_trace_step(struct ggml_trace * trace, const struct ggml_tensor * node, int i_node, int phase, int64_t * t_us) {
+    const int64_t t_now_us = ggml_time_us();
+    if (t_now_us > *t_us) {
+        ggml_trace_add(trace, 0, node, i_node, phase, *t_us, t_now_us);
+    }
+    *t_us = t_now_us;
+}
+
+static void ggml_trace_write_str(FILE * f, const char * str) {
+    for (const char * c = str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(f, "\\%c", *c);
+        } else if ((unsigned char) *c < 0x20) {
+            fprintf(f, "\\u%04x", (unsigned char) *c);
+        } else {
+            fputc(*c, f);
+        }
+    }
+}
+
+bool ggml_trace_write(struct ggml_trace * trace, const char * fname) {
+    FILE * f = fopen(fname, "w");
+    if (f == NULL) {
+        fprintf(stderr, "%s: failed to open %s\n", __func__, fname);
+        return false;
+    }
+
+    const int n_events = atomic_load(&trace->n_events);
+    const int n_kept   = MIN(n_events, trace->max_events);
+
+    static const char * phase_names[] = { "init", "compute", "finalize" };
+
+    int n_threads = 1;
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (int i = 0; i < n_kept; i++) {
+        const struct ggml_trace_event * e = &trace->events[(n_events - n_kept + i) % trace->max_events];
+
+        n_threads = MAX(n_threads, e->ith + 1);
+
+        fprintf(f, "{\"name\":\"");
+        if (e->phase == GGML_TRACE_GRAPH) {
+            fprintf(f, "graph");
+        } else if (e->phase == GGML_TRACE_WAIT) {
+            fprintf(f, "wait");
+        } else {
+            fprintf(f, "%s ", GGML_OP_NAME[e->op]);
+            ggml_trace_write_str(f, e->name);
+        }
+        fprintf(f, "\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%" PRId64 ",\"dur\":%" PRId64 ",\"pid\":0,\"tid\":%d,",
+                e->phase == GGML_TRACE_GRAPH ? "graph" : e->phase == GGML_TRACE_WAIT ? "wait" : phase_names[e->phase],
+                e->t_start_us, e->t_end_us - e->t_start_us, e->ith);
+        fprintf(f, "\"args\":{\"graph\":%d,\"node\":%d}},\n", e->graph, e->node);
+    }
+
+    for (int i = 0; i < n_threads; i++) {
+        fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}%s\n",
+                i, i == 0 ? "main" : "worker", i, i + 1 < n_threads ? "," : "");
+    }
+    fprintf(f, "],\"displayTimeUnit\":\"ms\"}\n");
+
+    const bool ok = !ferror(f);
+    fclose(f);
+
+    if (!ok) {
+        fprintf(stderr, "%s: failed to write %s\n", __func__, fname);
+    }
+
+    return ok;
+}
+
+//
+// hardware counters
+//
+
+// the counters of one thread, opened by the thread itself, and what they counted per op
+struct ggml_perf_counters {
+    int n_fd;
+    int fd[GGML_PROFILE_COUNTER_COUNT];    // fd[0] leads the group, all counters are read at once
+    int index[GGML_PROFILE_COUNTER_COUNT]; // position of each counter in the group, -1 if it is not available
+
+    int64_t op_counters[GGML_OP_COUNT][GGML_PROFILE_COUNTER_COUNT];
+};
+
+static void ggml_perf_counters_open(struct ggml_perf_counters * pc) {
+    memset(pc, 0, sizeof(*pc));
+    for (int i = 0; i < GGML_PROFILE_COUNTER_COUNT; i++) {
+        pc->index[i] = -1;
+    }
+
+#if defined(__linux__)
+    // the cache events are the last level cache on most CPUs
+    static const uint64_t configs[GGML_PROFILE_COUNTER_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_REFERENCES,
+        PERF_COUNT_HW_CACHE_MISSES,
+    };
+
+    for (int i = 0; i < GGML_PROFILE_COUNTER_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size           = sizeof(attr);
+        attr.type           = PERF_TYPE_HARDWARE;
+        attr.config         = configs[i];
+        attr.read_format    = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+
+        // the calling thread on any CPU, in the group of the first counter that could be opened
+        const int fd = (int) syscall(__NR_perf_event_open, &attr, 0, -1, pc->n_fd > 0 ? pc->fd[0] : -1, 0);
+        if (fd < 0) {
+            continue;
+        }
+        pc->index[i] = pc->n_fd;
+        pc->fd[pc->n_fd++] = fd;
+    }
+#endif
+}
+
+static void ggml_perf_counters_close(struct ggml_perf_counters * pc) {
+#if defined(__linux__)
+    for (int i = 0; i < pc->n_fd; i++) {
+        close(pc->fd[i]);
+    }
+#endif
+    pc->n_fd = 0;
+}
+
+static void ggml_perf_counters_read(const struct ggml_perf_counters * pc, int64_t values[GGML_PROFILE_COUNTER_COUNT]) {
+    // number of counters, followed by their values
+    uint64_t group[1 + GGML_PROFILE_COUNTER_COUNT] = {0};
+#if defined(__linux__)
+    if (pc->n_fd > 0 && read(pc->fd[0], group, sizeof(group)) < 0) {
+        group[0] = 0;
+    }
+#endif
+    for (int i = 0; i < GGML_PROFILE_COUNTER_COUNT; i++) {
+        values[i] = pc->index[i] >= 0 && (uint64_t) pc->index[i] < group[0] ? (int64_t) group[1 + pc->index[i]] : 0;
+    }
+}
+
+// adds the counts since values to the op, and moves values to now
+static void ggml_perf_counters_step(struct ggml_perf_counters * pc, enum ggml_op op, int64_t values[GGML_PROFILE_COUNTER_COUNT]) {
+    int64_t now[GGML_PROFILE_COUNTER_COUNT];
+    ggml_perf_counters_read(pc, now);
+    for (int i = 0; i < GGML_PROFILE_COUNTER_COUNT; i++) {
+        pc->op_counters[op][i] += now[i] - values[i];
+        values[i] = now[i];
+    }
+}
+
 struct ggml_compute_state_shared {
     ggml_lock_t spin;
 
@@ -16513,6 +16935,10 @@ struct ggml_compute_state_shared {
     atomic_int  n_ready;
     atomic_bool has_work;
     atomic_bool stop; // stop all threads
+
+    // optional timeline, and the index of the node that is computed
+    struct ggml_trace * trace;
+    int i_node;
 };
 
 struct ggml_compute_state {
@@ -16522,14 +16948,26 @@ struct ggml_compute_state {
     struct ggml_tensor * node;
 
     struct ggml_compute_state_shared * shared;
+
+    // hardware counters of the thread, null unless the profile samples them
+    struct ggml_perf_counters * counters;
 };
 
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_trace * trace = state->shared->trace;
 
     const int n_threads = state->shared->n_threads;
 
+    // closed by the calling thread of ggml_graph_compute() after the join
+    int64_t counters[GGML_PROFILE_COUNTER_COUNT] = {0};
+    if (state->counters) {
+        ggml_perf_counters_open(state->counters);
+    }
+
     while (true) {
+        const int64_t t_wait_us = trace ? ggml_time_us() : 0;
+
         if (atomic_fetch_add(&state->shared->n_ready, 1) == n_threads - 1) {
             atomic_store(&state->shared->has_work, false);
         } else {
@@ -16559,8 +16997,25 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         }
 
         if (state->node) {
+            const int64_t t_start_us = trace ? ggml_time_us() : 0;
+            if (trace) {
+                ggml_trace_add(trace, state->params.ith, NULL, state->shared->i_node, GGML_TRACE_WAIT, t_wait_us, t_start_us);
+            }
+
             if (state->params.ith < state->params.nth) {
+                if (state->counters) {
+                    ggml_perf_counters_read(state->counters, counters);
+                }
+
                 ggml_compute_forward(&state->params, state->node);
+
+                if (state->counters) {
+                    ggml_perf_counters_step(state->counters, state->node->op, counters);
+                }
+
+                if (trace) {
+                    ggml_trace_add(trace, state->params.ith, state->node, state->shared->i_node, state->params.type, t_start_us, ggml_time_us());
+                }
             }
 
             state->node = NULL;
@@ -16572,376 +17027,484 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     return 0;
 }
 
-void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
-    const int n_threads = cgraph->n_threads;
-
-    struct ggml_compute_state_shared state_shared = {
-        /*.spin      =*/ GGML_LOCK_INITIALIZER,
-        /*.n_threads =*/ n_threads,
-        /*.n_ready   =*/ 0,
-        /*.has_work  =*/ false,
-        /*.stop      =*/ false,
-    };
-    struct ggml_compute_state * workers = n_threads > 1 ? alloca(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
+// floating point operations of a node: 2 per multiply-add of a matrix multiplication, 1 per result element otherwise
+static int64_t ggml_profile_flops(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return 0;
+        case GGML_OP_MUL_MAT:
+            return 2*node->src0->ne[0]*ggml_nelements(node);
+        default:
+            return ggml_nelements(node);
+    }
+}
 
-    // create thread pool
-    if (n_threads > 1) {
-        ggml_lock_init(&state_shared.spin);
+// bytes moved by a node, assuming that the sources are read once and the result is written once
+static int64_t ggml_profile_bytes(const struct ggml_tensor * node) {
+    if (ggml_profile_flops(node) == 0) {
+        return 0;
+    }
+    int64_t bytes = ggml_nbytes(node);
+    if (node->op == GGML_OP_GET_ROWS) {
+        // only the selected rows are read
+        return bytes + ggml_nrows(node)*node->src0->nb[1] + ggml_nbytes(node->src1);
+    }
+    bytes += node->src0 ? ggml_nbytes(node->src0) : 0;
+    bytes += node->src1 ? ggml_nbytes(node->src1) : 0;
+    for (int i = 0; i < GGML_MAX_OPT; i++) {
+        bytes += node->opt[i] ? ggml_nbytes(node->opt[i]) : 0;
+    }
+    return bytes;
+}
 
-        atomic_store(&state_shared.has_work, true);
+// adds the time of the phases of a node, t_us holds the start of INIT and the end of each phase
+static void ggml_profile_add(struct ggml_profile * profile, const struct ggml_tensor * node, const int64_t t_us[4]) {
+    profile->op_runs[node->op]++;
+    for (int i = 0; i < 3; i++) {
+        profile->op_time_us[node->op][i] += t_us[i + 1] - t_us[i];
+    }
+    profile->op_flops[node->op] += ggml_profile_flops(node);
+    profile->op_bytes[node->op] += ggml_profile_bytes(node);
 
-        for (int j = 0; j < n_threads - 1; j++) {
-            workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
-                .params = {
-                    .type  = GGML_TASK_COMPUTE,
-                    .ith   = j + 1,
-                    .nth   = n_threads,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                },
-                .node   = NULL,
-                .shared = &state_shared,
-            };
+    // open addressing on the FNV-1a hash of the op and name
+    uint32_t hash = 2166136261u ^ (uint32_t) node->op;
+    for (const char * c = node->name; *c; c++) {
+        hash = (hash ^ (uint8_t) *c) * 16777619u;
+    }
 
-            int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
-            GGML_ASSERT(rc == 0);
-            UNUSED(rc);
+    for (int i = 0; i < GGML_MAX_PROFILE_NAMES; i++) {
+        struct ggml_profile_entry * e = &profile->names[(hash + i) % GGML_MAX_PROFILE_NAMES];
+        if (e->runs == 0) {
+            snprintf(e->name, sizeof(e->name), "%s", node->name);
+            e->op = node->op;
+            profile->n_names++;
+        } else if (e->op != node->op || strncmp(e->name, node->name, GGML_MAX_NAME) != 0) {
+            continue;
         }
+        e->runs++;
+        for (int j = 0; j < 3; j++) {
+            e->time_us[j] += t_us[j + 1] - t_us[j];
+        }
+        return;
     }
+    profile->n_names_dropped++;
+}
 
-    // initialize tasks + work buffer
-    {
-        size_t work_size = 0;
+// thread scheduling for the different operations: the number of tasks of a node and the size of the work buffer it needs
+static size_t ggml_graph_plan_node(struct ggml_tensor * node, int n_threads, int * n_tasks_out) {
+    int    n_tasks   = 1;
+    size_t work_size = 0;
 
-        // thread scheduling for the different operations
-        for (int i = 0; i < cgraph->n_nodes; i++) {
-            struct ggml_tensor * node = cgraph->nodes[i];
+    switch (node->op) {
+        case GGML_OP_CPY:
+        case GGML_OP_DUP:
+            {
+                n_tasks = n_threads;
 
-            switch (node->op) {
-                case GGML_OP_CPY:
-                case GGML_OP_DUP:
-                    {
-                        node->n_tasks = n_threads;
+                size_t cur = 0;
+                if (ggml_is_quantized(node->type)) {
+                    cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->ne[0] * n_threads;
+                }
 
-                        size_t cur = 0;
-                        if (ggml_is_quantized(node->type)) {
-                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->ne[0] * n_threads;
-                        }
+                work_size = cur;
+            } break;
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+            {
+                n_tasks = n_threads;
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_ADD:
-                case GGML_OP_ADD1:
-                    {
-                        node->n_tasks = n_threads;
+                size_t cur = 0;
 
-                        size_t cur = 0;
+                if (ggml_is_quantized(node->src0->type)) {
+                    cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->src0->ne[0] * n_threads;
+                }
 
-                        if (ggml_is_quantized(node->src0->type)) {
-                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->src0->ne[0] * n_threads;
-                        }
+                work_size = cur;
+            } break;
+        case GGML_OP_ACC:
+            {
+                n_tasks = n_threads;
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_ACC:
-                    {
-                        node->n_tasks = n_threads;
+                size_t cur = 0;
 
-                        size_t cur = 0;
+                if (ggml_is_quantized(node->src0->type)) {
+                    cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->src1->ne[0] * n_threads;
+                }
 
-                        if (ggml_is_quantized(node->src0->type)) {
-                            cur = GGML_TYPE_SIZE[GGML_TYPE_F32] * node->src1->ne[0] * n_threads;
-                        }
+                work_size = cur;
+            } break;
+        case GGML_OP_SUB:
+        case GGML_OP_DIV:
+        case GGML_OP_SQR:
+        case GGML_OP_SQRT:
+        case GGML_OP_LOG:
+        case GGML_OP_SUM:
+        case GGML_OP_SUM_ROWS:
+        case GGML_OP_MEAN:
+        case GGML_OP_REPEAT:
+        case GGML_OP_REPEAT_BACK:
+        case GGML_OP_ABS:
+        case GGML_OP_SGN:
+        case GGML_OP_NEG:
+        case GGML_OP_STEP:
+        case GGML_OP_RELU:
+            {
+                n_tasks = 1;
+            } break;
+        case GGML_OP_MUL:
+        case GGML_OP_GELU:
+        case GGML_OP_GELU_QUICK:
+        case GGML_OP_SILU:
+        case GGML_OP_SILU_BACK:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_RMS_NORM_BACK:
+            {
+                n_tasks = n_threads;
+            } break;
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_OUT_PROD:
+            {
+                n_tasks = n_threads;
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_SUB:
-                case GGML_OP_DIV:
-                case GGML_OP_SQR:
-                case GGML_OP_SQRT:
-                case GGML_OP_LOG:
-                case GGML_OP_SUM:
-                case GGML_OP_SUM_ROWS:
-                case GGML_OP_MEAN:
-                case GGML_OP_REPEAT:
-                case GGML_OP_REPEAT_BACK:
-                case GGML_OP_ABS:
-                case GGML_OP_SGN:
-                case GGML_OP_NEG:
-                case GGML_OP_STEP:
-                case GGML_OP_RELU:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_MUL:
-                case GGML_OP_GELU:
-                case GGML_OP_GELU_QUICK:
-                case GGML_OP_SILU:
-                case GGML_OP_SILU_BACK:
-                case GGML_OP_NORM:
-                case GGML_OP_RMS_NORM:
-                case GGML_OP_RMS_NORM_BACK:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_MUL_MAT:
-                case GGML_OP_OUT_PROD:
-                    {
-                        node->n_tasks = n_threads;
-
-                        // TODO: use different scheduling for different matrix sizes
-                        //const int nr0 = ggml_nrows(node->src0);
-                        //const int nr1 = ggml_nrows(node->src1);
+                // TODO: use different scheduling for different matrix sizes
+                //const int nr0 = ggml_nrows(node->src0);
+                //const int nr1 = ggml_nrows(node->src1);
 
-                        //node->n_tasks = MIN(n_threads, MAX(1, nr0/128));
-                        //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks = %d\n", nr0, nr1, nr0*nr1, node->n_tasks);
+                //n_tasks = MIN(n_threads, MAX(1, nr0/128));
+                //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks = %d\n", nr0, nr1, nr0*nr1, n_tasks);
 
-                        size_t cur = 0;
+                size_t cur = 0;
 
 #if defined(GGML_USE_CUBLAS)
-                        if (ggml_cuda_can_mul_mat(node->src0, node->src1, node)) {
-                            node->n_tasks = 1; // TODO: this actually is doing nothing
-                                                //       the threads are still spinning
-                        }
-                        else
+                if (ggml_cuda_can_mul_mat(node->src0, node->src1, node)) {
+                    n_tasks = 1; // TODO: this actually is doing nothing
+                                        //       the threads are still spinning
+                }
+                else
 #elif defined(GGML_USE_CLBLAST)
-                        if (ggml_cl_can_mul_mat(node->src0, node->src1, node)) {
-                            node->n_tasks = 1; // TODO: this actually is doing nothing
-                                                //       the threads are still spinning
-                            cur = ggml_cl_mul_mat_get_wsize(node->src0, node->src1, node);
-                        }
-                        else
+                if (ggml_cl_can_mul_mat(node->src0, node->src1, node)) {
+                    n_tasks = 1; // TODO: this actually is doing nothing
+                                        //       the threads are still spinning
+                    cur = ggml_cl_mul_mat_get_wsize(node->src0, node->src1, node);
+                }
+                else
 #endif
-                        if (node->src0->type == GGML_TYPE_F16 && node->src1->type == GGML_TYPE_F32) {
+                if (node->src0->type == GGML_TYPE_F16 && node->src1->type == GGML_TYPE_F32) {
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                node->n_tasks = 1; // TODO: this actually is doing nothing
-                                                   //       the threads are still spinning
-                                // here we need memory just for single 2D matrix from src0
-                                cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
-                            } else {
-                                cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
-                            }
+                    if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                        n_tasks = 1; // TODO: this actually is doing nothing
+                                           //       the threads are still spinning
+                        // here we need memory just for single 2D matrix from src0
+                        cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
+                    } else {
+                        cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
+                    }
 #else
-                            cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
+                    cur = GGML_TYPE_SIZE[GGML_TYPE_F16]*ggml_nelements(node->src1);
 #endif
-                        } else if (node->src0->type == GGML_TYPE_F32 && node->src1->type == GGML_TYPE_F32) {
-                            cur = 0;
+                } else if (node->src0->type == GGML_TYPE_F32 && node->src1->type == GGML_TYPE_F32) {
+                    cur = 0;
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                node->n_tasks = 1;
-                            }
+                    if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                        n_tasks = 1;
+                    }
 #endif
-                        } else if (ggml_is_quantized(node->src0->type) && node->src1->type == GGML_TYPE_F32) {
+                } else if (ggml_is_quantized(node->src0->type) && node->src1->type == GGML_TYPE_F32) {
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                node->n_tasks = 1;
-                                cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
-                            } else
+                    if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                        n_tasks = 1;
+                        cur = GGML_TYPE_SIZE[GGML_TYPE_F32]*(node->src0->ne[0]*node->src0->ne[1]);
+                    } else
 #endif
-                            {
-                                const enum ggml_type type_q = quantize_fns[node->src0->type].vec_dot_type;
-                                cur = GGML_TYPE_SIZE[type_q]*ggml_nelements(node->src1)/GGML_BLCK_SIZE[type_q];
-                            }
-                        } else {
-                            GGML_ASSERT(false);
-                        }
-
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_SCALE:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_SET:
-                case GGML_OP_CONT:
-                case GGML_OP_RESHAPE:
-                case GGML_OP_VIEW:
-                case GGML_OP_PERMUTE:
-                case GGML_OP_TRANSPOSE:
-                case GGML_OP_GET_ROWS:
-                case GGML_OP_GET_ROWS_BACK:
-                case GGML_OP_DIAG:
-                case GGML_OP_DIAG_MASK_ZERO:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_DIAG_MASK_INF:
-                case GGML_OP_SOFT_MAX:
-                case GGML_OP_SOFT_MAX_BACK:
-                case GGML_OP_ROPE:
-                case GGML_OP_ROPE_BACK:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_ALIBI:
-                    {
-                        node->n_tasks = 1; //TODO
-                    } break;
-                case GGML_OP_CLAMP:
-                    {
-                        node->n_tasks = 1; //TODO
-                    } break;
-                case GGML_OP_CONV_1D_S1_PH:
-                case GGML_OP_CONV_1D_S2_PH:
                     {
-                        node->n_tasks = n_threads;
-
-                        GGML_ASSERT(node->src0->ne[3] == 1);
-                        GGML_ASSERT(node->src1->ne[2] == 1);
-                        GGML_ASSERT(node->src1->ne[3] == 1);
-
-                        size_t cur = 0;
-                        const int nk = node->src0->ne[0];
-
-                        if (node->src0->type == GGML_TYPE_F16 &&
-                            node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(ggml_fp16_t)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
-                        } else if (node->src0->type == GGML_TYPE_F32 &&
-                                   node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(float)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
-                        } else {
-                            GGML_ASSERT(false);
-                        }
+                        const enum ggml_type type_q = quantize_fns[node->src0->type].vec_dot_type;
+                        cur = GGML_TYPE_SIZE[type_q]*ggml_nelements(node->src1)/GGML_BLCK_SIZE[type_q];
+                    }
+                } else {
+                    GGML_ASSERT(false);
+                }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_CONV_2D_SK_P0:
-                    {
-                        node->n_tasks = n_threads;
+                work_size = cur;
+            } break;
+        case GGML_OP_SCALE:
+            {
+                n_tasks = n_threads;
+            } break;
+        case GGML_OP_SET:
+        case GGML_OP_CONT:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_GET_ROWS_BACK:
+        case GGML_OP_DIAG:
+        case GGML_OP_DIAG_MASK_ZERO:
+            {
+                n_tasks = 1;
+            } break;
+        case GGML_OP_DIAG_MASK_INF:
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_SOFT_MAX_BACK:
+        case GGML_OP_ROPE:
+        case GGML_OP_ROPE_BACK:
+            {
+                n_tasks = n_threads;
+            } break;
+        case GGML_OP_ALIBI:
+            {
+                n_tasks = 1; //TODO
+            } break;
+        case GGML_OP_CLAMP:
+            {
+                n_tasks = 1; //TODO
+            } break;
+        case GGML_OP_CONV_1D_S1_PH:
+        case GGML_OP_CONV_1D_S2_PH:
+            {
+                n_tasks = n_threads;
+
+                GGML_ASSERT(node->src0->ne[3] == 1);
+                GGML_ASSERT(node->src1->ne[2] == 1);
+                GGML_ASSERT(node->src1->ne[3] == 1);
+
+                size_t cur = 0;
+                const int nk = node->src0->ne[0];
+
+                if (node->src0->type == GGML_TYPE_F16 &&
+                    node->src1->type == GGML_TYPE_F32) {
+                    cur = sizeof(ggml_fp16_t)*(
+                            nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                            ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                            );
+                } else if (node->src0->type == GGML_TYPE_F32 &&
+                           node->src1->type == GGML_TYPE_F32) {
+                    cur = sizeof(float)*(
+                            nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                            ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                            );
+                } else {
+                    GGML_ASSERT(false);
+                }
 
-                        GGML_ASSERT(node->src1->ne[3] == 1);
+                work_size = cur;
+            } break;
+        case GGML_OP_CONV_2D_SK_P0:
+            {
+                n_tasks = n_threads;
 
-                        const int64_t ne00 = node->src0->ne[0]; // W
-                        const int64_t ne01 = node->src0->ne[1]; // H
-                        const int64_t ne02 = node->src0->ne[2]; // C
-                        const int64_t ne03 = node->src0->ne[3]; // N
+                GGML_ASSERT(node->src1->ne[3] == 1);
 
-                        const int64_t ne10 = node->src1->ne[0]; // W
-                        const int64_t ne11 = node->src1->ne[1]; // H
-                        const int64_t ne12 = node->src1->ne[2]; // C
+                const int64_t ne00 = node->src0->ne[0]; // W
+                const int64_t ne01 = node->src0->ne[1]; // H
+                const int64_t ne02 = node->src0->ne[2]; // C
+                const int64_t ne03 = node->src0->ne[3]; // N
 
-                        const int64_t nk = ne00*ne01;
+                const int64_t ne10 = node->src1->ne[0]; // W
+                const int64_t ne11 = node->src1->ne[1]; // H
+                const int64_t ne12 = node->src1->ne[2]; // C
 
-                        UNUSED(ne02);
-                        UNUSED(ne03);
-                        UNUSED(nk);
+                const int64_t nk = ne00*ne01;
 
-                        size_t cur = 0;
+                UNUSED(ne02);
+                UNUSED(ne03);
+                UNUSED(nk);
 
-                        if (node->src0->type == GGML_TYPE_F16 &&
-                            node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(ggml_fp16_t)*(ne10*ne11*ne12);
-                        } else if (node->src0->type == GGML_TYPE_F32 &&
-                                   node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(float)*      (ne10*ne11*ne12);
-                        } else {
-                            GGML_ASSERT(false);
-                        }
+                size_t cur = 0;
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_ATTN:
-                    {
-                        node->n_tasks = n_threads;
+                if (node->src0->type == GGML_TYPE_F16 &&
+                    node->src1->type == GGML_TYPE_F32) {
+                    cur = sizeof(ggml_fp16_t)*(ne10*ne11*ne12);
+                } else if (node->src0->type == GGML_TYPE_F32 &&
+                           node->src1->type == GGML_TYPE_F32) {
+                    cur = sizeof(float)*      (ne10*ne11*ne12);
+                } else {
+                    GGML_ASSERT(false);
+                }
 
-                        size_t cur = 0;
+                work_size = cur;
+            } break;
+        case GGML_OP_FLASH_ATTN:
+            {
+                n_tasks = n_threads;
 
-                        const int64_t ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
+                size_t cur = 0;
 
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
+                const int64_t ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
+                if (node->src1->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
+                }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_FF:
-                    {
-                        node->n_tasks = n_threads;
+                if (node->src1->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
+                }
 
-                        size_t cur = 0;
+                work_size = cur;
+            } break;
+        case GGML_OP_FLASH_FF:
+            {
+                n_tasks = n_threads;
 
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+                size_t cur = 0;
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+                if (node->src1->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*node->src1->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*node->src1->ne[1]*n_tasks; // this is overestimated by x2
+                }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_ATTN_BACK:
-                    {
-                        node->n_tasks = n_threads;
+                if (node->src1->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*node->src1->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*node->src1->ne[1]*n_tasks; // this is overestimated by x2
+                }
 
-                        size_t cur = 0;
+                work_size = cur;
+            } break;
+        case GGML_OP_FLASH_ATTN_BACK:
+            {
+                n_tasks = n_threads;
 
-                        const int64_t    D = node->src0->ne[0];
-                        const int64_t ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
-                        const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*mxDn*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*mxDn*node->n_tasks; // this is overestimated by x2
-                        }
+                size_t cur = 0;
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*mxDn*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*mxDn*node->n_tasks; // this is overestimated by x2
-                        }
+                const int64_t    D = node->src0->ne[0];
+                const int64_t ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
+                const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
+                if (node->src1->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_WIN_PART:
-                case GGML_OP_WIN_UNPART:
-                case GGML_OP_MAP_UNARY:
-                case GGML_OP_MAP_BINARY:
-                case GGML_OP_MAP_CUSTOM1:
-                case GGML_OP_MAP_CUSTOM2:
-                case GGML_OP_MAP_CUSTOM3:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_CROSS_ENTROPY_LOSS:
-                    {
-                        node->n_tasks = n_threads;
+                if (node->src1->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                }
 
-                        size_t cur = ggml_type_size(node->type)*(node->n_tasks + node->src0->ne[0]*node->n_tasks);
+                work_size = cur;
+            } break;
+        case GGML_OP_WIN_PART:
+        case GGML_OP_WIN_UNPART:
+        case GGML_OP_MAP_UNARY:
+        case GGML_OP_MAP_BINARY:
+        case GGML_OP_MAP_CUSTOM1:
+        case GGML_OP_MAP_CUSTOM2:
+        case GGML_OP_MAP_CUSTOM3:
+            {
+                n_tasks = 1;
+            } break;
+        case GGML_OP_CROSS_ENTROPY_LOSS:
+            {
+                n_tasks = n_threads;
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_CROSS_ENTROPY_LOSS_BACK:
-                    {
-                        node->n_tasks = n_threads;
+                size_t cur = ggml_type_size(node->type)*(n_tasks + node->src0->ne[0]*n_tasks);
 
-                        size_t cur = ggml_type_size(node->type)*node->src0->ne[0]*node->n_tasks;
+                work_size = cur;
+            } break;
+        case GGML_OP_CROSS_ENTROPY_LOSS_BACK:
+            {
+                n_tasks = n_threads;
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_NONE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_COUNT:
-                    {
-                        GGML_ASSERT(false);
-                    } break;
-            }
+                size_t cur = ggml_type_size(node->type)*node->src0->ne[0]*n_tasks;
+
+                work_size = cur;
+            } break;
+        case GGML_OP_NONE:
+            {
+                n_tasks = 1;
+            } break;
+        case GGML_OP_COUNT:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+
+    *n_tasks_out = n_tasks;
+
+    return work_size;
+}
+
+int ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
+    const int n_threads = cgraph->n_threads;
+    int status = GGML_EXIT_SUCCESS;
+
+    struct ggml_compute_state_shared state_shared = {
+        /*.spin      =*/ GGML_LOCK_INITIALIZER,
+        /*.n_threads =*/ n_threads,
+        /*.n_ready   =*/ 0,
+        /*.has_work  =*/ false,
+        /*.stop      =*/ false,
+        /*.trace     =*/ cgraph->trace,
+        /*.i_node    =*/ 0,
+    };
+
+    struct ggml_trace * trace = cgraph->trace;
+    const int64_t trace_start_us = trace ? ggml_time_us() : 0;
+    if (trace) {
+        // only the position in the ring matters, keep the event counter far from overflowing
+        const int n_events = atomic_load(&trace->n_events);
+        if (n_events >= (1 << 30)) {
+            atomic_store(&trace->n_events, n_events % trace->max_events + trace->max_events);
+        }
+        trace->n_graphs++;
+    }
+
+    // the counters of the calling thread are counters[0], the workers open theirs when they start
+    struct ggml_perf_counters * counters = NULL;
+    int64_t counters_start[GGML_PROFILE_COUNTER_COUNT];
+    if (cgraph->profile && cgraph->profile->counters) {
+        counters = malloc(n_threads*sizeof(struct ggml_perf_counters));
+        GGML_ASSERT(counters);
+        ggml_perf_counters_open(&counters[0]);
+    }
+
+    struct ggml_compute_state * workers = n_threads > 1 ? alloca(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
+
+    // create thread pool
+    if (n_threads > 1) {
+        ggml_lock_init(&state_shared.spin);
+
+        atomic_store(&state_shared.has_work, true);
+
+        for (int j = 0; j < n_threads - 1; j++) {
+            workers[j] = (struct ggml_compute_state) {
+                .thrd     = 0,
+                .params   = {
+                    .type  = GGML_TASK_COMPUTE,
+                    .ith   = j + 1,
+                    .nth   = n_threads,
+                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
+                    .wdata = cgraph->work ? cgraph->work->data : NULL,
+                },
+                .node     = NULL,
+                .shared   = &state_shared,
+                .counters = counters ? &counters[j + 1] : NULL,
+            };
+
+            int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
+            GGML_ASSERT(rc == 0);
+            UNUSED(rc);
+        }
+    }
+
+    // initialize tasks + work buffer, unless the graph has a plan, e.g. from ggml_graph_import, that fits the threads
+    bool planned = cgraph->planned;
+    for (int i = 0; planned && i < cgraph->n_nodes; i++) {
+        planned = cgraph->nodes[i]->n_tasks <= n_threads;
+    }
+
+    if (!planned) {
+        size_t work_size = 0;
+
+        for (int i = 0; i < cgraph->n_nodes; i++) {
+            struct ggml_tensor * node = cgraph->nodes[i];
+
+            work_size = MAX(work_size, ggml_graph_plan_node(node, n_threads, &node->n_tasks));
         }
 
         if (cgraph->work != NULL && work_size > cgraph->work_size) {
@@ -16959,11 +17522,20 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
 
+    struct ggml_profile * profile = cgraph->profile;
+    const int64_t profile_start_us = profile ? ggml_time_us() : 0;
+
     for (int i = 0; i < cgraph->n_nodes; i++) {
         GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, i, cgraph->n_nodes);
 
         struct ggml_tensor * node = cgraph->nodes[i];
 
+        // the worker threads are idle between nodes, so the computation can stop here
+        if (cgraph->abort_callback && cgraph->abort_callback(cgraph->abort_callback_data)) {
+            status = GGML_EXIT_ABORTED;
+            break;
+        }
+
         // TODO: this could be used to avoid unnecessary computations, but it needs to be improved
         //if (node->grad == NULL && node->perf_runs > 0) {
         //    continue;
@@ -16972,6 +17544,18 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         const int64_t perf_node_start_cycles  = ggml_perf_cycles();
         const int64_t perf_node_start_time_us = ggml_perf_time_us();
 
+        // end of the INIT, COMPUTE and FINALIZE phases
+        int64_t profile_us[4] = {0};
+        if (profile) {
+            profile_us[0] = ggml_time_us();
+        }
+
+        int64_t trace_us = 0;
+        if (trace) {
+            state_shared.i_node = i;
+            trace_us = ggml_time_us();
+        }
+
         // INIT
         struct ggml_compute_params params = {
             /*.type  =*/ GGML_TASK_INIT,
@@ -16981,8 +17565,22 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
             /*.wdata =*/ cgraph->work ? cgraph->work->data : NULL,
         };
 
+        if (counters) {
+            ggml_perf_counters_read(&counters[0], counters_start);
+        }
+
         ggml_compute_forward(&params, node);
 
+        if (counters) {
+            ggml_perf_counters_step(&counters[0], node->op, counters_start);
+        }
+        if (profile) {
+            profile_us[1] = ggml_time_us();
+        }
+        if (trace) {
+            ggml_trace_step(trace, node, i, GGML_TASK_INIT, &trace_us);
+        }
+
         // COMPUTE
         if (node->n_tasks > 1) {
             if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
@@ -17014,11 +17612,27 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
             }
 
             atomic_store(&state_shared.has_work, true);
+
+            if (trace) {
+                ggml_trace_step(trace, node, i, GGML_TRACE_WAIT, &trace_us);
+            }
         }
 
         params.type = GGML_TASK_COMPUTE;
+        if (counters) {
+            ggml_perf_counters_read(&counters[0], counters_start);
+        }
+
         ggml_compute_forward(&params, node);
 
+        if (counters) {
+            ggml_perf_counters_step(&counters[0], node->op, counters_start);
+        }
+
+        if (trace) {
+            ggml_trace_step(trace, node, i, GGML_TASK_COMPUTE, &trace_us);
+        }
+
         // wait for thread pool
         if (node->n_tasks > 1) {
             if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
@@ -17036,6 +17650,14 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                 ggml_lock_lock  (&state_shared.spin);
                 ggml_lock_unlock(&state_shared.spin);
             }
+
+            if (trace) {
+                ggml_trace_step(trace, node, i, GGML_TRACE_WAIT, &trace_us);
+            }
+        }
+
+        if (profile) {
+            profile_us[2] = ggml_time_us();
         }
 
         // FINALIZE
@@ -17069,11 +17691,27 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
             }
 
             atomic_store(&state_shared.has_work, true);
+
+            if (trace) {
+                ggml_trace_step(trace, node, i, GGML_TRACE_WAIT, &trace_us);
+            }
         }
 
         params.type = GGML_TASK_FINALIZE;
+        if (counters) {
+            ggml_perf_counters_read(&counters[0], counters_start);
+        }
+
         ggml_compute_forward(&params, node);
 
+        if (counters) {
+            ggml_perf_counters_step(&counters[0], node->op, counters_start);
+        }
+
+        if (trace) {
+            ggml_trace_step(trace, node, i, GGML_TASK_FINALIZE, &trace_us);
+        }
+
         // wait for thread pool
         if (node->n_tasks > 1) {
             if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
@@ -17091,6 +17729,15 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                 ggml_lock_lock  (&state_shared.spin);
                 ggml_lock_unlock(&state_shared.spin);
             }
+
+            if (trace) {
+                ggml_trace_step(trace, node, i, GGML_TRACE_WAIT, &trace_us);
+            }
+        }
+
+        if (profile) {
+            profile_us[3] = ggml_time_us();
+            ggml_profile_add(profile, node, profile_us);
         }
 
         // performance stats (node)
@@ -17102,6 +17749,10 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
             node->perf_cycles  += perf_cycles_cur;
             node->perf_time_us += perf_time_us_cur;
         }
+
+        if (cgraph->eval_callback) {
+            cgraph->eval_callback(node, cgraph->eval_callback_data);
+        }
     }
 
     // join thread pool
@@ -17118,6 +17769,27 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
         ggml_lock_destroy(&state_shared.spin);
     }
 
+    if (profile) {
+        profile->runs++;
+        profile->time_us += ggml_time_us() - profile_start_us;
+    }
+
+    if (counters) {
+        for (int j = 0; j < n_threads; j++) {
+            for (int op = 0; op < GGML_OP_COUNT; op++) {
+                for (int k = 0; k < GGML_PROFILE_COUNTER_COUNT; k++) {
+                    profile->op_counters[op][k] += counters[j].op_counters[op][k];
+                }
+            }
+            ggml_perf_counters_close(&counters[j]);
+        }
+        free(counters);
+    }
+
+    if (trace) {
+        ggml_trace_add(trace, 0, NULL, -1, GGML_TRACE_GRAPH, trace_start_us, ggml_time_us());
+    }
+
     // performance stats (graph)
     {
         int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_start_cycles;
@@ -17134,6 +17806,122 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                 (double) perf_time_us_cur     / 1000.0,
                 (double) cgraph->perf_time_us / 1000.0 / cgraph->perf_runs);
     }
+
+    return status;
+}
+
+void ggml_profile_reset(struct ggml_profile * profile) {
+    const bool counters = profile->counters;
+    memset(profile, 0, sizeof(*profile));
+    profile->counters = counters;
+}
+
+void ggml_profile_print(const struct ggml_profile * profile, int n_names) {
+    const double t_total_ms = MAX(1, profile->time_us) / 1000.0;
+
+    fprintf(stderr, "%s: %" PRId64 " graph computations, %.3f ms, %.3f ms per computation\n",
+            __func__, profile->runs, t_total_ms, profile->runs > 0 ? t_total_ms / profile->runs : 0.0);
+
+    // ops by total time
+    int ops[GGML_OP_COUNT];
+    int n_ops = 0;
+    for (int i = 0; i < GGML_OP_COUNT; i++) {
+        if (profile->op_runs[i] == 0) {
+            continue;
+        }
+        const int64_t t = profile->op_time_us[i][0] + profile->op_time_us[i][1] + profile->op_time_us[i][2];
+        int j = n_ops++;
+        for (; j > 0; j--) {
+            const int k = ops[j - 1];
+            if (profile->op_time_us[k][0] + profile->op_time_us[k][1] + profile->op_time_us[k][2] >= t) {
+                break;
+            }
+            ops[j] = k;
+        }
+        ops[j] = i;
+    }
+
+    fprintf(stderr, "%s: %-16s %10s %12s %7s %10s %12s %12s %12s\n", __func__,
+            "op", "runs", "total ms", "%", "us/run", "init ms", "compute ms", "finalize ms");
+    for (int i = 0; i < n_ops; i++) {
+        const int op = ops[i];
+        const int64_t * t = profile->op_time_us[op];
+        const double t_ms = (t[0] + t[1] + t[2]) / 1000.0;
+        fprintf(stderr, "%s: %-16s %10" PRId64 " %12.3f %6.1f%% %10.3f %12.3f %12.3f %12.3f\n", __func__,
+                GGML_OP_NAME[op], profile->op_runs[op], t_ms, 100.0 * t_ms / t_total_ms, 1000.0 * t_ms / profile->op_runs[op],
+                t[0] / 1000.0, t[1] / 1000.0, t[2] / 1000.0);
+    }
+
+    // roofline: the arithmetic intensity (FLOP/B) of an op against the rates it achieves, ops far below the
+    // memory bandwidth of the machine in GB/s and below its peak GFLOP/s are limited by something else
+    bool has_counters = false;
+    for (int i = 0; i < GGML_OP_COUNT; i++) {
+        has_counters = has_counters || profile->op_counters[i][GGML_PROFILE_CYCLES] > 0;
+    }
+
+    fprintf(stderr, "%s: %-16s %10s %10s %8s %10s %10s", __func__, "op", "GFLOP", "GB", "FLOP/B", "GFLOP/s", "GB/s");
+    if (has_counters) {
+        fprintf(stderr, " %6s %10s %13s", "IPC", "LLC miss %", "LLC miss GB/s");
+    }
+    fprintf(stderr, "\n");
+    for (int i = 0; i < n_ops; i++) {
+        const int op = ops[i];
+        if (profile->op_bytes[op] == 0) {
+            continue;
+        }
+        const int64_t * t = profile->op_time_us[op];
+        const double t_s   = MAX(1, t[0] + t[1] + t[2]) / 1e6;
+        const double gflop = profile->op_flops[op] / 1e9;
+        const double gb    = profile->op_bytes[op] / 1e9;
+        fprintf(stderr, "%s: %-16s %10.3f %10.3f %8.2f %10.2f %10.2f", __func__,
+                GGML_OP_NAME[op], gflop, gb, gb > 0 ? gflop / gb : 0.0, gflop / t_s, gb / t_s);
+        if (has_counters) {
+            const int64_t * c = profile->op_counters[op];
+            // every miss reads one cache line from memory
+            fprintf(stderr, " %6.2f %9.1f%% %13.2f",
+                    c[GGML_PROFILE_CYCLES] > 0 ? (double) c[GGML_PROFILE_INSTRUCTIONS] / c[GGML_PROFILE_CYCLES] : 0.0,
+                    c[GGML_PROFILE_LLC_REFS] > 0 ? 100.0 * c[GGML_PROFILE_LLC_MISSES] / c[GGML_PROFILE_LLC_REFS] : 0.0,
+                    c[GGML_PROFILE_LLC_MISSES] * 64 / 1e9 / t_s);
+        }
+        fprintf(stderr, "\n");
+    }
+    if (profile->counters && !has_counters) {
+        fprintf(stderr, "%s: no hardware counters, perf_event_open is not available or not allowed (see /proc/sys/kernel/perf_event_paranoid)\n", __func__);
+    }
+
+    // tensor names by total time
+    const struct ggml_profile_entry * names[GGML_MAX_PROFILE_NAMES];
+    int n_used = 0;
+    for (int i = 0; i < GGML_MAX_PROFILE_NAMES; i++) {
+        const struct ggml_profile_entry * e = &profile->names[i];
+        if (e->runs == 0) {
+            continue;
+        }
+        const int64_t t = e->time_us[0] + e->time_us[1] + e->time_us[2];
+        int j = n_used++;
+        for (; j > 0; j--) {
+            const struct ggml_profile_entry * f = names[j - 1];
+            if (f->time_us[0] + f->time_us[1] + f->time_us[2] >= t) {
+                break;
+            }
+            names[j] = f;
+        }
+        names[j] = e;
+    }
+    if (n_names <= 0 || n_names > n_used) {
+        n_names = n_used;
+    }
+
+    fprintf(stderr, "%s: %-32s %-16s %10s %12s %7s %10s\n", __func__, "tensor", "op", "runs", "total ms", "%", "us/run");
+    for (int i = 0; i < n_names; i++) {
+        const struct ggml_profile_entry * e = names[i];
+        const double t_ms = (e->time_us[0] + e->time_us[1] + e->time_us[2]) / 1000.0;
+        fprintf(stderr, "%s: %-32s %-16s %10" PRId64 " %12.3f %6.1f%% %10.3f\n", __func__,
+                e->name[0] ? e->name : "(unnamed)", GGML_OP_NAME[e->op], e->runs, t_ms, 100.0 * t_ms / t_total_ms, 1000.0 * t_ms / e->runs);
+    }
+    if (profile->n_names_dropped > 0) {
+        fprintf(stderr, "%s: %d nodes were not counted by name, the name table is full\n", __func__, profile->n_names_dropped);
+    }
 }
 
 void ggml_graph_reset(struct ggml_cgraph * cgraph) {
@@ -17146,6 +17934,114 @@ void ggml_graph_reset(struct ggml_cgraph * cgraph) {
     }
 }
 
+// the ops whose result is a view of their first argument, they compute nothing
+static bool ggml_op_is_view(enum ggml_op op) {
+    return op == GGML_OP_RESHAPE || op == GGML_OP_VIEW || op == GGML_OP_TRANSPOSE || op == GGML_OP_PERMUTE;
+}
+
+// the elements are one after the other in memory, unlike ggml_is_contiguous the strides of the dimensions of size 1 do not matter
+static bool ggml_is_dense(const struct ggml_tensor * tensor) {
+    size_t nb = GGML_TYPE_SIZE[tensor->type];
+    if (tensor->nb[0] != nb) {
+        return false;
+    }
+    nb *= tensor->ne[0]/GGML_BLCK_SIZE[tensor->type];
+    for (int i = 1; i < GGML_MAX_DIMS; i++) {
+        if (tensor->ne[i] != 1 && tensor->nb[i] != nb) {
+            return false;
+        }
+        nb *= tensor->ne[i];
+    }
+    return true;
+}
+
+static bool ggml_graph_node_reads(const struct ggml_tensor * node, const struct ggml_tensor * tensor) {
+    if (node->src0 == tensor || node->src1 == tensor) {
+        return true;
+    }
+    for (int i = 0; i < GGML_MAX_OPT; i++) {
+        if (node->opt[i] == tensor) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int ggml_graph_optimize(struct ggml_cgraph * cgraph) {
+    const int n_nodes = cgraph->n_nodes;
+
+    bool drop[GGML_MAX_NODES] = { false };
+
+    // a copy of dense data to a dense tensor of the same type, e.g. a permuted tensor with one row, becomes a view of the data
+    for (int i = 0; i < n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+        struct ggml_tensor * src  = node->src0;
+
+        if (node->op != GGML_OP_CPY && node->op != GGML_OP_CONT && node->op != GGML_OP_DUP) {
+            continue;
+        }
+        if (node->backend != GGML_BACKEND_CPU || src->backend != GGML_BACKEND_CPU || cgraph->grads[i] != NULL) {
+            continue;
+        }
+        if (src->type != node->type || !ggml_is_dense(src) || !ggml_is_dense(node)) {
+            continue;
+        }
+        // a copy to a view, e.g. into the KV cache, has to write it
+        if (node->op == GGML_OP_CPY && (node->src1->op != GGML_OP_NONE || node->src1->data != node->data)) {
+            continue;
+        }
+
+        // the nodes that read the copy, none of them may point to its data
+        int  i_last = -1;
+        bool keep   = false;
+        for (int j = i + 1; j < n_nodes; j++) {
+            const struct ggml_tensor * other = cgraph->nodes[j];
+            if (ggml_graph_node_reads(other, node)) {
+                i_last = j;
+                keep  |= other->data == node->data || ggml_op_is_view(other->op);
+            }
+            keep |= node->op == GGML_OP_CPY && ggml_graph_node_reads(other, node->src1);
+        }
+        // the outputs of the graph are copied
+        if (i_last < 0 || keep) {
+            continue;
+        }
+
+        // the source must not be overwritten before the last read
+        const char * src_begin = src->data;
+        const char * src_end   = src_begin + ggml_nelements(src)*GGML_TYPE_SIZE[src->type]/GGML_BLCK_SIZE[src->type];
+        for (int j = i + 1; j <= i_last && !keep; j++) {
+            const struct ggml_tensor * other = cgraph->nodes[j];
+            const char * begin = other->data;
+            const char * end   = begin + ggml_nbytes(other);
+            keep = !ggml_op_is_view(other->op) && begin < src_end && src_begin < end;
+        }
+        if (keep) {
+            continue;
+        }
+
+        node->data = src->data;
+        drop[i] = true;
+    }
+
+    // the views compute nothing, the last node stays as the output
+    int n = 0;
+    for (int i = 0; i < n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        if (i < n_nodes - 1 && cgraph->grads[i] == NULL && (drop[i] || ggml_op_is_view(node->op))) {
+            continue;
+        }
+
+        cgraph->nodes[n] = node;
+        cgraph->grads[n] = cgraph->grads[i];
+        n++;
+    }
+    cgraph->n_nodes = n;
+
+    return n_nodes - n;
+}
+
 struct ggml_tensor * ggml_graph_get_tensor(struct ggml_cgraph * cgraph, const char * name) {
     for (int i = 0; i < cgraph->n_leafs; i++) {
         struct ggml_tensor * leaf = cgraph->leafs[i];
@@ -17196,16 +18092,51 @@ static void ggml_graph_export_node(const struct ggml_tensor * tensor, const char
             tensor->name);
 }
 
+// plan offset of an inplace result: it is kept in the data of src0, wherever the import places src0,
+// so that it also works when src0 is a view or a leaf
+#define GGML_GRAPH_OFFS_SRC0 (UINT64_MAX - 1)
+
 void ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname) {
     //assert(cgraph->work      == NULL);
     //assert(cgraph->work_size == 0);
 
+    const int n_threads = cgraph->n_threads > 0 ? cgraph->n_threads : GGML_DEFAULT_N_THREADS;
+
+    // execution plan: the tasks and work buffer size of each node, and the offset of its result in the eval buffer
+    // the results are placed one after the other, the views point into the results of their sources
+    int32_t  * plan_tasks = malloc(MAX(1, cgraph->n_nodes)*sizeof(int32_t));
+    uint64_t * plan_work  = malloc(MAX(1, cgraph->n_nodes)*sizeof(uint64_t));
+    uint64_t * plan_offs  = malloc(MAX(1, cgraph->n_nodes)*sizeof(uint64_t));
+    GGML_ASSERT(plan_tasks && plan_work && plan_offs);
+
     uint64_t size_eval = 0;
+    uint64_t work_size = 0;
 
-    // compute size of intermediate results
-    // TODO: does not take into account scratch buffers !!!!
     for (int i = 0; i < cgraph->n_nodes; ++i) {
-        size_eval += ggml_nbytes(cgraph->nodes[i]);
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        int n_tasks = 1;
+        plan_work[i]  = ggml_graph_plan_node(node, n_threads, &n_tasks);
+        plan_tasks[i] = n_tasks;
+        work_size     = MAX(work_size, plan_work[i]);
+
+        plan_offs[i] = UINT64_MAX;
+        if (ggml_op_is_view(node->op)) {
+            continue;
+        }
+
+        // an inplace op keeps the result of its source, e.g. ggml_diag_mask_inf_inplace does not copy it to its own
+        if (node->data != NULL && node->src0 != NULL && node->data == node->src0->data) {
+            plan_offs[i] = GGML_GRAPH_OFFS_SRC0;
+            continue;
+        }
+
+        plan_offs[i] = size_eval;
+        size_eval   += ((ggml_nbytes(node) + GGML_MEM_ALIGN - 1)/GGML_MEM_ALIGN)*GGML_MEM_ALIGN;
+    }
+
+    if (work_size > 0) {
+        work_size += CACHE_LINE_SIZE*(n_threads - 1);
     }
 
     // print
@@ -17214,10 +18145,12 @@ void ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname) {
 
         fprintf(fout, "\n");
         fprintf(fout, "%-16s %8x\n", "magic",        GGML_FILE_MAGIC);
-        fprintf(fout, "%-16s %8d\n", "version",      GGML_FILE_VERSION);
+        fprintf(fout, "%-16s %8d\n", "version",      GGML_GRAPH_VERSION);
         fprintf(fout, "%-16s %8d\n", "leafs",        cgraph->n_leafs);
         fprintf(fout, "%-16s %8d\n", "nodes",        cgraph->n_nodes);
         fprintf(fout, "%-16s %" PRIu64 "\n", "eval", size_eval);
+        fprintf(fout, "%-16s %8d\n", "threads",      n_threads);
+        fprintf(fout, "%-16s %" PRIu64 "\n", "work", work_size);
 
         // header
         fprintf(fout, "\n");
@@ -17266,21 +18199,27 @@ void ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname) {
 
         if (!fout) {
             fprintf(stderr, "%s: failed to open %s\n", __func__, fname);
+            free(plan_tasks);
+            free(plan_work);
+            free(plan_offs);
             return;
         }
 
         // header
         {
             const uint32_t magic   = GGML_FILE_MAGIC;
-            const uint32_t version = GGML_FILE_VERSION;
+            const uint32_t version = GGML_GRAPH_VERSION;
             const uint32_t n_leafs = cgraph->n_leafs;
             const uint32_t nodes   = cgraph->n_nodes;
+            const uint32_t threads = n_threads;
 
             fwrite(&magic,     sizeof(uint32_t), 1, fout);
             fwrite(&version,   sizeof(uint32_t), 1, fout);
             fwrite(&n_leafs,   sizeof(uint32_t), 1, fout);
             fwrite(&nodes,     sizeof(uint32_t), 1, fout);
             fwrite(&size_eval, sizeof(uint64_t), 1, fout);
+            fwrite(&threads,   sizeof(uint32_t), 1, fout);
+            fwrite(&work_size, sizeof(uint64_t), 1, fout);
         }
 
         // leafs
@@ -17313,8 +18252,15 @@ void ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname) {
 
                 fwrite(tensor->name, sizeof(char), GGML_MAX_NAME, fout);
 
+                // align the data in the file, so that it is aligned when the file is read or mapped to aligned memory
+                {
+                    static const char zeros[GGML_MEM_ALIGN] = { 0 };
+
+                    const long pos = ftell(fout);
+                    fwrite(zeros, sizeof(char), (GGML_MEM_ALIGN - pos % GGML_MEM_ALIGN) % GGML_MEM_ALIGN, fout);
+                }
+
                 // dump the data
-                // TODO: pad this to 32 byte boundary
                 {
                     const size_t size = ggml_nbytes(tensor);
 
@@ -17390,6 +18336,10 @@ void ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname) {
 
                             if (idx == -1) {
                                 fprintf(stderr, "%s: failed to find tensor, arg = %d, node = %d\n", __func__, j, i);
+                                fclose(fout);
+                                free(plan_tasks);
+                                free(plan_work);
+                                free(plan_offs);
                                 return;
                             }
 
@@ -17401,11 +18351,22 @@ void ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname) {
                         }
                     }
                 }
+
+                // output the plan
+                {
+                    fwrite(&plan_tasks[i], sizeof(int32_t),  1, fout);
+                    fwrite(&plan_work[i],  sizeof(uint64_t), 1, fout);
+                    fwrite(&plan_offs[i],  sizeof(uint64_t), 1, fout);
+                }
             }
         }
 
         fclose(fout);
     }
+
+    free(plan_tasks);
+    free(plan_work);
+    free(plan_offs);
 }
 
 struct ggml_cgraph ggml_graph_import(const char * fname, struct ggml_context ** ctx_data, struct ggml_context ** ctx_eval) {
@@ -17476,24 +18437,35 @@ struct ggml_cgraph ggml_graph_import(const char * fname, struct ggml_context **
 
         const uint32_t version = *(const uint32_t *) ptr; ptr += sizeof(version);
 
-        if (version != GGML_FILE_VERSION) {
+        if (version != GGML_FILE_VERSION && version != GGML_GRAPH_VERSION) {
             fprintf(stderr, "%s: invalid version number\n", __func__);
             return result;
         }
 
+        // version 1 has no execution plan, the nodes are allocated one at a time and planned by ggml_graph_compute
+        const bool has_plan = version >= 2;
+
         const uint32_t n_leafs   = *(const uint32_t *) ptr; ptr += sizeof(n_leafs);
         const uint32_t n_nodes   = *(const uint32_t *) ptr; ptr += sizeof(n_nodes);
         const uint64_t size_eval = *(const uint64_t *) ptr; ptr += sizeof(size_eval);
 
+        uint32_t n_threads = 0;
+        uint64_t work_size = 0;
+        if (has_plan) {
+            n_threads = *(const uint32_t *) ptr; ptr += sizeof(n_threads);
+            work_size = *(const uint64_t *) ptr; ptr += sizeof(work_size);
+        }
+
         result.n_leafs = n_leafs;
         result.n_nodes = n_nodes;
 
         // create the data context
         {
-            const size_t overhead = (n_leafs + n_nodes)*ggml_tensor_overhead();
+            // the views also create a tensor for their parameters
+            const size_t overhead = (n_leafs + 2*n_nodes + 2)*ggml_tensor_overhead();
 
             struct ggml_init_params params = {
-                .mem_size   = size_eval + overhead,
+                .mem_size   = size_eval + work_size + overhead,
                 .mem_buffer = NULL,
                 .no_alloc   = true,
             };
@@ -17506,6 +18478,20 @@ struct ggml_cgraph ggml_graph_import(const char * fname, struct ggml_context **
             }
         }
 
+        // the buffers of the plan: the results of the nodes and the work buffer
+        struct ggml_tensor * eval = NULL;
+        if (has_plan) {
+            ggml_set_no_alloc(*ctx_eval, false);
+
+            eval = ggml_new_tensor_1d(*ctx_eval, GGML_TYPE_I8, size_eval);
+            if (work_size > 0) {
+                result.work_size = work_size;
+                result.work      = ggml_new_tensor_1d(*ctx_eval, GGML_TYPE_I8, work_size);
+            }
+
+            ggml_set_no_alloc(*ctx_eval, true);
+        }
+
         // leafs
         {
             uint32_t type;
@@ -17537,7 +18523,12 @@ struct ggml_cgraph ggml_graph_import(const char * fname, struct ggml_context **
 
                 uint64_t ptr_cur = *(const uint64_t *) ptr; ptr += sizeof(ptr_cur);
 
-                memcpy(tensor->name, ptr, GGML_MAX_NAME); ptr += GGML_MAX_NAME;
+                ggml_set_name(tensor, ptr); ptr += GGML_MAX_NAME;
+
+                if (has_plan) {
+                    const size_t pos = ptr - (char *) data->data;
+                    ptr += (GGML_MEM_ALIGN - pos % GGML_MEM_ALIGN) % GGML_MEM_ALIGN;
+                }
 
                 tensor->data = (void *) ptr;
 
@@ -17588,6 +18579,14 @@ struct ggml_cgraph ggml_graph_import(const char * fname, struct ggml_context **
 
                 const int32_t * ptr_arg_idx = (const int32_t *) ptr; ptr += (2 + GGML_MAX_OPT)*sizeof(int32_t);
 
+                int32_t  n_tasks   = 0;
+                uint64_t offs_eval = UINT64_MAX;
+                if (has_plan) {
+                    n_tasks   = *(const int32_t  *) ptr; ptr += sizeof(n_tasks);
+                    ptr += sizeof(uint64_t); // work buffer size of the node, the graph allocates the largest
+                    offs_eval = *(const uint64_t *) ptr; ptr += sizeof(offs_eval);
+                }
+
                 struct ggml_tensor * args[2 + GGML_MAX_OPT] = { NULL };
 
                 // parse args
@@ -17607,7 +18606,7 @@ struct ggml_cgraph ggml_graph_import(const char * fname, struct ggml_context **
 
                 // create the tensor
                 // "view" operations are handled differently
-                // TODO: handle inplace ops - currently a copy is always made
+                // inplace ops are handled by the plan, without it a copy is always made
 
                 struct ggml_tensor * tensor = NULL;
 
@@ -17636,13 +18635,25 @@ struct ggml_cgraph ggml_graph_import(const char * fname, struct ggml_context **
                         } break;
                     default:
                         {
+                            // with a plan the result is placed in the eval buffer
+                            ggml_set_no_alloc(*ctx_eval, has_plan);
                             tensor = ggml_new_tensor(*ctx_eval, (enum ggml_type) type, n_dims, ne);
+                            ggml_set_no_alloc(*ctx_eval, false);
 
                             tensor->op = eop;
                         } break;
                 }
 
-                memcpy(tensor->name, ptr_name, GGML_MAX_NAME);
+                ggml_set_name(tensor, ptr_name);
+
+                if (has_plan) {
+                    tensor->n_tasks = n_tasks;
+                    if (offs_eval == GGML_GRAPH_OFFS_SRC0) {
+                        tensor->data = args[0]->data;
+                    } else if (offs_eval != UINT64_MAX) {
+                        tensor->data = (char *) eval->data + offs_eval;
+                    }
+                }
 
                 for (int j = 0; j < GGML_MAX_DIMS; ++j) {
                     tensor->nb[j] = nb[j];
@@ -17660,6 +18671,11 @@ struct ggml_cgraph ggml_graph_import(const char * fname, struct ggml_context **
                 fprintf(stderr, "%s: loaded node %d: '%16s', %3d dims, %9zu bytes\n", __func__, i, tensor->name, n_dims, ggml_nbytes(tensor));
             }
         }
+
+        if (has_plan) {
+            result.n_threads = n_threads;
+            result.planned   = true;
+        }
     }
 
     return result;
@@ -18912,6 +19928,29 @@ size_t ggml_quantize_chunk(enum ggml_type type, const float * src, void * dst, i
     return result;
 }
 
+size_t ggml_quantize_chunk_imatrix(enum ggml_type type, const float * src, void * dst, int start, int nrows, int n_per_row, int64_t * hist, const float * imatrix) {
+    GGML_ASSERT(start % n_per_row == 0);
+    if (imatrix == NULL) {
+        return ggml_quantize_chunk(type, src, dst, start, nrows*n_per_row, hist);
+    }
+    const size_t row_size = ggml_type_size(type)*n_per_row/ggml_blck_size(type);
+    void * rows = (char *) dst + (start/n_per_row)*row_size;
+    size_t result = 0;
+    switch (type) {
+#ifdef GGML_USE_K_QUANTS
+        case GGML_TYPE_Q2_K: result = ggml_quantize_q2_K_imatrix(src + start, rows, nrows, n_per_row, hist, imatrix); break;
+        case GGML_TYPE_Q3_K: result = ggml_quantize_q3_K_imatrix(src + start, rows, nrows, n_per_row, hist, imatrix); break;
+        case GGML_TYPE_Q4_K: result = ggml_quantize_q4_K_imatrix(src + start, rows, nrows, n_per_row, hist, imatrix); break;
+        case GGML_TYPE_Q5_K: result = ggml_quantize_q5_K_imatrix(src + start, rows, nrows, n_per_row, hist, imatrix); break;
+        case GGML_TYPE_Q6_K: result = ggml_quantize_q6_K_imatrix(src + start, rows, nrows, n_per_row, hist, imatrix); break;
+#endif
+        default:
+            result = ggml_quantize_chunk(type, src, dst, start, nrows*n_per_row, hist);
+    }
+    UNUSED(rows);
+    return result;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 int ggml_cpu_has_avx(void) {
@@ -190,6 +190,8 @@
 #define GGML_FILE_MAGIC   0x67676d6c // "ggml"
 #define GGML_FILE_VERSION 1
 
+#define GGML_GRAPH_VERSION 2 // ggml_graph_export, version 1 had no execution plan
+
 #define GGML_QNT_VERSION        2    // bump this on quantization format changes
 #define GGML_QNT_VERSION_FACTOR 1000 // do not change this
 
@@ -200,6 +202,10 @@
 #define GGML_MAX_OPT           4
 #define GGML_MAX_NAME          32
 #define GGML_DEFAULT_N_THREADS 4
+#define GGML_MAX_PROFILE_NAMES 256
+
+#define GGML_EXIT_SUCCESS 0
+#define GGML_EXIT_ABORTED 1
 
 #define GGML_ASSERT(x) \
     do { \
@@ -227,6 +233,9 @@ extern "C" {
     GGML_API void ggml_fp16_to_fp32_row(const ggml_fp16_t * x, float * y, size_t n);
     GGML_API void ggml_fp32_to_fp16_row(const float * x, ggml_fp16_t * y, size_t n);
 
+    // y = exp(x - max), returns the sum of y; the vectorized exp of GGML_OP_SOFT_MAX, for a softmax computed in pieces
+    GGML_API double ggml_soft_max_exp_row(const float * x, float * y, int n, float max);
+
     struct ggml_object;
     struct ggml_context;
 
@@ -409,6 +418,57 @@ extern "C" {
 
     static const size_t GGML_TENSOR_SIZE = sizeof(struct ggml_tensor);
 
+    // called by ggml_graph_compute() on the calling thread after each node has been computed
+    typedef void (*ggml_graph_eval_callback)(struct ggml_tensor * node, void * user_data);
+
+    // called by ggml_graph_compute() on the calling thread before each node, returning true stops the computation
+    typedef bool (*ggml_abort_callback)(void * user_data);
+
+    // time spent on the nodes with one tensor name and op, per task phase (INIT, COMPUTE, FINALIZE)
+    struct ggml_profile_entry {
+        char         name[GGML_MAX_NAME];
+        enum ggml_op op;
+        int64_t      runs;
+        int64_t      time_us[3];
+    };
+
+    // hardware counters sampled per op, see ggml_profile.counters
+    enum ggml_profile_counter {
+        GGML_PROFILE_CYCLES,
+        GGML_PROFILE_INSTRUCTIONS,
+        GGML_PROFILE_LLC_REFS,   // last level cache references
+        GGML_PROFILE_LLC_MISSES, // last level cache misses, each one reads a cache line from memory
+        GGML_PROFILE_COUNTER_COUNT,
+    };
+
+    // timings collected by ggml_graph_compute() while cgraph->profile is set, summed over all computations
+    // nodes are timed on the calling thread, from the start of INIT to the end of FINALIZE on all threads
+    struct ggml_profile {
+        int64_t runs;    // graph computations
+        int64_t time_us; // wall time of the graph computations
+
+        int64_t op_runs[GGML_OP_COUNT];
+        int64_t op_time_us[GGML_OP_COUNT][3];
+
+        // estimated work of the nodes: floating point operations, and bytes of the sources and the result
+        int64_t op_flops[GGML_OP_COUNT];
+        int64_t op_bytes[GGML_OP_COUNT];
+
+        // set to sample the hardware counters of every thread while it runs a node, with perf_event_open (Linux only)
+        // ggml_profile_reset() keeps it, counters that cannot be opened stay at zero
+        bool    counters;
+        int64_t op_counters[GGML_OP_COUNT][GGML_PROFILE_COUNTER_COUNT];
+
+        // nodes with the same name and op are added up, e.g. the same tensor of every layer
+        // names that do not fit are counted in n_names_dropped
+        int n_names;
+        int n_names_dropped;
+        struct ggml_profile_entry names[GGML_MAX_PROFILE_NAMES];
+    };
+
+    // timeline of ggml_graph_compute() on all threads, see ggml_trace_init()
+    struct ggml_trace;
+
     // computation graph
     struct ggml_cgraph {
         int n_nodes;
@@ -418,6 +478,9 @@ extern "C" {
         size_t work_size;
         struct ggml_tensor * work;
 
+        // the n_tasks of the nodes and the work buffer are set, ggml_graph_compute uses them if n_threads is enough
+        bool planned;
+
         struct ggml_tensor * nodes[GGML_MAX_NODES];
         struct ggml_tensor * grads[GGML_MAX_NODES];
         struct ggml_tensor * leafs[GGML_MAX_NODES];
@@ -426,6 +489,20 @@ extern "C" {
         int     perf_runs;
         int64_t perf_cycles;
         int64_t perf_time_us;
+
+        // optional, can be used to inspect intermediate results
+        ggml_graph_eval_callback eval_callback;
+        void *                   eval_callback_data;
+
+        // optional, can be used to stop a long computation
+        ggml_abort_callback abort_callback;
+        void *              abort_callback_data;
+
+        // optional, the per-op timings are added to it, costs nothing when NULL
+        struct ggml_profile * profile;
+
+        // optional, records the timeline of the threads, costs nothing when NULL
+        struct ggml_trace * trace;
     };
 
     // scratch buffer
@@ -550,6 +627,10 @@ extern "C" {
     GGML_API struct ggml_tensor * ggml_dup_tensor (struct ggml_context * ctx, const struct ggml_tensor * src);
     GGML_API struct ggml_tensor * ggml_view_tensor(struct ggml_context * ctx, const struct ggml_tensor * src);
 
+    // the first tensor of ctx with the name, found through an index of the names that the first lookup builds
+    // ggml_set_name/ggml_format_name mark the index as stale, names written to tensor->name directly are only seen by
+    // the lookups if they are written before the index is built
+    // the lookups can run on several threads at once, but not while tensors of ctx are named
     GGML_API struct ggml_tensor * ggml_get_tensor(struct ggml_context * ctx, const char * name);
 
     GGML_API struct ggml_tensor * ggml_set_zero(struct ggml_tensor * tensor);
@@ -1264,17 +1345,46 @@ extern "C" {
     GGML_API struct ggml_cgraph ggml_build_forward (struct ggml_tensor * tensor);
     GGML_API struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cgraph * gf, bool keep);
 
-    GGML_API void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph);
+    // returns GGML_EXIT_ABORTED if the abort callback stopped the computation, GGML_EXIT_SUCCESS otherwise
+    GGML_API int  ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph);
     GGML_API void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
+    // removes the nodes that compute nothing from a forward graph, returns how many: the views, reshapes, permutes
+    // and transposes, and the copies of data that is already contiguous, whose results then point to the data
+    // the copies to new tensors are taken as temporary, the copies to views (e.g. into a cache) and the outputs are kept
+    // the graph can no longer be exported
+    GGML_API int  ggml_graph_optimize(struct ggml_cgraph * cgraph);
+
     GGML_API struct ggml_tensor * ggml_graph_get_tensor(struct ggml_cgraph * cgraph, const char * name);
 
+    // the file holds the leafs with their data and the nodes with an execution plan for cgraph->n_threads:
+    // the tasks and work buffer size of each node and the offset of its result in one buffer
+    // ggml_graph_import allocates that buffer and the work buffer, the imported graph computes without planning
     GGML_API void               ggml_graph_export(const struct ggml_cgraph * cgraph, const char * fname);
     GGML_API struct ggml_cgraph ggml_graph_import(const char * fname, struct ggml_context ** ctx_data, struct ggml_context ** ctx_eval);
 
     // print info and performance information for the graph
     GGML_API void ggml_graph_print(const struct ggml_cgraph * cgraph);
 
+    // profiling of ggml_graph_compute(), see struct ggml_profile
+    GGML_API void ggml_profile_reset(struct ggml_profile * profile);
+    // print the time per op, per tensor name and per phase, the top n_names names are listed, all of them if n_names <= 0
+    // the ops are also listed with their FLOPs, bytes and achieved rates, and the hardware counters if sampled
+    GGML_API void ggml_profile_print(const struct ggml_profile * profile, int n_names);
+
+    // tracing of ggml_graph_compute(): while cgraph->trace is set, every thread records when it runs the INIT,
+    // COMPUTE and FINALIZE phase of each node and when it waits for the other threads
+    // the trace keeps the latest max_events events, it can be shared by several graphs computed one after the other
+    GGML_API struct ggml_trace * ggml_trace_init(int max_events);
+    GGML_API void                ggml_trace_free(struct ggml_trace * trace);
+    GGML_API void                ggml_trace_reset(struct ggml_trace * trace);
+    // copy the events of src into dst, both created with the same max_events
+    // must not be called while a graph with src is computed
+    GGML_API void                ggml_trace_copy(struct ggml_trace * dst, struct ggml_trace * src);
+    // write the events in the Chrome trace event JSON format, for chrome://tracing or https://ui.perfetto.dev
+    // must not be called while a graph with this trace is computed
+    GGML_API bool                ggml_trace_write(struct ggml_trace * trace, const char * fname);
+
     // dump the graph into a file using the dot format
     GGML_API void ggml_graph_dump_dot(const struct ggml_cgraph * gb, const struct ggml_cgraph * gf, const char * filename);
 
@@ -1455,6 +1565,11 @@ extern "C" {
 
     GGML_API size_t ggml_quantize_chunk(enum ggml_type type, const float * src, void * dst, int start, int n, int64_t * hist);
 
+    // quantize nrows rows of n_per_row elements, starting at element start (a multiple of n_per_row)
+    // imatrix holds the importance of each of the n_per_row columns and is used by the k-quants to
+    // minimize the weighted error; other types, or a NULL imatrix, behave like ggml_quantize_chunk
+    GGML_API size_t ggml_quantize_chunk_imatrix(enum ggml_type type, const float * src, void * dst, int start, int nrows, int n_per_row, int64_t * hist, const float * imatrix);
+
     //
     // system info
     //
@@ -54,6 +54,13 @@ static inline int nearest_int(float fval) {
     return (i & 0x007fffff) - 0x00400000;
 }
 
+// counts the nbits wide quant indices of a super-block in the 16 bins of hist, like the 4-bit quants do
+static void collect_hist_K(int64_t * restrict hist, const uint8_t * restrict L, int nbits) {
+    for (int j = 0; j < QK_K; ++j) {
+        hist[nbits >= 4 ? L[j] >> (nbits - 4) : L[j] << (4 - nbits)]++;
+    }
+}
+
 static float make_qx_quants(int n, int nmax, const float * restrict x, int8_t * restrict L, int rmse_type) {
     float max = 0;
     float amax = 0;
@@ -261,6 +268,533 @@ static float make_qkx1_quants(int n, int nmax, const float * restrict x, uint8_t
     return scale;
 }
 
+// weighted variant of make_qx_quants: minimizes sum w[i]*(x[i] - scale*l[i])^2
+static float make_qx_quants_w(int n, int nmax, const float * restrict x, int8_t * restrict L, const float * restrict w) {
+    float max = 0;
+    float amax = 0;
+    for (int i = 0; i < n; ++i) {
+        float ax = fabsf(x[i]);
+        if (ax > amax) { amax = ax; max = x[i]; }
+    }
+    if (!amax) { // all zero
+        for (int i = 0; i < n; ++i) {
+            L[i] = 0;
+        }
+        return 0.f;
+    }
+    float iscale = -nmax / max;
+    float sumlx = 0;
+    float suml2 = 0;
+    for (int i = 0; i < n; ++i) {
+        int l = nearest_int(iscale * x[i]);
+        l = MAX(-nmax, MIN(nmax-1, l));
+        L[i] = l + nmax;
+        sumlx += w[i]*x[i]*l;
+        suml2 += w[i]*l*l;
+    }
+    if (suml2 == 0) { // all weights are zero
+        return 1/iscale;
+    }
+    float scale = sumlx/suml2;
+    float best = scale * sumlx;
+    for (int is = -9; is <= 9; ++is) {
+        if (is == 0) {
+            continue;
+        }
+        iscale = -(nmax + 0.1f*is) / max;
+        float slx = 0;
+        float sl2 = 0;
+        for (int i = 0; i < n; ++i) {
+            int l = nearest_int(iscale * x[i]);
+            l = MAX(-nmax, MIN(nmax-1, l));
+            slx += w[i]*x[i]*l;
+            sl2 += w[i]*l*l;
+        }
+        if (sl2 > 0 && slx*slx > best*sl2) {
+            for (int i = 0; i < n; ++i) {
+                int l = nearest_int(iscale * x[i]);
+                L[i] = nmax + MAX(-nmax, MIN(nmax-1, l));
+            }
+            sumlx = slx; suml2 = sl2;
+            scale = sumlx/suml2; best = scale*sumlx;
+        }
+    }
+    for (int itry = 0; itry < 5; ++itry) {
+        int n_changed = 0;
+        for (int i = 0; i < n; ++i) {
+            int l = L[i] - nmax;
+            float slx = sumlx - w[i]*x[i]*l;
+            if (slx > 0) {
+                float sl2 = suml2 - w[i]*l*l;
+                int new_l = nearest_int(x[i] * sl2 / slx);
+                new_l = MAX(-nmax, MIN(nmax-1, new_l));
+                if (new_l != l) {
+                    slx += w[i]*x[i]*new_l;
+                    sl2 += w[i]*new_l*new_l;
+                    if (sl2 > 0 && slx*slx*suml2 > sumlx*sumlx*sl2) {
+                        L[i] = nmax + new_l; sumlx = slx; suml2 = sl2;
+                        scale = sumlx / suml2; best = scale * sumlx;
+                        ++n_changed;
+                    }
+                }
+            }
+        }
+        if (!n_changed) { break; }
+    }
+    return scale;
+}
+
+// weighted variant of make_qkx1_quants: x[i] is approximated as scale*l[i] - the_min, and for each
+// of a range of candidate scales the (scale, min) pair is refit with weighted least squares
+static float make_qkx_quants_w(int n, int nmax, const float * restrict x, const float * restrict w,
+        uint8_t * restrict L, float * restrict the_min) {
+    float min = x[0];
+    float max = x[0];
+    float sum_w = w[0];
+    float sum_x = w[0]*x[0];
+    for (int i = 1; i < n; ++i) {
+        if (x[i] < min) min = x[i];
+        if (x[i] > max) max = x[i];
+        sum_w += w[i];
+        sum_x += w[i]*x[i];
+    }
+    if (min > 0) min = 0;
+    if (max == min) {
+        for (int i = 0; i < n; ++i) L[i] = 0;
+        *the_min = -min;
+        return 0.f;
+    }
+    float iscale = nmax/(max - min);
+    float scale = 1/iscale;
+    float best_err = 0;
+    for (int i = 0; i < n; ++i) {
+        int l = nearest_int(iscale*(x[i] - min));
+        L[i] = MAX(0, MIN(nmax, l));
+        float diff = scale*L[i] + min - x[i];
+        best_err += w[i]*diff*diff;
+    }
+    uint8_t Laux[32];
+    assert(n <= 32);
+    for (int is = 0; is <= 20; ++is) {
+        iscale = (nmax - 1.f + 0.1f*is)/(max - min);
+        float sum_l = 0, sum_l2 = 0, sum_xl = 0;
+        for (int i = 0; i < n; ++i) {
+            int l = nearest_int(iscale*(x[i] - min));
+            l = MAX(0, MIN(nmax, l));
+            Laux[i] = l;
+            sum_l  += w[i]*l;
+            sum_l2 += w[i]*l*l;
+            sum_xl += w[i]*l*x[i];
+        }
+        float D = sum_w * sum_l2 - sum_l * sum_l;
+        if (D <= 0) {
+            continue;
+        }
+        float this_scale = (sum_w * sum_xl - sum_x * sum_l)/D;
+        float this_min   = (sum_l2 * sum_x - sum_l * sum_xl)/D;
+        if (this_min > 0) {
+            this_min = 0;
+            this_scale = sum_xl / sum_l2;
+        }
+        if (this_scale <= 0) {
+            continue;
+        }
+        float err = 0;
+        for (int i = 0; i < n; ++i) {
+            float diff = this_scale * Laux[i] + this_min - x[i];
+            err += w[i]*diff*diff;
+        }
+        if (err < best_err) {
+            for (int i = 0; i < n; ++i) L[i] = Laux[i];
+            best_err = err;
+            scale = this_scale;
+            min = this_min;
+        }
+    }
+    *the_min = -min;
+    return scale;
+}
+
+// per element weights for a super-block: the importance of the column, scaled by the magnitude of the weight
+static void make_block_weights(const float * restrict x, const float * restrict qw, float * restrict weight) {
+    float sum_x2 = 0;
+    for (int j = 0; j < QK_K; ++j) sum_x2 += x[j]*x[j];
+    const float sigma2 = sum_x2/QK_K;
+    for (int j = 0; j < QK_K; ++j) weight[j] = qw[j] * sqrtf(sigma2 + x[j]*x[j]);
+}
+
+#if defined(__AVX2__)
+
+//
+// AVX2 versions of the scale searches above. Sub-blocks are processed eight at a time, one per lane,
+// and every lane goes through exactly the same operations as the scalar code, so that the results
+// are bit-identical to the reference implementation. Whether the compiler fuses a*b + c in the scalar code depends on
+// the compiler and the flags, so the vector code fuses in the same builds:
+//  - gcc fuses in optimized builds, also across statements (e.g. in nearest_int), but not in ISO C mode such as the
+//    -std=c11 of the Makefile; -O1 and an explicit -ffp-contract are not detected
+//  - clang 14 and later fuse within an expression only
+//  - msvc does not fuse
+// Super-blocks with 16 sub-blocks are handled as two interleaved groups of 8 (ng = 2) to hide the
+// latency of the dependency chains in the coordinate descent.
+//
+
+#if defined(__FMA__) && defined(__GNUC__) && !defined(__clang__) && defined(__OPTIMIZE__) && !defined(__STRICT_ANSI__)
+#define KQ_FUSED      1
+#define KQ_FUSED_STMT 1
+#elif defined(__FMA__) && defined(__clang__) && __clang_major__ >= 14
+#define KQ_FUSED      1
+#define KQ_FUSED_STMT 0
+#else
+#define KQ_FUSED      0
+#define KQ_FUSED_STMT 0
+#endif
+
+#if KQ_FUSED
+#define KQ_MADD(a, b, c)  _mm256_fmadd_ps(a, b, c)
+#define KQ_NMADD(a, b, c) _mm256_fnmadd_ps(a, b, c)
+#else
+#define KQ_MADD(a, b, c)  _mm256_add_ps(_mm256_mul_ps(a, b), c)
+#define KQ_NMADD(a, b, c) _mm256_sub_ps(c, _mm256_mul_ps(a, b))
+#endif
+
+#if KQ_FUSED_STMT
+#define KQ_MADD_STMT(a, b, c) _mm256_fmadd_ps(a, b, c)
+#else
+#define KQ_MADD_STMT(a, b, c) _mm256_add_ps(_mm256_mul_ps(a, b), c)
+#endif
+
+#define KQ_MAX_NG 2
+
+// nearest_int(v) for each lane
+static inline __m256i nearest_int_x8(__m256 v) {
+    const __m256i i = _mm256_castps_si256(_mm256_add_ps(v, _mm256_set1_ps(12582912.f)));
+    return _mm256_sub_epi32(_mm256_and_si256(i, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x00400000));
+}
+
+// nearest_int(a*b) for each lane
+static inline __m256i nearest_int_mul_x8(__m256 a, __m256 b) {
+    const __m256i i = _mm256_castps_si256(KQ_MADD_STMT(a, b, _mm256_set1_ps(12582912.f)));
+    return _mm256_sub_epi32(_mm256_and_si256(i, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x00400000));
+}
+
+static inline __m256i clamp_epi32_x8(__m256i v, int lo, int hi) {
+    return _mm256_max_epi32(_mm256_set1_epi32(lo), _mm256_min_epi32(_mm256_set1_epi32(hi), v));
+}
+
+static inline __m256 blend_epi32_x8(__m256i a, __m256i b, __m256 mask) {
+    return _mm256_blendv_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b), mask);
+}
+
+// the 5 coordinate descent iterations of make_qx_quants / make_q3_quants
+// Lt holds l + offset, only the lanes in active take part
+static inline void rmse_refine_x8(int ng, int n, int nmax, const float * restrict xt, int32_t * restrict Lt, int offset,
+        __m256 * restrict sumlx, __m256 * restrict suml2, const __m256 * restrict valid) {
+    const __m256  zero    = _mm256_setzero_ps();
+    const __m256i voffset = _mm256_set1_epi32(offset);
+    __m256 active[KQ_MAX_NG];
+    int any = 0;
+    for (int g = 0; g < ng; ++g) {
+        active[g] = valid[g];
+        any |= _mm256_movemask_ps(active[g]);
+    }
+    for (int itry = 0; itry < 5 && any; ++itry) {
+        __m256 n_changed[KQ_MAX_NG];
+        for (int g = 0; g < ng; ++g) n_changed[g] = zero;
+        for (int i = 0; i < n; ++i) {
+            for (int g = 0; g < ng; ++g) {
+                const int k = 8*(ng*i + g);
+                const __m256  v    = _mm256_loadu_ps(xt + k);
+                const __m256  w    = _mm256_mul_ps(v, v);
+                const __m256  wx   = _mm256_mul_ps(w, v);
+                const __m256i Lold = _mm256_loadu_si256((const __m256i *)(Lt + k));
+                const __m256i l    = _mm256_sub_epi32(Lold, voffset);
+                const __m256  lf   = _mm256_cvtepi32_ps(l);
+                __m256 slx = KQ_NMADD(wx, lf, sumlx[g]);
+                __m256 sl2 = KQ_NMADD(_mm256_mul_ps(w, lf), lf, suml2[g]);
+                __m256 upd = _mm256_and_ps(active[g], _mm256_cmp_ps(slx, zero, _CMP_GT_OQ));
+                const __m256i new_l = clamp_epi32_x8(nearest_int_x8(_mm256_div_ps(_mm256_mul_ps(v, sl2), slx)), -nmax, nmax-1);
+                upd = _mm256_andnot_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(new_l, l)), upd);
+                const __m256 nlf = _mm256_cvtepi32_ps(new_l);
+                slx = KQ_MADD(wx, nlf, slx);
+                sl2 = KQ_MADD(_mm256_mul_ps(w, nlf), nlf, sl2);
+                upd = _mm256_and_ps(upd, _mm256_cmp_ps(sl2, zero, _CMP_GT_OQ));
+                upd = _mm256_and_ps(upd, _mm256_cmp_ps(_mm256_mul_ps(_mm256_mul_ps(slx, slx), suml2[g]),
+                                                       _mm256_mul_ps(_mm256_mul_ps(sumlx[g], sumlx[g]), sl2), _CMP_GT_OQ));
+                _mm256_storeu_ps((float *)(Lt + k), blend_epi32_x8(Lold, _mm256_add_epi32(new_l, voffset), upd));
+                sumlx[g] = _mm256_blendv_ps(sumlx[g], slx, upd);
+                suml2[g] = _mm256_blendv_ps(suml2[g], sl2, upd);
+                n_changed[g] = _mm256_or_ps(n_changed[g], upd);
+            }
+        }
+        any = 0;
+        for (int g = 0; g < ng; ++g) {
+            active[g] = _mm256_and_ps(active[g], n_changed[g]);
+            any |= _mm256_movemask_ps(active[g]);
+        }
+    }
+}
+
+// max and signed value of the max abs of each lane, as in make_qx_quants / make_q3_quants
+static inline void signed_max_x8(int ng, int n, const float * restrict xt, __m256 * restrict max, __m256 * restrict valid) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    for (int g = 0; g < ng; ++g) {
+        __m256 vmax = _mm256_setzero_ps();
+        __m256 amax = _mm256_setzero_ps();
+        for (int i = 0; i < n; ++i) {
+            const __m256 v  = _mm256_loadu_ps(xt + 8*(ng*i + g));
+            const __m256 av = _mm256_andnot_ps(sign, v);
+            const __m256 gt = _mm256_cmp_ps(av, amax, _CMP_GT_OQ);
+            amax = _mm256_blendv_ps(amax, av, gt);
+            vmax = _mm256_blendv_ps(vmax, v,  gt);
+        }
+        max[g]   = vmax;
+        valid[g] = _mm256_cmp_ps(amax, _mm256_setzero_ps(), _CMP_NEQ_UQ);
+    }
+}
+
+// make_qx_quants(n, nmax, x, L, 1) (q3 == false) or make_q3_quants(n, nmax, x, L, true) (q3 == true)
+// for 8*ng sub-blocks, xt and Lt are [n][8*ng]
+static inline void make_qx_quants_x8(int ng, int n, int nmax, const float * restrict xt, int32_t * restrict Lt,
+        float * restrict scales, bool q3) {
+    const __m256  zero  = _mm256_setzero_ps();
+    const __m256i vnmax = _mm256_set1_epi32(nmax);
+    const int offset = q3 ? 0 : nmax;
+
+    __m256 max[KQ_MAX_NG], valid[KQ_MAX_NG];
+    __m256 iscale[KQ_MAX_NG], sumlx[KQ_MAX_NG], suml2[KQ_MAX_NG], scale[KQ_MAX_NG], best[KQ_MAX_NG], active[KQ_MAX_NG];
+
+    signed_max_x8(ng, n, xt, max, valid);
+
+    for (int g = 0; g < ng; ++g) {
+        iscale[g] = _mm256_div_ps(_mm256_set1_ps((float)-nmax), max[g]);
+        sumlx[g]  = zero;
+        suml2[g]  = zero;
+    }
+    for (int i = 0; i < n; ++i) {
+        for (int g = 0; g < ng; ++g) {
+            const int k = 8*(ng*i + g);
+            const __m256  v = _mm256_loadu_ps(xt + k);
+            const __m256i l = clamp_epi32_x8(nearest_int_mul_x8(iscale[g], v), -nmax, nmax-1);
+            _mm256_storeu_si256((__m256i *)(Lt + k), _mm256_add_epi32(l, _mm256_set1_epi32(offset)));
+            const __m256 w  = _mm256_mul_ps(v, v);
+            const __m256 lf = _mm256_cvtepi32_ps(l);
+            sumlx[g] = KQ_MADD(_mm256_mul_ps(w, v), lf, sumlx[g]);
+            suml2[g] = KQ_MADD(_mm256_mul_ps(w, lf), lf, suml2[g]);
+        }
+    }
+
+    if (!q3) {
+        int any = 0;
+        for (int g = 0; g < ng; ++g) {
+            scale[g]  = _mm256_div_ps(sumlx[g], suml2[g]);
+            best[g]   = _mm256_mul_ps(scale[g], sumlx[g]);
+            active[g] = valid[g];
+            any |= _mm256_movemask_ps(active[g]);
+        }
+        for (int itry = 0; itry < 3 && any; ++itry) {
+            __m256 slx[KQ_MAX_NG], sl2[KQ_MAX_NG], changed[KQ_MAX_NG];
+            for (int g = 0; g < ng; ++g) {
+                iscale[g]  = _mm256_div_ps(_mm256_set1_ps(1.0f), scale[g]);
+                slx[g]     = zero;
+                sl2[g]     = zero;
+                changed[g] = zero;
+            }
+            for (int i = 0; i < n; ++i) {
+                for (int g = 0; g < ng; ++g) {
+                    const int k = 8*(ng*i + g);
+                    const __m256  v    = _mm256_loadu_ps(xt + k);
+                    const __m256i l    = clamp_epi32_x8(nearest_int_mul_x8(iscale[g], v), -nmax, nmax-1);
+                    const __m256i Lold = _mm256_loadu_si256((const __m256i *)(Lt + k));
+                    changed[g] = _mm256_or_ps(changed[g], _mm256_castsi256_ps(_mm256_xor_si256(
+                                    _mm256_cmpeq_epi32(_mm256_add_epi32(l, vnmax), Lold), _mm256_set1_epi32(-1))));
+                    const __m256 w  = _mm256_mul_ps(v, v);
+                    const __m256 lf = _mm256_cvtepi32_ps(l);
+                    slx[g] = KQ_MADD(_mm256_mul_ps(w, v), lf, slx[g]);
+                    sl2[g] = KQ_MADD(_mm256_mul_ps(w, lf), lf, sl2[g]);
+                }
+            }
+            // lanes stop when !changed || sl2 == 0 || slx*slx <= best*sl2
+            any = 0;
+            for (int g = 0; g < ng; ++g) {
+                active[g] = _mm256_and_ps(active[g], changed[g]);
+                active[g] = _mm256_and_ps(active[g], _mm256_cmp_ps(sl2[g], zero, _CMP_NEQ_UQ));
+                active[g] = _mm256_and_ps(active[g], _mm256_cmp_ps(_mm256_mul_ps(slx[g], slx[g]), _mm256_mul_ps(best[g], sl2[g]), _CMP_NLE_UQ));
+                any |= _mm256_movemask_ps(active[g]);
+            }
+            if (!any) {
+                break;
+            }
+            for (int i = 0; i < n; ++i) {
+                for (int g = 0; g < ng; ++g) {
+                    const int k = 8*(ng*i + g);
+                    const __m256i l    = clamp_epi32_x8(nearest_int_mul_x8(iscale[g], _mm256_loadu_ps(xt + k)), -nmax, nmax-1);
+                    const __m256i Lold = _mm256_loadu_si256((const __m256i *)(Lt + k));
+                    _mm256_storeu_ps((float *)(Lt + k), blend_epi32_x8(Lold, _mm256_add_epi32(l, vnmax), active[g]));
+                }
+            }
+            for (int g = 0; g < ng; ++g) {
+                sumlx[g] = _mm256_blendv_ps(sumlx[g], slx[g], active[g]);
+                suml2[g] = _mm256_blendv_ps(suml2[g], sl2[g], active[g]);
+                scale[g] = _mm256_div_ps(sumlx[g], suml2[g]);
+                best[g]  = _mm256_mul_ps(scale[g], sumlx[g]);
+            }
+        }
+    }
+
+    rmse_refine_x8(ng, n, nmax, xt, Lt, offset, sumlx, suml2, valid);
+
+    for (int g = 0; g < ng; ++g) {
+        _mm256_storeu_ps(scales + 8*g, _mm256_and_ps(_mm256_div_ps(sumlx[g], suml2[g]), valid[g]));
+    }
+    for (int i = 0; i < n; ++i) {
+        for (int g = 0; g < ng; ++g) {
+            const int k = 8*(ng*i + g);
+            __m256i Lv = _mm256_loadu_si256((const __m256i *)(Lt + k));
+            if (q3) {
+                Lv = _mm256_add_epi32(Lv, vnmax);
+            }
+            _mm256_storeu_si256((__m256i *)(Lt + k), _mm256_and_si256(Lv, _mm256_castps_si256(valid[g])));
+        }
+    }
+}
+
+// make_qkx1_quants(n, nmax, x, L, &the_min, ntry) for 8*ng sub-blocks, xt and Lt are [n][8*ng]
+// Lt must hold the previous content of L, as the scalar version compares against it
+static inline void make_qkx1_quants_x8(int ng, int n, int nmax, const float * restrict xt, int32_t * restrict Lt,
+        float * restrict scales, float * restrict the_mins, int ntry) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one  = _mm256_set1_ps(1.0f);
+
+    __m256 min[KQ_MAX_NG], flat[KQ_MAX_NG], iscale[KQ_MAX_NG], scale[KQ_MAX_NG], active[KQ_MAX_NG];
+
+    int any = 0;
+    for (int g = 0; g < ng; ++g) {
+        __m256 vmin = _mm256_loadu_ps(xt + 8*g);
+        __m256 vmax = vmin;
+        for (int i = 1; i < n; ++i) {
+            const __m256 v = _mm256_loadu_ps(xt + 8*(ng*i + g));
+            vmin = _mm256_min_ps(v, vmin);
+            vmax = _mm256_max_ps(v, vmax);
+        }
+        flat[g]   = _mm256_cmp_ps(vmax, vmin, _CMP_EQ_OQ);
+        min[g]    = _mm256_blendv_ps(vmin, zero, _mm256_cmp_ps(vmin, zero, _CMP_GT_OQ));
+        iscale[g] = _mm256_div_ps(_mm256_set1_ps((float)nmax), _mm256_sub_ps(vmax, min[g]));
+        scale[g]  = _mm256_div_ps(one, iscale[g]);
+        active[g] = _mm256_andnot_ps(flat[g], _mm256_castsi256_ps(_mm256_set1_epi32(-1)));
+        any |= _mm256_movemask_ps(active[g]);
+    }
+
+    for (int itry = 0; itry < ntry && any; ++itry) {
+        __m256  sumlx[KQ_MAX_NG], changed[KQ_MAX_NG], sum[KQ_MAX_NG], new_scale[KQ_MAX_NG];
+        __m256i suml2[KQ_MAX_NG];
+        for (int g = 0; g < ng; ++g) {
+            sumlx[g]   = zero;
+            suml2[g]   = _mm256_setzero_si256();
+            changed[g] = zero;
+            sum[g]     = zero;
+        }
+        for (int i = 0; i < n; ++i) {
+            for (int g = 0; g < ng; ++g) {
+                const int k = 8*(ng*i + g);
+                const __m256  t    = _mm256_sub_ps(_mm256_loadu_ps(xt + k), min[g]);
+                const __m256i l    = clamp_epi32_x8(nearest_int_mul_x8(iscale[g], t), 0, nmax);
+                const __m256i Lold = _mm256_loadu_si256((const __m256i *)(Lt + k));
+                changed[g] = _mm256_or_ps(changed[g], _mm256_andnot_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(l, Lold)), active[g]));
+                _mm256_storeu_ps((float *)(Lt + k), blend_epi32_x8(Lold, l, active[g]));
+                sumlx[g] = KQ_MADD(t, _mm256_cvtepi32_ps(l), sumlx[g]);
+                suml2[g] = _mm256_add_epi32(suml2[g], _mm256_mullo_epi32(l, l));
+            }
+        }
+        for (int g = 0; g < ng; ++g) {
+            new_scale[g] = _mm256_div_ps(sumlx[g], _mm256_cvtepi32_ps(suml2[g]));
+        }
+        for (int i = 0; i < n; ++i) {
+            for (int g = 0; g < ng; ++g) {
+                const int k = 8*(ng*i + g);
+                const __m256 lf = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(Lt + k)));
+                sum[g] = _mm256_add_ps(sum[g], KQ_NMADD(new_scale[g], lf, _mm256_loadu_ps(xt + k)));
+            }
+        }
+        any = 0;
+        for (int g = 0; g < ng; ++g) {
+            __m256 new_min = _mm256_div_ps(sum[g], _mm256_set1_ps((float)n));
+            new_min = _mm256_blendv_ps(new_min, zero, _mm256_cmp_ps(new_min, zero, _CMP_GT_OQ));
+
+            scale[g]  = _mm256_blendv_ps(scale[g],  new_scale[g], active[g]);
+            min[g]    = _mm256_blendv_ps(min[g],    new_min,      active[g]);
+            iscale[g] = _mm256_blendv_ps(iscale[g], _mm256_div_ps(one, new_scale[g]), active[g]);
+            active[g] = _mm256_and_ps(active[g], changed[g]);
+            any |= _mm256_movemask_ps(active[g]);
+        }
+    }
+
+    for (int g = 0; g < ng; ++g) {
+        _mm256_storeu_ps(scales   + 8*g, _mm256_andnot_ps(flat[g], scale[g]));
+        _mm256_storeu_ps(the_mins + 8*g, _mm256_andnot_ps(flat[g], _mm256_xor_ps(min[g], _mm256_set1_ps(-0.0f))));
+    }
+    for (int i = 0; i < n; ++i) {
+        for (int g = 0; g < ng; ++g) {
+            const int k = 8*(ng*i + g);
+            const __m256i Lv = _mm256_loadu_si256((const __m256i *)(Lt + k));
+            _mm256_storeu_si256((__m256i *)(Lt + k), _mm256_andnot_si256(_mm256_castps_si256(flat[g]), Lv));
+        }
+    }
+}
+
+// the scale searches for the nsb (8 or 16) sub-blocks of n values of a super-block
+static void make_qx_quants_sb(int nsb, int n, int nmax, const float * restrict x, int8_t * restrict L, float * restrict scales, bool q3) {
+    float   xt[QK_K];
+    int32_t Lt[QK_K];
+    for (int j = 0; j < nsb; ++j) {
+        for (int i = 0; i < n; ++i) xt[nsb*i + j] = x[n*j + i];
+    }
+    if (nsb == 16) {
+        make_qx_quants_x8(2, n, nmax, xt, Lt, scales, q3);
+    } else {
+        make_qx_quants_x8(1, n, nmax, xt, Lt, scales, q3);
+    }
+    for (int j = 0; j < nsb; ++j) {
+        for (int i = 0; i < n; ++i) L[n*j + i] = Lt[nsb*i + j];
+    }
+}
+
+static void make_qkx1_quants_sb(int nsb, int n, int nmax, const float * restrict x, uint8_t * restrict L,
+        float * restrict scales, float * restrict the_mins, int ntry) {
+    float   xt[QK_K];
+    int32_t Lt[QK_K];
+    for (int j = 0; j < nsb; ++j) {
+        for (int i = 0; i < n; ++i) {
+            xt[nsb*i + j] = x[n*j + i];
+            Lt[nsb*i + j] = L[n*j + i];
+        }
+    }
+    if (nsb == 16) {
+        make_qkx1_quants_x8(2, n, nmax, xt, Lt, scales, the_mins, ntry);
+    } else {
+        make_qkx1_quants_x8(1, n, nmax, xt, Lt, scales, the_mins, ntry);
+    }
+    for (int j = 0; j < nsb; ++j) {
+        for (int i = 0; i < n; ++i) L[n*j + i] = Lt[nsb*i + j];
+    }
+}
+
+#else
+
+static void make_qx_quants_sb(int nsb, int n, int nmax, const float * restrict x, int8_t * restrict L, float * restrict scales, bool q3) {
+    for (int j = 0; j < nsb; ++j) {
+        scales[j] = q3 ? make_q3_quants(n, nmax, x + n*j, L + n*j, true) : make_qx_quants(n, nmax, x + n*j, L + n*j, 1);
+    }
+}
+
+static void make_qkx1_quants_sb(int nsb, int n, int nmax, const float * restrict x, uint8_t * restrict L,
+        float * restrict scales, float * restrict the_mins, int ntry) {
+    for (int j = 0; j < nsb; ++j) {
+        scales[j] = make_qkx1_quants(n, nmax, x + n*j, L + n*j, &the_mins[j], ntry);
+    }
+}
+
+#endif // __AVX2__
+
 static inline void get_scale_min_k4(int j, const uint8_t * restrict q, uint8_t * restrict d, uint8_t * restrict m) {
     if (j < 4) {
         *d = q[j] & 63; *m = q[j + 4] & 63;
@@ -272,22 +806,39 @@ static inline void get_scale_min_k4(int j, const uint8_t * restrict q, uint8_t *
 
 //========================- 2-bit (de)-quantization
 
-void quantize_row_q2_K_reference(const float * restrict x, block_q2_K * restrict y, int k) {
+static void quantize_row_q2_K_impl(const float * restrict x, block_q2_K * restrict y, int k, const float * restrict qw, bool simd, int64_t * restrict hist) {
     assert(k % QK_K == 0);
     const int nb = k / QK_K;
 
-    uint8_t L[QK_K];
+    uint8_t L[QK_K] = {0}; // make_qkx1_quants compares with the previous quants, the first block with zeros
     float mins[QK_K/16];
     float scales[QK_K/16];
 
     const float q4scale = 15.f;
 
+    float weight[QK_K];
+
     for (int i = 0; i < nb; i++) {
 
+        if (qw) {
+            make_block_weights(x, qw + QK_K*i, weight);
+        }
+
+        if (qw) {
+            for (int j = 0; j < QK_K/16; ++j) {
+                scales[j] = make_qkx_quants_w(16, 3, x + 16*j, weight + 16*j, L + 16*j, &mins[j]);
+            }
+        } else if (simd) {
+            make_qkx1_quants_sb(QK_K/16, 16, 3, x, L, scales, mins, 5);
+        } else {
+            for (int j = 0; j < QK_K/16; ++j) {
+                scales[j] = make_qkx1_quants(16, 3, x + 16*j, L + 16*j, &mins[j], 5);
+            }
+        }
+
         float max_scale = 0; // as we are deducting the min, scales are always positive
         float max_min = 0;
         for (int j = 0; j < QK_K/16; ++j) {
-            scales[j] = make_qkx1_quants(16, 3, x + 16*j, L + 16*j, &mins[j], 5);
             float scale = scales[j];
             if (scale > max_scale) {
                 max_scale = scale;
@@ -336,11 +887,19 @@ void quantize_row_q2_K_reference(const float * restrict x, block_q2_K * restrict
             }
         }
 
+        if (hist) {
+            collect_hist_K(hist, L, 2);
+        }
+
         x += QK_K;
 
     }
 }
 
+void quantize_row_q2_K_reference(const float * restrict x, block_q2_K * restrict y, int k) {
+    quantize_row_q2_K_impl(x, y, k, NULL, false, NULL);
+}
+
 void dequantize_row_q2_K(const block_q2_K * restrict x, float * restrict y, int k) {
     assert(k % QK_K == 0);
     const int nb = k / QK_K;
@@ -375,37 +934,61 @@ void dequantize_row_q2_K(const block_q2_K * restrict x, float * restrict y, int
 }
 
 void quantize_row_q2_K(const float * restrict x, void * restrict vy, int k) {
-    quantize_row_q2_K_reference(x, vy, k);
+    quantize_row_q2_K_impl(x, vy, k, NULL, true, NULL);
 }
 
 size_t ggml_quantize_q2_K(const float * restrict src, void * restrict dst, int n, int k, int64_t * restrict hist) {
     const int nb = k / QK_K;
 
-    // TODO - collect histograms - although, at a second thought, I don't really care about them
-    (void)hist;
-
     for (int j = 0; j < nb; j += k) {
         block_q2_K * restrict y = (block_q2_K *)dst + j/QK_K;
-        quantize_row_q2_K_reference(src + j, y, k);
+        quantize_row_q2_K_impl(src + j, y, k, NULL, true, hist);
     }
     return (n/QK_K*sizeof(block_q2_K));
 }
 
+size_t ggml_quantize_q2_K_imatrix(const float * restrict src, void * restrict dst, int nrows, int n_per_row, int64_t * restrict hist, const float * restrict imatrix) {
+    assert(n_per_row % QK_K == 0);
+    const size_t row_size = n_per_row/QK_K*sizeof(block_q2_K);
+    for (int row = 0; row < nrows; ++row) {
+        block_q2_K * restrict y = (block_q2_K *)((char *)dst + row*row_size);
+        quantize_row_q2_K_impl(src + (size_t)row*n_per_row, y, n_per_row, imatrix, true, hist);
+    }
+    return nrows*row_size;
+}
+
 //========================= 3-bit (de)-quantization
 
-void quantize_row_q3_K_reference(const float * restrict x, block_q3_K * restrict y, int k) {
+static void quantize_row_q3_K_impl(const float * restrict x, block_q3_K * restrict y, int k, const float * restrict qw, bool simd, int64_t * restrict hist) {
     assert(k % QK_K == 0);
     const int nb = k / QK_K;
 
     int8_t L[QK_K];
     float scales[QK_K / 16];
 
+    float weight[QK_K];
+
     for (int i = 0; i < nb; i++) {
 
+        if (qw) {
+            make_block_weights(x, qw + QK_K*i, weight);
+        }
+
+        if (qw) {
+            for (int j = 0; j < QK_K/16; ++j) {
+                scales[j] = make_qx_quants_w(16, 4, x + 16*j, L + 16*j, weight + 16*j);
+            }
+        } else if (simd) {
+            make_qx_quants_sb(QK_K/16, 16, 4, x, L, scales, true);
+        } else {
+            for (int j = 0; j < QK_K/16; ++j) {
+                scales[j] = make_q3_quants(16, 4, x + 16*j, L + 16*j, true);
+            }
+        }
+
         float max_scale = 0;
         float amax = 0;
         for (int j = 0; j < QK_K/16; ++j) {
-            scales[j] = make_q3_quants(16, 4, x + 16*j, L + 16*j, true);
             float scale = fabsf(scales[j]);
             if (scale > amax) {
                 amax = scale; max_scale = scales[j];
@@ -465,10 +1048,18 @@ void quantize_row_q3_K_reference(const float * restrict x, block_q3_K * restrict
             }
         }
 
+        if (hist) {
+            collect_hist_K(hist, (const uint8_t *) L, 3);
+        }
+
         x += QK_K;
     }
 }
 
+void quantize_row_q3_K_reference(const float * restrict x, block_q3_K * restrict y, int k) {
+    quantize_row_q3_K_impl(x, y, k, NULL, false, NULL);
+}
+
 void dequantize_row_q3_K(const block_q3_K * restrict x, float * restrict y, int k) {
     assert(k % QK_K == 0);
     assert(QK_K == 256);
@@ -521,38 +1112,62 @@ void dequantize_row_q3_K(const block_q3_K * restrict x, float * restrict y, int
 }
 
 void quantize_row_q3_K(const float * restrict x, void * restrict vy, int k) {
-    quantize_row_q3_K_reference(x, vy, k);
+    quantize_row_q3_K_impl(x, vy, k, NULL, true, NULL);
 }
 
 size_t ggml_quantize_q3_K(const float * restrict src, void * restrict dst, int n, int k, int64_t * restrict hist) {
     const int nb = k / QK_K;
 
-    // TODO - collect histograms - although, at a second thought, I don't really care about them
-    (void)hist;
-
     for (int j = 0; j < nb; j += k) {
         block_q3_K * restrict y = (block_q3_K *)dst + j/QK_K;
-        quantize_row_q3_K_reference(src + j, y, k);
+        quantize_row_q3_K_impl(src + j, y, k, NULL, true, hist);
     }
     return (n/QK_K*sizeof(block_q3_K));
 }
 
+size_t ggml_quantize_q3_K_imatrix(const float * restrict src, void * restrict dst, int nrows, int n_per_row, int64_t * restrict hist, const float * restrict imatrix) {
+    assert(n_per_row % QK_K == 0);
+    const size_t row_size = n_per_row/QK_K*sizeof(block_q3_K);
+    for (int row = 0; row < nrows; ++row) {
+        block_q3_K * restrict y = (block_q3_K *)((char *)dst + row*row_size);
+        quantize_row_q3_K_impl(src + (size_t)row*n_per_row, y, n_per_row, imatrix, true, hist);
+    }
+    return nrows*row_size;
+}
+
 // ====================== 4-bit (de)-quantization
 
-void quantize_row_q4_K_reference(const float * restrict x, block_q4_K * restrict y, int k) {
+static void quantize_row_q4_K_impl(const float * restrict x, block_q4_K * restrict y, int k, const float * restrict qw, bool simd, int64_t * restrict hist) {
     assert(k % QK_K == 0);
     const int nb = k / QK_K;
 
-    uint8_t L[QK_K];
+    uint8_t L[QK_K] = {0}; // make_qkx1_quants compares with the previous quants, the first block with zeros
     float mins[QK_K/32];
     float scales[QK_K/32];
 
+    float weight[QK_K];
+
     for (int i = 0; i < nb; i++) {
 
+        if (qw) {
+            make_block_weights(x, qw + QK_K*i, weight);
+        }
+
+        if (qw) {
+            for (int j = 0; j < QK_K/32; ++j) {
+                scales[j] = make_qkx_quants_w(32, 15, x + 32*j, weight + 32*j, L + 32*j, &mins[j]);
+            }
+        } else if (simd) {
+            make_qkx1_quants_sb(QK_K/32, 32, 15, x, L, scales, mins, 5);
+        } else {
+            for (int j = 0; j < QK_K/32; ++j) {
+                scales[j] = make_qkx1_quants(32, 15, x + 32*j, L + 32*j, &mins[j], 5);
+            }
+        }
+
         float max_scale = 0; // as we are deducting the min, scales are always positive
         float max_min = 0;
         for (int j = 0; j < QK_K/32; ++j) {
-            scales[j] = make_qkx1_quants(32, 15, x + 32*j, L + 32*j, &mins[j], 5);
             float scale = scales[j];
             if (scale > max_scale) {
                 max_scale = scale;
@@ -599,11 +1214,19 @@ void quantize_row_q4_K_reference(const float * restrict x, block_q4_K * restrict
             for (int l = 0; l < 32; ++l) *q++ = L[j + l] | (L[j + l + 32] << 4);
         }
 
+        if (hist) {
+            collect_hist_K(hist, L, 4);
+        }
+
         x += QK_K;
 
     }
 }
 
+void quantize_row_q4_K_reference(const float * restrict x, block_q4_K * restrict y, int k) {
+    quantize_row_q4_K_impl(x, y, k, NULL, false, NULL);
+}
+
 void dequantize_row_q4_K(const block_q4_K * restrict x, float * restrict y, int k) {
     assert(k % QK_K == 0);
     const int nb = k / QK_K;
@@ -633,36 +1256,62 @@ void dequantize_row_q4_K(const block_q4_K * restrict x, float * restrict y, int
 void quantize_row_q4_K(const float * restrict x, void * restrict vy, int k) {
     assert(k % QK_K == 0);
     block_q4_K * restrict y = vy;
-    quantize_row_q4_K_reference(x, y, k);
+    quantize_row_q4_K_impl(x, y, k, NULL, true, NULL);
 }
 
 size_t ggml_quantize_q4_K(const float * restrict src, void * restrict dst, int n, int k, int64_t * restrict hist) {
     assert(k % QK_K == 0);
     const int nb = k / QK_K;
-    (void)hist; // TODO: collect histograms
     for (int j = 0; j < nb; j += k) {
         block_q4_K * restrict y = (block_q4_K *)dst + j/QK_K;
-        quantize_row_q4_K_reference(src + j, y, k);
+        quantize_row_q4_K_impl(src + j, y, k, NULL, true, hist);
     }
     return (n/QK_K*sizeof(block_q4_K));
 }
 
+size_t ggml_quantize_q4_K_imatrix(const float * restrict src, void * restrict dst, int nrows, int n_per_row, int64_t * restrict hist, const float * restrict imatrix) {
+    assert(n_per_row % QK_K == 0);
+    const size_t row_size = n_per_row/QK_K*sizeof(block_q4_K);
+    for (int row = 0; row < nrows; ++row) {
+        block_q4_K * restrict y = (block_q4_K *)((char *)dst + row*row_size);
+        quantize_row_q4_K_impl(src + (size_t)row*n_per_row, y, n_per_row, imatrix, true, hist);
+    }
+    return nrows*row_size;
+}
+
 // ====================== 5-bit (de)-quantization
 
-void quantize_row_q5_K_reference(const float * restrict x, block_q5_K * restrict y, int k) {
+static void quantize_row_q5_K_impl(const float * restrict x, block_q5_K * restrict y, int k, const float * restrict qw, bool simd, int64_t * restrict hist) {
     assert(k % QK_K == 0);
     const int nb = k / QK_K;
 
-    uint8_t L[QK_K];
+    uint8_t L[QK_K] = {0}; // make_qkx1_quants compares with the previous quants, the first block with zeros
     float mins[QK_K/32];
     float scales[QK_K/32];
 
+    float weight[QK_K];
+
     for (int i = 0; i < nb; i++) {
 
+        if (qw) {
+            make_block_weights(x, qw + QK_K*i, weight);
+        }
+
+        if (qw) {
+            for (int j = 0; j < QK_K/32; ++j) {
+                scales[j] = make_qkx_quants_w(32, 31, x + 32*j, weight + 32*j, L + 32*j, &mins[j]);
+            }
+        } else if (simd) {
+            make_qkx1_quants_sb(QK_K/32, 32, 31, x, L, scales, mins, 5);
+        } else {
+            for (int j = 0; j < QK_K/32; ++j) {
+                scales[j] = make_qkx1_quants(32, 31, x + 32*j, L + 32*j, &mins[j], 5);
+            }
+        }
+
         float max_scale = 0; // as we are deducting the min, scales are always positive
         float max_min = 0;
         for (int j = 0; j < QK_K/32; ++j) {
-            scales[j] = make_qkx1_quants(32, 31, x + 32*j, L + 32*j, &mins[j], 5);
             float scale = scales[j];
             if (scale > max_scale) {
                 max_scale = scale;
@@ -726,11 +1375,19 @@ void quantize_row_q5_K_reference(const float * restrict x, block_q5_K * restrict
             ql += 32;
         }
 
+        if (hist) {
+            collect_hist_K(hist, L, 5);
+        }
+
         x += QK_K;
 
     }
 }
 
+void quantize_row_q5_K_reference(const float * restrict x, block_q5_K * restrict y, int k) {
+    quantize_row_q5_K_impl(x, y, k, NULL, false, NULL);
+}
+
 void dequantize_row_q5_K(const block_q5_K * restrict x, float * restrict y, int k) {
     assert(k % QK_K == 0);
     const int nb = k / QK_K;
@@ -762,38 +1419,64 @@ void dequantize_row_q5_K(const block_q5_K * restrict x, float * restrict y, int
 void quantize_row_q5_K(const float * restrict x, void * restrict vy, int k) {
     assert(k % QK_K == 0);
     block_q5_K * restrict y = vy;
-    quantize_row_q5_K_reference(x, y, k);
+    quantize_row_q5_K_impl(x, y, k, NULL, true, NULL);
 }
 
 size_t ggml_quantize_q5_K(const float * restrict src, void * restrict dst, int n, int k, int64_t * restrict hist) {
     assert(k % QK_K == 0);
     const int nb = k / QK_K;
-    (void)hist;
     for (int j = 0; j < nb; j += k) {
         block_q5_K * restrict y = (block_q5_K *)dst + j/QK_K;
-        quantize_row_q5_K_reference(src + j, y, k);
+        quantize_row_q5_K_impl(src + j, y, k, NULL, true, hist);
     }
     return (n/QK_K*sizeof(block_q5_K));
 }
 
+size_t ggml_quantize_q5_K_imatrix(const float * restrict src, void * restrict dst, int nrows, int n_per_row, int64_t * restrict hist, const float * restrict imatrix) {
+    assert(n_per_row % QK_K == 0);
+    const size_t row_size = n_per_row/QK_K*sizeof(block_q5_K);
+    for (int row = 0; row < nrows; ++row) {
+        block_q5_K * restrict y = (block_q5_K *)((char *)dst + row*row_size);
+        quantize_row_q5_K_impl(src + (size_t)row*n_per_row, y, n_per_row, imatrix, true, hist);
+    }
+    return nrows*row_size;
+}
+
 // ====================== 6-bit (de)-quantization
 
-void quantize_row_q6_K_reference(const float * restrict x, block_q6_K * restrict y, int k) {
+static void quantize_row_q6_K_impl(const float * restrict x, block_q6_K * restrict y, int k, const float * restrict qw, bool simd, int64_t * restrict hist) {
     assert(k % QK_K == 0);
     const int nb = k / QK_K;
 
     int8_t L[QK_K];
     float   scales[QK_K/16];
 
+    float weight[QK_K];
+
     for (int i = 0; i < nb; i++) {
 
+        if (qw) {
+            make_block_weights(x, qw + QK_K*i, weight);
+        }
+
         float max_scale = 0;
         float max_abs_scale = 0;
 
+        if (qw) {
+            for (int ib = 0; ib < QK_K/16; ++ib) {
+                scales[ib] = make_qx_quants_w(16, 32, x + 16*ib, L + 16*ib, weight + 16*ib);
+            }
+        } else if (simd) {
+            make_qx_quants_sb(QK_K/16, 16, 32, x, L, scales, false);
+        } else {
+            for (int ib = 0; ib < QK_K/16; ++ib) {
+                scales[ib] = make_qx_quants(16, 32, x + 16*ib, L + 16*ib, 1);
+            }
+        }
+
         for (int ib = 0; ib < QK_K/16; ++ib) {
 
-            const float scale = make_qx_quants(16, 32, x + 16*ib, L + 16*ib, 1);
-            scales[ib] = scale;
+            const float scale = scales[ib];
 
             const float abs_scale = fabsf(scale);
             if (abs_scale > max_abs_scale) {
@@ -837,11 +1520,19 @@ void quantize_row_q6_K_reference(const float * restrict x, block_q6_K * restrict
             qh += 32;
         }
 
+        if (hist) {
+            collect_hist_K(hist, (const uint8_t *) L, 6);
+        }
+
         x += QK_K;
 
     }
 }
 
+void quantize_row_q6_K_reference(const float * restrict x, block_q6_K * restrict y, int k) {
+    quantize_row_q6_K_impl(x, y, k, NULL, false, NULL);
+}
+
 void dequantize_row_q6_K(const block_q6_K * restrict x, float * restrict y, int k) {
     assert(k % QK_K == 0);
     const int nb = k / QK_K;
@@ -878,22 +1569,30 @@ void dequantize_row_q6_K(const block_q6_K * restrict x, float * restrict y, int
 void quantize_row_q6_K(const float * restrict x, void * restrict vy, int k) {
     assert(k % QK_K == 0);
     block_q6_K * restrict y = vy;
-    quantize_row_q6_K_reference(x, y, k);
+    quantize_row_q6_K_impl(x, y, k, NULL, true, NULL);
 }
 
 size_t ggml_quantize_q6_K(const float * src, void * dst, int n, int k, int64_t * hist) {
     assert(k % QK_K == 0);
     const int nb = k / QK_K;
 
-    (void)hist; // TODO
-
     for (int j = 0; j < nb; j += k) {
         block_q6_K * restrict y = (block_q6_K *)dst + j/QK_K;
-        quantize_row_q6_K_reference(src + j, y, k);
+        quantize_row_q6_K_impl(src + j, y, k, NULL, true, hist);
     }
     return (n/QK_K*sizeof(block_q6_K));
 }
 
+size_t ggml_quantize_q6_K_imatrix(const float * restrict src, void * restrict dst, int nrows, int n_per_row, int64_t * restrict hist, const float * restrict imatrix) {
+    assert(n_per_row % QK_K == 0);
+    const size_t row_size = n_per_row/QK_K*sizeof(block_q6_K);
+    for (int row = 0; row < nrows; ++row) {
+        block_q6_K * restrict y = (block_q6_K *)((char *)dst + row*row_size);
+        quantize_row_q6_K_impl(src + (size_t)row*n_per_row, y, n_per_row, imatrix, true, hist);
+    }
+    return nrows*row_size;
+}
+
 //===================================== Q8_K ==============================================
 
 void quantize_row_q8_K_reference(const float * restrict x, block_q8_K * restrict y, int k) {
@@ -120,3 +120,11 @@ size_t ggml_quantize_q4_K(const float * src, void * dst, int n, int k, int64_t *
 size_t ggml_quantize_q5_K(const float * src, void * dst, int n, int k, int64_t * hist);
 size_t ggml_quantize_q6_K(const float * src, void * dst, int n, int k, int64_t * hist);
 
+// Quantization of whole rows weighted by an importance matrix (one value per column, n_per_row values)
+// NULL imatrix gives the same result as the functions above
+size_t ggml_quantize_q2_K_imatrix(const float * src, void * dst, int nrows, int n_per_row, int64_t * hist, const float * imatrix);
+size_t ggml_quantize_q3_K_imatrix(const float * src, void * dst, int nrows, int n_per_row, int64_t * hist, const float * imatrix);
+size_t ggml_quantize_q4_K_imatrix(const float * src, void * dst, int nrows, int n_per_row, int64_t * hist, const float * imatrix);
+size_t ggml_quantize_q5_K_imatrix(const float * src, void * dst, int nrows, int n_per_row, int64_t * hist, const float * imatrix);
+size_t ggml_quantize_q6_K_imatrix(const float * src, void * dst, int nrows, int n_per_row, int64_t * hist, const float * imatrix);
+
@@ -72,6 +72,11 @@ struct llama_file {
     FILE * fp;
     size_t size;
 
+    // pipes and sockets can only be read sequentially; for those the size is unknown (0)
+    // and the read position is tracked here instead of asking the OS
+    bool seekable = true;
+    mutable size_t pos = 0;
+
     llama_file(const char * fname, const char * mode) {
         fp = std::fopen(fname, mode);
         if (fp == NULL) {
@@ -82,7 +87,24 @@ struct llama_file {
         seek(0, SEEK_SET);
     }
 
+    // wrap an already open descriptor that is read as a stream (takes ownership of fd)
+    llama_file(int fd) {
+#ifdef _WIN32
+        fp = _fdopen(fd, "rb");
+#else
+        fp = fdopen(fd, "rb");
+#endif
+        if (fp == NULL) {
+            throw std::runtime_error(format("failed to open fd %d: %s", fd, strerror(errno)));
+        }
+        size = 0;
+        seekable = false;
+    }
+
     size_t tell() const {
+        if (!seekable) {
+            return pos;
+        }
 #ifdef _WIN32
         __int64 ret = _ftelli64(fp);
 #else
@@ -93,6 +115,12 @@ struct llama_file {
     }
 
     void seek(size_t offset, int whence) {
+        if (!seekable) {
+            // only forward skips are possible on a stream
+            LLAMA_ASSERT(whence == SEEK_CUR);
+            skip(offset);
+            return;
+        }
 #ifdef _WIN32
         int ret = _fseeki64(fp, (__int64) offset, whence);
 #else
@@ -113,6 +141,29 @@ struct llama_file {
         if (ret != 1) {
             throw std::runtime_error(std::string("unexpectedly reached end of file"));
         }
+        pos += len;
+    }
+
+    void skip(size_t len) const {
+        char buf[4096];
+        while (len > 0) {
+            const size_t n = std::min(len, sizeof(buf));
+            read_raw(buf, n);
+            len -= n;
+        }
+    }
+
+    // true if there is nothing left to read; blocks on a stream until data or EOF arrives
+    bool eof() const {
+        if (seekable) {
+            return tell() >= size;
+        }
+        const int c = std::getc(fp);
+        if (c == EOF) {
+            return true;
+        }
+        std::ungetc(c, fp);
+        return false;
     }
 
     std::uint32_t read_u32() {
@@ -196,6 +247,24 @@ struct llama_mmap {
     ~llama_mmap() {
         munmap(addr, size);
     }
+
+    // bytes of the mapping that are in RAM, all of them if it cannot be queried
+    size_t resident() const {
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+#ifdef __APPLE__
+        std::vector<char> pages((size + page_size - 1) / page_size);
+#else
+        std::vector<unsigned char> pages((size + page_size - 1) / page_size);
+#endif
+        if (mincore(addr, size, pages.data())) {
+            return size;
+        }
+        size_t n_resident = 0;
+        for (auto page : pages) {
+            n_resident += page & 1;
+        }
+        return std::min(n_resident * page_size, size);
+    }
 #elif defined(_WIN32)
     static constexpr bool SUPPORTED = true;
 
@@ -241,6 +310,11 @@ struct llama_mmap {
                     llama_format_win_err(GetLastError()).c_str());
         }
     }
+
+    // not queried, the whole mapping is counted
+    size_t resident() const {
+        return size;
+    }
 #else
     static constexpr bool SUPPORTED = false;
 
@@ -248,6 +322,10 @@ struct llama_mmap {
         (void)prefetch;
         throw std::runtime_error(std::string("mmap not supported"));
     }
+
+    size_t resident() const {
+        return 0;
+    }
 #endif
 };
 
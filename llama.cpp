@@ -35,11 +35,15 @@
 #include <queue>
 #include <cassert>
 #include <cstring>
+#include <cstdlib>
 #include <climits>
 #include <memory>
 #include <algorithm>
 #include <initializer_list>
 #include <thread>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <atomic>
 #include <mutex>
 #include <sstream>
@@ -193,6 +197,86 @@ struct llama_vocab {
 
     std::unordered_map<token, id> token_to_id;
     std::vector<token_score> id_to_token;
+
+    // byte trie over the token texts, used by the tokenizer to look up substrings without allocating
+    // the children of a node are stored contiguously, sorted by their byte; node 0 is the root
+    struct trie_node {
+        int32_t child;   // index of the first child
+        int32_t n_child;
+        id      tok;     // token whose text ends at this node, -1 if none
+        float   score;   // score of tok
+    };
+
+    std::vector<trie_node> trie;
+    std::vector<uint8_t>   trie_byte; // the byte leading to each node
+
+    // byte_pairs[a*256 + b] is set if some token text contains the bytes a, b next to each other
+    std::vector<bool> byte_pairs;
+
+    void build_trie() {
+        std::vector<id> order(id_to_token.size());
+        std::iota(order.begin(), order.end(), 0);
+        // ties are broken by id, so that the last duplicate wins like in token_to_id
+        std::sort(order.begin(), order.end(), [this](id a, id b) {
+            const int cmp = id_to_token[a].tok.compare(id_to_token[b].tok);
+            return cmp < 0 || (cmp == 0 && a < b);
+        });
+
+        struct pending {
+            int32_t node;
+            size_t  lo, hi; // range of order sharing the prefix of the node
+            size_t  depth;
+        };
+
+        trie.assign(1, { 0, 0, -1, 0.0f });
+        trie_byte.assign(1, 0);
+
+        byte_pairs.assign(256*256, false);
+        for (const auto & ts : id_to_token) {
+            for (size_t i = 1; i < ts.tok.size(); ++i) {
+                byte_pairs[(uint8_t) ts.tok[i - 1]*256 + (uint8_t) ts.tok[i]] = true;
+            }
+        }
+
+        std::deque<pending> queue;
+        queue.push_back({ 0, 0, order.size(), 0 });
+        while (!queue.empty()) {
+            const pending p = queue.front();
+            queue.pop_front();
+
+            size_t i = p.lo;
+            for (; i < p.hi && id_to_token[order[i]].tok.size() == p.depth; ++i) {
+                trie[p.node].tok   = order[i];
+                trie[p.node].score = id_to_token[order[i]].score;
+            }
+
+            trie[p.node].child = (int32_t) trie.size();
+            while (i < p.hi) {
+                const uint8_t c = id_to_token[order[i]].tok[p.depth];
+                size_t j = i + 1;
+                while (j < p.hi && (uint8_t) id_to_token[order[j]].tok[p.depth] == c) {
+                    ++j;
+                }
+                queue.push_back({ (int32_t) trie.size(), i, j, p.depth + 1 });
+                trie.push_back({ 0, 0, -1, 0.0f });
+                trie_byte.push_back(c);
+                trie[p.node].n_child++;
+                i = j;
+            }
+        }
+    }
+
+    // follows the n bytes of text starting at node, returns the reached node or -1
+    int32_t trie_walk(int32_t node, const char * text, size_t n) const {
+        for (size_t i = 0; i < n && node >= 0; ++i) {
+            const uint8_t   c     = (uint8_t) text[i];
+            const uint8_t * first = trie_byte.data() + trie[node].child;
+            const uint8_t * last  = first + trie[node].n_child;
+            const uint8_t * it    = std::lower_bound(first, last, c);
+            node = (it != last && *it == c) ? (int32_t) (it - trie_byte.data()) : -1;
+        }
+        return node;
+    }
 };
 
 struct llama_model {
@@ -217,6 +301,9 @@ struct llama_model {
     // model memory mapped file
     std::unique_ptr<llama_mmap> mapping;
 
+    // tensor data of a model that was streamed in, one buffer per tensor
+    std::vector<std::unique_ptr<llama_buffer>> stream_bufs;
+
     // objects representing data potentially being locked in memory
     llama_mlock mlock_buf;
     llama_mlock mlock_mmap;
@@ -247,6 +334,12 @@ struct llama_model {
     }
 };
 
+// sum of the squared activations that entered a weight matrix, per column
+struct llama_imatrix_stats {
+    std::vector<double> sum_sq;
+    int64_t n_rows = 0;
+};
+
 struct llama_context {
     llama_context(const llama_model & model, const llama_vocab & vocab) : model(model), vocab(vocab), t_load_us(model.t_load_us), t_start_us(model.t_start_us) {}
 
@@ -262,6 +355,17 @@ struct llama_context {
     int32_t n_eval   = 0; // number of eval calls
     int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
 
+    // per-op timings of the graph computations, null while profiling is off (see llama_set_profiling)
+    std::unique_ptr<ggml_profile> profile;
+
+    // timeline of the graph computations, owned by the caller (see llama_set_trace)
+    ggml_trace * trace = nullptr;
+
+    // the eval started by llama_eval_begin, with a copy of its tokens
+    std::thread              eval_thread;
+    std::vector<llama_token> eval_tokens;
+    int                      eval_result = 0;
+
     const llama_model & model;
     const llama_vocab & vocab;
 
@@ -281,6 +385,24 @@ struct llama_context {
 
     // input embedding (1-dimensional array: [n_embd])
     std::vector<float> embedding;
+    enum llama_pooling_type pooling_type = LLAMA_POOLING_LAST;
+    bool embd_norm = false;
+
+    // tokens [embd_pool_begin, embd_pool_end) are pooled into the embedding,
+    // embd_pool holds their sum (mean pooling) or the first of them (cls pooling)
+    std::vector<float> embd_pool;
+    int embd_pool_begin = 0;
+    int embd_pool_end   = 0;
+
+    // stops llama_eval between graph nodes when it returns true (see llama_set_abort_callback)
+    llama_abort_callback abort_callback = nullptr;
+    void * abort_callback_user_data = nullptr;
+    bool eval_aborted = false;
+
+    // importance matrix collection (see llama_set_imatrix_collection)
+    bool collect_imatrix = false;
+    std::unordered_map<const ggml_tensor *, std::string> imatrix_weights; // weight tensor -> name
+    std::map<std::string, llama_imatrix_stats> imatrix;
 
     // memory buffers used to evaluate the model
     // TODO: move in llama_state
@@ -294,6 +416,10 @@ struct llama_context {
     int    buf_last = 0;
     size_t buf_max_size[LLAMA_MAX_SCRATCH_BUFFERS] = { 0 };
 
+    // the most that the evals used of buf_compute, and of the work buffer of the graph in it
+    size_t mem_compute_peak = 0;
+    size_t mem_work_peak    = 0;
+
     void use_buf(struct ggml_context * ctx, int i) {
 #if defined(LLAMA_USE_SCRATCH)
         size_t last_size = 0;
@@ -389,6 +515,9 @@ struct llama_load_tensor {
     struct ggml_tensor * ggml_tensor = NULL;
     uint8_t * data;
 
+    // owns the data of tensors read from a stream
+    std::unique_ptr<llama_buffer> stream_buf;
+
     llama_load_tensor(const std::string & name) : name(name) {}
 
     void calc_all() {
@@ -480,6 +609,14 @@ struct llama_file_loader {
         read_vocab();
         read_tensor_metadata(file_idx, tensors_map);
     }
+    // streaming: only the header is read here, the tensors follow via read_tensor_header()
+    llama_file_loader(int fd)
+        : file(fd) {
+        fprintf(stderr, "llama.cpp: streaming model from fd %d\n", fd);
+        read_magic();
+        read_hparams();
+        read_vocab();
+    }
     void read_magic() {
         uint32_t magic = file.read_u32();
 
@@ -534,46 +671,53 @@ struct llama_file_loader {
             tok_score.tok = std::move(word);
             tok_score.score = score;
         }
+
+        vocab.build_trie();
+    }
+    // reads the header of the next tensor and leaves the file positioned at its data
+    std::string read_tensor_header(size_t file_idx, llama_load_tensor_shard & shard) {
+        uint32_t n_dims = file.read_u32();
+        uint32_t name_len = file.read_u32();
+        shard.type = (enum ggml_type) file.read_u32();
+        shard.ne.resize(n_dims);
+        file.read_raw(shard.ne.data(), sizeof(shard.ne[0]) * n_dims);
+        std::string name = file.read_string(name_len);
+        if (n_dims < 1 || n_dims > 2) {
+            throw std::runtime_error(format("llama.cpp: tensor '%s' should not be %u-dimensional", name.c_str(), n_dims));
+        }
+        switch (shard.type) {
+            case GGML_TYPE_F32:
+            case GGML_TYPE_F16:
+            case GGML_TYPE_Q4_0:
+            case GGML_TYPE_Q4_1:
+            case GGML_TYPE_Q5_0:
+            case GGML_TYPE_Q5_1:
+            case GGML_TYPE_Q8_0:
+            case GGML_TYPE_Q2_K:
+            case GGML_TYPE_Q3_K:
+            case GGML_TYPE_Q4_K:
+            case GGML_TYPE_Q5_K:
+            case GGML_TYPE_Q6_K:
+                break;
+            default: {
+                throw std::runtime_error(format("unrecognized tensor type %u\n", shard.type));
+            }
+        }
+
+        if (file_version >= LLAMA_FILE_VERSION_GGJT_V1) {
+            // skip to the next multiple of 32 bytes
+            file.seek(-static_cast<ptrdiff_t>(file.tell()) & 31, SEEK_CUR);
+        }
+        shard.file_idx = file_idx;
+        shard.file_off = file.tell();
+
+        shard.calc_size();
+        return name;
     }
     void read_tensor_metadata(size_t file_idx, llama_load_tensors_map & tensors_map) {
         while (file.tell() < file.size) {
             llama_load_tensor_shard shard;
-            uint32_t n_dims = file.read_u32();
-            uint32_t name_len = file.read_u32();
-            shard.type = (enum ggml_type) file.read_u32();
-            shard.ne.resize(n_dims);
-            file.read_raw(shard.ne.data(), sizeof(shard.ne[0]) * n_dims);
-            std::string name = file.read_string(name_len);
-            if (n_dims < 1 || n_dims > 2) {
-                throw std::runtime_error(format("llama.cpp: tensor '%s' should not be %u-dimensional", name.c_str(), n_dims));
-            }
-            switch (shard.type) {
-                case GGML_TYPE_F32:
-                case GGML_TYPE_F16:
-                case GGML_TYPE_Q4_0:
-                case GGML_TYPE_Q4_1:
-                case GGML_TYPE_Q5_0:
-                case GGML_TYPE_Q5_1:
-                case GGML_TYPE_Q8_0:
-                case GGML_TYPE_Q2_K:
-                case GGML_TYPE_Q3_K:
-                case GGML_TYPE_Q4_K:
-                case GGML_TYPE_Q5_K:
-                case GGML_TYPE_Q6_K:
-                    break;
-                default: {
-                    throw std::runtime_error(format("unrecognized tensor type %u\n", shard.type));
-                }
-            }
-
-            if (file_version >= LLAMA_FILE_VERSION_GGJT_V1) {
-                // skip to the next multiple of 32 bytes
-                file.seek(-static_cast<ptrdiff_t>(file.tell()) & 31, SEEK_CUR);
-            }
-            shard.file_idx = file_idx;
-            shard.file_off = file.tell();
-
-            shard.calc_size();
+            std::string name = read_tensor_header(file_idx, shard);
             file.seek(shard.size, SEEK_CUR);
 
             auto it = tensors_map.name_to_idx.find(name);
@@ -658,6 +802,7 @@ struct llama_model_loader {
     std::vector<std::unique_ptr<llama_file_loader>> file_loaders;
     llama_load_tensors_map tensors_map;
     bool use_mmap;
+    bool stream = false; // tensors are read sequentially from a pipe or socket, see load_stream_data()
     size_t num_ggml_tensors_created = 0;
     struct ggml_context * ggml_ctx = NULL;
     std::unique_ptr<llama_mmap> mapping;
@@ -687,6 +832,12 @@ struct llama_model_loader {
         }
     }
 
+    llama_model_loader(int fd) {
+        file_loaders.emplace_back(new llama_file_loader(fd));
+        use_mmap = false;
+        stream = true;
+    }
+
     bool alignment_prevents_mmap() {
         for (const llama_load_tensor & lt : tensors_map.tensors) {
             for (const llama_load_tensor_shard & shard : lt.shards) {
@@ -711,6 +862,10 @@ struct llama_model_loader {
         *ctx_size_p = *mmapped_size_p = 0;
         for (const llama_load_tensor & lt : tensors_map.tensors) {
             *ctx_size_p += sizeof(struct ggml_tensor) + GGML_OBJECT_SIZE;
+            if (stream) {
+                // the data stays in the buffer it was streamed into
+                continue;
+            }
             *(use_mmap ? mmapped_size_p : ctx_size_p) += lt.size;
         }
     }
@@ -743,8 +898,12 @@ struct llama_model_loader {
         ggml_set_name(tensor, lt.name.c_str());
         LLAMA_ASSERT(lt.ggml_tensor == NULL); // if this fails, we called get_tensor twice on the same tensor
 
+        if (stream) {
+            // already read by load_stream_data()
+            tensor->data = lt.stream_buf->addr;
+        }
         if (backend != GGML_BACKEND_CPU) {
-            ggml_set_no_alloc(ggml_ctx, use_mmap);
+            ggml_set_no_alloc(ggml_ctx, use_mmap || stream);
         }
         tensor->backend = backend;
         lt.ggml_tensor = tensor;
@@ -758,6 +917,51 @@ struct llama_model_loader {
         }
     }
 
+    // read all tensors in file order, each one into its own buffer as soon as it arrives
+    // this lets a download from a pipe or socket overlap with the model load
+    // the ggml tensors are created afterwards by get_tensor(), once the tensor list is known
+    // the size of a stream is unknown, so the progress is the share of the weights of the LLaMA layout that have been read
+    void load_stream_data(llama_progress_callback progress_callback, void * progress_callback_user_data) {
+        LLAMA_ASSERT(stream);
+        llama_file_loader & fl = *file_loaders.at(0);
+
+        const llama_hparams & hparams = fl.hparams;
+        const double n_embd = hparams.n_embd;
+        const double n_ff   = ((2*(4*hparams.n_embd)/3 + hparams.n_mult - 1)/hparams.n_mult)*hparams.n_mult;
+        const double n_weights_expected = 2*hparams.n_vocab*n_embd + n_embd +
+                                          hparams.n_layer*(4*n_embd*n_embd + 3*n_embd*n_ff + 2*n_embd);
+
+        double n_weights_done = 0;
+        while (!fl.file.eof()) {
+            if (progress_callback) {
+                progress_callback((float) std::min(n_weights_done/n_weights_expected, 0.99), progress_callback_user_data);
+            }
+
+            llama_load_tensor_shard shard;
+            std::string name = fl.read_tensor_header(0, shard);
+
+            if (tensors_map.name_to_idx.find(name) != tensors_map.name_to_idx.end()) {
+                throw std::runtime_error(format("llama.cpp: tensor '%s' appears twice in the stream", name.c_str()));
+            }
+            tensors_map.tensors.emplace_back(name);
+            tensors_map.name_to_idx.emplace(name, tensors_map.tensors.size() - 1);
+
+            llama_load_tensor & lt = tensors_map.tensors.back();
+            lt.shards.push_back(shard);
+            lt.calc_all();
+
+            lt.stream_buf.reset(new llama_buffer);
+            lt.stream_buf->resize(lt.size);
+            fl.file.read_raw(lt.stream_buf->addr, lt.size);
+
+            double n_weights = 1;
+            for (uint32_t ne : lt.ne) {
+                n_weights *= ne;
+            }
+            n_weights_done += n_weights;
+        }
+    }
+
     void load_all_data(llama_progress_callback progress_callback, void *  progress_callback_user_data, llama_mlock * lmlock) {
         size_t data_size = 0;
         size_t prefetch_size = 0;
@@ -778,14 +982,15 @@ struct llama_model_loader {
 
         size_t done_size = 0;
         for (llama_load_tensor & lt : tensors_map.tensors) {
-            if (progress_callback) {
+            // a stream has reported its progress while it was read by load_stream_data()
+            if (progress_callback && !stream) {
                 progress_callback((float) done_size / data_size, progress_callback_user_data);
             }
             LLAMA_ASSERT(lt.ggml_tensor); // unused tensors should have been caught by load_data already
             lt.data = (uint8_t *) lt.ggml_tensor->data;
 
             // allocate temp buffer if not using mmap
-            if (!use_mmap && lt.data == NULL) {
+            if (!use_mmap && !stream && lt.data == NULL) {
                 GGML_ASSERT(lt.ggml_tensor->backend != GGML_BACKEND_CPU);
                 lt.data = (uint8_t*)malloc(ggml_nbytes(lt.ggml_tensor));
             }
@@ -804,14 +1009,18 @@ struct llama_model_loader {
                 case GGML_BACKEND_GPU:
                 case GGML_BACKEND_GPU_SPLIT:
                     ggml_cuda_transform_tensor(lt.data, lt.ggml_tensor);
-                    if (!use_mmap) {
+                    if (stream) {
+                        lt.stream_buf.reset();
+                    } else if (!use_mmap) {
                         free(lt.data);
                     }
                     break;
 #elif defined(GGML_USE_CLBLAST)
                 case GGML_BACKEND_GPU:
                     ggml_cl_transform_tensor(lt.data, lt.ggml_tensor);
-                    if (!use_mmap) {
+                    if (stream) {
+                        lt.stream_buf.reset();
+                    } else if (!use_mmap) {
                         free(lt.data);
                     }
                     break;
@@ -825,7 +1034,10 @@ struct llama_model_loader {
     }
 
     void load_data_for(llama_load_tensor & lt) {
-        if (use_mmap) {
+        if (stream) {
+            // already read by load_stream_data()
+            LLAMA_ASSERT(lt.data);
+        } else if (use_mmap) {
             LLAMA_ASSERT(lt.shards.size() == 1);
             lt.data = (uint8_t *) mapping->addr + lt.shards.at(0).file_off;
         } else if (lt.split_type == SPLIT_NONE) {
@@ -940,8 +1152,11 @@ struct llama_context_params llama_context_default_params() {
         /*.gpu_layers                  =*/ 0,
         /*.main_gpu                    =*/ 0,
         /*.tensor_split                =*/ {0},
+        /*.pooling_type                =*/ LLAMA_POOLING_LAST,
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
+        /*.abort_callback              =*/ nullptr,
+        /*.abort_callback_user_data    =*/ nullptr,
         /*.low_vram                    =*/ false,
         /*.f16_kv                      =*/ true,
         /*.logits_all                  =*/ false,
@@ -949,6 +1164,7 @@ struct llama_context_params llama_context_default_params() {
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.embedding                   =*/ false,
+        /*.embd_norm                   =*/ false,
     };
 
     return result;
@@ -960,6 +1176,7 @@ struct llama_model_quantize_params llama_model_quantize_default_params() {
         /*.ftype                       =*/ LLAMA_FTYPE_MOSTLY_Q5_1,
         /*.allow_requantize            =*/ false,
         /*.quantize_output_tensor      =*/ true,
+        /*.imatrix                     =*/ nullptr,
     };
 
     return result;
@@ -1042,6 +1259,7 @@ static const char *llama_model_type_name(e_model type) {
 
 static void llama_model_load_internal(
         const std::string & fname,
+        int fd,
         llama_model & model,
         llama_vocab & vocab,
         int n_ctx,
@@ -1059,7 +1277,8 @@ static void llama_model_load_internal(
 
     model.t_start_us = ggml_time_us();
 
-    std::unique_ptr<llama_model_loader> ml(new llama_model_loader(fname, use_mmap, vocab_only));
+    // a valid fd means the model is streamed from it and fname is only informational
+    std::unique_ptr<llama_model_loader> ml(fd >= 0 ? new llama_model_loader(fd) : new llama_model_loader(fname, use_mmap, vocab_only));
 
     vocab = std::move(ml->file_loaders.at(0)->vocab);
     model.hparams = ml->file_loaders.at(0)->hparams;
@@ -1118,10 +1337,20 @@ static void llama_model_load_internal(
         }
     }
 
+    // a streamed model stops here as well, before any tensor data is read from the descriptor
     if (vocab_only) {
         return;
     }
 
+    if (ml->stream) {
+        if (use_mlock) {
+            fprintf(stderr, "%s: warning: mlock is not supported for streamed models\n", __func__);
+        }
+
+        // the tensor list of a stream is only known once all of it has been read
+        ml->load_stream_data(progress_callback, progress_callback_user_data);
+    }
+
     auto & ctx = model.ctx;
 
     size_t ctx_size;
@@ -1140,7 +1369,7 @@ static void llama_model_load_internal(
         struct ggml_init_params params = {
             /*.mem_size   =*/ model.buf.size,
             /*.mem_buffer =*/ model.buf.addr,
-            /*.no_alloc   =*/ ml->use_mmap,
+            /*.no_alloc   =*/ ml->use_mmap || ml->stream,
         };
 
         model.ctx = ggml_init(params);
@@ -1328,6 +1557,12 @@ static void llama_model_load_internal(
 
     model.mapping = std::move(ml->mapping);
 
+    for (llama_load_tensor & lt : ml->tensors_map.tensors) {
+        if (lt.stream_buf) {
+            model.stream_bufs.push_back(std::move(lt.stream_buf));
+        }
+    }
+
     // loading time will be recalculate after the first eval, so
     // we take page faults deferred by mmap() into consideration
     model.t_load_us = ggml_time_us() - model.t_start_us;
@@ -1335,6 +1570,7 @@ static void llama_model_load_internal(
 
 static bool llama_model_load(
         const std::string & fname,
+        int fd,
         llama_model & model,
         llama_vocab & vocab,
         int n_ctx,
@@ -1350,7 +1586,7 @@ static bool llama_model_load(
         llama_progress_callback progress_callback,
         void *progress_callback_user_data) {
     try {
-        llama_model_load_internal(fname, model, vocab, n_ctx, n_batch, n_gpu_layers, main_gpu, tensor_split, low_vram, memory_type,
+        llama_model_load_internal(fname, fd, model, vocab, n_ctx, n_batch, n_gpu_layers, main_gpu, tensor_split, low_vram, memory_type,
                                   use_mmap, use_mlock, vocab_only, progress_callback, progress_callback_user_data);
         return true;
     } catch (const std::exception & err) {
@@ -1359,6 +1595,79 @@ static bool llama_model_load(
     }
 }
 
+// graph eval callback used while collecting the importance matrix
+static void llama_imatrix_collect(struct ggml_tensor * node, void * user_data) {
+    llama_context & lctx = *(llama_context *) user_data;
+
+    if (node->op != GGML_OP_MUL_MAT) {
+        return;
+    }
+
+    const auto it = lctx.imatrix_weights.find(node->src0);
+    if (it == lctx.imatrix_weights.end()) {
+        return;
+    }
+
+    const ggml_tensor * x = node->src1;
+    if (x->type != GGML_TYPE_F32 || x->backend != GGML_BACKEND_CPU || x->data == nullptr) {
+        return;
+    }
+
+    llama_imatrix_stats & stats = lctx.imatrix[it->second];
+    if (stats.sum_sq.empty()) {
+        stats.sum_sq.resize(x->ne[0], 0.0);
+    }
+    LLAMA_ASSERT(stats.sum_sq.size() == (size_t) x->ne[0]);
+
+    for (int64_t i3 = 0; i3 < x->ne[3]; ++i3) {
+        for (int64_t i2 = 0; i2 < x->ne[2]; ++i2) {
+            for (int64_t i1 = 0; i1 < x->ne[1]; ++i1) {
+                const char * row = (const char *) x->data + i1*x->nb[1] + i2*x->nb[2] + i3*x->nb[3];
+                for (int64_t i0 = 0; i0 < x->ne[0]; ++i0) {
+                    const float v = *(const float *) (row + i0*x->nb[0]);
+                    stats.sum_sq[i0] += v*v;
+                }
+                stats.n_rows++;
+            }
+        }
+    }
+}
+
+static void llama_embd_normalize(float * embd, int n_embd) {
+    double sum = 0.0;
+    for (int i = 0; i < n_embd; i++) {
+        sum += (double) embd[i]*embd[i];
+    }
+    const float scale = sum > 0.0 ? (float) (1.0/sqrt(sum)) : 0.0f;
+    for (int i = 0; i < n_embd; i++) {
+        embd[i] *= scale;
+    }
+}
+
+// pools the final hidden states of the n_tokens tokens of one sequence into out
+static void llama_embd_pool(enum llama_pooling_type type, const float * hidden, int n_tokens, int n_embd, float * out) {
+    switch (type) {
+        case LLAMA_POOLING_MEAN:
+            std::fill(out, out + n_embd, 0.0f);
+            for (int i = 0; i < n_tokens; i++) {
+                for (int j = 0; j < n_embd; j++) {
+                    out[j] += hidden[i*n_embd + j];
+                }
+            }
+            for (int j = 0; j < n_embd; j++) {
+                out[j] /= n_tokens;
+            }
+            break;
+        case LLAMA_POOLING_CLS:
+            memcpy(out, hidden, sizeof(float)*n_embd);
+            break;
+        case LLAMA_POOLING_LAST:
+        default:
+            memcpy(out, hidden + n_embd*(n_tokens - 1), sizeof(float)*n_embd);
+            break;
+    }
+}
+
 // evaluate the transformer
 //
 //   - lctx:         llama context
@@ -1373,7 +1682,10 @@ static bool llama_eval_internal(
             const int    n_tokens,
             const int    n_past,
             const int    n_threads,
-            const char * cgraph_fname) {
+            const char * cgraph_fname,
+        const int32_t *  seq_lens = nullptr,
+            const int    n_seqs   = 0,
+                float *  embd_seq = nullptr) {
 
     // enforce that the first token is BOS
     if (n_past == 0 && tokens[0] != llama_token_bos()) {
@@ -1416,10 +1728,44 @@ static bool llama_eval_internal(
     ggml_cgraph gf = {};
     gf.n_threads = N >= 32 && ggml_cpu_has_blas() && !ggml_cpu_has_gpublas() ? 1 : n_threads;
 
+    if (lctx.collect_imatrix) {
+        gf.eval_callback      = llama_imatrix_collect;
+        gf.eval_callback_data = &lctx;
+    }
+
+    gf.abort_callback      = lctx.abort_callback;
+    gf.abort_callback_data = lctx.abort_callback_user_data;
+    gf.profile             = lctx.profile.get();
+    gf.trace               = lctx.trace;
+    lctx.eval_aborted = false;
+
     struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
     ggml_set_name(embd, "embd");
     memcpy(embd->data, tokens, N*ggml_element_size(embd));
 
+    // with seq_lens the batch holds n_seqs independent sequences, one after the other
+    // each token only attends to the earlier tokens of its own sequence
+    // the RoPE positions run on across the sequences, which leaves the attention scores unchanged
+    struct ggml_tensor * KQ_mask = NULL;
+    if (seq_lens) {
+        LLAMA_ASSERT(n_past == 0);
+
+        KQ_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, N, N);
+        ggml_set_name(KQ_mask, "KQ_mask");
+
+        float * data = (float *) KQ_mask->data;
+        int seq_start = 0;
+        for (int s = 0; s < n_seqs; s++) {
+            for (int i = seq_start; i < seq_start + seq_lens[s]; i++) {
+                for (int j = 0; j < N; j++) {
+                    data[i*N + j] = j >= seq_start && j <= i ? 0.0f : -INFINITY;
+                }
+            }
+            seq_start += seq_lens[s];
+        }
+        LLAMA_ASSERT(seq_start == N);
+    }
+
     struct ggml_tensor * cur;
     struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.tok_embeddings, embd);
 
@@ -1549,7 +1895,10 @@ static bool llama_eval_internal(
             ggml_set_name(KQ_scaled, "KQ_scaled");
 
             // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
+            // the sequence mask is shared by all heads through a view with a zero head stride
+            struct ggml_tensor * KQ_masked = KQ_mask
+                ? ggml_add_inplace(ctx0, KQ_scaled, ggml_view_3d(ctx0, KQ_mask, N, N, n_head, KQ_mask->nb[1], 0, 0))
+                : ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
             offload_func_kq(KQ_masked);
             ggml_set_name(KQ_masked, "KQ_masked");
 
@@ -1678,9 +2027,11 @@ static bool llama_eval_internal(
     }
 
 
-    // lm_head
-    cur = ggml_mul_mat(ctx0, model.output, cur);
-    ggml_set_name(cur, "result_output");
+    // lm_head, not needed when only the embeddings of the sequences are returned
+    if (!embd_seq) {
+        cur = ggml_mul_mat(ctx0, model.output, cur);
+        ggml_set_name(cur, "result_output");
+    }
 
     lctx.use_buf(ctx0, -1);
 
@@ -1690,6 +2041,11 @@ static bool llama_eval_internal(
     // run the computation
     ggml_build_forward_expand(&gf, cur);
 
+    // the export needs all the nodes
+    if (!cgraph_fname) {
+        ggml_graph_optimize(&gf);
+    }
+
 #ifdef GGML_USE_METAL
     if (lctx.ctx_metal && N == 1) {
         ggml_metal_graph_compute(lctx.ctx_metal, &gf);
@@ -1711,12 +2067,17 @@ static bool llama_eval_internal(
             ggml_metal_get_tensor(lctx.ctx_metal, kv_self.v);
         }
 
-        ggml_graph_compute(ctx0, &gf);
+        lctx.eval_aborted = ggml_graph_compute(ctx0, &gf) == GGML_EXIT_ABORTED;
     }
 #else
-    ggml_graph_compute(ctx0, &gf);
+    lctx.eval_aborted = ggml_graph_compute(ctx0, &gf) == GGML_EXIT_ABORTED;
 #endif
 
+    if (lctx.eval_aborted) {
+        ggml_free(ctx0);
+        return false;
+    }
+
     if (cgraph_fname) {
         ggml_graph_export(&gf, cgraph_fname);
     }
@@ -1738,8 +2099,21 @@ static bool llama_eval_internal(
     // update kv token count
     lctx.kv_self.n = n_past + N;
 
+    // pool the embeddings of each sequence
+    if (embd_seq) {
+        int seq_start = 0;
+        for (int s = 0; s < n_seqs; s++) {
+            float * out = embd_seq + s*n_embd;
+            llama_embd_pool(lctx.pooling_type, (float *) ggml_get_data(embeddings) + n_embd*seq_start, seq_lens[s], n_embd, out);
+            if (lctx.embd_norm) {
+                llama_embd_normalize(out, n_embd);
+            }
+            seq_start += seq_lens[s];
+        }
+    }
+
     // extract logits
-    {
+    if (!embd_seq) {
         auto & logits_out = lctx.logits;
 
         if (lctx.logits_all) {
@@ -1753,17 +2127,60 @@ static bool llama_eval_internal(
     }
 
     // extract embeddings
-    if (!lctx.embedding.empty()) {
+    if (!embd_seq && !lctx.embedding.empty()) {
         auto & embedding_out = lctx.embedding;
+        auto & pool = lctx.embd_pool;
+        const float * hidden = (float *) ggml_get_data(embeddings);
 
         embedding_out.resize(n_embd);
-        memcpy(embedding_out.data(), (float *) ggml_get_data(embeddings) + (n_embd*(N - 1)), sizeof(float)*n_embd);
+
+        // the pooling goes on over the tokens of the previous calls only if this batch follows them
+        if (n_past == 0 || n_past != lctx.embd_pool_end) {
+            lctx.embd_pool_begin = n_past;
+            std::fill(pool.begin(), pool.end(), 0.0f);
+        }
+
+        switch (lctx.pooling_type) {
+            case LLAMA_POOLING_MEAN:
+                {
+                    const int n_pooled = n_past + N - lctx.embd_pool_begin;
+                    for (int i = 0; i < N; i++) {
+                        for (int j = 0; j < n_embd; j++) {
+                            pool[j] += hidden[i*n_embd + j];
+                        }
+                    }
+                    for (int j = 0; j < n_embd; j++) {
+                        embedding_out[j] = pool[j]/n_pooled;
+                    }
+                } break;
+            case LLAMA_POOLING_CLS:
+                {
+                    if (n_past == lctx.embd_pool_begin) {
+                        memcpy(pool.data(), hidden, sizeof(float)*n_embd);
+                    }
+                    memcpy(embedding_out.data(), pool.data(), sizeof(float)*n_embd);
+                } break;
+            case LLAMA_POOLING_LAST:
+            default:
+                memcpy(embedding_out.data(), hidden + (n_embd*(N - 1)), sizeof(float)*n_embd);
+                break;
+        }
+        lctx.embd_pool_end = n_past + N;
+
+        if (lctx.embd_norm) {
+            llama_embd_normalize(embedding_out.data(), n_embd);
+        }
     }
 
     if (mem_per_token == 0) {
         mem_per_token = ggml_used_mem(ctx0)/N;
     }
 
+    lctx.mem_compute_peak = std::max(lctx.mem_compute_peak, ggml_used_mem(ctx0));
+    if (gf.work) {
+        lctx.mem_work_peak = std::max(lctx.mem_work_peak, ggml_nbytes(gf.work));
+    }
+
 #if 0
     printf("\n%s: used_mem = %.3f MB, scratch -- %.3f MB %.3f MB\n", __func__,
             ggml_used_mem(ctx0)/1024.0/1024.0,
@@ -1802,6 +2219,7 @@ struct llama_sp_symbol {
     index next;
     const char * text;
     size_t n;
+    int32_t node; // trie node of the text, -1 if the text is not a prefix of any token
 };
 
 static_assert(std::is_trivially_copyable<llama_sp_symbol>::value, "llama_sp_symbol is not trivially copyable");
@@ -1818,31 +2236,75 @@ struct llama_sp_bigram {
     llama_sp_symbol::index right;
     float score;
     size_t size;
+    int32_t node;
 };
 
 // original implementation:
 // https://github.com/ggerganov/llama.cpp/commit/074bea2eb1f1349a0118239c4152914aecaa1be4
+// the tokenizer keeps its buffers between calls, so it can be reused for several texts
 struct llama_tokenizer {
     llama_tokenizer(const llama_vocab & vocab): vocab_(vocab) {}
 
     void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
+        tokenize(text.c_str(), text.size(), output);
+    }
+
+    void tokenize(const char * text, size_t size, std::vector<llama_vocab::id> & output) {
+        symbols_.clear();
+        if (size == 0) {
+            return;
+        }
+
         // split string into utf8 chars
         int index = 0;
         size_t offs = 0;
-        while (offs < text.size()) {
+        while (offs < size) {
             llama_sp_symbol sym;
-            size_t char_len = std::min(text.size() - offs, utf8_len(text[offs]));
-            sym.text = text.c_str() + offs;
+            size_t char_len = std::min(size - offs, utf8_len(text[offs]));
+            sym.text = text + offs;
             sym.n = char_len;
+            sym.node = vocab_.trie_walk(0, sym.text, sym.n);
             offs += char_len;
             sym.prev = index - 1;
-            sym.next = offs == text.size() ? -1 : index + 1;
+            sym.next = offs == size ? -1 : index + 1;
             index++;
             symbols_.emplace_back(sym);
         }
 
+        // no token can span two chars whose boundary bytes never appear next to each other in the vocab,
+        // so the text is merged one segment between such boundaries at a time, which keeps the queue small
+        for (size_t seg_start = 0; seg_start < symbols_.size(); ) {
+            size_t seg_end = seg_start + 1;
+            for (; seg_end < symbols_.size(); ++seg_end) {
+                const auto & prev = symbols_[seg_end - 1];
+                if (!vocab_.byte_pairs[(uint8_t) prev.text[prev.n - 1]*256 + (uint8_t) symbols_[seg_end].text[0]]) {
+                    break;
+                }
+            }
+            merge_segment(seg_start, seg_end);
+            seg_start = seg_end;
+        }
+
+        for (int i = 0; i != -1; i = symbols_[i].next) {
+            auto & symbol = symbols_[i];
+            const llama_vocab::id token = symbol.node < 0 ? -1 : vocab_.trie[symbol.node].tok;
+
+            if (token < 0) {
+                // output any symbols that did not form tokens as bytes.
+                for (int j = 0; j < (int) symbol.n; ++j) {
+                    llama_vocab::id token_id = static_cast<uint8_t>(symbol.text[j]) + 3;
+                    output.push_back(token_id);
+                }
+            } else {
+                output.push_back(token);
+            }
+        }
+    }
+
+private:
+    void merge_segment(size_t start, size_t end) {
         // seed the work queue with all possible 2-character tokens.
-        for (size_t i = 1; i < symbols_.size(); ++i) {
+        for (size_t i = start + 1; i < end; ++i) {
             try_add_bigram(i - 1, i);
         }
 
@@ -1862,6 +2324,7 @@ struct llama_tokenizer {
 
             // merge the right sym into the left one
             left_sym.n += right_sym.n;
+            left_sym.node = bigram.node;
             right_sym.n = 0;
 
             //printf("left = '%*s' size = %zu\n", (int) left_sym.n, left_sym.text, bigram.size);
@@ -1876,47 +2339,29 @@ struct llama_tokenizer {
             try_add_bigram(left_sym.prev, bigram.left);
             try_add_bigram(bigram.left, left_sym.next);
         }
-
-        for (int i = 0; i != -1; i = symbols_[i].next) {
-            auto & symbol = symbols_[i];
-            auto token = vocab_.token_to_id.find(std::string(symbol.text, symbol.n));
-
-            if (token == vocab_.token_to_id.end()) {
-                // output any symbols that did not form tokens as bytes.
-                for (int j = 0; j < (int) symbol.n; ++j) {
-                    llama_vocab::id token_id = static_cast<uint8_t>(symbol.text[j]) + 3;
-                    output.push_back(token_id);
-                }
-            } else {
-                output.push_back((*token).second);
-            }
-        }
     }
 
-private:
     void try_add_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
         }
 
-        const std::string text = std::string(symbols_[left].text, symbols_[left].n + symbols_[right].n);
-        auto token = vocab_.token_to_id.find(text);
-
-        if (token == vocab_.token_to_id.end()) {
+        // continue the walk of the left symbol with the bytes of the right one
+        const int32_t node = vocab_.trie_walk(symbols_[left].node, symbols_[right].text, symbols_[right].n);
+        if (node < 0) {
             return;
         }
 
-        if (static_cast<size_t>((*token).second) >= vocab_.id_to_token.size()) {
+        if (vocab_.trie[node].tok < 0) {
             return;
         }
 
-        const auto &tok_score = vocab_.id_to_token[(*token).second];
-
         llama_sp_bigram bigram;
         bigram.left = left;
         bigram.right = right;
-        bigram.score = tok_score.score;
-        bigram.size = text.size();
+        bigram.score = vocab_.trie[node].score;
+        bigram.size = symbols_[left].n + symbols_[right].n;
+        bigram.node = node;
         work_queue_.push(bigram);
     }
 
@@ -1925,20 +2370,17 @@ private:
     llama_sp_bigram::queue work_queue_;
 };
 
-static std::vector<llama_vocab::id> llama_tokenize(const llama_vocab & vocab, const std::string & text, bool bos) {
-    llama_tokenizer tokenizer(vocab);
-    std::vector<llama_vocab::id> output;
-
-    if (text.empty()) {
-        return output;
+static void llama_tokenize(llama_tokenizer & tokenizer, const char * text, bool bos, std::vector<llama_vocab::id> & output) {
+    const size_t size = strlen(text);
+    if (size == 0) {
+        return;
     }
 
     if (bos) {
         output.push_back(llama_token_bos());
     }
 
-    tokenizer.tokenize(text, output);
-    return output;
+    tokenizer.tokenize(text, size, output);
 }
 
 //
@@ -1958,15 +2400,24 @@ void llama_sample_softmax(struct llama_context * ctx, llama_token_data_array * c
         candidates->sorted = true;
     }
 
-    float max_l = candidates->data[0].logit;
-    float cum_sum = 0.0f;
-    for (size_t i = 0; i < candidates->size; ++i) {
-        float p = expf(candidates->data[i].logit - max_l);
-        candidates->data[i].p = p;
-        cum_sum += p;
+    // the vectorized exp of ggml works on contiguous values, so the logits go through a small buffer
+    // on the stack in chunks and the probabilities are normalized in place
+    const float max_l = candidates->data[0].logit;
+    float buf[256];
+    double sum = 0.0;
+    for (size_t i0 = 0; i0 < candidates->size; i0 += 256) {
+        const int n = (int) std::min<size_t>(256, candidates->size - i0);
+        for (int i = 0; i < n; ++i) {
+            buf[i] = candidates->data[i0 + i].logit;
+        }
+        sum += ggml_soft_max_exp_row(buf, buf, n, max_l);
+        for (int i = 0; i < n; ++i) {
+            candidates->data[i0 + i].p = buf[i];
+        }
     }
+    const float scale = 1.0/sum;
     for (size_t i = 0; i < candidates->size; ++i) {
-        candidates->data[i].p /= cum_sum;
+        candidates->data[i].p *= scale;
     }
 
     if (ctx) {
@@ -2349,65 +2800,400 @@ llama_token llama_sample_token(struct llama_context * ctx, llama_token_data_arra
 }
 
 //
-// quantization
+// sampler chain
 //
 
-static void llama_convert_tensor_internal(const llama_load_tensor & tensor, llama_buffer & output, const int nelements, const int nthread) {
-    if (output.size < nelements * sizeof(float)) {
-        output.resize(nelements * sizeof(float));
-    }
-    float * f32_output = (float *) output.addr;
+struct llama_sampler {
+    llama_sampler_params params;
 
-    quantize_fns_t qtype;
-    if (ggml_is_quantized(tensor.type)) {
-        qtype = ggml_internal_get_quantize_fn(tensor.type);
-        if (qtype.dequantize_row_q == NULL) {
-            throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available", ggml_type_name(tensor.type)));
-        }
-    } else if (tensor.type != GGML_TYPE_F16) {
-        throw std::runtime_error(format("cannot dequantize/convert tensor type %s", ggml_type_name(tensor.type)));
-    }
+    float mirostat_mu;
 
-    if (nthread < 2) {
-        if (tensor.type == GGML_TYPE_F16) {
-            ggml_fp16_to_fp32_row((ggml_fp16_t *)tensor.data, f32_output, nelements);
-        } else if (ggml_is_quantized(tensor.type)) {
-            qtype.dequantize_row_q(tensor.data, f32_output, nelements);
-        } else {
-            LLAMA_ASSERT(false); // unreachable
-        }
+    // buffers kept across tokens
+    std::vector<float>            logits;     // logits of the last token with the penalties applied
+    std::vector<float>            selection;  // scratch for the top-k selection
+    std::vector<llama_token>      recent;     // sorted copy of the last tokens
+    std::vector<llama_token_data> candidates;
+};
+
+struct llama_sampler_params llama_sampler_default_params() {
+    struct llama_sampler_params result = {
+        /*.temp                        =*/ 0.80f,
+        /*.top_k                       =*/ 40,
+        /*.top_p                       =*/ 0.95f,
+        /*.tfs_z                       =*/ 1.00f,
+        /*.typical_p                   =*/ 1.00f,
+        /*.repeat_penalty              =*/ 1.10f,
+        /*.presence_penalty            =*/ 0.00f,
+        /*.frequency_penalty           =*/ 0.00f,
+        /*.mirostat                    =*/ 0,
+        /*.mirostat_tau                =*/ 5.00f,
+        /*.mirostat_eta                =*/ 0.10f,
+        /*.penalize_nl                 =*/ true,
+    };
+
+    return result;
+}
+
+struct llama_sampler * llama_sampler_init(struct llama_sampler_params params) {
+    llama_sampler * smpl = new llama_sampler;
+    smpl->params = params;
+    llama_sampler_reset(smpl);
+    return smpl;
+}
+
+void llama_sampler_free(struct llama_sampler * smpl) {
+    delete smpl;
+}
+
+void llama_sampler_reset(struct llama_sampler * smpl) {
+    smpl->mirostat_mu = 2.0f * smpl->params.mirostat_tau;
+}
+
+// same as llama_sample_repetition_penalty followed by llama_sample_frequency_and_presence_penalties,
+// but only the logits of the tokens that occur in last_tokens are visited
+static void llama_sampler_apply_penalties(llama_sampler * smpl, const llama_token * last_tokens, size_t last_tokens_size) {
+    const auto & params = smpl->params;
+    const bool repeat   = params.repeat_penalty != 1.0f;
+    const bool freq     = params.frequency_penalty != 0.0f || params.presence_penalty != 0.0f;
+    if (last_tokens_size == 0 || (!repeat && !freq)) {
         return;
     }
 
-    auto block_size = tensor.type == GGML_TYPE_F16 ? 1 : (size_t)ggml_blck_size(tensor.type);
-    auto block_size_bytes = ggml_type_size(tensor.type);
+    auto & logits = smpl->logits;
+    const llama_token n_vocab = (llama_token) logits.size();
+    const llama_token nl      = llama_token_nl();
+    const bool keep_nl        = !params.penalize_nl && nl < n_vocab;
+    const float nl_logit      = keep_nl ? logits[nl] : 0.0f;
 
-    LLAMA_ASSERT(nelements % block_size == 0);
-    auto nblocks = nelements / block_size;
-    auto blocks_per_thread = nblocks / nthread;
-    auto spare_blocks = nblocks - (blocks_per_thread * nthread); // if blocks aren't divisible by thread count
+    auto & recent = smpl->recent;
+    recent.assign(last_tokens, last_tokens + last_tokens_size);
+    std::sort(recent.begin(), recent.end());
 
-    std::vector<std::thread> workers;
-    for (auto tnum = 0, in_buff_offs = 0, out_buff_offs = 0; tnum < nthread; tnum++) {
-        auto thr_blocks = blocks_per_thread + (tnum == nthread - 1 ? spare_blocks : 0); // num blocks for this thread
-        auto thr_elems = thr_blocks * block_size; // number of elements for this thread
-        auto thr_block_bytes = thr_blocks * block_size_bytes; // number of input bytes for this thread
-
-        auto compute = [qtype] (ggml_type typ, uint8_t * inbuf, float * outbuf, int nels) {
-            if (typ == GGML_TYPE_F16) {
-                ggml_fp16_to_fp32_row((ggml_fp16_t *)inbuf, outbuf, nels);
+    for (size_t i = 0; i < recent.size(); ) {
+        const llama_token id = recent[i];
+        size_t j = i + 1;
+        while (j < recent.size() && recent[j] == id) {
+            ++j;
+        }
+        const int count = j - i;
+        i = j;
+
+        if (id < 0 || id >= n_vocab) {
+            continue;
+        }
+
+        float & logit = logits[id];
+        if (repeat) {
+            if (logit <= 0) {
+                logit *= params.repeat_penalty;
             } else {
-                qtype.dequantize_row_q(inbuf, outbuf, nels);
+                logit /= params.repeat_penalty;
             }
-        };
-        workers.push_back(std::thread(compute, tensor.type, tensor.data + in_buff_offs, f32_output + out_buff_offs, thr_elems));
-        in_buff_offs += thr_block_bytes;
-        out_buff_offs += thr_elems;
-    }
-    for (auto & worker : workers) {
-        worker.join();
+        }
+        if (freq) {
+            logit -= float(count) * params.frequency_penalty + float(count > 0) * params.presence_penalty;
+        }
     }
 
+    if (keep_nl) {
+        logits[nl] = nl_logit;
+    }
+}
+
+// fills the candidates with the k tokens with the largest logits, sorted in descending order
+// on equal logits the token with the lower id is kept
+static void llama_sampler_top_k(llama_sampler * smpl, int k) {
+    const auto & logits     = smpl->logits;
+    auto       & candidates = smpl->candidates;
+    const int n_vocab = logits.size();
+
+    auto better = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit || (a.logit == b.logit && a.id < b.id);
+    };
+
+    candidates.clear();
+
+    if (k >= n_vocab) {
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            candidates.push_back(llama_token_data{ id, logits[id], 0.0f });
+        }
+    } else if (k <= 256) {
+        // single pass keeping the best k in a heap whose top is the worst of them
+        // for the usual small k almost every logit is rejected by one comparison
+        for (llama_token id = 0; id < k; ++id) {
+            candidates.push_back(llama_token_data{ id, logits[id], 0.0f });
+        }
+        std::make_heap(candidates.begin(), candidates.end(), better);
+        for (llama_token id = k; id < n_vocab; ++id) {
+            if (logits[id] > candidates.front().logit) {
+                std::pop_heap(candidates.begin(), candidates.end(), better);
+                candidates.back() = llama_token_data{ id, logits[id], 0.0f };
+                std::push_heap(candidates.begin(), candidates.end(), better);
+            }
+        }
+    } else {
+        // find the k-th largest logit in linear time, then collect everything above it
+        auto & selection = smpl->selection;
+        selection.assign(logits.begin(), logits.end());
+        std::nth_element(selection.begin(), selection.begin() + (k - 1), selection.end(), std::greater<float>());
+        const float threshold = selection[k - 1];
+
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            if (logits[id] > threshold) {
+                candidates.push_back(llama_token_data{ id, logits[id], 0.0f });
+            }
+        }
+        for (llama_token id = 0; id < n_vocab && (int) candidates.size() < k; ++id) {
+            if (logits[id] == threshold) {
+                candidates.push_back(llama_token_data{ id, logits[id], 0.0f });
+            }
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end(), better);
+}
+
+llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, const llama_token * last_tokens, size_t last_tokens_size) {
+    const auto & params = smpl->params;
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    const int n_vocab = llama_n_vocab(ctx);
+    const float * logits = llama_get_logits(ctx);
+    smpl->logits.assign(logits, logits + n_vocab);
+
+    llama_sampler_apply_penalties(smpl, last_tokens, last_tokens_size);
+
+    if (params.temp <= 0) {
+        // greedy sampling, the first of the largest logits as in llama_sample_token_greedy
+        const auto max_iter = std::max_element(smpl->logits.begin(), smpl->logits.end());
+        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        ctx->n_sample++;
+        return max_iter - smpl->logits.begin();
+    }
+
+    const int k = params.mirostat != 0 ? n_vocab : std::max(1, std::min(params.top_k <= 0 ? n_vocab : params.top_k, n_vocab));
+    llama_sampler_top_k(smpl, k);
+
+    llama_token_data_array candidates_p = { smpl->candidates.data(), smpl->candidates.size(), true };
+
+    if (params.mirostat == 0) {
+        llama_sample_tail_free(nullptr, &candidates_p, params.tfs_z, 1);
+        llama_sample_typical  (nullptr, &candidates_p, params.typical_p, 1);
+        llama_sample_top_p    (nullptr, &candidates_p, params.top_p, 1);
+    }
+    llama_sample_temperature(nullptr, &candidates_p, params.temp);
+
+    ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+
+    if (params.mirostat == 1) {
+        const int mirostat_m = 100;
+        return llama_sample_token_mirostat(ctx, &candidates_p, params.mirostat_tau, params.mirostat_eta, mirostat_m, &smpl->mirostat_mu);
+    }
+    if (params.mirostat == 2) {
+        return llama_sample_token_mirostat_v2(ctx, &candidates_p, params.mirostat_tau, params.mirostat_eta, &smpl->mirostat_mu);
+    }
+    return llama_sample_token(ctx, &candidates_p);
+}
+
+//
+// quantization
+//
+
+// persistent pool of worker threads used by the quantizer
+// parallel_for() runs fn(i, ith) for every i in [0, n) and returns when all of them are done,
+// ith identifies the thread (0 is the calling thread, which takes part in the work)
+struct llama_quantize_pool {
+    llama_quantize_pool(int n_threads) : n_threads(std::max(1, n_threads)) {
+        for (int ith = 1; ith < this->n_threads; ++ith) {
+            workers.emplace_back([this, ith] { worker(ith); });
+        }
+    }
+
+    ~llama_quantize_pool() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv_work.notify_all();
+        for (auto & w : workers) {
+            w.join();
+        }
+    }
+
+    void parallel_for(size_t n, const std::function<void(size_t, int)> & fn) {
+        if (n_threads == 1 || n == 1) {
+            for (size_t i = 0; i < n; ++i) {
+                fn(i, 0);
+            }
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job_fn   = &fn;
+            job_n    = n;
+            job_next = 0;
+            n_busy   = n_threads;
+            job_id++;
+        }
+        cv_work.notify_all();
+
+        run(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [this] { return n_busy == 0; });
+        job_fn = nullptr;
+    }
+
+    int n_threads;
+
+private:
+    void run(int ith) {
+        while (true) {
+            const size_t i = job_next.fetch_add(1);
+            if (i >= job_n) {
+                break;
+            }
+            (*job_fn)(i, ith);
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        if (--n_busy == 0) {
+            cv_done.notify_one();
+        }
+    }
+
+    void worker(int ith) {
+        uint64_t last_job = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_work.wait(lock, [&] { return stop || job_id != last_job; });
+                if (stop) {
+                    return;
+                }
+                last_job = job_id;
+            }
+            run(ith);
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable cv_work;
+    std::condition_variable cv_done;
+    bool stop = false;
+
+    const std::function<void(size_t, int)> * job_fn = nullptr;
+    size_t job_n = 0;
+    std::atomic<size_t> job_next{0};
+    int n_busy = 0;
+    uint64_t job_id = 0;
+};
+
+// single producer / single consumer queue with a fixed capacity, used to hand tensors
+// between the reader, quantizer and writer stages
+template <typename T>
+struct llama_bounded_queue {
+    llama_bounded_queue(size_t capacity) : capacity(capacity) {}
+
+    // returns false if the queue was closed by the consumer
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return closed || items.size() < capacity; });
+        if (closed) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        cv.notify_all();
+        return true;
+    }
+
+    // returns false once the queue is closed and drained
+    bool pop(T & item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        cv.notify_all();
+        return true;
+    }
+
+    void close() {
+        std::unique_lock<std::mutex> lock(mutex);
+        closed = true;
+        cv.notify_all();
+    }
+
+private:
+    size_t capacity;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool closed = false;
+};
+
+static void llama_convert_tensor_internal(const llama_load_tensor & tensor, llama_buffer & output, const int nelements, llama_quantize_pool & pool) {
+    if (output.size < nelements * sizeof(float)) {
+        output.resize(nelements * sizeof(float));
+    }
+    float * f32_output = (float *) output.addr;
+
+    quantize_fns_t qtype;
+    if (ggml_is_quantized(tensor.type)) {
+        qtype = ggml_internal_get_quantize_fn(tensor.type);
+        if (qtype.dequantize_row_q == NULL) {
+            throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available", ggml_type_name(tensor.type)));
+        }
+    } else if (tensor.type != GGML_TYPE_F16) {
+        throw std::runtime_error(format("cannot dequantize/convert tensor type %s", ggml_type_name(tensor.type)));
+    }
+
+    auto block_size = tensor.type == GGML_TYPE_F16 ? 1 : (size_t)ggml_blck_size(tensor.type);
+    auto block_size_bytes = ggml_type_size(tensor.type);
+
+    LLAMA_ASSERT(nelements % block_size == 0);
+    const size_t nblocks = nelements / block_size;
+
+    // split into pieces of at least 64k elements so that small tensors do not pay for the synchronization
+    const size_t blocks_per_piece = std::max<size_t>(1, 65536/block_size);
+    const size_t npieces = (nblocks + blocks_per_piece - 1)/blocks_per_piece;
+
+    pool.parallel_for(npieces, [&](size_t ip, int) {
+        const size_t first = ip*blocks_per_piece;
+        const size_t nb    = std::min(blocks_per_piece, nblocks - first);
+
+        const uint8_t * inbuf  = tensor.data + first*block_size_bytes;
+        float         * outbuf = f32_output  + first*block_size;
+
+        if (tensor.type == GGML_TYPE_F16) {
+            ggml_fp16_to_fp32_row((const ggml_fp16_t *) inbuf, outbuf, nb*block_size);
+        } else {
+            qtype.dequantize_row_q(inbuf, outbuf, nb*block_size);
+        }
+    });
+}
+
+static std::unordered_map<std::string, std::vector<float>> llama_load_imatrix(const std::string & fname) {
+    llama_file file(fname.c_str(), "rb");
+
+    const uint32_t magic   = file.read_u32();
+    const uint32_t version = file.read_u32();
+    if (magic != LLAMA_IMATRIX_MAGIC || version != LLAMA_IMATRIX_VERSION) {
+        throw std::runtime_error(format("%s is not an importance matrix file (magic %08x, version %u)", fname.c_str(), magic, version));
+    }
+
+    std::unordered_map<std::string, std::vector<float>> result;
+    const uint32_t n_entries = file.read_u32();
+    for (uint32_t i = 0; i < n_entries; ++i) {
+        std::string name = file.read_string(file.read_u32());
+        file.read_u32(); // number of rows the statistics were collected over
+        std::vector<float> values(file.read_u32());
+        file.read_raw(values.data(), sizeof(float) * values.size());
+        result[name] = std::move(values);
+    }
+    return result;
 }
 
 static void llama_model_quantize_internal(const std::string & fname_inp, const std::string & fname_out, const llama_model_quantize_params * params) {
@@ -2467,159 +3253,243 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
     size_t total_size_new = 0;
     std::vector<int64_t> hist_all(1 << 4, 0);
 
-    std::vector<std::thread> workers;
-    std::mutex mutex;
-
-    size_t idx = 0;
-    for (llama_load_tensor & tensor : model_loader->tensors_map.tensors) {
-        llama_buffer read_data;
-        read_data.resize(tensor.size);
-        tensor.data = read_data.addr;
-        model_loader->load_data_for(tensor);
-
-        printf("[%4zu/%4zu] %36s - %16s, type = %6s, ",
-               ++idx, model_loader->tensors_map.tensors.size(),
-               tensor.name.c_str(), llama_format_tensor_shape(tensor.ne).c_str(),
-               ggml_type_name(tensor.type));
-
-        // This used to be a regex, but <regex> has an extreme cost to compile times.
-        bool quantize = tensor.name.rfind("weight") == tensor.name.size() - 6; // ends with 'weight'?
+    std::unordered_map<std::string, std::vector<float>> imatrix_data;
+    if (params->imatrix) {
+        imatrix_data = llama_load_imatrix(params->imatrix);
+        printf("%s: loaded importance matrix for %zu tensors from %s\n", __func__, imatrix_data.size(), params->imatrix);
+    }
 
-        // quantize only 2D tensors
-        quantize &= (tensor.ne.size() == 2);
-        quantize &= params->quantize_output_tensor || tensor.name != "output.weight";
-        quantize &= quantized_type != tensor.type;
+    llama_quantize_pool pool(nthread);
 
+    // the model is processed as a three stage pipeline: while tensor i is being quantized,
+    // tensor i+1 is read from the input and tensor i-1 is written to the output
+    struct read_item {
+        llama_load_tensor * tensor;
+        std::unique_ptr<llama_buffer> data;
+    };
+    struct write_item {
+        llama_load_tensor * tensor;
+        std::unique_ptr<llama_buffer> data;
+        std::unique_ptr<llama_buffer> work;
         enum ggml_type new_type;
         void * new_data;
         size_t new_size;
-        llama_buffer work;
+    };
 
-        if (!quantize) {
-            new_type = tensor.type;
-            new_data = tensor.data;
-            new_size = tensor.size;
-            printf("size = %8.3f MB\n", tensor.size/1024.0/1024.0);
-        } else {
-            new_type = quantized_type;
-#ifdef GGML_USE_K_QUANTS
-            if (quantized_type == GGML_TYPE_Q2_K || quantized_type == GGML_TYPE_Q3_K || quantized_type == GGML_TYPE_Q4_K ||
-                quantized_type == GGML_TYPE_Q5_K || quantized_type == GGML_TYPE_Q6_K) {
-                int nx = tensor.ne.at(0);
-                int ny = tensor.ne.at(1);
-                if (nx % QK_K != 0 || ny % QK_K != 0) {
-                    fprintf(stderr, "\n\n========================= Tensor sizes %d x %d are not divisible by %d\n",nx,ny,QK_K);
-                    fprintf(stderr, "This is required to be able to use k-quants for now!\n");
-                    fprintf(stderr, "========================================================================================\n\n");
-                    throw std::runtime_error("Unsupported tensor size encountered\n");
-                }
-            }
-            if (tensor.name == "output.weight") {
-                int nx = tensor.ne.at(0);
-                int ny = tensor.ne.at(1);
-                if (nx % QK_K == 0 && ny % QK_K == 0) {
-                    new_type = GGML_TYPE_Q6_K;
+    llama_bounded_queue<read_item>  read_queue(1);
+    llama_bounded_queue<write_item> write_queue(1);
+
+    std::exception_ptr reader_error;
+    std::exception_ptr writer_error;
+
+    std::thread reader([&]() {
+        try {
+            for (llama_load_tensor & tensor : model_loader->tensors_map.tensors) {
+                read_item item;
+                item.tensor = &tensor;
+                item.data.reset(new llama_buffer);
+                item.data->resize(tensor.size);
+                tensor.data = item.data->addr;
+                model_loader->load_data_for(tensor);
+                if (!read_queue.push(std::move(item))) {
+                    break;
                 }
-            } else if (tensor.name.find("attention.wv.weight") != std::string::npos) {
-                if      (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_M || ftype == LLAMA_FTYPE_MOSTLY_Q2_K) new_type = GGML_TYPE_Q4_K;
-                else if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_L) new_type = GGML_TYPE_Q5_K;
-                else if ((ftype == LLAMA_FTYPE_MOSTLY_Q4_K_M || ftype == LLAMA_FTYPE_MOSTLY_Q5_K_M) &&
-                         (i_attention_wv < n_attention_wv/8 || i_attention_wv >= 7*n_attention_wv/8 ||
-                         (i_attention_wv - n_attention_wv/8)%3 == 2)) new_type = GGML_TYPE_Q6_K;
-                ++i_attention_wv;
-            } else if (tensor.name.find("feed_forward.w2.weight") != std::string::npos) {
-                if      (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_M || ftype == LLAMA_FTYPE_MOSTLY_Q2_K) new_type = GGML_TYPE_Q4_K;
-                else if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_L) new_type = GGML_TYPE_Q5_K;
-                else if ((ftype == LLAMA_FTYPE_MOSTLY_Q4_K_M || ftype == LLAMA_FTYPE_MOSTLY_Q5_K_M) &&
-                         (i_feed_forward_w2 < n_feed_forward_w2/8 || i_feed_forward_w2 >= 7*n_feed_forward_w2/8 ||
-                         (i_feed_forward_w2 - n_feed_forward_w2/8)%3 == 2)) new_type = GGML_TYPE_Q6_K;
-                ++i_feed_forward_w2;
-            } else if (tensor.name.find("attention.wo.weight") != std::string::npos) {
-                if      (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_M || ftype == LLAMA_FTYPE_MOSTLY_Q2_K) new_type = GGML_TYPE_Q4_K;
-                else if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_L) new_type = GGML_TYPE_Q5_K;
             }
-#endif
-
-            float * f32_data;
-            size_t nelements = tensor.ne.at(0) * tensor.ne.at(1);
-            llama_buffer f32_conv_buf;
+        } catch (...) {
+            reader_error = std::current_exception();
+        }
+        read_queue.close();
+    });
 
-            if (tensor.type == GGML_TYPE_F32) {
-                f32_data = (float *) tensor.data;
-            } else if (ggml_is_quantized(tensor.type) && !params->allow_requantize) {
-                throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor.type)));
-            } else {
-                llama_convert_tensor_internal(tensor, f32_conv_buf, nelements, nthread);
-                f32_data = (float *) f32_conv_buf.addr;
+    std::thread writer([&]() {
+        try {
+            write_item item;
+            while (write_queue.pop(item)) {
+                file_saver.write_tensor(*item.tensor, item.new_type, item.new_data, item.new_size);
+                item = write_item();
             }
+        } catch (...) {
+            writer_error = std::current_exception();
+        }
+        write_queue.close();
+    });
 
-            printf("quantizing .. ");
-            fflush(stdout);
+    auto finish = [&]() {
+        read_queue.close();
+        write_queue.close();
+        reader.join();
+        writer.join();
+    };
 
-            work.resize(nelements * 4); // upper bound on size
-            new_data = work.addr;
-            std::vector<int64_t> hist_cur(1 << 4, 0);
+    // per thread histograms and sizes, merged after each tensor
+    std::vector<std::vector<int64_t>> hist_thread(pool.n_threads, std::vector<int64_t>(1 << 4, 0));
+    std::vector<size_t> size_thread(pool.n_threads, 0);
 
-            int chunk_size = 32 * 512;
-            const int nchunk = (nelements + chunk_size - 1)/chunk_size;
-            const int nthread_use = nthread > 1 ? std::max(1, std::min(nthread, nchunk)) : 1;
-            if (nthread_use < 2) {
-                new_size = ggml_quantize_chunk(new_type, f32_data, new_data, 0, nelements, hist_cur.data());
+    try {
+        size_t idx = 0;
+        read_item input;
+        while (read_queue.pop(input)) {
+            llama_load_tensor & tensor = *input.tensor;
+
+            printf("[%4zu/%4zu] %36s - %16s, type = %6s, ",
+                   ++idx, model_loader->tensors_map.tensors.size(),
+                   tensor.name.c_str(), llama_format_tensor_shape(tensor.ne).c_str(),
+                   ggml_type_name(tensor.type));
+
+            // This used to be a regex, but <regex> has an extreme cost to compile times.
+            bool quantize = tensor.name.rfind("weight") == tensor.name.size() - 6; // ends with 'weight'?
+
+            // quantize only 2D tensors
+            quantize &= (tensor.ne.size() == 2);
+            quantize &= params->quantize_output_tensor || tensor.name != "output.weight";
+            quantize &= quantized_type != tensor.type;
+
+            enum ggml_type new_type;
+            void * new_data;
+            size_t new_size;
+            std::unique_ptr<llama_buffer> work(new llama_buffer);
+
+            if (!quantize) {
+                new_type = tensor.type;
+                new_data = tensor.data;
+                new_size = tensor.size;
+                printf("size = %8.3f MB\n", tensor.size/1024.0/1024.0);
             } else {
-                size_t counter = 0;
-                new_size = 0;
-                auto compute = [&mutex, &counter, &hist_cur, &new_size, new_type, f32_data, new_data, nelements, chunk_size] () {
-                    std::vector<int64_t> local_hist;
-                    size_t local_size = 0;
-                    while (true) {
-                        std::unique_lock<std::mutex> lock(mutex);
-                        size_t first = counter; counter += chunk_size;
-                        if (first >= nelements) {
-                            if (!local_hist.empty()) {
-                                for (int j=0; j<int(local_hist.size()); ++j) {
-                                    hist_cur[j] += local_hist[j];
-                                }
-                                new_size += local_size;
-                            }
-                            break;
-                        }
-                        lock.unlock();
-                        size_t last = std::min(nelements, first + chunk_size);
-                        if (local_hist.empty()) {
-                            local_hist.resize(hist_cur.size(), 0);
-                        }
-                        local_size += ggml_quantize_chunk(new_type, f32_data, new_data, first, last - first, local_hist.data());
+                new_type = quantized_type;
+#ifdef GGML_USE_K_QUANTS
+                if (quantized_type == GGML_TYPE_Q2_K || quantized_type == GGML_TYPE_Q3_K || quantized_type == GGML_TYPE_Q4_K ||
+                    quantized_type == GGML_TYPE_Q5_K || quantized_type == GGML_TYPE_Q6_K) {
+                    int nx = tensor.ne.at(0);
+                    int ny = tensor.ne.at(1);
+                    if (nx % QK_K != 0 || ny % QK_K != 0) {
+                        fprintf(stderr, "\n\n========================= Tensor sizes %d x %d are not divisible by %d\n",nx,ny,QK_K);
+                        fprintf(stderr, "This is required to be able to use k-quants for now!\n");
+                        fprintf(stderr, "========================================================================================\n\n");
+                        throw std::runtime_error("Unsupported tensor size encountered\n");
                     }
-                };
-                if ((int) workers.size() < nthread_use - 1) {
-                    workers.resize(nthread_use - 1);
                 }
-                for (int it = 0; it < nthread_use - 1; ++it) {
-                    workers[it] = std::thread(compute);
+                if (tensor.name == "output.weight") {
+                    int nx = tensor.ne.at(0);
+                    int ny = tensor.ne.at(1);
+                    if (nx % QK_K == 0 && ny % QK_K == 0) {
+                        new_type = GGML_TYPE_Q6_K;
+                    }
+                } else if (tensor.name.find("attention.wv.weight") != std::string::npos) {
+                    if      (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_M || ftype == LLAMA_FTYPE_MOSTLY_Q2_K) new_type = GGML_TYPE_Q4_K;
+                    else if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_L) new_type = GGML_TYPE_Q5_K;
+                    else if ((ftype == LLAMA_FTYPE_MOSTLY_Q4_K_M || ftype == LLAMA_FTYPE_MOSTLY_Q5_K_M) &&
+                             (i_attention_wv < n_attention_wv/8 || i_attention_wv >= 7*n_attention_wv/8 ||
+                             (i_attention_wv - n_attention_wv/8)%3 == 2)) new_type = GGML_TYPE_Q6_K;
+                    ++i_attention_wv;
+                } else if (tensor.name.find("feed_forward.w2.weight") != std::string::npos) {
+                    if      (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_M || ftype == LLAMA_FTYPE_MOSTLY_Q2_K) new_type = GGML_TYPE_Q4_K;
+                    else if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_L) new_type = GGML_TYPE_Q5_K;
+                    else if ((ftype == LLAMA_FTYPE_MOSTLY_Q4_K_M || ftype == LLAMA_FTYPE_MOSTLY_Q5_K_M) &&
+                             (i_feed_forward_w2 < n_feed_forward_w2/8 || i_feed_forward_w2 >= 7*n_feed_forward_w2/8 ||
+                             (i_feed_forward_w2 - n_feed_forward_w2/8)%3 == 2)) new_type = GGML_TYPE_Q6_K;
+                    ++i_feed_forward_w2;
+                } else if (tensor.name.find("attention.wo.weight") != std::string::npos) {
+                    if      (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_M || ftype == LLAMA_FTYPE_MOSTLY_Q2_K) new_type = GGML_TYPE_Q4_K;
+                    else if (ftype == LLAMA_FTYPE_MOSTLY_Q3_K_L) new_type = GGML_TYPE_Q5_K;
                 }
-                compute();
-                for (int it = 0; it < nthread_use - 1; ++it) {
-                    workers[it].join();
+#endif
+
+                float * f32_data;
+                size_t nelements = tensor.ne.at(0) * tensor.ne.at(1);
+                llama_buffer f32_conv_buf;
+
+                if (tensor.type == GGML_TYPE_F32) {
+                    f32_data = (float *) tensor.data;
+                } else if (ggml_is_quantized(tensor.type) && !params->allow_requantize) {
+                    throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor.type)));
+                } else {
+                    llama_convert_tensor_internal(tensor, f32_conv_buf, nelements, pool);
+                    f32_data = (float *) f32_conv_buf.addr;
                 }
-            }
 
-            printf("size = %8.2f MB -> %8.2f MB | hist: ", tensor.size/1024.0/1024.0, new_size/1024.0/1024.0);
-            int64_t tot_count = 0;
-            for (size_t i = 0; i < hist_cur.size(); i++) {
-                hist_all[i] += hist_cur[i];
-                tot_count += hist_cur[i];
-            }
+                const int nx = tensor.ne.at(0);
+                const int ny = tensor.ne.at(1);
+
+                const float * imatrix = nullptr;
+                const auto it = imatrix_data.find(tensor.name);
+                if (it != imatrix_data.end()) {
+                    if (it->second.size() != (size_t) nx) {
+                        throw std::runtime_error(format("importance matrix for %s has %zu columns, expected %d",
+                                                        tensor.name.c_str(), it->second.size(), nx));
+                    }
+                    imatrix = it->second.data();
+                }
+
+                printf(imatrix ? "quantizing with imatrix .. " : "quantizing .. ");
+                fflush(stdout);
+
+                work->resize(nelements * 4); // upper bound on size
+                new_data = work->addr;
+                std::vector<int64_t> hist_cur(1 << 4, 0);
+
+                // chunks are made of whole rows so that each row sees the importance of its columns
+                const int chunk_rows = std::max(1, 32 * 512 / nx);
+                const size_t nchunk = (ny + chunk_rows - 1)/chunk_rows;
+
+                for (int ith = 0; ith < pool.n_threads; ++ith) {
+                    std::fill(hist_thread[ith].begin(), hist_thread[ith].end(), 0);
+                    size_thread[ith] = 0;
+                }
+
+                pool.parallel_for(nchunk, [&](size_t ichunk, int ith) {
+                    const int first = ichunk*chunk_rows;
+                    const int nrows = std::min(ny - first, chunk_rows);
+                    size_thread[ith] += ggml_quantize_chunk_imatrix(new_type, f32_data, new_data, first*nx, nrows, nx, hist_thread[ith].data(), imatrix);
+                });
+
+                new_size = 0;
+                for (int ith = 0; ith < pool.n_threads; ++ith) {
+                    for (size_t j = 0; j < hist_cur.size(); ++j) {
+                        hist_cur[j] += hist_thread[ith][j];
+                    }
+                    new_size += size_thread[ith];
+                }
 
-            if (tot_count > 0) {
+                printf("size = %8.2f MB -> %8.2f MB | hist: ", tensor.size/1024.0/1024.0, new_size/1024.0/1024.0);
+                int64_t tot_count = 0;
                 for (size_t i = 0; i < hist_cur.size(); i++) {
-                    printf("%5.3f ", hist_cur[i] / float(nelements));
+                    hist_all[i] += hist_cur[i];
+                    tot_count += hist_cur[i];
+                }
+
+                if (tot_count > 0) {
+                    for (size_t i = 0; i < hist_cur.size(); i++) {
+                        printf("%5.3f ", hist_cur[i] / float(nelements));
+                    }
                 }
+                printf("\n");
+            }
+            total_size_org += tensor.size;
+            total_size_new += new_size;
+
+            write_item output;
+            output.tensor   = &tensor;
+            output.data     = std::move(input.data);
+            output.work     = std::move(work);
+            output.new_type = new_type;
+            output.new_data = new_data;
+            output.new_size = new_size;
+            if (!write_queue.push(std::move(output))) {
+                break; // the writer failed
             }
-            printf("\n");
         }
-        total_size_org += tensor.size;
-        total_size_new += new_size;
-        file_saver.write_tensor(tensor, new_type, new_data, new_size);
+    } catch (...) {
+        finish();
+        throw;
+    }
+
+    finish();
+
+    if (reader_error) {
+        std::rethrow_exception(reader_error);
+    }
+    if (writer_error) {
+        std::rethrow_exception(writer_error);
     }
 
     printf("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
@@ -2654,7 +3524,7 @@ struct llama_model * llama_load_model_from_file(
 
     ggml_type memory_type = params.f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
 
-    if (!llama_model_load(path_model, *model, model->vocab, params.n_ctx, params.n_batch, params.n_gpu_layers,
+    if (!llama_model_load(path_model, -1, *model, model->vocab, params.n_ctx, params.n_batch, params.n_gpu_layers,
                 params.main_gpu, params.tensor_split, params.low_vram, memory_type, params.use_mmap, params.use_mlock,
                 params.vocab_only, params.progress_callback, params.progress_callback_user_data)) {
         delete model;
@@ -2665,6 +3535,28 @@ struct llama_model * llama_load_model_from_file(
     return model;
 }
 
+struct llama_model * llama_load_model_from_fd(
+                                    int   fd,
+            struct llama_context_params   params) {
+    ggml_time_init();
+
+    llama_model * model = new llama_model;
+
+    ggml_type memory_type = params.f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
+
+    const std::string name = "fd " + std::to_string(fd);
+
+    if (!llama_model_load(name, fd, *model, model->vocab, params.n_ctx, params.n_batch, params.n_gpu_layers,
+                params.main_gpu, params.tensor_split, params.low_vram, memory_type, /*use_mmap*/ false, params.use_mlock,
+                params.vocab_only, params.progress_callback, params.progress_callback_user_data)) {
+        delete model;
+        fprintf(stderr, "%s: failed to load model\n", __func__);
+        return nullptr;
+    }
+
+    return model;
+}
+
 void llama_free_model(struct llama_model * model) {
     delete model;
 }
@@ -2703,6 +3595,15 @@ struct llama_context * llama_new_context_with_model(
     ctx->rng = std::mt19937(params.seed);
     ctx->logits_all = params.logits_all;
 
+    const char * profile_env = getenv("LLAMA_PROFILE");
+    if (profile_env && atoi(profile_env) != 0) {
+        llama_set_profiling(ctx, atoi(profile_env));
+    }
+    ctx->pooling_type = params.pooling_type;
+    ctx->embd_norm = params.embd_norm;
+    ctx->abort_callback = params.abort_callback;
+    ctx->abort_callback_user_data = params.abort_callback_user_data;
+
     ggml_type memory_type = params.f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
 
     // reserve memory for context buffers
@@ -2729,6 +3630,7 @@ struct llama_context * llama_new_context_with_model(
 
         if (params.embedding){
             ctx->embedding.resize(hparams.n_embd);
+            ctx->embd_pool.resize(hparams.n_embd);
         }
 
         ctx->buf_compute.resize(MEM_REQ_EVAL().at(ctx->model.type));
@@ -2745,6 +3647,12 @@ struct llama_context * llama_new_context_with_model(
         void * data_ptr  = NULL;
         size_t data_size = 0;
 
+        if (!ctx->model.stream_bufs.empty()) {
+            fprintf(stderr, "%s: streamed models are not supported with Metal\n", __func__);
+            llama_free(ctx);
+            return NULL;
+        }
+
         if (params.use_mmap) {
             data_ptr  = ctx->model.mapping->addr;
             data_size = ctx->model.mapping->size;
@@ -2792,6 +3700,7 @@ struct llama_context * llama_init_from_file(
 }
 
 void llama_free(struct llama_context * ctx) {
+    llama_eval_wait(ctx);
     if (ctx->model_owner) {
         delete &ctx->model;
     }
@@ -3076,6 +3985,39 @@ int llama_get_kv_cache_token_count(const struct llama_context * ctx) {
     return ctx->kv_self.n;
 }
 
+struct llama_memory_info llama_get_memory_info(const struct llama_context * ctx) {
+    const auto & model = ctx->model;
+    const auto & kv_self = ctx->kv_self;
+
+    struct llama_memory_info info = {};
+
+    info.model = model.buf.size;
+    info.model_resident = model.buf.size;
+    if (model.mapping) {
+        info.model += model.mapping->size;
+        info.model_resident += model.mapping->resident();
+    }
+    for (const auto & buf : model.stream_bufs) {
+        info.model += buf->size;
+        info.model_resident += buf->size;
+    }
+
+    info.kv_size = kv_self.buf.size;
+    if (kv_self.k) {
+        info.kv_used = (ggml_nbytes(kv_self.k) + ggml_nbytes(kv_self.v)) / model.hparams.n_ctx * kv_self.n;
+    }
+
+    info.compute_size = ctx->buf_compute.size;
+    info.compute_peak = ctx->mem_compute_peak;
+    for (int i = 0; i < 2; i++) {
+        info.scratch_size[i] = ctx->buf_scratch[i].size;
+        info.scratch_peak[i] = ctx->get_buf_max_mem(i);
+    }
+    info.work_peak = ctx->mem_work_peak;
+
+    return info;
+}
+
 #define LLAMA_MAX_RNG_STATE (64*1024)
 
 void llama_set_rng_seed(struct llama_context * ctx, int seed) {
@@ -3116,6 +4058,113 @@ size_t llama_get_state_size(const struct llama_context * ctx) {
     return s_total;
 }
 
+// Returns the *maximum* size of the kv cache part of the state
+size_t llama_get_kv_state_size(const struct llama_context * ctx) {
+    return sizeof(size_t) + sizeof(int) + ctx->kv_self.buf.size;
+}
+
+// Copies only the kv cache to the specified destination address
+size_t llama_copy_kv_state_data(struct llama_context * ctx, uint8_t * dst) {
+    uint8_t * out = dst;
+
+    const auto & kv_self = ctx->kv_self;
+    const auto & hparams = ctx->model.hparams;
+    const int    n_layer = hparams.n_layer;
+    const int    n_embd  = hparams.n_embd;
+    const int    n_ctx   = hparams.n_ctx;
+
+    const size_t kv_size = kv_self.buf.size;
+    const int    kv_ntok = llama_get_kv_cache_token_count(ctx);
+
+    memcpy(out, &kv_size, sizeof(kv_size)); out += sizeof(kv_size);
+    memcpy(out, &kv_ntok, sizeof(kv_ntok)); out += sizeof(kv_ntok);
+
+    if (kv_size) {
+        const size_t elt_size = ggml_element_size(kv_self.k);
+
+        ggml_context * cpy_ctx = ggml_init({ 4096, NULL, /* no_alloc */ true });
+        ggml_cgraph gf{};
+        gf.n_threads = 1;
+
+        ggml_tensor * kout3d = ggml_new_tensor_3d(cpy_ctx, kv_self.k->type, n_embd, kv_ntok, n_layer);
+        kout3d->data = out;
+        out += ggml_nbytes(kout3d);
+
+        ggml_tensor * vout3d = ggml_new_tensor_3d(cpy_ctx, kv_self.v->type, kv_ntok, n_embd, n_layer);
+        vout3d->data = out;
+        out += ggml_nbytes(vout3d);
+
+        ggml_tensor * k3d = ggml_view_3d(cpy_ctx, kv_self.k,
+            n_embd, kv_ntok, n_layer,
+            elt_size*n_embd, elt_size*n_embd*n_ctx, 0);
+
+        ggml_tensor * v3d = ggml_view_3d(cpy_ctx, kv_self.v,
+            kv_ntok, n_embd, n_layer,
+            elt_size*n_ctx, elt_size*n_ctx*n_embd, 0);
+
+        ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, k3d, kout3d));
+        ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, v3d, vout3d));
+        ggml_graph_compute(cpy_ctx, &gf);
+
+        ggml_free(cpy_ctx);
+    }
+
+    return out - dst;
+}
+
+// Sets only the kv cache reading from the specified source address
+size_t llama_set_kv_state_data(struct llama_context * ctx, uint8_t * src) {
+    uint8_t * inp = src;
+
+    const auto & kv_self = ctx->kv_self;
+    const auto & hparams = ctx->model.hparams;
+    const int    n_layer = hparams.n_layer;
+    const int    n_embd  = hparams.n_embd;
+    const int    n_ctx   = hparams.n_ctx;
+
+    size_t kv_size;
+    int kv_ntok;
+
+    memcpy(&kv_size, inp, sizeof(kv_size)); inp += sizeof(kv_size);
+    memcpy(&kv_ntok, inp, sizeof(kv_ntok)); inp += sizeof(kv_ntok);
+
+    if (kv_size) {
+        LLAMA_ASSERT(kv_self.buf.size == kv_size);
+
+        const size_t elt_size = ggml_element_size(kv_self.k);
+
+        ggml_context * cpy_ctx = ggml_init({ 4096, NULL, /* no_alloc */ true });
+        ggml_cgraph gf{};
+        gf.n_threads = 1;
+
+        ggml_tensor * kin3d = ggml_new_tensor_3d(cpy_ctx, kv_self.k->type, n_embd, kv_ntok, n_layer);
+        kin3d->data = (void *) inp;
+        inp += ggml_nbytes(kin3d);
+
+        ggml_tensor * vin3d = ggml_new_tensor_3d(cpy_ctx, kv_self.v->type, kv_ntok, n_embd, n_layer);
+        vin3d->data = (void *) inp;
+        inp += ggml_nbytes(vin3d);
+
+        ggml_tensor * k3d = ggml_view_3d(cpy_ctx, kv_self.k,
+            n_embd, kv_ntok, n_layer,
+            elt_size*n_embd, elt_size*n_embd*n_ctx, 0);
+
+        ggml_tensor * v3d = ggml_view_3d(cpy_ctx, kv_self.v,
+            kv_ntok, n_embd, n_layer,
+            elt_size*n_ctx, elt_size*n_ctx*n_embd, 0);
+
+        ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, kin3d, k3d));
+        ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, vin3d, v3d));
+        ggml_graph_compute(cpy_ctx, &gf);
+
+        ggml_free(cpy_ctx);
+    }
+
+    ctx->kv_self.n = kv_ntok;
+
+    return inp - src;
+}
+
 // Copies the state to the specified destination address
 size_t llama_copy_state_data(struct llama_context * ctx, uint8_t * dst) {
     uint8_t * out = dst;
@@ -3163,49 +4212,7 @@ size_t llama_copy_state_data(struct llama_context * ctx, uint8_t * dst) {
     }
 
     // copy kv cache
-    {
-        const auto & kv_self = ctx->kv_self;
-        const auto & hparams = ctx->model.hparams;
-        const int    n_layer = hparams.n_layer;
-        const int    n_embd  = hparams.n_embd;
-        const int    n_ctx   = hparams.n_ctx;
-
-        const size_t kv_size = kv_self.buf.size;
-        const int    kv_ntok = llama_get_kv_cache_token_count(ctx);
-
-        memcpy(out, &kv_size, sizeof(kv_size)); out += sizeof(kv_size);
-        memcpy(out, &kv_ntok, sizeof(kv_ntok)); out += sizeof(kv_ntok);
-
-        if (kv_size) {
-            const size_t elt_size = ggml_element_size(kv_self.k);
-
-            ggml_context * cpy_ctx = ggml_init({ 4096, NULL, /* no_alloc */ true });
-            ggml_cgraph gf{};
-            gf.n_threads = 1;
-
-            ggml_tensor * kout3d = ggml_new_tensor_3d(cpy_ctx, kv_self.k->type, n_embd, kv_ntok, n_layer);
-            kout3d->data = out;
-            out += ggml_nbytes(kout3d);
-
-            ggml_tensor * vout3d = ggml_new_tensor_3d(cpy_ctx, kv_self.v->type, kv_ntok, n_embd, n_layer);
-            vout3d->data = out;
-            out += ggml_nbytes(vout3d);
-
-            ggml_tensor * k3d = ggml_view_3d(cpy_ctx, kv_self.k,
-                n_embd, kv_ntok, n_layer,
-                elt_size*n_embd, elt_size*n_embd*n_ctx, 0);
-
-            ggml_tensor * v3d = ggml_view_3d(cpy_ctx, kv_self.v,
-                kv_ntok, n_embd, n_layer,
-                elt_size*n_ctx, elt_size*n_ctx*n_embd, 0);
-
-            ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, k3d, kout3d));
-            ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, v3d, vout3d));
-            ggml_graph_compute(cpy_ctx, &gf);
-
-            ggml_free(cpy_ctx);
-        }
-    }
+    out += llama_copy_kv_state_data(ctx, out);
 
     const size_t written  = out - dst;
     const size_t max_size = llama_get_state_size(ctx);
@@ -3267,53 +4274,7 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
     }
 
     // set kv cache
-    {
-        const auto & kv_self = ctx->kv_self;
-        const auto & hparams = ctx->model.hparams;
-        const int    n_layer = hparams.n_layer;
-        const int    n_embd  = hparams.n_embd;
-        const int    n_ctx   = hparams.n_ctx;
-
-        size_t kv_size;
-        int kv_ntok;
-
-        memcpy(&kv_size, inp, sizeof(kv_size)); inp += sizeof(kv_size);
-        memcpy(&kv_ntok, inp, sizeof(kv_ntok)); inp += sizeof(kv_ntok);
-
-        if (kv_size) {
-            LLAMA_ASSERT(kv_self.buf.size == kv_size);
-
-            const size_t elt_size = ggml_element_size(kv_self.k);
-
-            ggml_context * cpy_ctx = ggml_init({ 4096, NULL, /* no_alloc */ true });
-            ggml_cgraph gf{};
-            gf.n_threads = 1;
-
-            ggml_tensor * kin3d = ggml_new_tensor_3d(cpy_ctx, kv_self.k->type, n_embd, kv_ntok, n_layer);
-            kin3d->data = (void *) inp;
-            inp += ggml_nbytes(kin3d);
-
-            ggml_tensor * vin3d = ggml_new_tensor_3d(cpy_ctx, kv_self.v->type, kv_ntok, n_embd, n_layer);
-            vin3d->data = (void *) inp;
-            inp += ggml_nbytes(vin3d);
-
-            ggml_tensor * k3d = ggml_view_3d(cpy_ctx, kv_self.k,
-                n_embd, kv_ntok, n_layer,
-                elt_size*n_embd, elt_size*n_embd*n_ctx, 0);
-
-            ggml_tensor * v3d = ggml_view_3d(cpy_ctx, kv_self.v,
-                kv_ntok, n_embd, n_layer,
-                elt_size*n_ctx, elt_size*n_ctx*n_embd, 0);
-
-            ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, kin3d, k3d));
-            ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, vin3d, v3d));
-            ggml_graph_compute(cpy_ctx, &gf);
-
-            ggml_free(cpy_ctx);
-        }
-
-        ctx->kv_self.n = kv_ntok;
-    }
+    inp += llama_set_kv_state_data(ctx, inp);
 
     const size_t nread    = inp - src;
     const size_t max_size = llama_get_state_size(ctx);
@@ -3402,6 +4363,68 @@ bool llama_save_session_file(struct llama_context * ctx, const char * path_sessi
     return true;
 }
 
+void llama_set_abort_callback(struct llama_context * ctx, llama_abort_callback abort_callback, void * abort_callback_user_data) {
+    ctx->abort_callback           = abort_callback;
+    ctx->abort_callback_user_data = abort_callback_user_data;
+}
+
+void llama_set_profiling(struct llama_context * ctx, int level) {
+    if (level <= 0) {
+        ctx->profile.reset();
+        return;
+    }
+    if (!ctx->profile) {
+        ctx->profile.reset(new ggml_profile());
+    }
+    ctx->profile->counters = level >= 2;
+}
+
+void llama_set_trace(struct llama_context * ctx, struct ggml_trace * trace) {
+    ctx->trace = trace;
+}
+
+void llama_set_imatrix_collection(struct llama_context * ctx, bool enable) {
+    ctx->collect_imatrix = enable;
+    if (enable && ctx->imatrix_weights.empty()) {
+        for (const auto & kv : ctx->model.tensors_by_name) {
+            if (kv.second->n_dims == 2) {
+                ctx->imatrix_weights[kv.second] = kv.first;
+            }
+        }
+    }
+}
+
+bool llama_save_imatrix(struct llama_context * ctx, const char * path_imatrix) {
+    try {
+        llama_file file(path_imatrix, "wb");
+
+        file.write_u32(LLAMA_IMATRIX_MAGIC);
+        file.write_u32(LLAMA_IMATRIX_VERSION);
+        file.write_u32((uint32_t) ctx->imatrix.size());
+
+        std::vector<float> values;
+        for (const auto & kv : ctx->imatrix) {
+            const llama_imatrix_stats & stats = kv.second;
+
+            values.resize(stats.sum_sq.size());
+            for (size_t i = 0; i < values.size(); ++i) {
+                values[i] = stats.n_rows > 0 ? (float) (stats.sum_sq[i] / stats.n_rows) : 0.0f;
+            }
+
+            file.write_u32((uint32_t) kv.first.size());
+            file.write_raw(kv.first.data(), kv.first.size());
+            file.write_u32((uint32_t) std::min<int64_t>(stats.n_rows, UINT32_MAX));
+            file.write_u32((uint32_t) values.size());
+            file.write_raw(values.data(), sizeof(float) * values.size());
+        }
+    } catch (const std::exception & err) {
+        fprintf(stderr, "%s: failed to save importance matrix: %s\n", __func__, err.what());
+        return false;
+    }
+
+    return true;
+}
+
 int llama_eval(
         struct llama_context * ctx,
            const llama_token * tokens,
@@ -3409,7 +4432,9 @@ int llama_eval(
                          int   n_past,
                          int   n_threads) {
     if (!llama_eval_internal(*ctx, tokens, n_tokens, n_past, n_threads, nullptr)) {
-        fprintf(stderr, "%s: failed to eval\n", __func__);
+        if (!ctx->eval_aborted) {
+            fprintf(stderr, "%s: failed to eval\n", __func__);
+        }
         return 1;
     }
 
@@ -3423,6 +4448,59 @@ int llama_eval(
     return 0;
 }
 
+void llama_eval_begin(
+        struct llama_context * ctx,
+           const llama_token * tokens,
+                         int   n_tokens,
+                         int   n_past,
+                         int   n_threads) {
+    llama_eval_wait(ctx);
+
+    ctx->eval_tokens.assign(tokens, tokens + n_tokens);
+    ctx->eval_thread = std::thread([ctx, n_past, n_threads]() {
+        ctx->eval_result = llama_eval(ctx, ctx->eval_tokens.data(), ctx->eval_tokens.size(), n_past, n_threads);
+    });
+}
+
+int llama_eval_wait(struct llama_context * ctx) {
+    if (!ctx->eval_thread.joinable()) {
+        return 1;
+    }
+    ctx->eval_thread.join();
+    return ctx->eval_result;
+}
+
+int llama_eval_embeddings(
+        struct llama_context * ctx,
+           const llama_token * tokens,
+               const int32_t * seq_lens,
+                         int   n_seqs,
+                       float * embd,
+                         int   n_threads) {
+    int n_tokens = 0;
+    for (int s = 0; s < n_seqs; s++) {
+        if (seq_lens[s] <= 0) {
+            fprintf(stderr, "%s: sequence %d is empty\n", __func__, s);
+            return 1;
+        }
+        n_tokens += seq_lens[s];
+    }
+
+    if (n_tokens == 0 || n_tokens > (int) ctx->model.hparams.n_ctx) {
+        fprintf(stderr, "%s: invalid number of tokens %d, the context holds %d\n", __func__, n_tokens, ctx->model.hparams.n_ctx);
+        return 1;
+    }
+
+    if (!llama_eval_internal(*ctx, tokens, n_tokens, 0, n_threads, nullptr, seq_lens, n_seqs, embd)) {
+        if (!ctx->eval_aborted) {
+            fprintf(stderr, "%s: failed to eval\n", __func__);
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
 int llama_eval_export(struct llama_context * ctx, const char * fname) {
     const int n_batch = 1;
     const int n_ctx   = 512 - n_batch;
@@ -3443,7 +4521,9 @@ int llama_tokenize(
                  llama_token * tokens,
                          int   n_max_tokens,
                         bool   add_bos) {
-    auto res = llama_tokenize(ctx->vocab, text, add_bos);
+    llama_tokenizer tokenizer(ctx->vocab);
+    std::vector<llama_vocab::id> res;
+    llama_tokenize(tokenizer, text, add_bos, res);
 
     if (n_max_tokens < (int) res.size()) {
         fprintf(stderr, "%s: too many tokens\n", __func__);
@@ -3457,6 +4537,85 @@ int llama_tokenize(
     return res.size();
 }
 
+int llama_tokenize_batch(
+        struct llama_context * ctx,
+                const char ** texts,
+                         int   n_texts,
+                 llama_token * tokens,
+                         int   n_max_tokens,
+                     int32_t * offsets,
+                        bool   add_bos,
+                         int   n_threads) {
+    if (n_threads <= 0) {
+        n_threads = std::thread::hardware_concurrency();
+    }
+    n_threads = std::max(1, std::min(n_threads, n_texts));
+
+    // each thread tokenizes a contiguous range of texts with roughly the same number of bytes
+    // into its own buffer, reusing one tokenizer for all of them
+    std::vector<size_t> text_size(n_texts);
+    size_t total_size = 0;
+    for (int i = 0; i < n_texts; ++i) {
+        text_size[i] = strlen(texts[i]);
+        total_size  += text_size[i];
+    }
+
+    std::vector<int> first(n_threads + 1, n_texts);
+    first[0] = 0;
+    {
+        size_t acc = 0;
+        int ith = 1;
+        for (int i = 0; i < n_texts && ith < n_threads; ++i) {
+            acc += text_size[i];
+            while (ith < n_threads && acc*n_threads >= total_size*ith) {
+                first[ith++] = i + 1;
+            }
+        }
+    }
+
+    std::vector<std::vector<llama_vocab::id>> output(n_threads);
+
+    auto compute = [&](int ith) {
+        llama_tokenizer tokenizer(ctx->vocab);
+        auto & out = output[ith];
+        for (int i = first[ith]; i < first[ith + 1]; ++i) {
+            offsets[i] = out.size();
+            llama_tokenize(tokenizer, texts[i], add_bos, out);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads - 1);
+    for (int ith = 1; ith < n_threads; ++ith) {
+        workers.emplace_back(compute, ith);
+    }
+    compute(0);
+    for (auto & worker : workers) {
+        worker.join();
+    }
+
+    // make the per-thread offsets global and gather the tokens
+    size_t n_tokens = 0;
+    for (int ith = 0; ith < n_threads; ++ith) {
+        for (int i = first[ith]; i < first[ith + 1]; ++i) {
+            offsets[i] += n_tokens;
+        }
+        n_tokens += output[ith].size();
+    }
+    offsets[n_texts] = n_tokens;
+
+    if (n_max_tokens < (int) n_tokens) {
+        fprintf(stderr, "%s: too many tokens\n", __func__);
+        return -((int) n_tokens);
+    }
+
+    for (int ith = 0; ith < n_threads; ++ith) {
+        std::copy(output[ith].begin(), output[ith].end(), tokens + offsets[first[ith]]);
+    }
+
+    return n_tokens;
+}
+
 int llama_n_vocab(const struct llama_context * ctx) {
     return ctx->vocab.id_to_token.size();
 }
@@ -3469,6 +4628,27 @@ int llama_n_embd(const struct llama_context * ctx) {
     return ctx->model.hparams.n_embd;
 }
 
+int llama_model_desc(const struct llama_model * model, char * buf, size_t buf_size) {
+    return snprintf(buf, buf_size, "%s %s",
+            llama_model_type_name(model->type), llama_ftype_name(model->hparams.ftype));
+}
+
+uint64_t llama_model_size(const struct llama_model * model) {
+    uint64_t size = 0;
+    for (const auto & it : model->tensors_by_name) {
+        size += ggml_nbytes(it.second);
+    }
+    return size;
+}
+
+uint64_t llama_model_n_params(const struct llama_model * model) {
+    uint64_t n_params = 0;
+    for (const auto & it : model->tensors_by_name) {
+        n_params += ggml_nelements(it.second);
+    }
+    return n_params;
+}
+
 int llama_get_vocab(
         const struct llama_context * ctx,
         const char * * strings,
@@ -3527,6 +4707,11 @@ void llama_print_timings(struct llama_context * ctx) {
     fprintf(stderr, "%s:        eval time = %8.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, 1e-3 * ctx->t_eval_us,   n_eval,   1e-3 * ctx->t_eval_us   / n_eval,   1e6 / ctx->t_eval_us   * n_eval);
     fprintf(stderr, "%s:       total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0);
+
+    if (ctx->profile) {
+        fprintf(stderr, "\n");
+        ggml_profile_print(ctx->profile.get(), 20);
+    }
 }
 
 void llama_reset_timings(struct llama_context * ctx) {
@@ -3534,6 +4719,10 @@ void llama_reset_timings(struct llama_context * ctx) {
     ctx->t_sample_us = ctx->n_sample = 0;
     ctx->t_eval_us   = ctx->n_eval   = 0;
     ctx->t_p_eval_us = ctx->n_p_eval = 0;
+
+    if (ctx->profile) {
+        ggml_profile_reset(ctx->profile.get());
+    }
 }
 
 const char * llama_print_system_info(void) {
@@ -3562,3 +4751,11 @@ const char * llama_print_system_info(void) {
 const std::vector<std::pair<std::string, struct ggml_tensor *>>& llama_internal_get_tensor_map(struct llama_context * ctx) {
     return ctx->model.tensors_by_name;
 }
+
+// For internal test use: the penalties and top-k selection of llama_sampler_sample() applied to the given logits
+const std::vector<llama_token_data> & llama_internal_sampler_top_k(struct llama_sampler * smpl, const float * logits, int n_vocab, const llama_token * last_tokens, size_t last_tokens_size, int k) {
+    smpl->logits.assign(logits, logits + n_vocab);
+    llama_sampler_apply_penalties(smpl, last_tokens, last_tokens_size);
+    llama_sampler_top_k(smpl, std::max(1, std::min(k, n_vocab)));
+    return smpl->candidates;
+}
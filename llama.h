@@ -39,12 +39,15 @@
 #define LLAMA_FILE_MAGIC_GGMF        0x67676d66u // 'ggmf'
 #define LLAMA_FILE_MAGIC_GGML        0x67676d6cu // 'ggml'
 #define LLAMA_FILE_MAGIC_GGSN        0x6767736eu // 'ggsn'
+#define LLAMA_FILE_MAGIC_IMAT        0x696d6174u // 'imat'
 
 #define LLAMA_FILE_VERSION           3
 #define LLAMA_FILE_MAGIC             LLAMA_FILE_MAGIC_GGJT
 #define LLAMA_FILE_MAGIC_UNVERSIONED LLAMA_FILE_MAGIC_GGML
 #define LLAMA_SESSION_MAGIC          LLAMA_FILE_MAGIC_GGSN
 #define LLAMA_SESSION_VERSION        1
+#define LLAMA_IMATRIX_MAGIC          LLAMA_FILE_MAGIC_IMAT
+#define LLAMA_IMATRIX_VERSION        1
 
 #if defined(GGML_USE_CUBLAS) || defined(GGML_USE_CLBLAST) || defined(GGML_USE_METAL)
 // Defined when llama.cpp is compiled with support for offloading model layers to GPU.
@@ -80,6 +83,16 @@ extern "C" {
 
     typedef void (*llama_progress_callback)(float progress, void *ctx);
 
+    // called between the operations of llama_eval, returning true stops the evaluation
+    typedef bool (*llama_abort_callback)(void * ctx);
+
+    // how the final hidden states of the tokens are combined into the embedding
+    enum llama_pooling_type {
+        LLAMA_POOLING_LAST = 0, // the last token
+        LLAMA_POOLING_MEAN = 1, // the average over all tokens
+        LLAMA_POOLING_CLS  = 2, // the first token, the BOS
+    };
+
    struct llama_context_params {
         int seed;                              // RNG seed, -1 for random
         int n_ctx;                             // text context
@@ -87,10 +100,15 @@ extern "C" {
         int n_gpu_layers;                      // number of layers to store in VRAM
         int main_gpu;                          // the GPU that is used for scratch and small tensors
         float tensor_split[LLAMA_MAX_DEVICES]; // how to split layers across multiple GPUs
+        enum llama_pooling_type pooling_type;  // how the tokens are pooled into the embedding
         // called with a progress value between 0 and 1, pass NULL to disable
         llama_progress_callback progress_callback;
         // context pointer passed to the progress callback
         void * progress_callback_user_data;
+        // called during llama_eval, pass NULL to disable
+        llama_abort_callback abort_callback;
+        // context pointer passed to the abort callback
+        void * abort_callback_user_data;
 
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool low_vram;   // if true, reduce VRAM usage at the cost of performance
@@ -100,6 +118,7 @@ extern "C" {
         bool use_mmap;   // use mmap if possible
         bool use_mlock;  // force system to keep model in RAM
         bool embedding;  // embedding mode only
+        bool embd_norm;  // L2-normalize the embeddings
     };
     // model file types
     enum llama_ftype {
@@ -130,6 +149,7 @@ extern "C" {
         enum llama_ftype   ftype;    // quantize to this llama_ftype
         bool allow_requantize;       // allow quantizing non-f32/f16 tensors
         bool quantize_output_tensor; // quantize output.weight
+        const char * imatrix;        // importance matrix saved by llama_save_imatrix, or NULL
     } llama_model_quantize_params;
 
     LLAMA_API struct llama_context_params llama_context_default_params();
@@ -149,6 +169,13 @@ extern "C" {
                              const char * path_model,
             struct llama_context_params   params);
 
+    // Load a model by reading it sequentially from a pipe, socket or file descriptor.
+    // Tensors are placed as they arrive, so the load can overlap with a download.
+    // mmap is not used and the descriptor is closed when loading is done.
+    LLAMA_API struct llama_model * llama_load_model_from_fd(
+                                    int   fd,
+            struct llama_context_params   params);
+
     LLAMA_API void llama_free_model(struct llama_model * model);
 
     LLAMA_API struct llama_context * llama_new_context_with_model(
@@ -194,6 +221,22 @@ extern "C" {
     // Returns the number of tokens in the KV cache
     LLAMA_API int llama_get_kv_cache_token_count(const struct llama_context * ctx);
 
+    // Memory of a context and its model in bytes. The buffers are sized from the model type, the peaks
+    // are the most that llama_eval used of them so far.
+    struct llama_memory_info {
+        size_t model;          // weights: the model buffer, the mapped model file and the streamed tensors
+        size_t model_resident; // part of the weights in RAM, mincore tells which pages of the mapped file are
+        size_t kv_size;        // KV cache
+        size_t kv_used;        // part of the KV cache that holds tokens
+        size_t compute_size;   // graph: the tensors, the intermediate results outside of scratch and the work buffer
+        size_t compute_peak;
+        size_t scratch_size[2]; // intermediate results of the layers
+        size_t scratch_peak[2];
+        size_t work_peak;      // work buffer of the graph computation, included in compute_peak
+    };
+
+    LLAMA_API struct llama_memory_info llama_get_memory_info(const struct llama_context * ctx);
+
     // Sets the current rng seed.
     LLAMA_API void llama_set_rng_seed(struct llama_context * ctx, int seed);
 
@@ -210,14 +253,42 @@ extern "C" {
     // Returns the number of bytes read
     LLAMA_API size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src);
 
+    // The same for the kv cache alone, without the rng, logits and embedding, for example to reuse the
+    // evaluation of a prompt prefix without touching the sampling state
+    LLAMA_API size_t llama_get_kv_state_size(const struct llama_context * ctx);
+    LLAMA_API size_t llama_copy_kv_state_data(struct llama_context * ctx, uint8_t * dst);
+    LLAMA_API size_t llama_set_kv_state_data(struct llama_context * ctx, uint8_t * src);
+
     // Save/load session file
     LLAMA_API bool llama_load_session_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out);
     LLAMA_API bool llama_save_session_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count);
 
+    // While enabled, llama_eval records the time spent per ggml op, per tensor name and per compute phase,
+    // llama_print_timings prints the summary and llama_reset_timings clears it. It costs nothing while disabled.
+    // Level 0 disables it, 1 records the timings, 2 also samples the cycles, instructions and last level cache
+    // misses of every thread per op with perf_event_open (Linux only).
+    // Setting the LLAMA_PROFILE environment variable to the level enables it for every new context. CPU only.
+    LLAMA_API void llama_set_profiling(struct llama_context * ctx, int level);
+
+    // Record the timeline of every llama_eval into a trace created with ggml_trace_init, or stop with NULL.
+    // The caller owns the trace and writes it with ggml_trace_write, several contexts can share one trace
+    // as long as they do not eval at the same time. CPU only.
+    LLAMA_API void llama_set_trace(struct llama_context * ctx, struct ggml_trace * trace);
+
+    // Importance matrix: while enabled, every llama_eval accumulates the mean square of the activations
+    // that enter each weight matrix, per column. llama_model_quantize can use the saved statistics
+    // to minimize the error on the columns that matter most. CPU only.
+    LLAMA_API void llama_set_imatrix_collection(struct llama_context * ctx, bool enable);
+    LLAMA_API bool llama_save_imatrix(struct llama_context * ctx, const char * path_imatrix);
+
+    // Replaces the abort callback set in llama_context_params
+    LLAMA_API void llama_set_abort_callback(struct llama_context * ctx, llama_abort_callback abort_callback, void * abort_callback_user_data);
+
     // Run the llama inference to obtain the logits and probabilities for the next token.
     // tokens + n_tokens is the provided batch of new tokens to process
     // n_past is the number of tokens to use from previous eval calls
-    // Returns 0 on success
+    // Returns 0 on success, 1 on failure or when the abort callback stopped the evaluation.
+    // An aborted evaluation leaves the KV cache valid up to n_past.
     LLAMA_API int llama_eval(
             struct llama_context * ctx,
                const llama_token * tokens,
@@ -225,6 +296,36 @@ extern "C" {
                              int   n_past,
                              int   n_threads);
 
+    // Start llama_eval on a thread of its own and return at once, so that the caller can sample, detokenize
+    // or evaluate another context meanwhile. The tokens are copied. The context must not be used until
+    // llama_eval_wait, which returns the result of llama_eval. A pending eval is waited for by the next
+    // llama_eval_begin and by llama_free.
+    // Evals running at the same time should share the cores: the threads of ggml spin while they wait.
+    LLAMA_API void llama_eval_begin(
+            struct llama_context * ctx,
+               const llama_token * tokens,
+                             int   n_tokens,
+                             int   n_past,
+                             int   n_threads);
+
+    // Returns 1 when no eval is pending.
+    LLAMA_API int llama_eval_wait(struct llama_context * ctx);
+
+    // Compute the embeddings of n_seqs independent sequences in a single evaluation.
+    // The tokens of all sequences are stored one after the other, sequence i has seq_lens[i] tokens
+    // and the first sequence must start with BOS. Each sequence only attends to its own tokens.
+    // The pooled embedding of sequence i is written to embd[i*n_embd] .. embd[(i + 1)*n_embd - 1].
+    // The total number of tokens should not exceed the batch size and must fit in the context.
+    // The KV cache is overwritten, the next llama_eval has to start again from n_past = 0.
+    // Returns 0 on success, 1 on failure or when the abort callback stopped the evaluation.
+    LLAMA_API int llama_eval_embeddings(
+            struct llama_context * ctx,
+               const llama_token * tokens,
+                   const int32_t * seq_lens,
+                             int   n_seqs,
+                           float * embd,
+                             int   n_threads);
+
     // Export a static computation graph for context of 511 and batch size of 1
     // NOTE: since this functionality is mostly for debugging and demonstration purposes, we hardcode these
     //       parameters here to keep things simple
@@ -243,10 +344,31 @@ extern "C" {
                              int   n_max_tokens,
                             bool   add_bos);
 
+    // Convert n_texts texts into tokens, using up to n_threads threads.
+    // The tokens of all texts are stored one after the other in tokens, the tokens of text i are
+    // tokens[offsets[i]] .. tokens[offsets[i + 1] - 1], so offsets must hold n_texts + 1 entries.
+    // Returns the total number of tokens on success, no more than n_max_tokens
+    // Returns a negative number on failure - the total number of tokens that would have been returned
+    LLAMA_API int llama_tokenize_batch(
+            struct llama_context * ctx,
+                    const char ** texts,
+                             int   n_texts,
+                     llama_token * tokens,
+                             int   n_max_tokens,
+                         int32_t * offsets,
+                            bool   add_bos,
+                             int   n_threads);
+
     LLAMA_API int llama_n_vocab(const struct llama_context * ctx);
     LLAMA_API int llama_n_ctx  (const struct llama_context * ctx);
     LLAMA_API int llama_n_embd (const struct llama_context * ctx);
 
+    // Describe the model, e.g. "7B mostly Q4_0", returns the length of the description like snprintf
+    LLAMA_API int llama_model_desc(const struct llama_model * model, char * buf, size_t buf_size);
+    // Size of all the weights in bytes, and their number of parameters
+    LLAMA_API uint64_t llama_model_size    (const struct llama_model * model);
+    LLAMA_API uint64_t llama_model_n_params(const struct llama_model * model);
+
     // Get the vocabulary as output parameters.
     // Returns number of results.
     LLAMA_API int llama_get_vocab(
@@ -262,7 +384,9 @@ extern "C" {
     // Cols: n_vocab
     LLAMA_API float * llama_get_logits(struct llama_context * ctx);
 
-    // Get the embeddings for the input
+    // Get the embeddings for the input, pooled as set by pooling_type in llama_context_params
+    // The pooled tokens are those evaluated since the last llama_eval with n_past = 0, when every call
+    // continues where the previous one ended, otherwise the pooling starts over with the latest batch.
     // shape: [n_embd] (1-dimensional)
     LLAMA_API float * llama_get_embeddings(struct llama_context * ctx);
 
@@ -319,6 +443,41 @@ extern "C" {
     /// @details Randomly selects a token from the candidates based on their probabilities.
     LLAMA_API llama_token llama_sample_token(struct llama_context * ctx, llama_token_data_array * candidates);
 
+    // Sampler chain
+
+    // The usual sampling sequence (penalties, then greedy, mirostat or top-k -> tail free -> typical -> top-p -> temperature)
+    // as one object that keeps its buffers and the mirostat state across tokens.
+    // Penalties are applied only to the tokens in last_tokens and top-k is selected in linear time before anything is
+    // sorted, so sampling does not scale with n_vocab * last_tokens_size or n_vocab * log(n_vocab).
+    typedef struct llama_sampler_params {
+        float   temp;              // <= 0.0 for greedy sampling
+        int32_t top_k;             // <= 0 to use vocab size
+        float   top_p;             // 1.0 = disabled
+        float   tfs_z;             // 1.0 = disabled
+        float   typical_p;         // 1.0 = disabled
+        float   repeat_penalty;    // 1.0 = disabled
+        float   presence_penalty;  // 0.0 = disabled
+        float   frequency_penalty; // 0.0 = disabled
+        int     mirostat;          // 0 = disabled, 1 = mirostat, 2 = mirostat 2.0
+        float   mirostat_tau;      // target entropy
+        float   mirostat_eta;      // learning rate
+        bool    penalize_nl;       // consider newlines as a repeatable token
+    } llama_sampler_params;
+
+    struct llama_sampler;
+
+    LLAMA_API struct llama_sampler_params llama_sampler_default_params();
+
+    LLAMA_API struct llama_sampler * llama_sampler_init(struct llama_sampler_params params);
+    LLAMA_API void llama_sampler_free(struct llama_sampler * smpl);
+
+    // Resets the mirostat state, for example when starting a new generation
+    LLAMA_API void llama_sampler_reset(struct llama_sampler * smpl);
+
+    /// @details Samples the next token from the logits of the last evaluated token.
+    /// @param last_tokens The previous tokens considered by the repetition, frequency and presence penalties.
+    LLAMA_API llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, const llama_token * last_tokens, size_t last_tokens_size);
+
     // Performance information
     LLAMA_API void llama_print_timings(struct llama_context * ctx);
     LLAMA_API void llama_reset_timings(struct llama_context * ctx);
@@ -339,6 +498,8 @@ struct ggml_tensor;
 
 const std::vector<std::pair<std::string, struct ggml_tensor *>>& llama_internal_get_tensor_map(struct llama_context * ctx);
 
+const std::vector<llama_token_data> & llama_internal_sampler_top_k(struct llama_sampler * smpl, const float * logits, int n_vocab, const llama_token * last_tokens, size_t last_tokens_size, int k);
+
 #endif
 
 #endif // LLAMA_H
@@ -0,0 +1,206 @@
+// llama_eval_begin/llama_eval_wait compute the same logits as llama_eval, also while another context evaluates
+
+#include "llama.h"
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+const char* RESULT_STR[] = {"ok", "FAILED"};
+
+static void write_u32(FILE * f, uint32_t x) {
+    fwrite(&x, sizeof(x), 1, f);
+}
+
+static void write_tensor(FILE * f, std::mt19937 & rng, const std::string & name, std::vector<uint32_t> ne, float scale, float value) {
+    write_u32(f, ne.size());
+    write_u32(f, name.size());
+    write_u32(f, 0); // GGML_TYPE_F32
+    size_t n = 1;
+    for (uint32_t x : ne) {
+        write_u32(f, x);
+        n *= x;
+    }
+    fwrite(name.data(), 1, name.size(), f);
+    const long pad = -ftell(f) & 31;
+    for (long i = 0; i < pad; i++) {
+        fputc(0, f);
+    }
+
+    std::normal_distribution<float> dist(0.0f, scale);
+    std::vector<float> data(n, value);
+    if (scale > 0.0f) {
+        for (float & x : data) {
+            x = dist(rng);
+        }
+    }
+    fwrite(data.data(), sizeof(float), n, f);
+}
+
+// a tiny model with random weights and the vocabulary of the vocab-only file fname_vocab
+static bool write_model(const char * fname_vocab, const char * fname) {
+    FILE * fv = fopen(fname_vocab, "rb");
+    if (fv == NULL) {
+        return false;
+    }
+    std::vector<char> vocab;
+    fseek(fv, 8 + 7*sizeof(uint32_t), SEEK_SET); // magic, version, hparams
+    char buf[4096];
+    size_t n_read;
+    while ((n_read = fread(buf, 1, sizeof(buf), fv)) > 0) {
+        vocab.insert(vocab.end(), buf, buf + n_read);
+    }
+    fclose(fv);
+
+    FILE * f = fopen(fname, "wb");
+    if (f == NULL) {
+        return false;
+    }
+
+    const uint32_t n_vocab = 32000, n_embd = 32, n_mult = 32, n_head = 2, n_layer = 1, n_rot = n_embd/n_head;
+    const uint32_t n_ff = ((2*(4*n_embd)/3 + n_mult - 1)/n_mult)*n_mult;
+
+    write_u32(f, LLAMA_FILE_MAGIC);
+    write_u32(f, LLAMA_FILE_VERSION);
+    for (uint32_t x : { n_vocab, n_embd, n_mult, n_head, n_layer, n_rot, (uint32_t) LLAMA_FTYPE_ALL_F32 }) {
+        write_u32(f, x);
+    }
+    fwrite(vocab.data(), 1, vocab.size(), f);
+
+    std::mt19937 rng(42);
+    write_tensor(f, rng, "tok_embeddings.weight", { n_embd, n_vocab }, 0.5f, 0.0f);
+    write_tensor(f, rng, "norm.weight", { n_embd }, 0.0f, 1.0f);
+    write_tensor(f, rng, "output.weight", { n_embd, n_vocab }, 0.1f, 0.0f);
+    for (uint32_t i = 0; i < n_layer; i++) {
+        const std::string p = "layers." + std::to_string(i) + ".";
+        write_tensor(f, rng, p + "attention_norm.weight", { n_embd }, 0.0f, 1.0f);
+        for (const char * w : { "wq", "wk", "wv", "wo" }) {
+            write_tensor(f, rng, p + "attention." + w + ".weight", { n_embd, n_embd }, 0.2f, 0.0f);
+        }
+        write_tensor(f, rng, p + "ffn_norm.weight", { n_embd }, 0.0f, 1.0f);
+        write_tensor(f, rng, p + "feed_forward.w1.weight", { n_embd, n_ff }, 0.2f, 0.0f);
+        write_tensor(f, rng, p + "feed_forward.w2.weight", { n_ff, n_embd }, 0.2f, 0.0f);
+        write_tensor(f, rng, p + "feed_forward.w3.weight", { n_embd, n_ff }, 0.2f, 0.0f);
+    }
+
+    const bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+static std::vector<float> get_logits(llama_context * ctx) {
+    const float * logits = llama_get_logits(ctx);
+    return std::vector<float>(logits, logits + llama_n_vocab(ctx));
+}
+
+int main(int argc, char * argv[]) {
+    bool verbose = false;
+    std::string fname_vocab;
+
+    std::string arg;
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        if (arg == "-v") {
+            verbose = true;
+        } else if (fname_vocab.empty()) {
+            fname_vocab = arg;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+    if (fname_vocab.empty()) {
+        fprintf(stderr, "Usage: %s [-v] <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    const char * fname = "test-eval-async.bin";
+    if (!write_model(fname_vocab.c_str(), fname)) {
+        fprintf(stderr, "error: failed to write the model %s\n", fname);
+        return 1;
+    }
+
+    llama_init_backend();
+
+    auto lparams = llama_context_default_params();
+    lparams.n_ctx = 64;
+    lparams.seed  = 1;
+
+    llama_model * model = llama_load_model_from_file(fname, lparams);
+    remove(fname);
+    if (model == NULL) {
+        fprintf(stderr, "error: failed to load the model\n");
+        return 1;
+    }
+    llama_context * ctx_sync  = llama_new_context_with_model(model, lparams);
+    llama_context * ctx_async = llama_new_context_with_model(model, lparams);
+    assert(ctx_sync && ctx_async);
+
+    int num_failed = 0;
+    bool failed = false;
+
+    // nothing to wait for
+    failed = !(llama_eval_wait(ctx_async) == 1);
+    num_failed += failed;
+    if (failed || verbose) {
+        printf("wait, no eval:     %s\n", RESULT_STR[failed]);
+    }
+
+    // the prompt, the tokens are copied by llama_eval_begin
+    std::vector<llama_token> prompt = { llama_token_bos(), 15043, 2787, 29991 };
+    const int n_prompt = prompt.size();
+
+    llama_eval_begin(ctx_async, prompt.data(), n_prompt, 0, 1);
+    prompt.assign(n_prompt, 0);
+    const int result_async = llama_eval_wait(ctx_async);
+
+    prompt = { llama_token_bos(), 15043, 2787, 29991 };
+    const int result_sync = llama_eval(ctx_sync, prompt.data(), n_prompt, 0, 1);
+
+    failed = !(result_async == 0 && result_sync == 0 && get_logits(ctx_async) == get_logits(ctx_sync));
+    num_failed += failed;
+    if (failed || verbose) {
+        printf("prompt:            %s\n", RESULT_STR[failed]);
+    }
+
+    // the next tokens, the async eval overlaps with the sync eval of the other context
+    int n_past = n_prompt;
+    failed = false;
+    for (llama_token token : { 445, 338, 29871 }) {
+        llama_eval_begin(ctx_async, &token, 1, n_past, 1);
+        const int result_next_sync  = llama_eval(ctx_sync, &token, 1, n_past, 1);
+        const int result_next_async = llama_eval_wait(ctx_async);
+        failed |= !(result_next_async == 0 && result_next_sync == 0 && get_logits(ctx_async) == get_logits(ctx_sync));
+        n_past++;
+    }
+    num_failed += failed;
+    if (failed || verbose) {
+        printf("overlapped evals:  %s\n", RESULT_STR[failed]);
+    }
+
+    // the result of an eval is returned only once
+    failed = !(llama_eval_wait(ctx_async) == 1);
+    num_failed += failed;
+    if (failed || verbose) {
+        printf("wait, waited:      %s\n", RESULT_STR[failed]);
+    }
+
+    if (num_failed || verbose) {
+        printf("%d tests failed\n", num_failed);
+    }
+
+    llama_free(ctx_async);
+    llama_free(ctx_sync);
+    llama_free_model(model);
+
+    return num_failed > 0;
+}
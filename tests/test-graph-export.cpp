@@ -0,0 +1,363 @@
+// Round trip of a graph through ggml_graph_export and ggml_graph_import, with and without the execution plan
+
+#include "ggml.h"
+
+#undef NDEBUG
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+// GGML_MEM_ALIGN of ggml.c, the leaf data of a version 2 file is aligned to it
+#if UINTPTR_MAX == 0xFFFFFFFF
+    #define MEM_ALIGN 4
+#else
+    #define MEM_ALIGN 16
+#endif
+
+const char* RESULT_STR[] = {"ok", "FAILED"};
+
+const float MAX_OUTPUT_ERROR = 1e-6f;
+
+static bool is_view_op(enum ggml_op op) {
+    return op == GGML_OP_VIEW || op == GGML_OP_RESHAPE || op == GGML_OP_PERMUTE || op == GGML_OP_TRANSPOSE;
+}
+
+static void fill_random(struct ggml_tensor * t, int seed) {
+    const int n = ggml_nelements(t);
+    for (int i = 0; i < n; i++) {
+        ggml_set_f32_1d(t, i, 0.5f*cosf(0.1f*(i + 1)*(seed + 1)) + 0.1f*seed);
+    }
+}
+
+static float max_difference(struct ggml_tensor * a, struct ggml_tensor * b) {
+    if (ggml_nelements(a) != ggml_nelements(b)) {
+        return INFINITY;
+    }
+    float diff = 0.0f;
+    for (int i = 0; i < ggml_nelements(a); i++) {
+        diff = fmaxf(diff, fabsf(ggml_get_f32_1d(a, i) - ggml_get_f32_1d(b, i)));
+    }
+    return diff;
+}
+
+static std::vector<char> read_file(const char * fname) {
+    std::vector<char> buf;
+    FILE * f = fopen(fname, "rb");
+    if (f) {
+        char tmp[4096];
+        size_t n;
+        while ((n = fread(tmp, 1, sizeof(tmp), f)) > 0) {
+            buf.insert(buf.end(), tmp, tmp + n);
+        }
+        fclose(f);
+    }
+    return buf;
+}
+
+template <typename T>
+static T read_value(const std::vector<char> & buf, size_t & pos) {
+    T value;
+    memcpy(&value, buf.data() + pos, sizeof(T));
+    pos += sizeof(T);
+    return value;
+}
+
+template <typename T>
+static void write_value(std::vector<char> & buf, T value) {
+    buf.insert(buf.end(), (const char *) &value, (const char *) &value + sizeof(T));
+}
+
+// Rewrites a version 2 file of gf in the layout of version 1: no threads and work buffer in the header, no padding
+// before the leaf data and no plan of the nodes; the size of the results is the sum of the nodes as version 1 wrote it
+static bool write_version_1(const struct ggml_cgraph * gf, const std::vector<char> & v2, const char * fname) {
+    const size_t leaf_header = 3*sizeof(uint32_t) + 2*GGML_MAX_DIMS*sizeof(uint64_t) + sizeof(uint64_t) + GGML_MAX_NAME;
+    const size_t node_header = leaf_header + (2 + GGML_MAX_OPT)*sizeof(int32_t);
+    const size_t node_plan   = sizeof(int32_t) + 2*sizeof(uint64_t);
+
+    std::vector<char> v1;
+    size_t pos = 0;
+
+    write_value(v1, read_value<uint32_t>(v2, pos)); // magic
+    read_value<uint32_t>(v2, pos);
+    write_value<uint32_t>(v1, GGML_FILE_VERSION);
+    write_value(v1, read_value<uint32_t>(v2, pos)); // leafs
+    write_value(v1, read_value<uint32_t>(v2, pos)); // nodes
+    read_value<uint64_t>(v2, pos);
+    read_value<uint32_t>(v2, pos);
+    read_value<uint64_t>(v2, pos);
+
+    uint64_t size_eval = 0;
+    for (int i = 0; i < gf->n_nodes; i++) {
+        size_eval += ggml_nbytes(gf->nodes[i]);
+    }
+    write_value(v1, size_eval);
+
+    for (int i = 0; i < gf->n_leafs; i++) {
+        v1.insert(v1.end(), v2.begin() + pos, v2.begin() + pos + leaf_header);
+        pos += leaf_header;
+        pos += (MEM_ALIGN - pos % MEM_ALIGN) % MEM_ALIGN;
+
+        const size_t size = ggml_nbytes(gf->leafs[i]);
+        v1.insert(v1.end(), v2.begin() + pos, v2.begin() + pos + size);
+        pos += size;
+    }
+
+    for (int i = 0; i < gf->n_nodes; i++) {
+        v1.insert(v1.end(), v2.begin() + pos, v2.begin() + pos + node_header);
+        pos += node_header + node_plan;
+    }
+
+    if (pos != v2.size()) {
+        return false;
+    }
+
+    FILE * f = fopen(fname, "wb");
+    if (!f) {
+        return false;
+    }
+    const bool ok = fwrite(v1.data(), 1, v1.size(), f) == v1.size();
+    fclose(f);
+    return ok;
+}
+
+// The f16 weights need a work buffer for the conversion of the input, and the output reads views. Version 1 has no
+// inplace ops, the imported ops always write a new tensor
+static struct ggml_tensor * build_output(
+        struct ggml_context * ctx, struct ggml_tensor * w, struct ggml_tensor * x, struct ggml_tensor * b, struct ggml_tensor * u,
+        bool inplace) {
+    struct ggml_tensor * kq   = ggml_add(ctx, ggml_mul_mat(ctx, w, x), b);
+    struct ggml_tensor * prob = ggml_soft_max(ctx, inplace ? ggml_diag_mask_inf_inplace(ctx, kq, 1) : ggml_diag_mask_inf(ctx, kq, 1));
+    struct ggml_tensor * r    = ggml_reshape_2d(ctx, prob, 12, 4);
+    struct ggml_tensor * m    = ggml_mul_mat(ctx, r, u);
+    struct ggml_tensor * out  = ggml_add(ctx,
+            ggml_cont(ctx, ggml_transpose(ctx, m)),
+            ggml_view_2d(ctx, prob, 5, 4, prob->nb[1], 2*sizeof(float)));
+    ggml_set_name(out, "out");
+    return out;
+}
+
+int main(int argc, char * argv[]) {
+    bool verbose = false;
+
+    std::string arg;
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        if (arg == "-v") {
+            verbose = true;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    const char * fname_v2 = "test-graph-export-v2.ggml";
+    const char * fname_v1 = "test-graph-export-v1.ggml";
+
+    const int n_threads = 2;
+
+    struct ggml_init_params ggml_params = {
+        /* .mem_size   = */ 16*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+    struct ggml_context * ctx = ggml_init(ggml_params);
+
+    struct ggml_tensor * w = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, 32, 8);
+    struct ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 32, 6);
+    struct ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 8, 6);
+    struct ggml_tensor * u = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 12, 5);
+    fill_random(w, 1);
+    fill_random(x, 2);
+    fill_random(b, 3);
+    fill_random(u, 4);
+    ggml_set_name(w, "w");
+    ggml_set_name(x, "x");
+    ggml_set_name(b, "b");
+    ggml_set_name(u, "u");
+
+    struct ggml_tensor * out = build_output(ctx, w, x, b, u, true);
+    struct ggml_cgraph gf = ggml_build_forward(out);
+    gf.n_threads = n_threads;
+
+    ggml_graph_export(&gf, fname_v2);
+    ggml_graph_compute(ctx, &gf);
+
+    int num_failed = 0;
+    bool failed = false;
+
+    // version 2: the plan of the export is the one ggml_graph_compute makes for the same threads
+    {
+        const std::vector<char> buf = read_file(fname_v2);
+        size_t pos = 2*sizeof(uint32_t);
+        const uint32_t n_leafs   = read_value<uint32_t>(buf, pos);
+        const uint32_t n_nodes   = read_value<uint32_t>(buf, pos);
+        const uint64_t size_eval = read_value<uint64_t>(buf, pos);
+        const uint32_t threads   = read_value<uint32_t>(buf, pos);
+        const uint64_t work_size = read_value<uint64_t>(buf, pos);
+
+        struct ggml_context * ctx_data = NULL;
+        struct ggml_context * ctx_eval = NULL;
+        struct ggml_cgraph gi = ggml_graph_import(fname_v2, &ctx_data, &ctx_eval);
+
+        failed = !(gi.planned && gi.n_threads == n_threads && threads == (uint32_t) n_threads &&
+                   gi.n_leafs == gf.n_leafs && gi.n_nodes == gf.n_nodes &&
+                   n_leafs == (uint32_t) gf.n_leafs && n_nodes == (uint32_t) gf.n_nodes &&
+                   work_size > 0 && gi.work_size == work_size && work_size == gf.work_size &&
+                   gi.work != NULL && ggml_nbytes(gi.work) == work_size);
+        num_failed += failed;
+        if (failed || verbose) {
+            printf("v2 header:         %s (%d threads, %d nodes, %zu bytes of work)\n", RESULT_STR[failed], gi.n_threads, gi.n_nodes, gi.work_size);
+        }
+
+        // the results are in one buffer of size_eval bytes, the inplace mask and the views share the data of their source
+        int n_wrong = 0;
+        const char * eval_begin = NULL;
+        for (int i = 0; i < gi.n_nodes; i++) {
+            const struct ggml_tensor * node = gi.nodes[i];
+            if (!is_view_op(node->op) && (eval_begin == NULL || (const char *) node->data < eval_begin)) {
+                eval_begin = (const char *) node->data;
+            }
+        }
+        for (int i = 0; i < gi.n_nodes; i++) {
+            const struct ggml_tensor * node = gi.nodes[i];
+            const char * data = (const char *) node->data;
+
+            n_wrong += node->n_tasks != gf.nodes[i]->n_tasks;
+            n_wrong += node->op != gf.nodes[i]->op;
+            n_wrong += data < eval_begin || data + ggml_nbytes(node) > eval_begin + size_eval;
+            if (node->op == GGML_OP_DIAG_MASK_INF || node->op == GGML_OP_RESHAPE) {
+                n_wrong += node->data != node->src0->data;
+            }
+        }
+        failed = n_wrong != 0;
+        num_failed += failed;
+        if (failed || verbose) {
+            printf("v2 plan:           %s (%d wrong)\n", RESULT_STR[failed], n_wrong);
+        }
+
+        // the imported graph computes with its plan and work buffer
+        struct ggml_tensor * work = gi.work;
+        ggml_graph_compute(ctx_eval, &gi);
+
+        const float diff = max_difference(gi.nodes[gi.n_nodes - 1], out);
+        failed = !(gi.work == work && diff <= MAX_OUTPUT_ERROR);
+        num_failed += failed;
+        if (failed || verbose) {
+            printf("v2 compute:        %s (difference %g)\n", RESULT_STR[failed], diff);
+        }
+
+        ggml_free(ctx_data);
+        ggml_free(ctx_eval);
+    }
+
+    // version 2: inplace ops on a view at an offset and on a leaf keep their result in the data of the source
+    {
+        struct ggml_tensor * c = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 8, 3);
+        fill_random(c, 5);
+        ggml_set_name(c, "c");
+
+        struct ggml_tensor * s    = ggml_add(ctx, ggml_mul_mat(ctx, w, x), b);
+        struct ggml_tensor * rows = ggml_view_2d(ctx, s, 8, 3, s->nb[1], 3*s->nb[1]);
+        struct ggml_tensor * out2 = ggml_add(ctx,
+                ggml_soft_max(ctx, ggml_diag_mask_inf_inplace(ctx, rows, 1)),
+                ggml_soft_max(ctx, ggml_diag_mask_inf_inplace(ctx, c, 2)));
+
+        struct ggml_cgraph gf2 = ggml_build_forward(out2);
+        gf2.n_threads = n_threads;
+
+        ggml_graph_export(&gf2, fname_v2);
+        ggml_graph_compute(ctx, &gf2);
+
+        struct ggml_context * ctx_data = NULL;
+        struct ggml_context * ctx_eval = NULL;
+        struct ggml_cgraph gi = ggml_graph_import(fname_v2, &ctx_data, &ctx_eval);
+
+        int n_wrong = 0;
+        for (int i = 0; i < gi.n_nodes; i++) {
+            const struct ggml_tensor * node = gi.nodes[i];
+            if (node->op == GGML_OP_DIAG_MASK_INF) {
+                n_wrong += node->data != node->src0->data;
+            }
+        }
+
+        ggml_graph_compute(ctx_eval, &gi);
+
+        const float diff = max_difference(gi.nodes[gi.n_nodes - 1], out2);
+        failed = !(gi.planned && n_wrong == 0 && diff <= MAX_OUTPUT_ERROR);
+        num_failed += failed;
+        if (failed || verbose) {
+            printf("v2 inplace views:  %s (%d wrong, difference %g)\n", RESULT_STR[failed], n_wrong, diff);
+        }
+
+        ggml_free(ctx_data);
+        ggml_free(ctx_eval);
+    }
+
+    // version 1: no plan, ggml_graph_compute plans the imported graph
+    {
+        struct ggml_tensor * out1 = build_output(ctx, w, x, b, u, false);
+
+        struct ggml_cgraph gf1 = ggml_build_forward(out1);
+        gf1.n_threads = n_threads;
+
+        // exported as version 2 and rewritten in the layout of version 1
+        ggml_graph_export(&gf1, fname_v1);
+        ggml_graph_compute(ctx, &gf1);
+
+        failed = !write_version_1(&gf1, read_file(fname_v1), fname_v1);
+        num_failed += failed;
+        if (failed || verbose) {
+            printf("v1 write:          %s\n", RESULT_STR[failed]);
+        }
+
+        struct ggml_context * ctx_data = NULL;
+        struct ggml_context * ctx_eval = NULL;
+        struct ggml_cgraph gi = ggml_graph_import(fname_v1, &ctx_data, &ctx_eval);
+
+        failed = !(!gi.planned && gi.work == NULL && gi.work_size == 0 && gi.n_leafs == gf1.n_leafs && gi.n_nodes == gf1.n_nodes);
+        num_failed += failed;
+        if (failed || verbose) {
+            printf("v1 import:         %s (%d nodes)\n", RESULT_STR[failed], gi.n_nodes);
+        }
+
+        struct ggml_context * ctx_work = ggml_init(ggml_params);
+        gi.n_threads = n_threads;
+        ggml_graph_compute(ctx_work, &gi);
+
+        int n_wrong = 0;
+        for (int i = 0; i < gi.n_nodes; i++) {
+            n_wrong += gi.nodes[i]->n_tasks != gf1.nodes[i]->n_tasks;
+        }
+
+        const float diff = max_difference(gi.nodes[gi.n_nodes - 1], out1);
+        failed = !(n_wrong == 0 && gi.work_size == gf1.work_size && diff <= MAX_OUTPUT_ERROR);
+        num_failed += failed;
+        if (failed || verbose) {
+            printf("v1 compute:        %s (%d wrong tasks, difference %g)\n", RESULT_STR[failed], n_wrong, diff);
+        }
+
+        ggml_free(ctx_work);
+        ggml_free(ctx_data);
+        ggml_free(ctx_eval);
+    }
+
+    if (num_failed || verbose) {
+        printf("%d tests failed\n", num_failed);
+    }
+
+    remove(fname_v2);
+    remove(fname_v1);
+
+    ggml_free(ctx);
+
+    return num_failed > 0;
+}
@@ -0,0 +1,149 @@
+// Removal of the nodes that compute nothing from a forward graph - ggml_graph_optimize
+
+#include "ggml.h"
+
+#undef NDEBUG
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+const char* RESULT_STR[] = {"ok", "FAILED"};
+
+static bool is_view_op(enum ggml_op op) {
+    return op == GGML_OP_VIEW || op == GGML_OP_RESHAPE || op == GGML_OP_PERMUTE || op == GGML_OP_TRANSPOSE;
+}
+
+static void fill_random(struct ggml_tensor * t, int seed) {
+    const int n = ggml_nelements(t);
+    for (int i = 0; i < n; i++) {
+        ggml_set_f32_1d(t, i, 0.5f*cosf(0.1f*(i + 1)*(seed + 1)) + 0.1f*seed);
+    }
+}
+
+static std::vector<float> get_values(struct ggml_tensor * t) {
+    std::vector<float> values(ggml_nelements(t));
+    for (size_t i = 0; i < values.size(); i++) {
+        values[i] = ggml_get_f32_1d(t, i);
+    }
+    return values;
+}
+
+static bool graph_has(const struct ggml_cgraph * gf, const struct ggml_tensor * t) {
+    for (int i = 0; i < gf->n_nodes; i++) {
+        if (gf->nodes[i] == t) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char * argv[]) {
+    bool verbose = false;
+
+    std::string arg;
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        if (arg == "-v") {
+            verbose = true;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    struct ggml_init_params ggml_params = {
+        /* .mem_size   = */ 16*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+    struct ggml_context * ctx = ggml_init(ggml_params);
+
+    struct ggml_tensor * a     = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 8, 6);
+    struct ggml_tensor * b     = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 8, 6);
+    struct ggml_tensor * cache = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 32);
+    fill_random(a, 1);
+    fill_random(b, 2);
+    ggml_set_zero(cache);
+
+    struct ggml_tensor * s = ggml_add(ctx, a, b);
+
+    // a copy of permuted data is computed
+    struct ggml_tensor * c1 = ggml_cont(ctx, ggml_permute(ctx, ggml_reshape_3d(ctx, s, 8, 2, 3), 0, 2, 1, 3));
+
+    // copies of one row to new tensors read the row in place, also when the row is permuted
+    struct ggml_tensor * row2 = ggml_view_1d(ctx, s, 8, 2*s->nb[1]);
+    struct ggml_tensor * c2   = ggml_cpy(ctx, row2, ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 8));
+    struct ggml_tensor * row3 = ggml_view_3d(ctx, s, 8, 1, 1, s->nb[1], s->nb[1], 3*s->nb[1]);
+    struct ggml_tensor * c3   = ggml_cont(ctx, ggml_permute(ctx, row3, 0, 2, 1, 3));
+
+    // a copy to a view of the cache has to write it
+    struct ggml_tensor * c4 = ggml_cpy(ctx, ggml_view_1d(ctx, s, 8, 4*s->nb[1]), ggml_view_1d(ctx, cache, 8, 8*sizeof(float)));
+
+    struct ggml_tensor * y   = ggml_add(ctx, ggml_reshape_2d(ctx, c1, 8, 6), b);
+    struct ggml_tensor * out = ggml_mul_mat(ctx, y, ggml_mul(ctx, c2, c3));
+
+    struct ggml_cgraph gf = ggml_build_forward(c4);
+    ggml_build_forward_expand(&gf, out);
+    gf.n_threads = 1;
+
+    ggml_graph_compute(ctx, &gf);
+
+    const std::vector<float> out_reference   = get_values(out);
+    const std::vector<float> cache_reference = get_values(cache);
+
+    int n_views = 0;
+    for (int i = 0; i < gf.n_nodes; i++) {
+        n_views += is_view_op(gf.nodes[i]->op);
+    }
+    const int n_nodes = gf.n_nodes;
+
+    int num_failed = 0;
+    bool failed = false;
+
+    // the views and the two copies of a row are dropped
+    const int n_dropped = ggml_graph_optimize(&gf);
+
+    int n_wrong = 0;
+    for (int i = 0; i < gf.n_nodes; i++) {
+        n_wrong += is_view_op(gf.nodes[i]->op);
+    }
+    failed = !(n_views == 8 && n_dropped == n_views + 2 && gf.n_nodes == n_nodes - n_dropped && n_wrong == 0);
+    num_failed += failed;
+    if (failed || verbose) {
+        printf("dropped nodes:     %s (%d of %d nodes, %d views, %d views left)\n", RESULT_STR[failed], n_dropped, n_nodes, n_views, n_wrong);
+    }
+
+    failed = !(!graph_has(&gf, c2) && !graph_has(&gf, c3) && graph_has(&gf, c1) && graph_has(&gf, c4) && graph_has(&gf, out) &&
+               c2->data == row2->data && c3->data == row3->data);
+    num_failed += failed;
+    if (failed || verbose) {
+        printf("folded copies:     %s\n", RESULT_STR[failed]);
+    }
+
+    // the optimized graph computes the same outputs
+    ggml_set_zero(out);
+    ggml_set_zero(cache);
+    ggml_graph_compute(ctx, &gf);
+
+    failed = !(get_values(out) == out_reference && get_values(cache) == cache_reference);
+    num_failed += failed;
+    if (failed || verbose) {
+        printf("outputs:           %s\n", RESULT_STR[failed]);
+    }
+
+    if (num_failed || verbose) {
+        printf("%d tests failed\n", num_failed);
+    }
+
+    ggml_free(ctx);
+
+    return num_failed > 0;
+}
@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include <string>
 #include <vector>
 
@@ -18,6 +19,7 @@ const float MAX_QUANTIZATION_TOTAL_ERROR = 0.002f;
 const float MAX_QUANTIZATION_TOTAL_ERROR_2BITS = 0.0075f;
 const float MAX_QUANTIZATION_TOTAL_ERROR_3BITS = 0.0040f;
 const float MAX_DOT_PRODUCT_ERROR = 0.02f;
+const float MAX_IMATRIX_UNIFORM_ERROR_RATIO = 1.05f;
 
 const char* RESULT_STR[] = {"ok", "FAILED"};
 
@@ -64,6 +66,38 @@ float reference_quantization_error(quantize_fns_t & qfns, size_t test_size, cons
     return array_rmse(tmp_out.data(), tmp_out_ref.data(), test_size);
 }
 
+// Error weighted per column, the quantity the importance matrix quantizers minimize
+float weighted_rmse(const float * a1, const float * a2, const float * w, size_t n_per_row, size_t n) {
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        double diff = a1[i] - a2[i];
+        sum += w[i % n_per_row] * diff * diff;
+    }
+    return sqrtf(sum) / n;
+}
+
+// Weighted error of quantizing with an importance matrix (NULL for the unweighted quantizer)
+float imatrix_quantization_error(ggml_type type, quantize_fns_t & qfns, size_t n_per_row, size_t test_size,
+                                 const float * test_data, const float * imatrix, const float * w, int64_t * hist) {
+    std::vector<uint8_t> tmp_q(2*test_size);
+    std::vector<float> tmp_out(test_size);
+
+    ggml_quantize_chunk_imatrix(type, test_data, tmp_q.data(), 0, test_size/n_per_row, n_per_row, hist, imatrix);
+    qfns.dequantize_row_q(tmp_q.data(), tmp_out.data(), test_size);
+    return weighted_rmse(test_data, tmp_out.data(), w, n_per_row, test_size);
+}
+
+// Whether the optimized quantizer produces exactly the bytes of the reference one
+bool reference_quantization_exact(ggml_type type, quantize_fns_t & qfns, size_t test_size, const float * test_data) {
+    const size_t row_size = ggml_type_size(type)*test_size/ggml_blck_size(type);
+    std::vector<uint8_t> tmp_q(row_size);
+    std::vector<uint8_t> tmp_q_ref(row_size);
+
+    qfns.quantize_row_q(test_data, tmp_q.data(), test_size);
+    qfns.quantize_row_q_reference(test_data, tmp_q_ref.data(), test_size);
+    return memcmp(tmp_q.data(), tmp_q_ref.data(), row_size) == 0;
+}
+
 float dot_product(const float * a1, const float * a2, size_t test_size) {
     double sum = 0;
     for (size_t i = 0; i < test_size; i++) {
@@ -110,6 +144,14 @@ int main(int argc, char * argv[]) {
     generate_data(0.0, test_data.size(), test_data.data());
     generate_data(1.0, test_data2.size(), test_data2.data());
 
+    // importance matrices for rows of n_per_row columns: uniform, and a few columns that matter a lot more
+    const size_t n_per_row = 1024;
+    std::vector<float> imatrix_ones(n_per_row, 1.0f);
+    std::vector<float> imatrix_skew(n_per_row);
+    for (size_t i = 0; i < n_per_row; i++) {
+        imatrix_skew[i] = i % 7 == 0 ? 50.0f : 1.0f;
+    }
+
     // Initialize GGML, ensures float conversion tables are initialized
     struct ggml_init_params ggml_params = {
         /* .mem_size   = */ 1*1024,
@@ -150,6 +192,53 @@ int main(int argc, char * argv[]) {
                 printf("%5s dot product error:              %s (%f)\n", ggml_type_name(type), RESULT_STR[failed], vec_dot_error);
             }
         }
+
+        if (qfns.quantize_row_q && qfns.dequantize_row_q && ggml_blck_size(type) == 256) {
+            // k-quants: the vectorized quantizers must match the reference byte for byte
+            failed = !(reference_quantization_exact(type, qfns, test_size, test_data.data()) &&
+                       reference_quantization_exact(type, qfns, test_size, test_data2.data()));
+            num_failed += failed;
+            if (failed || verbose) {
+                printf("%5s reference implementation bytes: %s\n", ggml_type_name(type), RESULT_STR[failed]);
+            }
+
+            // k-quants: importance matrix guided quantization
+            // the weighted search differs from the plain one, so uniform weights must match its error, not its bytes
+            int64_t hist_plain[16] = {0};
+            int64_t hist_ones[16]  = {0};
+            const float plain_error = imatrix_quantization_error(type, qfns, n_per_row, test_size, test_data.data(),
+                                                                 NULL, imatrix_ones.data(), hist_plain);
+            const float ones_error  = imatrix_quantization_error(type, qfns, n_per_row, test_size, test_data.data(),
+                                                                 imatrix_ones.data(), imatrix_ones.data(), hist_ones);
+            failed = !(ones_error < MAX_IMATRIX_UNIFORM_ERROR_RATIO*plain_error);
+            num_failed += failed;
+            if (failed || verbose) {
+                printf("%5s uniform imatrix error:          %s (%f vs %f)\n", ggml_type_name(type), RESULT_STR[failed], ones_error, plain_error);
+            }
+
+            int64_t hist_sum_plain = 0;
+            int64_t hist_sum_ones  = 0;
+            for (int j = 0; j < 16; j++) {
+                hist_sum_plain += hist_plain[j];
+                hist_sum_ones  += hist_ones[j];
+            }
+            failed = !(hist_sum_plain == (int64_t) test_size && hist_sum_ones == (int64_t) test_size);
+            num_failed += failed;
+            if (failed || verbose) {
+                printf("%5s histogram count:                %s (%lld, %lld)\n", ggml_type_name(type), RESULT_STR[failed],
+                       (long long) hist_sum_plain, (long long) hist_sum_ones);
+            }
+
+            const float unweighted_error = imatrix_quantization_error(type, qfns, n_per_row, test_size, test_data.data(),
+                                                                      NULL, imatrix_skew.data(), NULL);
+            const float weighted_error   = imatrix_quantization_error(type, qfns, n_per_row, test_size, test_data.data(),
+                                                                      imatrix_skew.data(), imatrix_skew.data(), NULL);
+            failed = !(weighted_error < unweighted_error);
+            num_failed += failed;
+            if (failed || verbose) {
+                printf("%5s weighted imatrix error:         %s (%f vs %f)\n", ggml_type_name(type), RESULT_STR[failed], weighted_error, unweighted_error);
+            }
+        }
     }
 
     if (num_failed || verbose) {
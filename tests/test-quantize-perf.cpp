@@ -33,6 +33,7 @@ struct quantize_perf_params {
     size_t alignment_offset = 0;
     bool op_quantize_row_q_reference = false;
     bool op_quantize_row_q = false;
+    bool op_quantize_chunk = false;
     bool op_dequantize_row_q = false;
     bool op_quantize_row_q_dot = false;
     bool op_vec_dot_q = false;
@@ -150,6 +151,8 @@ int main(int argc, char * argv[]) {
                 params.op_quantize_row_q_reference = true;
             } else if (op == "quantize_row_q") {
                 params.op_quantize_row_q = true;
+            } else if (op == "quantize_chunk") {
+                params.op_quantize_chunk = true;
             } else if (op == "dequantize_row_q") {
                 params.op_dequantize_row_q = true;
             } else if (op == "quantize_row_q_dot") {
@@ -191,8 +194,8 @@ int main(int argc, char * argv[]) {
     if (params.test_sizes.empty()) {
         params.test_sizes.push_back(L1_SIZE);
     }
-    if (!(params.op_quantize_row_q_reference || params.op_quantize_row_q || params.op_dequantize_row_q || params.op_quantize_row_q_dot || params.op_vec_dot_q)) {
-        params.op_quantize_row_q_reference = params.op_quantize_row_q = params.op_dequantize_row_q = params.op_quantize_row_q_dot = params.op_vec_dot_q = true;
+    if (!(params.op_quantize_row_q_reference || params.op_quantize_row_q || params.op_quantize_chunk || params.op_dequantize_row_q || params.op_quantize_row_q_dot || params.op_vec_dot_q)) {
+        params.op_quantize_row_q_reference = params.op_quantize_row_q = params.op_quantize_chunk = params.op_dequantize_row_q = params.op_quantize_row_q_dot = params.op_vec_dot_q = true;
     }
 
     std::sort(params.test_sizes.begin(), params.test_sizes.end());
@@ -260,6 +263,22 @@ int main(int argc, char * argv[]) {
                 printf("\n");
             }
 
+            // the path used when quantizing models (ggml_quantize_chunk), the intermediate activation types are not handled there
+            if (params.op_quantize_chunk && type != GGML_TYPE_Q8_1 && type != GGML_TYPE_Q8_K) {
+                printf("  quantize_chunk\n");
+                for (size_t size : params.test_sizes) {
+                    printf("    %zu values (%.2f MB)\n", size, 4*size/(float)(1024*1024));
+                    int64_t hist[16];
+                    auto quantize_fn = [&](void ) {
+                        ggml_quantize_chunk(type, test_data1, test_q1, 0, size, hist);
+                        return test_q1[0];
+                    };
+                    size_t quantized_size = size / ggml_blck_size(type) * ggml_type_size(type);
+                    benchmark_function(size, quantized_size, quantize_fn);
+                }
+                printf("\n");
+            }
+
             if (params.op_dequantize_row_q) {
                 printf("  dequantize_row_q\n");
                 qfns.quantize_row_q(test_data1, test_q1, largest);
@@ -1,4 +1,5 @@
 #include "ggml.h"
+#define LLAMA_API_INTERNAL
 #include "llama.h"
 
 #ifdef NDEBUG
@@ -11,6 +12,7 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <random>
 
 void dump(const llama_token_data_array * candidates) {
     for (size_t i = 0; i < candidates->size; i++) {
@@ -173,6 +175,97 @@ void test_frequency_presence_penalty(
     }
 }
 
+
+// the sampler chain selects the top-k with a heap (small k) or nth_element (large k) instead of sorting,
+// its result must be the same as sorting all candidates, keeping the lower id on equal logits
+void test_sampler_top_k(size_t n_vocab, int k, bool ties) {
+    std::mt19937 rng(42);
+    std::vector<float> logits(n_vocab);
+    if (ties) {
+        for (size_t i = 0; i < n_vocab; i++) {
+            logits[i] = (float) (rng() % 16);
+        }
+    } else {
+        std::vector<int> perm(n_vocab);
+        std::iota(perm.begin(), perm.end(), 0);
+        std::shuffle(perm.begin(), perm.end(), rng);
+        for (size_t i = 0; i < n_vocab; i++) {
+            logits[i] = 0.001f*perm[i] - 5.0f;
+        }
+    }
+
+    std::vector<llama_token_data> candidates;
+    candidates.reserve(n_vocab);
+    for (llama_token token_id = 0; token_id < (llama_token)n_vocab; token_id++) {
+        candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    }
+
+    std::vector<llama_token_data> expected = candidates;
+    std::sort(expected.begin(), expected.end(), [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit || (a.logit == b.logit && a.id < b.id);
+    });
+    expected.resize(std::min((size_t) k, n_vocab));
+
+    llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
+    llama_sample_top_k(nullptr, &candidates_p, k, 1);
+
+    llama_sampler_params params = llama_sampler_default_params();
+    params.repeat_penalty = 1.0f;
+    llama_sampler * smpl = llama_sampler_init(params);
+    const std::vector<llama_token_data> & selected = llama_internal_sampler_top_k(smpl, logits.data(), n_vocab, nullptr, 0, k);
+
+    assert(selected.size() == expected.size());
+    assert(selected.size() == candidates_p.size);
+    for (size_t i = 0; i < selected.size(); i++) {
+        assert(selected[i].logit == candidates_p.data[i].logit);
+        assert(selected[i].logit == expected[i].logit);
+        assert(selected[i].id    == expected[i].id);
+    }
+
+    llama_sampler_free(smpl);
+}
+
+
+// the sampler chain only visits the logits of the last tokens,
+// the result must be the same as the repetition, frequency and presence penalties over all candidates
+void test_sampler_penalties(
+                const std::vector<llama_token> & last_tokens,
+                float penalty, float alpha_frequency, float alpha_presence, bool penalize_nl) {
+    const size_t n_vocab = 64;
+    std::vector<float> logits(n_vocab);
+    for (size_t i = 0; i < n_vocab; i++) {
+        logits[i] = 3.0f*sinf(0.37f*i);
+    }
+
+    std::vector<llama_token_data> candidates;
+    candidates.reserve(n_vocab);
+    for (llama_token token_id = 0; token_id < (llama_token)n_vocab; token_id++) {
+        candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    }
+
+    llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
+    llama_sample_repetition_penalty(nullptr, &candidates_p, last_tokens.data(), last_tokens.size(), penalty);
+    llama_sample_frequency_and_presence_penalties(nullptr, &candidates_p, last_tokens.data(), last_tokens.size(), alpha_frequency, alpha_presence);
+    if (!penalize_nl) {
+        candidates[llama_token_nl()].logit = logits[llama_token_nl()];
+    }
+
+    llama_sampler_params params = llama_sampler_default_params();
+    params.repeat_penalty    = penalty;
+    params.frequency_penalty = alpha_frequency;
+    params.presence_penalty  = alpha_presence;
+    params.penalize_nl       = penalize_nl;
+    llama_sampler * smpl = llama_sampler_init(params);
+    const std::vector<llama_token_data> & selected = llama_internal_sampler_top_k(smpl, logits.data(), n_vocab, last_tokens.data(), last_tokens.size(), n_vocab);
+
+    assert(selected.size() == n_vocab);
+    for (size_t i = 0; i < selected.size(); i++) {
+        assert(selected[i].logit == candidates[selected[i].id].logit);
+    }
+
+    llama_sampler_free(smpl);
+}
+
 int main(void) {
     ggml_time_init();
 
@@ -199,5 +292,20 @@ int main(void) {
     test_frequency_presence_penalty({0.2f, 0.2f, 0.2f, 0.2f, 0.2f}, {0, 1, 2},       {0.499966f, 0.499966f, 0.000023f, 0.000023f, 0.000023f}, 5.0f, 5.0f);
     test_frequency_presence_penalty({0.2f, 0.2f, 0.2f, 0.2f, 0.2f}, {0, 1, 2, 0, 0}, {0.499977f, 0.499977f, 0.000023f, 0.000023f, 0.000000f}, 5.0f, 5.0f);
 
+    test_sampler_top_k(32000, 1, false);
+    test_sampler_top_k(32000, 40, false);
+    test_sampler_top_k(32000, 40, true);
+    test_sampler_top_k(32000, 256, true);
+    test_sampler_top_k(32000, 1000, false);
+    test_sampler_top_k(32000, 1000, true);
+    test_sampler_top_k(100, 100, true);
+    test_sampler_top_k(100, 200, false);
+
+    test_sampler_penalties({}, 1.3f, 0.5f, 0.3f, true);
+    test_sampler_penalties({5, 13, 20}, 1.3f, 0.0f, 0.0f, true);
+    test_sampler_penalties({5, 13, 20, 5, 5, 63, 0}, 1.3f, 0.5f, 0.3f, true);
+    test_sampler_penalties({5, 13, 20, 5, 5, 63, 0}, 1.0f, 0.5f, 0.3f, false);
+    test_sampler_penalties({13, 13, 2, 40, 2}, 50.0f, 5.0f, 5.0f, false);
+
     printf("OK\n");
 }
@@ -0,0 +1,199 @@
+// Accuracy and speed of the vectorized softmax - ggml_soft_max_exp_row and GGML_OP_SOFT_MAX
+
+#include "ggml.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+const float MAX_SOFT_MAX_RELATIVE_ERROR = 1e-6f;
+
+const char* RESULT_STR[] = {"ok", "FAILED"};
+
+#define ITERATIONS 20
+
+// Generate synthetic logits in [-range, range], with a few -INFINITY as produced by masking
+void generate_data(float range, size_t n, float * dst) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = range*sinf(0.37f*i + 0.5f);
+    }
+    for (size_t i = 7; i < n; i += 61) {
+        dst[i] = -INFINITY;
+    }
+}
+
+// Scalar softmax in double precision, x - max is rounded to float like in the tested code
+// returns the sum of exp(x - max)
+double soft_max_reference(size_t n, double * y, const float * x) {
+    float max = -INFINITY;
+    for (size_t i = 0; i < n; i++) {
+        max = std::max(max, x[i]);
+    }
+    double sum = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        y[i] = exp((double) (x[i] - max));
+        sum += y[i];
+    }
+    for (size_t i = 0; i < n; i++) {
+        y[i] /= sum;
+    }
+    return sum;
+}
+
+// softmax with the exp and the sum of ggml_soft_max_exp_row, returns the sum
+double soft_max_ggml(size_t n, float * y, const float * x) {
+    float max = -INFINITY;
+    for (size_t i = 0; i < n; i++) {
+        max = std::max(max, x[i]);
+    }
+    const double sum = ggml_soft_max_exp_row(x, y, n, max);
+    for (size_t i = 0; i < n; i++) {
+        y[i] /= sum;
+    }
+    return sum;
+}
+
+// Scalar softmax with expf, as used before the vectorized version
+void soft_max_expf(size_t n, float * y, const float * x) {
+    float max = -INFINITY;
+    for (size_t i = 0; i < n; i++) {
+        max = std::max(max, x[i]);
+    }
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        y[i] = expf(x[i] - max);
+        sum += y[i];
+    }
+    for (size_t i = 0; i < n; i++) {
+        y[i] /= sum;
+    }
+}
+
+// Largest relative error of y, ignoring values below the smallest normal float
+float max_relative_error(size_t n, const float * y, const double * ref) {
+    float err = 0.0f;
+    for (size_t i = 0; i < n; i++) {
+        if (ref[i] < 1e-37) {
+            if (y[i] != 0.0f && fabs(y[i] - ref[i]) > 1e-37) {
+                return INFINITY;
+            }
+            continue;
+        }
+        err = std::max(err, (float) (fabs(y[i] - ref[i])/ref[i]));
+    }
+    return err;
+}
+
+// minimum time of one call in microseconds, short calls are repeated to get a measurable time
+template <typename F>
+float benchmark_us(size_t n, F function) {
+    const int repeat = std::max<int>(1, 100000/n);
+    function();
+    int64_t min_time_us = INT64_MAX;
+    for (int i = 0; i < ITERATIONS; i++) {
+        const int64_t start_time = ggml_time_us();
+        for (int j = 0; j < repeat; j++) {
+            function();
+        }
+        min_time_us = std::min(min_time_us, ggml_time_us() - start_time);
+    }
+    return min_time_us / (float) repeat;
+}
+
+int main(int argc, char * argv[]) {
+    bool verbose = false;
+
+    std::string arg;
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        if (arg == "-v") {
+            verbose = true;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    // sampling candidates, an attention row, a vocabulary
+    const size_t test_sizes[] = { 40, 4099, 32000 };
+    const float  test_ranges[] = { 1.0f, 20.0f, 100.0f };
+
+    struct ggml_init_params ggml_params = {
+        /* .mem_size   = */ 4*32000*sizeof(float) + 16*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    int num_failed = 0;
+    bool failed = false;
+
+    for (size_t n : test_sizes) {
+        for (float range : test_ranges) {
+            std::vector<float>  x(n);
+            std::vector<float>  y(n);
+            std::vector<double> ref(n);
+
+            generate_data(range, n, x.data());
+            const double ref_sum = soft_max_reference(n, ref.data(), x.data());
+
+            const double sum = soft_max_ggml(n, y.data(), x.data());
+            const float row_error = std::max(max_relative_error(n, y.data(), ref.data()), (float) (fabs(sum - ref_sum)/ref_sum));
+            failed = !(row_error < MAX_SOFT_MAX_RELATIVE_ERROR);
+            num_failed += failed;
+            if (failed || verbose) {
+                printf("%6zu values, range %5.1f, ggml_soft_max_exp_row error: %s (%g)\n", n, range, RESULT_STR[failed], row_error);
+            }
+
+            // the graph op uses the same kernel where available, otherwise a fp16 exp table
+            struct ggml_context * ctx = ggml_init(ggml_params);
+            struct ggml_tensor * t = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n);
+            memcpy(t->data, x.data(), n*sizeof(float));
+            struct ggml_tensor * out = ggml_soft_max(ctx, t);
+            struct ggml_cgraph gf = ggml_build_forward(out);
+            gf.n_threads = 1;
+            ggml_graph_compute(ctx, &gf);
+
+            const float op_error = max_relative_error(n, (const float *) out->data, ref.data());
+#if defined(__AVX2__) && defined(__FMA__)
+            failed = !(op_error < MAX_SOFT_MAX_RELATIVE_ERROR);
+#else
+            failed = !(op_error < 1e-2f);
+#endif
+            num_failed += failed;
+            if (failed || verbose) {
+                printf("%6zu values, range %5.1f, GGML_OP_SOFT_MAX error:      %s (%g)\n", n, range, RESULT_STR[failed], op_error);
+            }
+            ggml_free(ctx);
+        }
+    }
+
+    if (verbose) {
+        printf("\n");
+        for (size_t n : test_sizes) {
+            std::vector<float> x(n);
+            std::vector<float> y(n);
+            generate_data(20.0f, n, x.data());
+
+            const float t_expf = benchmark_us(n, [&]() { soft_max_expf(n, y.data(), x.data()); });
+            const float t_ggml = benchmark_us(n, [&]() { soft_max_ggml(n, y.data(), x.data()); });
+            printf("%6zu values: expf %8.2f us, ggml_soft_max_exp_row %8.2f us (%.2fx)\n", n, t_expf, t_ggml, t_expf/t_ggml);
+        }
+    }
+
+    if (num_failed || verbose) {
+        printf("%d tests failed\n", num_failed);
+    }
+
+    return num_failed > 0;
+}
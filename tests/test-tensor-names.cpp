@@ -0,0 +1,133 @@
+// Lookups of tensors by name - ggml_get_tensor and the name index of a context
+
+#include "ggml.h"
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+const char* RESULT_STR[] = {"ok", "FAILED"};
+
+// The first tensor of ctx with the name, by walking all tensors in allocation order
+struct ggml_tensor * get_tensor_reference(const std::vector<struct ggml_tensor *> & tensors, const char * name) {
+    for (struct ggml_tensor * t : tensors) {
+        if (strcmp(t->name, name) == 0) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char * argv[]) {
+    bool verbose = false;
+
+    std::string arg;
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        if (arg == "-v") {
+            verbose = true;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    struct ggml_init_params ggml_params = {
+        /* .mem_size   = */ 16*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ true,
+    };
+    struct ggml_context * ctx = ggml_init(ggml_params);
+
+    int num_failed = 0;
+    bool failed = false;
+
+    // tensors that have no name yet are found by the empty name
+    struct ggml_tensor * unnamed = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4);
+    failed = !(ggml_get_tensor(ctx, "") == unnamed && ggml_get_tensor(ctx, "a") == NULL);
+    num_failed += failed;
+    if (failed || verbose) {
+        printf("unnamed tensors:   %s\n", RESULT_STR[failed]);
+    }
+
+    // enough named tensors for the index to grow several times, every 10th name is used twice
+    const int n_tensors = 3000;
+    std::vector<struct ggml_tensor *> tensors;
+    tensors.push_back(unnamed);
+    for (int i = 0; i < n_tensors; i++) {
+        struct ggml_tensor * t = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4);
+        ggml_format_name(t, "t%d", i % 10 == 9 ? i - 1 : i);
+        tensors.push_back(t);
+    }
+
+    // views are named after their source, and can be renamed like any other tensor
+    for (int i = 0; i < n_tensors; i += 100) {
+        struct ggml_tensor * v = ggml_view_tensor(ctx, tensors[1 + i]);
+        tensors.push_back(v);
+        if (i % 200 == 0) {
+            ggml_format_name(v, "v%d", i);
+        }
+    }
+
+    // renamed tensors are found by the new name only, a later tensor with the old name takes its place
+    for (int i = 0; i < n_tensors; i += 7) {
+        ggml_format_name(tensors[1 + i], "r%d", i);
+    }
+
+    int n_wrong = 0;
+    for (int i = 0; i < n_tensors; i++) {
+        const std::string names[] = {
+            "t" + std::to_string(i), "r" + std::to_string(i), "v" + std::to_string(i),
+            "t" + std::to_string(i) + " (view)", "r" + std::to_string(i) + " (view)",
+        };
+        for (const std::string & name : names) {
+            n_wrong += ggml_get_tensor(ctx, name.c_str()) != get_tensor_reference(tensors, name.c_str());
+        }
+    }
+    failed = n_wrong != 0;
+    num_failed += failed;
+    if (failed || verbose) {
+        printf("named tensors:     %s (%d wrong)\n", RESULT_STR[failed], n_wrong);
+    }
+
+    // duplicates resolve to the first tensor with the name
+    failed = !(ggml_get_tensor(ctx, "t8") == tensors[1 + 8] && tensors[1 + 9] != tensors[1 + 8] && strcmp(tensors[1 + 9]->name, "t8") == 0);
+    num_failed += failed;
+    if (failed || verbose) {
+        printf("duplicate names:   %s\n", RESULT_STR[failed]);
+    }
+
+    // names that no tensor has, or had
+    failed = !(ggml_get_tensor(ctx, "t9") == NULL && ggml_get_tensor(ctx, "t0") == NULL &&
+               ggml_get_tensor(ctx, "missing") == NULL && ggml_get_tensor(ctx, "t100000") == NULL);
+    num_failed += failed;
+    if (failed || verbose) {
+        printf("missing names:     %s\n", RESULT_STR[failed]);
+    }
+
+    // tensors of another context are not found
+    struct ggml_context * ctx2 = ggml_init(ggml_params);
+    ggml_set_name(ggml_new_tensor_1d(ctx2, GGML_TYPE_F32, 4), "other");
+    failed = !(ggml_get_tensor(ctx, "other") == NULL && ggml_get_tensor(ctx2, "other") != NULL && ggml_get_tensor(ctx2, "t1") == NULL);
+    num_failed += failed;
+    if (failed || verbose) {
+        printf("other contexts:    %s\n", RESULT_STR[failed]);
+    }
+
+    if (num_failed || verbose) {
+        printf("%d tests failed\n", num_failed);
+    }
+
+    ggml_free(ctx2);
+    ggml_free(ctx);
+
+    return num_failed > 0;
+}
@@ -94,6 +94,43 @@ int main(int argc, char **argv) {
         }
     }
 
+    // the same texts as one batch, on several threads
+    {
+        std::vector<const char *> texts;
+        size_t n_max_tokens = 0;
+        for (const auto & test_kv : k_tests()) {
+            texts.push_back(test_kv.first.c_str());
+            n_max_tokens += test_kv.second.size();
+        }
+
+        std::vector<llama_token> res(n_max_tokens);
+        std::vector<int32_t> offsets(texts.size() + 1);
+        const int n = llama_tokenize_batch(ctx, texts.data(), int(texts.size()), res.data(), int(res.size()), offsets.data(), true, 4);
+
+        bool correct = n == (int) n_max_tokens;
+
+        int i = 0;
+        for (const auto & test_kv : k_tests()) {
+            if (!correct) {
+                break;
+            }
+            const std::vector<llama_token> got(res.begin() + offsets[i], res.begin() + offsets[i + 1]);
+            if (got != test_kv.second) {
+                fprintf(stderr, "%s : failed batch test: '%s'\n", __func__, test_kv.first.c_str());
+                correct = false;
+            }
+            ++i;
+        }
+
+        if (!correct) {
+            fprintf(stderr, "%s : failed batch test, got %d tokens, expected %zu\n", __func__, n, n_max_tokens);
+
+            llama_free_model(model);
+            llama_free(ctx);
+            return 4;
+        }
+    }
+
     llama_free_model(model);
     llama_free(ctx);
 